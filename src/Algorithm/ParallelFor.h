@@ -0,0 +1,235 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ParallelFor.h
+	@author Jukka Jylnki
+	@brief Distributes independent work items over multiple threads. */
+#pragma once
+
+#include "../Math/MathNamespace.h"
+
+#include "../Math/assume.h"
+
+#ifdef MATH_THREADING_SUPPORT
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#endif
+
+MATH_BEGIN_NAMESPACE
+
+/// Returns the number of threads the hardware can run concurrently.
+/// Returns 1 if this cannot be determined, or if MathGeoLib was built without MATH_THREADING_SUPPORT.
+inline int NumHardwareThreads()
+{
+#ifdef MATH_THREADING_SUPPORT
+	int numThreads = (int)std::thread::hardware_concurrency();
+	return numThreads > 0 ? numThreads : 1;
+#else
+	return 1;
+#endif
+}
+
+#ifdef MATH_THREADING_SUPPORT
+template<typename Func>
+struct ParallelForWorker
+{
+	Func *func;
+	int numItems;
+	std::atomic<int> nextItem;
+
+	void Run(int threadIndex)
+	{
+		for(int i = nextItem++; i < numItems; i = nextItem++)
+			(*func)(i, threadIndex);
+	}
+
+	static void RunJob(void *worker, int threadIndex) { static_cast<ParallelForWorker<Func>*>(worker)->Run(threadIndex); }
+};
+#endif
+
+/// A set of worker threads that persists between calls to ParallelFor(numItems, pool, func).
+/** ParallelFor(numItems, numThreads, func) starts and joins its threads on every call, which costs tens of
+	microseconds per thread. Code that runs a parallel loop each frame, e.g. a broadphase, can create one pool up
+	front instead: its threads sleep on a condition variable between the loops, and are only woken up for each loop.
+	A pool runs one loop at a time, so do not share a pool between threads that run loops concurrently. If
+	MathGeoLib was built without MATH_THREADING_SUPPORT, the pool has no worker threads, and the loops run on the
+	calling thread. */
+class ParallelForPool
+{
+public:
+	/// Starts numThreads-1 worker threads. The thread that calls ParallelFor() is the remaining thread.
+	/// If numThreads <= 0, NumHardwareThreads() threads are used.
+	explicit ParallelForPool(int numThreads = 0)
+#ifdef MATH_THREADING_SUPPORT
+	:job(0), jobData(0), generation(0), numBusyWorkers(0), quit(false)
+#endif
+	{
+		if (numThreads <= 0)
+			numThreads = NumHardwareThreads();
+#ifdef MATH_THREADING_SUPPORT
+		workers.reserve(numThreads-1);
+		for(int i = 1; i < numThreads; ++i)
+			workers.push_back(std::thread(&ParallelForPool::WorkerMain, this, i));
+#endif
+	}
+
+	~ParallelForPool()
+	{
+#ifdef MATH_THREADING_SUPPORT
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wakeUp.notify_all();
+		for(size_t i = 0; i < workers.size(); ++i)
+			workers[i].join();
+#endif
+	}
+
+	/// Returns the number of threads the loops of this pool run on, including the calling thread.
+	int NumThreads() const
+	{
+#ifdef MATH_THREADING_SUPPORT
+		return (int)workers.size() + 1;
+#else
+		return 1;
+#endif
+	}
+
+	/// Calls job(jobData, threadIndex) once on each thread of this pool, the calling thread being thread 0, and
+	/// returns after all the calls have returned. Used by ParallelFor(numItems, pool, func).
+	void RunOnAllThreads(void (*job_)(void *, int), void *jobData_)
+	{
+#ifdef MATH_THREADING_SUPPORT
+		if (!workers.empty())
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				assume(numBusyWorkers == 0 && "ParallelForPool can only run one loop at a time!");
+				job = job_;
+				jobData = jobData_;
+				numBusyWorkers = (int)workers.size();
+				++generation;
+			}
+			wakeUp.notify_all();
+			job_(jobData_, 0);
+			std::unique_lock<std::mutex> lock(mutex);
+			while(numBusyWorkers > 0)
+				allDone.wait(lock);
+			return;
+		}
+#endif
+		job_(jobData_, 0);
+	}
+
+private:
+	ParallelForPool(const ParallelForPool &); // Not implemented.
+	void operator =(const ParallelForPool &); // Not implemented.
+
+#ifdef MATH_THREADING_SUPPORT
+	void WorkerMain(int threadIndex)
+	{
+		unsigned int seenGeneration = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for(;;)
+		{
+			while(!quit && generation == seenGeneration)
+				wakeUp.wait(lock);
+			if (quit)
+				return;
+			seenGeneration = generation;
+			void (*currentJob)(void *, int) = job;
+			void *currentJobData = jobData;
+			lock.unlock();
+			currentJob(currentJobData, threadIndex);
+			lock.lock();
+			if (--numBusyWorkers == 0)
+				allDone.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	/// Signaled when a new loop is started, or when the pool is destroyed.
+	std::condition_variable wakeUp;
+	/// Signaled when the last worker has finished its part of the current loop.
+	std::condition_variable allDone;
+	void (*job)(void *, int);
+	void *jobData;
+	/// Incremented for each loop, so that each worker runs each loop exactly once.
+	unsigned int generation;
+	int numBusyWorkers;
+	bool quit;
+#endif
+};
+
+/// Calls func(itemIndex, threadIndex) once for each itemIndex in the range [0, numItems[.
+/** The items are handed out dynamically to numThreads threads, one of which is the calling thread, so func must be
+	safe to call concurrently for different items. threadIndex is in the range [0, numThreads[, and can be used
+	to address per-thread scratch data. If numThreads <= 0, NumHardwareThreads() threads are used.
+	If MathGeoLib was built without MATH_THREADING_SUPPORT, all items are processed in increasing order on the
+	calling thread. */
+template<typename Func>
+void ParallelFor(int numItems, int numThreads, Func &func)
+{
+	if (numThreads <= 0)
+		numThreads = NumHardwareThreads();
+#ifdef MATH_THREADING_SUPPORT
+	if (numThreads > numItems)
+		numThreads = numItems;
+	if (numThreads > 1)
+	{
+		ParallelForWorker<Func> worker;
+		worker.func = &func;
+		worker.numItems = numItems;
+		worker.nextItem = 0;
+
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads-1);
+		for(int i = 1; i < numThreads; ++i)
+			threads.push_back(std::thread(&ParallelForWorker<Func>::Run, &worker, i));
+		worker.Run(0);
+		for(size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+		return;
+	}
+#endif
+	for(int i = 0; i < numItems; ++i)
+		func(i, 0);
+}
+
+/// Calls func(itemIndex, threadIndex) once for each itemIndex in the range [0, numItems[, on the threads of the
+/// given pool. The same as ParallelFor(numItems, pool.NumThreads(), func), except that no threads are started.
+template<typename Func>
+void ParallelFor(int numItems, ParallelForPool &pool, Func &func)
+{
+#ifdef MATH_THREADING_SUPPORT
+	if (pool.NumThreads() > 1 && numItems > 1)
+	{
+		ParallelForWorker<Func> worker;
+		worker.func = &func;
+		worker.numItems = numItems;
+		worker.nextItem = 0;
+		pool.RunOnAllThreads(&ParallelForWorker<Func>::RunJob, &worker);
+		return;
+	}
+#endif
+	for(int i = 0; i < numItems; ++i)
+		func(i, 0);
+}
+
+MATH_END_NAMESPACE
@@ -39,17 +39,21 @@
 #include "Circle.h"
 #include "Frustum.h"
 #include "GeometryAll.h"
+#include "HashGrid.h"
 #include "HitInfo.h"
 #include "KDTree.h"
 #include "Line.h"
 #include "LineSegment.h"
+#include "LinearQuadTree.h"
 #include "OBB.h"
+#include "Octree.h"
 #include "Plane.h"
 #include "Polygon.h"
 #include "Polyhedron.h"
 #include "QuadTree.h"
 #include "Ray.h"
 #include "Sphere.h"
+#include "SweepAndPrune.h"
 #include "Triangle.h"
 #include "TriangleMesh.h"
 #include "GeomType.h"
@@ -0,0 +1,279 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file HashGrid.h
+	@author Jukka Jylnki
+	@brief Uniform grids that store only their occupied cells in a hash table, for broadphase queries of many
+		similarly sized objects. */
+#pragma once
+
+#ifdef MATH_GRAPHICSENGINE_INTEROP
+#include "Time/Profiler.h"
+#else
+#define PROFILE(x)
+#endif
+#include "../Math/float2.h"
+#include "../Math/float3.h"
+#include "../Math/MathTypes.h"
+#include "AABB.h"
+#include "AABB2D.h"
+#include "Sphere.h"
+#include <vector>
+
+MATH_BEGIN_NAMESPACE
+
+/// The occupied cells of a hash grid, stored in an open addressing hash table.
+/** Each occupied cell of the grid has a slot in the table, keyed by the packed integer coordinates of the cell. The
+	objects of the cells are kept in a single pool of entries, where the entries of each cell form a linked list.
+	Removed entries are reused by later additions, so once the pool and the table have grown to their working size,
+	adding and removing objects does not allocate memory. The table uses linear probing, and removes the slots of
+	cells that become empty by shifting the following slots back, so there are no tombstones to clean up.
+	@param Bounds The type of the bounding box of the objects, AABB2D or AABB. */
+template<typename T, typename Bounds>
+class HashGridCellTable
+{
+public:
+	/// An object in a cell of the grid.
+	struct Entry
+	{
+		T object;
+		/// The bounding box of the object when it was added to the grid.
+		Bounds aabb;
+		/// The index of the next entry of the same cell, or 0xFFFFFFFF if this is the last entry of the cell.
+		u32 next;
+	};
+
+	/// A slot of the hash table.
+	struct Slot
+	{
+		/// The packed integer coordinates of the cell.
+		u64 key;
+		/// The index of the first entry of the cell.
+		u32 firstEntry;
+		/// The number of objects in the cell. If 0, this slot is free.
+		u32 numEntries;
+	};
+
+	HashGridCellTable()
+	:freeEntry(0xFFFFFFFF), numOccupiedSlots(0), numObjects(0), hashShift(64)
+	{
+	}
+
+	/// Removes all objects and cells from the table.
+	void Clear();
+
+	/// Adds the given object to the cell with the given key.
+	void Add(u64 key, const T &object, const Bounds &aabb);
+
+	/// Removes the given object from the cell with the given key. The objects are compared with operator ==.
+	/// @return True if the object was found.
+	bool Remove(u64 key, const T &object);
+
+	/// @return The slot of the cell with the given key, or null if the cell is empty.
+	const Slot *Find(u64 key) const
+	{
+		u32 index = FindSlot(key);
+		return (index != 0xFFFFFFFF) ? &slots[index] : 0;
+	}
+
+	/// Returns all the slots of the table, including the free ones. Iterate over these to visit each occupied cell.
+	const std::vector<Slot> &Slots() const { return slots; }
+
+	Entry &GetEntry(u32 index) { return entries[index]; }
+	const Entry &GetEntry(u32 index) const { return entries[index]; }
+
+	int NumOccupiedCells() const { return numOccupiedSlots; }
+	int NumObjects() const { return numObjects; }
+
+private:
+	/// Returns the index of the slot where the search for the given key starts.
+	u32 HomeSlot(u64 key) const { return (u32)((key * 0x9E3779B97F4A7C15ULL) >> hashShift); }
+
+	/// Returns the index of the slot of the cell with the given key, or 0xFFFFFFFF if the cell is empty.
+	u32 FindSlot(u64 key) const;
+
+	/// Doubles the number of slots of the table.
+	void Grow();
+
+	/// Frees the slot at the given index.
+	void RemoveSlot(u32 index);
+
+	std::vector<Slot> slots;
+	std::vector<Entry> entries;
+	/// The head of the list of unused entries, linked through Entry::next.
+	u32 freeEntry;
+	int numOccupiedSlots;
+	int numObjects;
+	/// The hash of a key is the top 64 - hashShift bits of the key multiplied by a constant.
+	int hashShift;
+};
+
+/// A uniform 2D grid that stores objects of type T in the cells that contain the centers of their bounding rectangles.
+/** A hash grid is the broadphase of choice for a large number of objects of similar size. Unlike QuadTree, it needs
+	no bounds for the world, and adding and removing an object is a constant time operation. Only the occupied cells
+	are stored, so the size of the world does not affect the memory usage. The objects are compared to each other
+	and to the queries with the bounding rectangles that they had when they were added to the grid.
+
+	For best performance, choose the cell size to be about twice the size of a typical object. Objects larger than
+	the cells are supported, but the queries search all the cells within the distance of the largest object ever
+	added to the grid, so a few huge objects slow down all the queries.
+
+	To store objects of type T in a HashGrid2D, define the function AABB2D GetAABB2D(const T &object), which returns
+	the bounding rectangle of the object. T must be comparable with operator == for Remove(). */
+template<typename T>
+class HashGrid2D
+{
+public:
+	typedef HashGridCellTable<T, AABB2D> CellTable;
+
+	explicit HashGrid2D(float cellSize = 1.f);
+
+	/// Removes all objects from the grid, and sets the cell size of the grid.
+	void Clear(float cellSize);
+	void Clear() { Clear(cellSize); }
+
+	/// Adds the given object to the grid. Runs in constant time.
+	void Add(const T &object);
+
+	/// Removes the given object from the grid. Runs in constant time.
+	/** The cell of the object is found with its current bounding rectangle, so this must be called before the bounds
+		of the object change. To move an object, remove it, change its position and add it again.
+		@return True if the object was found in the grid. */
+	bool Remove(const T &object);
+
+	float CellSize() const { return cellSize; }
+	int NumObjects() const { return cells.NumObjects(); }
+	int NumOccupiedCells() const { return cells.NumOccupiedCells(); }
+
+	/// Returns the integer coordinates of the cell that contains the given point.
+	void CellCoordinates(const float2 &point, int &x, int &y) const;
+
+	/// Calls the given callback function for each object of the grid whose bounding rectangle intersects the given
+	/// AABB.
+	/** @param callback A function or a function object of prototype
+			bool callbackFunction(HashGrid2D<T> &grid, const AABB2D &queryAABB, T &object, const AABB2D &objectAABB);
+		If the callback function returns true, the execution of the query is stopped. */
+	template<typename Func>
+	inline void AABBQuery(const AABB2D &aabb, Func &callback);
+
+	/// Calls the given callback function for each object of the grid whose bounding rectangle intersects the given
+	/// circle.
+	/** @param callback A function or a function object of prototype
+			bool callbackFunction(HashGrid2D<T> &grid, const AABB2D &circleAABB, T &object, const AABB2D &objectAABB);
+		where circleAABB is the bounding rectangle of the circle. If the callback function returns true, the execution
+		of the query is stopped. */
+	template<typename Func>
+	inline void CircleQuery(const float2 &center, float radius, Func &callback);
+
+	/// Finds all pairs of objects in the grid whose bounding rectangles intersect, and calls the given callback
+	/// function once for each pair.
+	/** @param callback A function or a function object of prototype
+			void callbackFunction(T &a, T &b); */
+	template<typename Func>
+	inline void CollidingPairsQuery(Func &callback);
+
+private:
+	static u64 CellKey(int x, int y) { return ((u64)(u32)x << 32) | (u64)(u32)y; }
+
+	/// Calls the callback for the objects that intersect the query rectangle and pass the given filter.
+	template<typename Filter, typename Func>
+	inline void Query(const AABB2D &aabb, const Filter &filter, Func &callback);
+
+	CellTable cells;
+	float cellSize;
+	float invCellSize;
+	/// The largest half-size of any object added to the grid since the last call to Clear().
+	float2 maxHalfSize;
+};
+
+/// A uniform 3D grid that stores objects of type T in the cells that contain the centers of their bounding boxes.
+/** This is the 3D counterpart of HashGrid2D. The integer cell coordinates are stored in 21 bits per axis, so cells
+	farther than 2^20 cells from the origin alias with other cells. The aliasing is harmless to the results, since
+	the queries test the bounding box of each object they find, but it adds work if the objects are spread that far.
+
+	To store objects of type T in a HashGrid3D, define the function AABB GetAABB(const T &object), which returns the
+	bounding box of the object. T must be comparable with operator == for Remove(). */
+template<typename T>
+class HashGrid3D
+{
+public:
+	typedef HashGridCellTable<T, AABB> CellTable;
+
+	explicit HashGrid3D(float cellSize = 1.f);
+
+	/// Removes all objects from the grid, and sets the cell size of the grid.
+	void Clear(float cellSize);
+	void Clear() { Clear(cellSize); }
+
+	/// Adds the given object to the grid. Runs in constant time.
+	void Add(const T &object);
+
+	/// Removes the given object from the grid. Runs in constant time.
+	/** The cell of the object is found with its current bounding box, so this must be called before the bounds of
+		the object change.
+		@return True if the object was found in the grid. */
+	bool Remove(const T &object);
+
+	float CellSize() const { return cellSize; }
+	int NumObjects() const { return cells.NumObjects(); }
+	int NumOccupiedCells() const { return cells.NumOccupiedCells(); }
+
+	/// Returns the integer coordinates of the cell that contains the given point.
+	void CellCoordinates(const float3 &point, int &x, int &y, int &z) const;
+
+	/// Calls the given callback function for each object of the grid whose bounding box intersects the given AABB.
+	/** @param callback A function or a function object of prototype
+			bool callbackFunction(HashGrid3D<T> &grid, const AABB &queryAABB, T &object, const AABB &objectAABB);
+		If the callback function returns true, the execution of the query is stopped. */
+	template<typename Func>
+	inline void AABBQuery(const AABB &aabb, Func &callback);
+
+	/// Calls the given callback function for each object of the grid whose bounding box intersects the given sphere.
+	/** @param callback A function or a function object of prototype
+			bool callbackFunction(HashGrid3D<T> &grid, const AABB &sphereAABB, T &object, const AABB &objectAABB);
+		where sphereAABB is the bounding box of the sphere. If the callback function returns true, the execution of
+		the query is stopped. */
+	template<typename Func>
+	inline void SphereQuery(const Sphere &sphere, Func &callback);
+
+	/// Finds all pairs of objects in the grid whose bounding boxes intersect, and calls the given callback function
+	/// once for each pair.
+	/** @param callback A function or a function object of prototype
+			void callbackFunction(T &a, T &b); */
+	template<typename Func>
+	inline void CollidingPairsQuery(Func &callback);
+
+private:
+	/// The cell coordinates are wrapped to this many bits per axis in the cell keys.
+	static const int keyBitsPerAxis = 21;
+
+	static u64 CellKey(int x, int y, int z)
+	{
+		const u64 mask = ((u64)1 << keyBitsPerAxis) - 1;
+		return (((u64)(u32)x & mask) << (2 * keyBitsPerAxis)) | (((u64)(u32)y & mask) << keyBitsPerAxis) | ((u64)(u32)z & mask);
+	}
+
+	template<typename Filter, typename Func>
+	inline void Query(const AABB &aabb, const Filter &filter, Func &callback);
+
+	CellTable cells;
+	float cellSize;
+	float invCellSize;
+	/// The largest half-size of any object added to the grid since the last call to Clear().
+	float3 maxHalfSize;
+};
+
+MATH_END_NAMESPACE
+
+#include "HashGrid.inl"
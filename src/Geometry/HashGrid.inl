@@ -0,0 +1,521 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file HashGrid.inl
+	@author Jukka Jylnki
+	@brief Implementation for the HashGrid2D and HashGrid3D objects. */
+#pragma once
+
+#include "../Math/MathFunc.h"
+
+MATH_BEGIN_NAMESPACE
+
+template<typename T, typename Bounds>
+void HashGridCellTable<T, Bounds>::Clear()
+{
+	slots.clear();
+	entries.clear();
+	freeEntry = 0xFFFFFFFF;
+	numOccupiedSlots = 0;
+	numObjects = 0;
+	hashShift = 64;
+}
+
+template<typename T, typename Bounds>
+void HashGridCellTable<T, Bounds>::Grow()
+{
+	std::vector<Slot> oldSlots;
+	oldSlots.swap(slots);
+	Slot empty;
+	empty.key = 0;
+	empty.firstEntry = 0xFFFFFFFF;
+	empty.numEntries = 0;
+	slots.resize(oldSlots.empty() ? 16 : oldSlots.size() * 2, empty);
+	hashShift = 64;
+	for(size_t size = slots.size(); size > 1; size >>= 1)
+		--hashShift;
+
+	// The entries stay where they are, only the slots that point to them move.
+	const u32 mask = (u32)slots.size() - 1;
+	for(size_t i = 0; i < oldSlots.size(); ++i)
+		if (oldSlots[i].numEntries > 0)
+		{
+			u32 index = HomeSlot(oldSlots[i].key);
+			while(slots[index].numEntries > 0)
+				index = (index + 1) & mask;
+			slots[index] = oldSlots[i];
+		}
+}
+
+template<typename T, typename Bounds>
+void HashGridCellTable<T, Bounds>::Add(u64 key, const T &object, const Bounds &aabb)
+{
+	// Keep the table at most half full, so that the probe sequences stay short.
+	if ((size_t)(numOccupiedSlots + 1) * 2 > slots.size())
+		Grow();
+
+	u32 entryIndex;
+	if (freeEntry != 0xFFFFFFFF)
+	{
+		entryIndex = freeEntry;
+		freeEntry = entries[entryIndex].next;
+	}
+	else
+	{
+		entryIndex = (u32)entries.size();
+		entries.push_back(Entry());
+	}
+	Entry &entry = entries[entryIndex];
+	entry.object = object;
+	entry.aabb = aabb;
+
+	const u32 mask = (u32)slots.size() - 1;
+	u32 index = HomeSlot(key);
+	while(slots[index].numEntries > 0 && slots[index].key != key)
+		index = (index + 1) & mask;
+	Slot &slot = slots[index];
+	if (slot.numEntries == 0)
+	{
+		slot.key = key;
+		slot.firstEntry = 0xFFFFFFFF;
+		++numOccupiedSlots;
+	}
+	entry.next = slot.firstEntry;
+	slot.firstEntry = entryIndex;
+	++slot.numEntries;
+	++numObjects;
+}
+
+template<typename T, typename Bounds>
+u32 HashGridCellTable<T, Bounds>::FindSlot(u64 key) const
+{
+	if (slots.empty())
+		return 0xFFFFFFFF;
+	const u32 mask = (u32)slots.size() - 1;
+	u32 index = HomeSlot(key);
+	while(slots[index].numEntries > 0)
+	{
+		if (slots[index].key == key)
+			return index;
+		index = (index + 1) & mask;
+	}
+	return 0xFFFFFFFF;
+}
+
+template<typename T, typename Bounds>
+bool HashGridCellTable<T, Bounds>::Remove(u64 key, const T &object)
+{
+	u32 slotIndex = FindSlot(key);
+	if (slotIndex == 0xFFFFFFFF)
+		return false;
+
+	Slot *slot = &slots[slotIndex];
+	u32 *link = &slot->firstEntry;
+	while(*link != 0xFFFFFFFF)
+	{
+		Entry &entry = entries[*link];
+		if (entry.object == object)
+		{
+			u32 entryIndex = *link;
+			*link = entry.next;
+			entry.next = freeEntry;
+			freeEntry = entryIndex;
+			--numObjects;
+			if (--slot->numEntries == 0)
+				RemoveSlot(slotIndex);
+			return true;
+		}
+		link = &entry.next;
+	}
+	return false;
+}
+
+template<typename T, typename Bounds>
+void HashGridCellTable<T, Bounds>::RemoveSlot(u32 index)
+{
+	// Shift back the following slots of the same probe sequences, so that no search passes through a free slot
+	// before reaching its key.
+	const u32 mask = (u32)slots.size() - 1;
+	u32 next = index;
+	for(;;)
+	{
+		next = (next + 1) & mask;
+		if (slots[next].numEntries == 0)
+			break;
+		u32 home = HomeSlot(slots[next].key);
+		// The slot can be moved to the free slot if its home slot is not cyclically in ]index, next].
+		bool homeBetween = (index <= next) ? (index < home && home <= next) : (index < home || home <= next);
+		if (homeBetween)
+			continue;
+		slots[index] = slots[next];
+		index = next;
+	}
+	slots[index].numEntries = 0;
+	slots[index].firstEntry = 0xFFFFFFFF;
+	--numOccupiedSlots;
+}
+
+/// Accepts all the objects whose bounds intersect the bounding box of a query.
+struct HashGridAcceptAll
+{
+	template<typename Bounds>
+	bool operator ()(const Bounds &) const { return true; }
+};
+
+/// Accepts the objects whose bounding rectangles intersect the circle of HashGrid2D::CircleQuery().
+struct HashGridCircleFilter
+{
+	float2 center;
+	float radiusSq;
+
+	bool operator ()(const AABB2D &aabb) const { return aabb.DistanceSq(center) <= radiusSq; }
+};
+
+/// Accepts the objects whose bounding boxes intersect the sphere of HashGrid3D::SphereQuery().
+struct HashGridSphereFilter
+{
+	Sphere sphere;
+
+	bool operator ()(const AABB &aabb) const { return aabb.Intersects(sphere); }
+};
+
+/// Converts a cell coordinate computed in floating point to an int, clamping it to a range where the
+/// coordinates of the neighboring cells can be computed without overflow.
+inline int HashGridCellCoordinate(float coordinate)
+{
+	return (int)Clamp(Floor(coordinate), -1073741824.f, 1073741824.f);
+}
+
+template<typename T>
+HashGrid2D<T>::HashGrid2D(float cellSize_)
+{
+	Clear(cellSize_);
+}
+
+template<typename T>
+void HashGrid2D<T>::Clear(float cellSize_)
+{
+	assume(cellSize_ > 0.f);
+	cells.Clear();
+	cellSize = cellSize_;
+	invCellSize = 1.f / cellSize_;
+	maxHalfSize = float2(0.f, 0.f);
+}
+
+template<typename T>
+void HashGrid2D<T>::CellCoordinates(const float2 &point, int &x, int &y) const
+{
+	x = HashGridCellCoordinate(point.x * invCellSize);
+	y = HashGridCellCoordinate(point.y * invCellSize);
+}
+
+template<typename T>
+void HashGrid2D<T>::Add(const T &object)
+{
+	AABB2D aabb = GetAABB2D(object);
+	assert(aabb.minPoint.x <= aabb.maxPoint.x);
+	assert(aabb.minPoint.y <= aabb.maxPoint.y);
+	int x, y;
+	CellCoordinates((aabb.minPoint + aabb.maxPoint) * 0.5f, x, y);
+	maxHalfSize = Max(maxHalfSize, (aabb.maxPoint - aabb.minPoint) * 0.5f);
+	cells.Add(CellKey(x, y), object, aabb);
+}
+
+template<typename T>
+bool HashGrid2D<T>::Remove(const T &object)
+{
+	AABB2D aabb = GetAABB2D(object);
+	int x, y;
+	CellCoordinates((aabb.minPoint + aabb.maxPoint) * 0.5f, x, y);
+	return cells.Remove(CellKey(x, y), object);
+}
+
+template<typename T>
+template<typename Filter, typename Func>
+inline void HashGrid2D<T>::Query(const AABB2D &aabb, const Filter &filter, Func &callback)
+{
+	// The objects are in the cells of their centers, so search the cells that contain the centers of all the objects
+	// that can reach the query.
+	// The margin covers the rounding errors in the computed centers of the objects.
+	const float2 reach = maxHalfSize * 1.00001f + (aabb.minPoint.Abs() + aabb.maxPoint.Abs()) * 1e-6f;
+	int x0, y0, x1, y1;
+	CellCoordinates(aabb.minPoint - reach, x0, y0);
+	CellCoordinates(aabb.maxPoint + reach, x1, y1);
+	double numCellsInRange = ((double)x1 - x0 + 1) * ((double)y1 - y0 + 1);
+	if (numCellsInRange > cells.NumOccupiedCells())
+	{
+		// The query covers more cells than there are occupied cells, so it is faster to visit the occupied cells.
+		const std::vector<typename CellTable::Slot> &slots = cells.Slots();
+		for(size_t i = 0; i < slots.size(); ++i)
+			for(u32 e = (slots[i].numEntries > 0) ? slots[i].firstEntry : 0xFFFFFFFF; e != 0xFFFFFFFF; e = cells.GetEntry(e).next)
+			{
+				typename CellTable::Entry &entry = cells.GetEntry(e);
+				if (entry.aabb.Intersects(aabb) && filter(entry.aabb) && callback(*this, aabb, entry.object, entry.aabb))
+					return;
+			}
+		return;
+	}
+
+	for(int y = y0; y <= y1; ++y)
+		for(int x = x0; x <= x1; ++x)
+		{
+			const typename CellTable::Slot *slot = cells.Find(CellKey(x, y));
+			if (!slot)
+				continue;
+			for(u32 e = slot->firstEntry; e != 0xFFFFFFFF; e = cells.GetEntry(e).next)
+			{
+				typename CellTable::Entry &entry = cells.GetEntry(e);
+				if (entry.aabb.Intersects(aabb) && filter(entry.aabb) && callback(*this, aabb, entry.object, entry.aabb))
+					return;
+			}
+		}
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid2D<T>::AABBQuery(const AABB2D &aabb, Func &callback)
+{
+	PROFILE(HashGrid2D_AABBQuery);
+	HashGridAcceptAll filter;
+	Query(aabb, filter, callback);
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid2D<T>::CircleQuery(const float2 &center, float radius, Func &callback)
+{
+	PROFILE(HashGrid2D_CircleQuery);
+	assume(radius >= 0.f);
+	HashGridCircleFilter filter;
+	filter.center = center;
+	filter.radiusSq = radius * radius;
+	Query(AABB2D(center - float2(radius, radius), center + float2(radius, radius)), filter, callback);
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid2D<T>::CollidingPairsQuery(Func &callback)
+{
+	PROFILE(HashGrid2D_CollidingPairsQuery);
+	// Two objects can only intersect if their centers are at most the sum of their half-sizes apart, so each object
+	// is tested against the objects of the cells within this many cells of its own. The cells of two points at a
+	// distance d apart differ by at most floor(d / cellSize) + 1, and the small factor covers the rounding errors
+	// in the computed centers.
+	const int reachX = (int)(2.00002f * maxHalfSize.x * invCellSize) + 1;
+	const int reachY = (int)(2.00002f * maxHalfSize.y * invCellSize) + 1;
+
+	const std::vector<typename CellTable::Slot> &slots = cells.Slots();
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		const typename CellTable::Slot &slot = slots[i];
+		if (slot.numEntries == 0)
+			continue;
+
+		// The pairs within the cell.
+		for(u32 a = slot.firstEntry; a != 0xFFFFFFFF; a = cells.GetEntry(a).next)
+		{
+			typename CellTable::Entry &entryA = cells.GetEntry(a);
+			for(u32 b = entryA.next; b != 0xFFFFFFFF; b = cells.GetEntry(b).next)
+			{
+				typename CellTable::Entry &entryB = cells.GetEntry(b);
+				if (entryA.aabb.Intersects(entryB.aabb))
+					callback(entryA.object, entryB.object);
+			}
+		}
+
+		// The pairs with the neighboring cells that come after this cell in (x, y) order, so that each pair of cells is
+		// only visited from one of them.
+		const int cellX = (int)(u32)(slot.key >> 32);
+		const int cellY = (int)(u32)slot.key;
+		for(int dy = 0; dy <= reachY; ++dy)
+			for(int dx = (dy == 0) ? 1 : -reachX; dx <= reachX; ++dx)
+			{
+				const typename CellTable::Slot *neighbor = cells.Find(CellKey(cellX + dx, cellY + dy));
+				if (!neighbor)
+					continue;
+				for(u32 a = slot.firstEntry; a != 0xFFFFFFFF; a = cells.GetEntry(a).next)
+				{
+					typename CellTable::Entry &entryA = cells.GetEntry(a);
+					for(u32 b = neighbor->firstEntry; b != 0xFFFFFFFF; b = cells.GetEntry(b).next)
+					{
+						typename CellTable::Entry &entryB = cells.GetEntry(b);
+						if (entryA.aabb.Intersects(entryB.aabb))
+							callback(entryA.object, entryB.object);
+					}
+				}
+			}
+	}
+}
+
+template<typename T>
+HashGrid3D<T>::HashGrid3D(float cellSize_)
+{
+	Clear(cellSize_);
+}
+
+template<typename T>
+void HashGrid3D<T>::Clear(float cellSize_)
+{
+	assume(cellSize_ > 0.f);
+	cells.Clear();
+	cellSize = cellSize_;
+	invCellSize = 1.f / cellSize_;
+	maxHalfSize = float3(0.f, 0.f, 0.f);
+}
+
+template<typename T>
+void HashGrid3D<T>::CellCoordinates(const float3 &point, int &x, int &y, int &z) const
+{
+	x = HashGridCellCoordinate(point.x * invCellSize);
+	y = HashGridCellCoordinate(point.y * invCellSize);
+	z = HashGridCellCoordinate(point.z * invCellSize);
+}
+
+template<typename T>
+void HashGrid3D<T>::Add(const T &object)
+{
+	AABB aabb = GetAABB(object);
+	assert(aabb.IsFinite());
+	assert(aabb.minPoint.x <= aabb.maxPoint.x && aabb.minPoint.y <= aabb.maxPoint.y && aabb.minPoint.z <= aabb.maxPoint.z);
+	int x, y, z;
+	CellCoordinates(aabb.CenterPoint(), x, y, z);
+	maxHalfSize = Max(maxHalfSize, aabb.HalfSize());
+	cells.Add(CellKey(x, y, z), object, aabb);
+}
+
+template<typename T>
+bool HashGrid3D<T>::Remove(const T &object)
+{
+	AABB aabb = GetAABB(object);
+	int x, y, z;
+	CellCoordinates(aabb.CenterPoint(), x, y, z);
+	return cells.Remove(CellKey(x, y, z), object);
+}
+
+template<typename T>
+template<typename Filter, typename Func>
+inline void HashGrid3D<T>::Query(const AABB &aabb, const Filter &filter, Func &callback)
+{
+	const float3 reach = maxHalfSize * 1.00001f + (aabb.minPoint.Abs() + aabb.maxPoint.Abs()) * 1e-6f;
+	int x0, y0, z0, x1, y1, z1;
+	CellCoordinates(aabb.minPoint - reach, x0, y0, z0);
+	CellCoordinates(aabb.maxPoint + reach, x1, y1, z1);
+	double numCellsInRange = ((double)x1 - x0 + 1) * ((double)y1 - y0 + 1) * ((double)z1 - z0 + 1);
+	// A range wider than the wrapping of the cell keys would visit the same keys twice.
+	const int maxRange = (1 << keyBitsPerAxis) - 1;
+	if (numCellsInRange > cells.NumOccupiedCells() || x1 - x0 >= maxRange || y1 - y0 >= maxRange || z1 - z0 >= maxRange)
+	{
+		const std::vector<typename CellTable::Slot> &slots = cells.Slots();
+		for(size_t i = 0; i < slots.size(); ++i)
+			for(u32 e = (slots[i].numEntries > 0) ? slots[i].firstEntry : 0xFFFFFFFF; e != 0xFFFFFFFF; e = cells.GetEntry(e).next)
+			{
+				typename CellTable::Entry &entry = cells.GetEntry(e);
+				if (entry.aabb.Intersects(aabb) && filter(entry.aabb) && callback(*this, aabb, entry.object, entry.aabb))
+					return;
+			}
+		return;
+	}
+
+	for(int z = z0; z <= z1; ++z)
+		for(int y = y0; y <= y1; ++y)
+			for(int x = x0; x <= x1; ++x)
+			{
+				const typename CellTable::Slot *slot = cells.Find(CellKey(x, y, z));
+				if (!slot)
+					continue;
+				for(u32 e = slot->firstEntry; e != 0xFFFFFFFF; e = cells.GetEntry(e).next)
+				{
+					typename CellTable::Entry &entry = cells.GetEntry(e);
+					if (entry.aabb.Intersects(aabb) && filter(entry.aabb) && callback(*this, aabb, entry.object, entry.aabb))
+						return;
+				}
+			}
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid3D<T>::AABBQuery(const AABB &aabb, Func &callback)
+{
+	PROFILE(HashGrid3D_AABBQuery);
+	HashGridAcceptAll filter;
+	Query(aabb, filter, callback);
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid3D<T>::SphereQuery(const Sphere &sphere, Func &callback)
+{
+	PROFILE(HashGrid3D_SphereQuery);
+	HashGridSphereFilter filter;
+	filter.sphere = sphere;
+	Query(sphere.MinimalEnclosingAABB(), filter, callback);
+}
+
+template<typename T>
+template<typename Func>
+inline void HashGrid3D<T>::CollidingPairsQuery(Func &callback)
+{
+	PROFILE(HashGrid3D_CollidingPairsQuery);
+	const int reachX = (int)(2.00002f * maxHalfSize.x * invCellSize) + 1;
+	const int reachY = (int)(2.00002f * maxHalfSize.y * invCellSize) + 1;
+	const int reachZ = (int)(2.00002f * maxHalfSize.z * invCellSize) + 1;
+	assert(Max(reachX, Max(reachY, reachZ)) < (1 << (keyBitsPerAxis - 1)));
+	// Sign-extends a wrapped cell coordinate of a key back to an int.
+	const int signShift = 32 - keyBitsPerAxis;
+	const u64 mask = ((u64)1 << keyBitsPerAxis) - 1;
+
+	const std::vector<typename CellTable::Slot> &slots = cells.Slots();
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		const typename CellTable::Slot &slot = slots[i];
+		if (slot.numEntries == 0)
+			continue;
+
+		for(u32 a = slot.firstEntry; a != 0xFFFFFFFF; a = cells.GetEntry(a).next)
+		{
+			typename CellTable::Entry &entryA = cells.GetEntry(a);
+			for(u32 b = entryA.next; b != 0xFFFFFFFF; b = cells.GetEntry(b).next)
+			{
+				typename CellTable::Entry &entryB = cells.GetEntry(b);
+				if (entryA.aabb.Intersects(entryB.aabb))
+					callback(entryA.object, entryB.object);
+			}
+		}
+
+		// The pairs with the neighboring cells that come after this cell in (x, y, z) order.
+		const int cellX = (int)((u32)((slot.key >> (2 * keyBitsPerAxis)) & mask) << signShift) >> signShift;
+		const int cellY = (int)((u32)((slot.key >> keyBitsPerAxis) & mask) << signShift) >> signShift;
+		const int cellZ = (int)((u32)(slot.key & mask) << signShift) >> signShift;
+		for(int dz = 0; dz <= reachZ; ++dz)
+			for(int dy = (dz == 0) ? 0 : -reachY; dy <= reachY; ++dy)
+				for(int dx = (dz == 0 && dy == 0) ? 1 : -reachX; dx <= reachX; ++dx)
+				{
+					const typename CellTable::Slot *neighbor = cells.Find(CellKey(cellX + dx, cellY + dy, cellZ + dz));
+					if (!neighbor)
+						continue;
+					for(u32 a = slot.firstEntry; a != 0xFFFFFFFF; a = cells.GetEntry(a).next)
+					{
+						typename CellTable::Entry &entryA = cells.GetEntry(a);
+						for(u32 b = neighbor->firstEntry; b != 0xFFFFFFFF; b = cells.GetEntry(b).next)
+						{
+							typename CellTable::Entry &entryB = cells.GetEntry(b);
+							if (entryA.aabb.Intersects(entryB.aabb))
+								callback(entryA.object, entryB.object);
+						}
+					}
+				}
+	}
+}
+
+MATH_END_NAMESPACE
@@ -41,7 +41,7 @@ struct KdTreeNode
 	/// If this is a leaf, has the value AxisNone.
 	unsigned splitAxis : 2;
 	/// If this is an inner node, specifies the index/offset to the child node pair.
-	/// If this is a leaf, the value is undefined.
+	/// If this is a leaf, specifies the number of objects in the object bucket of this leaf.
 	unsigned childIndex : 30;
 	union
 	{
@@ -54,11 +54,164 @@ struct KdTreeNode
 	/// If true, this leaf does not contain any objects.
 	bool IsEmptyLeaf() const { assert(IsLeaf()); return bucketIndex == 0; }
 	bool IsLeaf() const { return splitAxis == AxisNone; }
+	/// Returns the number of objects in this leaf.
+	int NumObjects() const { assert(IsLeaf()); return (int)childIndex; }
 	int LeftChildIndex() const { return (int)childIndex; }
 	int RightChildIndex() const { return (int)childIndex+1; }
 	CardinalAxis SplitAxis() const { return (CardinalAxis)splitAxis; }
 };
 
+/// Specifies how KdTree<T>::Build() chooses the split planes of the tree.
+enum KdTreeSplitStrategy
+{
+	/// Splits the longest axis of each node at its center point. Fast to build, but produces unbalanced
+	/// trees for unevenly distributed (clustered) geometry.
+	KdTreeSplitMidpoint = 0,
+	/// Chooses the split plane that minimizes the Surface Area Heuristic cost, evaluated at a fixed number of
+	/// bin boundaries along each axis. Slower to build, but generally produces trees that are faster to query.
+	KdTreeSplitSAH
+};
+
+/// Specifies the parameters that control how a kD-tree is built.
+struct KdTreeBuildParams
+{
+	KdTreeBuildParams()
+	:splitStrategy(KdTreeSplitMidpoint),
+	numSAHBins(32),
+	traversalCost(1.f),
+	intersectionCost(4.f),
+	maxLeafObjects(16),
+	maxTreeDepth(30),
+	maxNodes(0),
+	numThreads(1)
+	{
+	}
+
+	/// The strategy to use for choosing the split planes.
+	KdTreeSplitStrategy splitStrategy;
+
+	/// If splitStrategy == KdTreeSplitSAH, specifies the number of bins along each axis to evaluate the SAH cost at.
+	int numSAHBins;
+
+	/// If splitStrategy == KdTreeSplitSAH, specifies the estimated relative cost of traversing through an inner node.
+	float traversalCost;
+
+	/// If splitStrategy == KdTreeSplitSAH, specifies the estimated relative cost of testing a single object for intersection.
+	float intersectionCost;
+
+	/// Leaves containing at most this many objects are never split further.
+	int maxLeafObjects;
+
+	/// Leaves at this depth (the root being at depth 1) are never split further, regardless of their object count.
+	/// Can be at most KdTree<T>::maxSupportedTreeDepth.
+	int maxTreeDepth;
+
+	/// If > 0, specifies a budget for the total number of nodes in the tree: leaves are not split further once the
+	/// budget would be exceeded. If <= 0, the number of nodes is unlimited.
+	/// @note A node budget is allocated in depth-first order, so a tree built with a budget is always built on a single thread.
+	int maxNodes;
+
+	/// Specifies the number of threads to build the tree with. If <= 0, all hardware threads are used.
+	/// The built tree is identical regardless of the number of threads used.
+	int numThreads;
+};
+
+/// Describes the shape and the estimated query performance of a built kD-tree. See KdTree<T>::ComputeStats().
+struct KdTreeStats
+{
+	int numNodes;
+	int numInnerNodes;
+	int numLeaves;
+	int numEmptyLeaves;
+	int treeHeight;
+
+	/// The number of objects in the largest leaf.
+	int maxLeafOccupancy;
+
+	/// The average number of objects in the non-empty leaves.
+	float avgLeafOccupancy;
+
+	/// The ratio of empty leaves to all leaves, in the range [0, 1].
+	float emptyLeafRatio;
+
+	/// The number of leaves that hold more than maxLeafObjects objects, but were left unsplit because they are at maxTreeDepth.
+	int numDepthLimitedLeaves;
+
+	/// The Surface Area Heuristic cost of the tree: the estimated cost of a random ray query through it,
+	/// in the units of KdTreeBuildParams::traversalCost and KdTreeBuildParams::intersectionCost.
+	float sahCost;
+};
+
+/// Identifies an object found by KdTree<T>::KNearest() or KdTree<T>::RadiusQuery().
+struct KdTreeNeighbor
+{
+	/// The index of the object in the kD-tree.
+	int objectIndex;
+	/// The distance of the object to the query point, as returned by T::Distance(const float3 &).
+	float distance;
+
+	/// Orders the neighbors by distance, and the neighbors at equal distances by object index.
+	bool operator <(const KdTreeNeighbor &rhs) const
+	{
+		return distance < rhs.distance || (distance == rhs.distance && objectIndex < rhs.objectIndex);
+	}
+};
+
+/// Reports that the bounding box of an object overlaps a query box in KdTree<T>::AABBQueryBatch().
+struct KdTreeAABBQueryHit
+{
+	/// The index of the query box in the array of query boxes.
+	int queryIndex;
+	/// The index of the object in the tree.
+	int objectIndex;
+
+	/// Orders the pairs by query index, and the pairs of the same query by object index.
+	bool operator <(const KdTreeAABBQueryHit &rhs) const
+	{
+		return queryIndex < rhs.queryIndex || (queryIndex == rhs.queryIndex && objectIndex < rhs.objectIndex);
+	}
+};
+
+/// The header of a kD-tree blob written by KdTree<T>::SaveToBuffer().
+/** The header is followed by the node array, the bucket array and the object array of the tree, each starting
+	at a multiple of ALIGNMENT bytes from the beginning of the blob. The arrays are stored in the in-memory
+	layout of the machine that wrote the blob, so that a loaded tree can be queried directly from the blob. */
+struct KdTreeBlobHeader
+{
+	/// Identifies the data as a kD-tree blob. The bytes "MGKD" in little-endian order.
+	static const u32 MAGIC = 0x444B474D;
+	/// The current version of the blob format. Blobs of other versions are rejected on load.
+	static const u32 VERSION = 1;
+	/// Written in the byte order of the machine that wrote the blob. Reads back as a different value
+	/// on a machine with the opposite byte order.
+	static const u32 ENDIAN_TAG = 0x01020304;
+	/// The alignment, in bytes, of the blob and of each array in it.
+	static const u32 ALIGNMENT = 16;
+
+	u32 magic;
+	u32 version;
+	u32 endianTag;
+	/// The sizes of KdTreeBlobHeader, KdTreeNode and the object type T on the machine that wrote the blob.
+	u32 headerSize;
+	u32 nodeSize;
+	u32 objectSize;
+	/// The number of nodes in the node array, including the unused dummy node at index 0.
+	u32 numNodes;
+	/// The number of u32 entries in the bucket array.
+	u32 numBucketEntries;
+	u32 numObjects;
+	u32 reserved; ///< Padding, always zero.
+	/// The byte offsets of the arrays from the beginning of the blob.
+	u64 nodesOffset;
+	u64 bucketsOffset;
+	u64 objectsOffset;
+	/// The size of the whole blob in bytes.
+	u64 totalSize;
+	/// The bounding box of the tree.
+	float rootAABBMin[3];
+	float rootAABBMax[3];
+};
+
 /// Type T must have a member function bool T.Intersects(const AABB &) const;
 template<typename T>
 class KdTree
@@ -67,10 +220,19 @@ public:
 	/// Represents the end of list in the index list of a bucket.
 	static const u32 BUCKET_SENTINEL = 0xFFFFFFFF;
 
+	/// The maximum value of KdTreeBuildParams::maxTreeDepth. The traversal stacks of the queries are sized by this.
+	static const int maxSupportedTreeDepth = 64;
+
 	/// Constructs an empty kD-tree.
 	KdTree()
+	:nodePtr(0),
+	numNodesStored(0),
+	bucketPtr(0),
+	objectPtr(0),
+	mappedBlob(0),
+	numGarbageBucketEntries(0)
 #ifdef _DEBUG
-	:needsBuilding(false)
+	,needsBuilding(false)
 #endif
 	{}
 
@@ -83,7 +245,54 @@ public:
 
 	/// Creates the kD-tree data structure based on all the objects added to the tree.
 	/// After Build() has been called, do *not* call AddObjects() again.
-	void Build();
+	/// @param params Specifies the split strategy and the leaf size rules to use for building the tree.
+	void Build(const KdTreeBuildParams &params = KdTreeBuildParams());
+
+	/// Inserts a single object to an already built kD-tree, without rebuilding the tree.
+	/** The object is added to the buckets of all the leaves it overlaps. If the bucket of such a leaf has no room
+		to grow in place and the leaf holds more than KdTreeBuildParams::maxLeafObjects objects, the leaf is split
+		into a new subtree with the parameters the tree was built with.
+		@return The index of the inserted object. The indices of removed objects are reused. */
+	int InsertObject(const T &object);
+
+	/// Removes a single object from an already built kD-tree, without rebuilding the tree.
+	/// The indices of the other objects do not change.
+	void RemoveObject(int objectIndex);
+
+	/// Replaces an object of an already built kD-tree, e.g. after the object has moved, and updates the buckets
+	/// of the leaves the old and the new object overlap, without rebuilding the tree.
+	/// The object keeps its index.
+	/// @note Incremental updates do not coarsen the tree, so after a large portion of the objects have moved,
+	///       call Build() again to restore the query performance of the tree.
+	void MoveObject(int objectIndex, const T &object);
+
+	/// Returns the number of bytes SaveToBuffer() writes.
+	size_t SerializedSize() const;
+
+	/// Writes this kD-tree into a single blob of memory, e.g. for saving the tree of static geometry to a file.
+	/** The blob stores the nodes, the object buckets and the objects in their in-memory layout, so type T must be
+		trivially copyable. The blob can be loaded with LoadFromMappedBuffer() on a machine with the same byte order
+		and the same struct layouts (compiler ABI) as this one.
+		@param buffer [out] The memory to write the blob to. Must be aligned to KdTreeBlobHeader::ALIGNMENT bytes.
+		@param bufferSize The size of buffer in bytes.
+		@return The number of bytes written, or 0 if the buffer is smaller than SerializedSize(). */
+	size_t SaveToBuffer(void *buffer, size_t bufferSize) const;
+
+	/// Makes this kD-tree query the tree stored in a blob written by SaveToBuffer(), e.g. from a memory-mapped file.
+	/** Nothing is copied: the queries read the nodes, buckets and objects directly from the blob, so the memory
+		must stay valid and unmodified for as long as this tree uses it. The child indices of the nodes and the
+		contents of the buckets are checked in one pass over the blob, so that a corrupt blob is rejected instead of
+		making the queries read outside of it. The objects themselves are not checked. A loaded tree is read-only, i.e. do
+		not call AddObjects(), Build(), InsertObject(), RemoveObject() or MoveObject() on it, and do not modify the
+		returned buckets or objects. Call Clear() to detach the tree from the blob.
+		@param buffer The blob to load. Must be aligned to KdTreeBlobHeader::ALIGNMENT bytes.
+		@param bufferSize The size of buffer in bytes.
+		@return False if the buffer does not hold a complete and valid blob of this object type and version in the
+			byte order of this machine, in which case this tree is left empty. */
+	bool LoadFromMappedBuffer(const void *buffer, size_t bufferSize);
+
+	/// Returns true if this tree queries a blob given to LoadFromMappedBuffer().
+	bool IsMapped() const { return mappedBlob != 0; }
 
 	/// Empties the whole kD-tree of all objects.
 	/// Call this function if you want to reuse this structure for rebuilding another kD-tree, after first
@@ -92,10 +301,19 @@ public:
 
 	/// Returns an object bucket by the given bucket index.
 	/// An object bucket is a contiguous C array of object indices, terminated with a sentinel value BUCKET_SENTINEL.
+	/// The number of objects in the bucket of a leaf is also available as KdTreeNode::NumObjects().
 	/// To fetch the actual object based on an object index, call the Object() method.
+	/// @note The buckets of all leaves are stored in a single array. After Build(), the buckets are ordered the same
+	///       way as the leaves in the node array, but the buckets that InsertObject() and MoveObject() move or split
+	///       are appended to the end of the array.
 	u32 *Bucket(int bucketIndex);
 	const u32 *Bucket(int bucketIndex) const;
 
+	/// Returns the node at the given node index. The node at index 0 is an unused dummy node, and the root
+	/// node is at index 1. The children of an inner node are at indices LeftChildIndex() and RightChildIndex().
+	KdTreeNode &Node(int nodeIndex);
+	const KdTreeNode &Node(int nodeIndex) const;
+
 	/// Returns an object by the given object index.
 	T &Object(int objectIndex);
 	const T &Object(int objectIndex) const;
@@ -114,6 +332,11 @@ public:
 	/// Returns the maximum height of the tree (the path from the root to the farthest leaf node).
 	int TreeHeight() const;
 
+	/// Computes statistics about the structure of this tree.
+	/// @param params The parameters the tree was built with, used for the SAH cost constants and the split limits.
+	/// Warning: This function iterates over the whole tree, so the running time is linear to the number of nodes, and not constant.
+	KdTreeStats ComputeStats(const KdTreeBuildParams &params = KdTreeBuildParams()) const;
+
 	/// Returns the root node.
 	KdTreeNode *Root();
 	const KdTreeNode *Root() const;
@@ -138,6 +361,35 @@ public:
 	template<typename Func>
 	inline void RayQuery(const Ray &r, Func &leafCallback);
 
+	/// Same as above, but passes the tree to the callback as const KdTree<T> &tree.
+	/** The const queries do not modify the tree, and keep their traversal state on the stack of the calling
+		thread, so any number of threads can run const queries on the same built tree concurrently without
+		locking, as long as no thread modifies the tree at the same time. */
+	template<typename Func>
+	inline void RayQuery(const Ray &r, Func &leafCallback) const;
+
+	/// Traverses a packet of N rays through this kD-tree at once, and calls the given leafCallback function for each
+	/// leaf of the tree that is entered by at least one ray of the packet.
+	/** The rays of the packet share a single traversal stack, and are tracked with a bitmask of active rays, so that
+		coherent rays (e.g. rays from a common origin towards nearby targets) only fetch each node once. The per-ray
+		interval computations are written as fixed-width loops over the packet so that they compile to SSE (N=4) or
+		AVX (N=8) instructions.
+		If the rays in the packet do not have the same direction signs on each axis, they do not share a front-to-back
+		traversal order, and the packet is traversed one ray at a time instead.
+		@param rays An array of N rays to query through this kD-tree. N can be at most 32.
+		@param leafCallback A function or a function object of prototype
+			u32 LeafCallbackFunction(KdTree<T> &tree, const KdTreeNode &leaf, const Ray *rays, const float *tNear, const float *tFar, u32 activeMask);
+			The i'th bit of activeMask is set if the i'th ray enters the leaf, in which case the ray overlaps the leaf
+			in the range [tNear[i], tFar[i]]. The function returns a bitmask of rays that have finished their traversal.
+			The execution of the query is stopped as soon as all rays of the packet have finished. */
+	template<int N, typename Func>
+	inline void RayPacketQuery(const Ray *rays, Func &leafCallback);
+
+	/// Same as above, but passes the tree to the callback as const KdTree<T> &tree.
+	/// Safe to call concurrently from multiple threads, see the const version of RayQuery().
+	template<int N, typename Func>
+	inline void RayPacketQuery(const Ray *rays, Func &leafCallback) const;
+
 	/// Performs an AABB intersection query in this kD-tree, and calls the given leafCallback function for each leaf
 	/// of the tree which intersects the given AABB.
 	/** @param aabb The axis-aligned bounding box to query through this kD-tree.
@@ -148,6 +400,26 @@ public:
 	template<typename Func>
 	inline void AABBQuery(const AABB &aabb, Func &leafCallback);
 
+	/// Same as above, but the callback is of prototype
+	///    bool LeafCallbackFunction(const KdTree<T> &tree, const KdTreeNode &leaf, const AABB &aabb);
+	/// Safe to call concurrently from multiple threads, see the const version of RayQuery().
+	template<typename Func>
+	inline void AABBQuery(const AABB &aabb, Func &leafCallback) const;
+
+	/// Finds the objects that overlap each of the given query boxes, traversing the tree once for the whole batch.
+	/** Each node of the tree is visited once, carrying the list of the query boxes that overlap it. The list is
+		partitioned to the children of the node by the split plane, and at each leaf the objects of the leaf are
+		tested against the query boxes in the list. Each pair of a query box and an object with overlapping
+		bounding boxes (as in AABB::Intersects()) is reported once, even if the object is stored in several leaves.
+		Type T must have a member function AABB T.BoundingAABB() const.
+		@param queries An array of numQueries query boxes.
+		@param outHits [out] An array of at least maxHits elements that receives the found pairs, in no particular order.
+		@param scratch Working memory for the query lists. The vector is cleared first. To avoid memory allocations,
+			reuse the same vector between queries.
+		@return The total number of pairs found. If this is greater than maxHits, only the first maxHits pairs are
+			written to outHits, and the query can be repeated with a larger buffer. */
+	int AABBQueryBatch(const AABB *queries, int numQueries, KdTreeAABBQueryHit *outHits, int maxHits, std::vector<int> &scratch) const;
+
 #if 0 ///\bug Doesn't work properly. Fix up!
 	/// Performs an intersection query of this kD-tree against a given kD-tree, and calls the given
 	/// leafCallback function for each leaf pair that intersect each other.
@@ -172,21 +444,142 @@ public:
 	inline void NearestObjects(const float3 &point, Func &leafCallback);
 #endif
 
-private:
-	static const int maxNodes = 256 * 1024;
-	static const int maxTreeDepth = 30;
+	/// Finds the k objects closest to the given point.
+	/** Type T must have a member function float T.Distance(const float3 &) const. The query does not allocate memory:
+		the candidates are kept in a bounded max-heap inside outNeighbors, which is sorted when the query finishes.
+		@param point The target point to find the nearest objects to.
+		@param k The maximum number of objects to return.
+		@param outNeighbors [out] An array of at least k elements that receives the found objects, sorted by increasing distance.
+		@return The number of objects written to outNeighbors. This is less than k only if the tree has fewer than k objects. */
+	int KNearest(const float3 &point, int k, KdTreeNeighbor *outNeighbors) const;
+
+	/// Finds all the objects at most the distance r away from the given point.
+	/** Type T must have a member function float T.Distance(const float3 &) const.
+		@param outNeighbors [out] Receives the found objects, sorted by increasing distance. The vector is cleared first.
+			To avoid memory allocations, reuse the same vector between queries. */
+	void RadiusQuery(const float3 &point, float r, std::vector<KdTreeNeighbor> &outNeighbors) const;
 
+private:
 	std::vector<KdTreeNode> nodes;
 	std::vector<T> objects;
-	std::vector<u32*> buckets;
+	/// Stores the object buckets of all leaves back to back. Each bucket is terminated by BUCKET_SENTINEL.
+	/// Index 0 holds a lone sentinel that represents the bucket of all empty leaves.
+	std::vector<u32> bucketData;
 
-	int AllocateNodePair();
+	/// Marks the unused entries in bucketData after the sentinel of a bucket, into which the bucket can grow in place.
+	static const u32 BUCKET_FREE = 0xFFFFFFFE;
 
-	void FreeBuckets();
+	/// The arrays the queries read. These point to the data of the vectors above, or into the blob given
+	/// to LoadFromMappedBuffer(). Updated by UpdateDataPointers() after each modification of the vectors.
+	KdTreeNode *nodePtr;
+	int numNodesStored; ///< The number of nodes in nodePtr, including the dummy node at index 0.
+	u32 *bucketPtr;
+	T *objectPtr;
+
+	/// The blob this tree was loaded from, or null if this tree owns its data.
+	const void *mappedBlob;
+
+	void UpdateDataPointers();
+
+	/// Checks that the child indices of the nodes and the object indices of the buckets of a blob given to
+	/// LoadFromMappedBuffer() stay within the arrays of the blob, and that the tree is not too deep to query.
+	static bool IsValidMappedTree(const KdTreeNode *nodes, u32 numNodes, const u32 *buckets, u32 numBucketEntries, u32 numObjects);
+
+	/// The parameters the tree was last built with. Used to split leaves that grow too large in InsertObject().
+	KdTreeBuildParams buildParams;
+
+	/// The indices of removed objects, reused by InsertObject().
+	std::vector<int> freeObjectIndices;
+	/// For each object, true if the object has been removed with RemoveObject() and its index is in
+	/// freeObjectIndices. The objects past the end of this vector have not been removed.
+	std::vector<bool> isObjectRemoved;
+
+	bool IsObjectRemoved(int objectIndex) const { return objectIndex < (int)isObjectRemoved.size() && isObjectRemoved[objectIndex]; }
+
+	/// The number of entries in bucketData that are no longer part of the bucket of any leaf.
+	int numGarbageBucketEntries;
+
+	/// Stores the nodes and the object buckets of a tree, or of a subtree of it, while it is being built.
+	struct BuildContext
+	{
+		std::vector<KdTreeNode> nodes;
+		std::vector<u32*> buckets;
+	};
+
+	/// Specifies a subtree that is split on a worker thread during a multithreaded build.
+	struct BuildTask
+	{
+		BuildTask(int nodeIndex_, const AABB &aabb_, int numObjects_, int depth_)
+		:nodeIndex(nodeIndex_), aabb(aabb_), numObjects(numObjects_), depth(depth_)
+		{
+		}
+
+		int nodeIndex; ///< The root node of this subtree in the BuildContext of the top of the tree.
+		AABB aabb;
+		int numObjects;
+		int depth;
+		BuildContext subtree;
+	};
+
+	struct BuildSubtreesFunc;
+	struct KNearestFunc;
+	struct RadiusQueryFunc;
+
+	/// Implement the const and the non-const queries. Tree is either KdTree<T> or const KdTree<T>.
+	template<typename Tree, typename Func>
+	static inline void RayQueryImpl(Tree &tree, const Ray &r, Func &leafCallback);
+	template<int N, typename Tree, typename Func>
+	static inline void RayPacketQueryImpl(Tree &tree, const Ray *rays, Func &leafCallback);
+	template<typename Tree, typename Func>
+	static inline void AABBQueryImpl(Tree &tree, const AABB &aabb, Func &leafCallback);
+
+	/// Calls leafCallback for each leaf that may hold objects closer to point than leafCallback.MaxDistanceSq(),
+	/// visiting the leaf that contains the point first and pruning subtrees by the distance to their cells.
+	template<typename Func>
+	inline void NearestLeavesQuery(const float3 &point, Func &leafCallback) const;
+
+	static int AllocateNodePair(std::vector<KdTreeNode> &nodeArray);
+
+	static void FreeBuckets(BuildContext &ctx);
+
+	/// Moves the buckets of the built tree in ctx into bucketData, and frees the buckets of ctx.
+	void CompactBuckets(BuildContext &ctx);
 
 	AABB BoundingAABB(const u32 *bucket) const;
 
-	void SplitLeaf(int nodeIndex, const AABB &nodeAABB, int numObjectsInBucket, int leafDepth);
+	/// Adds the given object to the buckets of all leaves its bounding box overlaps.
+	void InsertToLeaves(int objectIndex);
+	/// Removes the given object from the buckets of all leaves its bounding box overlaps.
+	void RemoveFromLeaves(int objectIndex);
+	void InsertToLeaf(int nodeIndex, int leafDepth, int objectIndex);
+	void RemoveFromLeaf(int nodeIndex, int objectIndex);
+
+	/// Replaces the given leaf with a subtree built from the given bucket of objects.
+	/// @return False if the leaf could not be split, in which case the tree is not modified.
+	bool SplitLeafInPlace(int nodeIndex, int leafDepth, const u32 *bucket, int numObjectsInBucket);
+
+	/// Appends a bucket to the end of bucketData, followed by free room for the bucket to grow into.
+	/// @return The offset of the new bucket in bucketData.
+	u32 AppendBucket(const u32 *bucket, int numObjectsInBucket, int capacity);
+
+	/// Packs the buckets of all leaves back to back in bucketData, removing all unused entries.
+	void CompactBucketData();
+
+	/// Recursively splits the given leaf of ctx. If deferredTasks is not null, the children at depth deferDepth are
+	/// not split, but are appended to deferredTasks instead.
+	void SplitLeaf(BuildContext &ctx, int nodeIndex, const AABB &nodeAABB, int numObjectsInBucket, int leafDepth,
+		const KdTreeBuildParams &params, std::vector<BuildTask> *deferredTasks = 0, int deferDepth = 0) const;
+
+	void BuildParallel(BuildContext &ctx, int numThreads, const KdTreeBuildParams &params) const;
+
+	/// Appends the subtree at srcNodeIndex in src to dst, allocating the nodes and buckets in the same order as SplitLeaf().
+	static void MergeSubtree(BuildContext &dst, const BuildContext &src, int srcNodeIndex, int dstNodeIndex, int dstBucketIndex,
+		const std::vector<BuildTask> *tasks, const std::vector<int> *taskOfNode);
+
+	/// Finds the split plane with the smallest SAH cost for the given bucket of objects.
+	/// @return False if splitting the node is estimated to be more expensive than keeping it as a leaf.
+	bool FindSAHSplit(const u32 *bucket, int numObjectsInBucket, const AABB &nodeAABB, const KdTreeBuildParams &params,
+		CardinalAxis &outSplitAxis, float &outSplitPos) const;
 
 	///\todo Implement support for deep copying.
 	KdTree(const KdTree &);
@@ -199,6 +592,8 @@ private:
 #endif
 
 	int TreeHeight(int nodeIndex) const;
+
+	void ComputeStats(int nodeIndex, const AABB &nodeAABB, int depth, const KdTreeBuildParams &params, KdTreeStats &stats) const;
 };
 
 /// Finds the nearestray hit to a KdTree<Triangle>.
@@ -216,9 +611,9 @@ struct TriangleKdTreeRayQueryNearestHitVisitor
 		pos = float3::nan;
 		barycentricUV = float2::nan;
 	}
-	bool operator()(KdTree<Triangle> &tree, const KdTreeNode &leaf, const Ray &ray, float tNear, float tFar)
+	bool operator()(const KdTree<Triangle> &tree, const KdTreeNode &leaf, const Ray &ray, float tNear, float tFar)
 	{
-		u32 *bucket = tree.Bucket(leaf.bucketIndex);
+		const u32 *bucket = tree.Bucket(leaf.bucketIndex);
 		assert(bucket);
 		while(*bucket != KdTree<Triangle>::BUCKET_SENTINEL)
 		{
@@ -239,6 +634,80 @@ struct TriangleKdTreeRayQueryNearestHitVisitor
 	}
 };
 
+/// Finds the nearest ray hits of a packet of N rays to a KdTree<Triangle>.
+/// The hit of the i'th ray is returned in hits[i], with the same semantics as TriangleKdTreeRayQueryNearestHitVisitor.
+template<int N>
+struct TriangleKdTreeRayPacketQueryNearestHitVisitor
+{
+	TriangleKdTreeRayQueryNearestHitVisitor hits[N];
+
+	u32 operator()(const KdTree<Triangle> &tree, const KdTreeNode &leaf, const Ray *rays, const float *tNear, const float *tFar, u32 activeMask)
+	{
+		// Transpose the packet to structure-of-arrays form, so that the loops over the rays below compile to SIMD code.
+		float ox[N], oy[N], oz[N], dx[N], dy[N], dz[N];
+		float rayT[N], hitU[N], hitV[N];
+		u32 triangleIndex[N];
+		bool active[N];
+		for(int i = 0; i < N; ++i)
+		{
+			ox[i] = rays[i].pos.x; oy[i] = rays[i].pos.y; oz[i] = rays[i].pos.z;
+			dx[i] = rays[i].dir.x; dy[i] = rays[i].dir.y; dz[i] = rays[i].dir.z;
+			rayT[i] = hits[i].rayT;
+			hitU[i] = hitV[i] = 0.f;
+			triangleIndex[i] = hits[i].triangleIndex;
+			active[i] = (activeMask & (1u << i)) != 0;
+		}
+
+		// Loop over the triangles in the outer loop so that each triangle is fetched only once for the whole packet.
+		// The inner loop is Triangle::IntersectLineTri() computed for all rays at once.
+		const float epsilon = 1e-4f;
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != KdTree<Triangle>::BUCKET_SENTINEL; ++bucket)
+		{
+			const Triangle &tri = tree.Object(*bucket);
+			const float3 e1 = tri.b - tri.a;
+			const float3 e2 = tri.c - tri.a;
+			for(int i = 0; i < N; ++i)
+			{
+				float px = dy[i] * e2.z - dz[i] * e2.y;
+				float py = dz[i] * e2.x - dx[i] * e2.z;
+				float pz = dx[i] * e2.y - dy[i] * e2.x;
+				float det = e1.x * px + e1.y * py + e1.z * pz;
+				float recipDet = 1.f / det;
+				float tx = ox[i] - tri.a.x;
+				float ty = oy[i] - tri.a.y;
+				float tz = oz[i] - tri.a.z;
+				float u = (tx * px + ty * py + tz * pz) * recipDet;
+				float qx = ty * e1.z - tz * e1.y;
+				float qy = tz * e1.x - tx * e1.z;
+				float qz = tx * e1.y - ty * e1.x;
+				float v = (dx[i] * qx + dy[i] * qy + dz[i] * qz) * recipDet;
+				float t = (e2.x * qx + e2.y * qy + e2.z * qz) * recipDet;
+				bool hit = active[i] && fabs(det) > epsilon && u >= -epsilon && u <= 1.f + epsilon && v >= -epsilon && u + v <= 1.f + epsilon
+					&& t >= tNear[i] && t <= tFar[i] && t < rayT[i];
+				rayT[i] = hit ? t : rayT[i];
+				hitU[i] = hit ? u : hitU[i];
+				hitV[i] = hit ? v : hitV[i];
+				triangleIndex[i] = hit ? *bucket : triangleIndex[i];
+			}
+		}
+
+		u32 finished = 0;
+		for(int i = 0; i < N; ++i)
+		{
+			if (active[i] && triangleIndex[i] != hits[i].triangleIndex)
+			{
+				hits[i].rayT = rayT[i];
+				hits[i].pos = rays[i].GetPoint(rayT[i]);
+				hits[i].barycentricUV = float2(hitU[i], hitV[i]);
+				hits[i].triangleIndex = triangleIndex[i];
+			}
+			if (hits[i].rayT < FLOAT_INF)
+				finished |= 1u << i;
+		}
+		return finished & activeMask;
+	}
+};
+
 MATH_END_NAMESPACE
 
 #include "KDTree.inl"
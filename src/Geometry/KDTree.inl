@@ -22,27 +22,78 @@
 #include "Ray.h"
 #include "../Math/assume.h"
 #include "../Math/MathFunc.h"
+#include "../Algorithm/ParallelFor.h"
+
+#include <algorithm>
+#include <string.h>
 
 MATH_BEGIN_NAMESPACE
 
 template<typename T>
-int KdTree<T>::AllocateNodePair()
+const u32 KdTree<T>::BUCKET_SENTINEL;
+
+template<typename T>
+const u32 KdTree<T>::BUCKET_FREE;
+
+template<typename T>
+int KdTree<T>::AllocateNodePair(std::vector<KdTreeNode> &nodeArray)
 {
-	int index = nodes.size();
+	int index = nodeArray.size();
 	KdTreeNode n;
 	n.splitAxis = AxisNone; // The newly allocated nodes will be leaves.
+	n.childIndex = 0;
 	n.bucketIndex = 0;
-	nodes.push_back(n);
-	nodes.push_back(n);
+	nodeArray.push_back(n);
+	nodeArray.push_back(n);
 	return index;
 }
 
 template<typename T>
-void KdTree<T>::FreeBuckets()
+void KdTree<T>::FreeBuckets(BuildContext &ctx)
+{
+	for(size_t i = 0; i < ctx.buckets.size(); ++i)
+		delete[] ctx.buckets[i];
+	ctx.buckets.clear();
+}
+
+template<typename T>
+void KdTree<T>::CompactBuckets(BuildContext &ctx)
 {
-	for(size_t i = 0; i < buckets.size(); ++i)
-		delete[] buckets[i];
-	buckets.clear();
+	// The nodes are allocated in depth-first order, so laying out the buckets in the order of the leaves
+	// in the node array keeps the objects of nearby leaves close to each other in memory as well.
+	size_t numIndices = 1;
+	for(size_t i = 1; i < ctx.nodes.size(); ++i)
+		if (ctx.nodes[i].IsLeaf() && ctx.nodes[i].bucketIndex != 0)
+		{
+			const u32 *bucket = ctx.buckets[ctx.nodes[i].bucketIndex];
+			while(*bucket++ != BUCKET_SENTINEL)
+				++numIndices;
+			++numIndices;
+		}
+
+	bucketData.clear();
+	bucketData.reserve(numIndices);
+	bucketData.push_back(BUCKET_SENTINEL); // Offset 0 is shared by all empty leaves.
+	for(size_t i = 1; i < ctx.nodes.size(); ++i)
+	{
+		KdTreeNode &node = ctx.nodes[i];
+		if (!node.IsLeaf())
+			continue;
+		const u32 *bucket = node.bucketIndex != 0 ? ctx.buckets[node.bucketIndex] : 0;
+		if (!bucket || *bucket == BUCKET_SENTINEL)
+		{
+			node.bucketIndex = 0;
+			node.childIndex = 0;
+			continue;
+		}
+		node.bucketIndex = (u32)bucketData.size();
+		while(*bucket != BUCKET_SENTINEL)
+			bucketData.push_back(*bucket++);
+		node.childIndex = (u32)bucketData.size() - node.bucketIndex;
+		bucketData.push_back(BUCKET_SENTINEL);
+	}
+	assert(bucketData.size() == numIndices);
+	FreeBuckets(ctx);
 }
 
 template<typename T>
@@ -60,41 +111,130 @@ AABB KdTree<T>::BoundingAABB(const u32 *bucket) const
 }
 
 template<typename T>
-void KdTree<T>::SplitLeaf(int nodeIndex, const AABB &nodeAABB, int numObjectsInBucket, int leafDepth)
+bool KdTree<T>::FindSAHSplit(const u32 *bucket, int numObjectsInBucket, const AABB &nodeAABB, const KdTreeBuildParams &params,
+	CardinalAxis &outSplitAxis, float &outSplitPos) const
 {
-	if (leafDepth >= maxTreeDepth)
+	assert(bucket);
+	const float nodeArea = nodeAABB.SurfaceArea();
+	if (!(nodeArea > 0.f))
+	{
+		// Degenerate node, the SAH is not defined. Fall back to a midpoint split.
+		outSplitAxis = (CardinalAxis)nodeAABB.Size().MaxElementIndex();
+		outSplitPos = nodeAABB.CenterPoint()[outSplitAxis];
+		return true;
+	}
+
+	const int numBins = Clamp(params.numSAHBins, 2, 1024);
+
+	// For each axis, count how many objects start and end in each bin. Objects starting before a candidate
+	// plane overlap the left side of the plane, and objects ending after it overlap the right side.
+	std::vector<int> minBins(3*numBins, 0);
+	std::vector<int> maxBins(3*numBins, 0);
+	const float3 nodeSize = nodeAABB.Size();
+	float3 binScale;
+	for(int axis = 0; axis < 3; ++axis)
+		binScale[axis] = nodeSize[axis] > 0.f ? numBins / nodeSize[axis] : 0.f;
+
+	for(const u32 *obj = bucket; *obj != BUCKET_SENTINEL; ++obj)
+	{
+		AABB aabb = objects[*obj].BoundingAABB();
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			int minBin = (int)((aabb.minPoint[axis] - nodeAABB.minPoint[axis]) * binScale[axis]);
+			int maxBin = (int)((aabb.maxPoint[axis] - nodeAABB.minPoint[axis]) * binScale[axis]);
+			++minBins[axis*numBins + Clamp(minBin, 0, numBins-1)];
+			++maxBins[axis*numBins + Clamp(maxBin, 0, numBins-1)];
+		}
+	}
+
+	const float leafCost = params.intersectionCost * numObjectsInBucket;
+	float bestCost = leafCost;
+	bool foundSplit = false;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if (binScale[axis] == 0.f)
+			continue; // The node is flat along this axis, no split planes to choose from.
+
+		const int *minBin = &minBins[axis*numBins];
+		const int *maxBin = &maxBins[axis*numBins];
+		const int axis2 = (axis+1) % 3;
+		const int axis3 = (axis+2) % 3;
+		// The area of the two faces of a child box perpendicular to the split axis, and the perimeter of those faces.
+		const float capArea = 2.f * nodeSize[axis2] * nodeSize[axis3];
+		const float capPerimeter = 2.f * (nodeSize[axis2] + nodeSize[axis3]);
+
+		int numLeft = 0;
+		int numRight = numObjectsInBucket;
+		for(int i = 1; i < numBins; ++i)
+		{
+			numLeft += minBin[i-1];
+			numRight -= maxBin[i-1];
+			if (numLeft == numObjectsInBucket || numRight == numObjectsInBucket)
+				continue; // SplitLeaf() would reject this plane, since it does not separate any objects.
+
+			const float leftLength = nodeSize[axis] * i / numBins;
+			const float leftArea = capArea + capPerimeter * leftLength;
+			const float rightArea = capArea + capPerimeter * (nodeSize[axis] - leftLength);
+			const float cost = params.traversalCost + params.intersectionCost * (leftArea * numLeft + rightArea * numRight) / nodeArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				outSplitAxis = (CardinalAxis)axis;
+				outSplitPos = nodeAABB.minPoint[axis] + leftLength;
+				foundSplit = true;
+			}
+		}
+	}
+	return foundSplit;
+}
+
+template<typename T>
+void KdTree<T>::SplitLeaf(BuildContext &ctx, int nodeIndex, const AABB &nodeAABB, int numObjectsInBucket, int leafDepth,
+	const KdTreeBuildParams &params, std::vector<BuildTask> *deferredTasks, int deferDepth) const
+{
+	if (leafDepth >= params.maxTreeDepth)
 		return; // Exceeded max depth - disallow splitting.
+	if (params.maxNodes > 0 && (int)ctx.nodes.size() - 1 + 2 > params.maxNodes)
+		return; // Splitting would exceed the node budget.
 
-	KdTreeNode *node = &nodes[nodeIndex];
+	KdTreeNode *node = &ctx.nodes[nodeIndex];
 	assert(node->IsLeaf());
-	// Choose the longest axis for the split and convert the node from a leaf to an inner node.
 	int curBucketIndex = node->bucketIndex; // The existing objects.
 	assert(curBucketIndex != 0); // The leaf must contain some objects, otherwise this function should never be called!
-	CardinalAxis splitAxis = (CardinalAxis)nodeAABB.Size().MaxElementIndex();
-	float splitPos = nodeAABB.CenterPoint()[splitAxis];
 
-	// Compute the new bounding boxes for the left and right children.
-	AABB leftAABB = nodeAABB;
-	AABB rightAABB = nodeAABB;
-	leftAABB.maxPoint[splitAxis] = splitPos;
-	rightAABB.minPoint[splitAxis] = splitPos;
+	// Choose the split plane and convert the node from a leaf to an inner node.
+	CardinalAxis splitAxis;
+	float splitPos;
+	if (params.splitStrategy == KdTreeSplitSAH)
+	{
+		if (!FindSAHSplit(ctx.buckets[curBucketIndex], numObjectsInBucket, nodeAABB, params, splitAxis, splitPos))
+			return; // Cheaper to keep this node as a leaf.
+	}
+	else
+	{
+		// Split the longest axis at the center.
+		splitAxis = (CardinalAxis)nodeAABB.Size().MaxElementIndex();
+		splitPos = nodeAABB.CenterPoint()[splitAxis];
+	}
 
 	// Sort all objects into the left and right children.
 	u32 *leftBucket = new u32[numObjectsInBucket+1];
 	u32 *rightBucket = new u32[numObjectsInBucket+1];
 
-	u32 *curObject = buckets[curBucketIndex];
+	u32 *curObject = ctx.buckets[curBucketIndex];
 	u32 *l = leftBucket;
 	u32 *r = rightBucket;
 	int numObjectsLeft = 0;
 	int numObjectsRight = 0;
 	while(*curObject != BUCKET_SENTINEL)
 	{
+		// All objects in the bucket overlap the node, so only the split axis decides the side. (Testing the other
+		// axes with AABB::Intersects() would reject the objects on the boundary of the node that have a zero extent, e.g. points)
 		AABB aabb = objects[*curObject].BoundingAABB();
-		bool left = leftAABB.Intersects(aabb);
-		bool right = rightAABB.Intersects(aabb);
+		bool left = aabb.minPoint[splitAxis] < splitPos;
+		bool right = aabb.maxPoint[splitAxis] > splitPos;
 		if (!left && !right)
-			left = right = true; // Numerical precision issues: bounding box doesn't intersect either anymore, so place into both children.
+			left = right = true; // The bounding box is flat and lies on the split plane, so place into both children.
 		if (left)
 		{
 			*l++ = *curObject;
@@ -123,69 +263,183 @@ void KdTree<T>::SplitLeaf(int nodeIndex, const AABB &nodeAABB, int numObjectsInB
 	node->splitPos = splitPos;
 
 	// Allocate nodes for the children.
-	int childIndex = AllocateNodePair();
-	node = &nodes[nodeIndex]; // AllocateNodePair() above invalidates the 'node' pointer! Recompute it.
+	int childIndex = AllocateNodePair(ctx.nodes);
+	node = &ctx.nodes[nodeIndex]; // AllocateNodePair() above invalidates the 'node' pointer! Recompute it.
 	node->childIndex = childIndex;
 
 	// Recompute tighter AABB's for the children which have now been populated with objects.
-	leftAABB = BoundingAABB(leftBucket);
-	rightAABB = BoundingAABB(rightBucket);
+	AABB leftAABB = BoundingAABB(leftBucket);
+	AABB rightAABB = BoundingAABB(rightBucket);
 
 	// For the left child, reuse the bucket index the parent had. (free the bucket of the parent)
-	KdTreeNode *leftChild = &nodes[childIndex];
-	delete[] buckets[curBucketIndex];
-	buckets[curBucketIndex] = leftBucket;
+	KdTreeNode *leftChild = &ctx.nodes[childIndex];
+	delete[] ctx.buckets[curBucketIndex];
+	ctx.buckets[curBucketIndex] = leftBucket;
 	leftChild->bucketIndex = curBucketIndex;
 
 	// For the right child, allocate a new bucket.
-	KdTreeNode *rightChild = &nodes[childIndex+1];
-	rightChild->bucketIndex = buckets.size();
-	buckets.push_back(rightBucket);
+	KdTreeNode *rightChild = &ctx.nodes[childIndex+1];
+	rightChild->bucketIndex = ctx.buckets.size();
+	ctx.buckets.push_back(rightBucket);
 
 	assert(numObjectsLeft < numObjectsInBucket && numObjectsRight < numObjectsInBucket);
 
-	// Recursively split children.
-	if (numObjectsLeft > 16)
-		SplitLeaf(childIndex, leftAABB, numObjectsLeft, leafDepth + 1);
-	if (numObjectsRight > 16)
-		SplitLeaf(childIndex+1, rightAABB, numObjectsRight, leafDepth + 1);
+	// Recursively split children, or leave them to be split later if they are deep enough to be built on a worker thread.
+	if (numObjectsLeft > params.maxLeafObjects)
+	{
+		if (deferredTasks && leafDepth + 1 >= deferDepth)
+			deferredTasks->push_back(BuildTask(childIndex, leftAABB, numObjectsLeft, leafDepth + 1));
+		else
+			SplitLeaf(ctx, childIndex, leftAABB, numObjectsLeft, leafDepth + 1, params, deferredTasks, deferDepth);
+	}
+	if (numObjectsRight > params.maxLeafObjects)
+	{
+		if (deferredTasks && leafDepth + 1 >= deferDepth)
+			deferredTasks->push_back(BuildTask(childIndex+1, rightAABB, numObjectsRight, leafDepth + 1));
+		else
+			SplitLeaf(ctx, childIndex+1, rightAABB, numObjectsRight, leafDepth + 1, params, deferredTasks, deferDepth);
+	}
+}
+
+template<typename T>
+void KdTree<T>::MergeSubtree(BuildContext &dst, const BuildContext &src, int srcNodeIndex, int dstNodeIndex, int dstBucketIndex,
+	const std::vector<BuildTask> *tasks, const std::vector<int> *taskOfNode)
+{
+	if (taskOfNode && (*taskOfNode)[srcNodeIndex] >= 0)
+	{
+		// This node was split further on a worker thread. Continue from the root of that subtree.
+		MergeSubtree(dst, (*tasks)[(*taskOfNode)[srcNodeIndex]].subtree, 1, dstNodeIndex, dstBucketIndex, 0, 0);
+		return;
+	}
+
+	const KdTreeNode &node = src.nodes[srcNodeIndex];
+	if (node.IsLeaf())
+	{
+		dst.nodes[dstNodeIndex].bucketIndex = dstBucketIndex;
+		dst.buckets[dstBucketIndex] = src.buckets[node.bucketIndex];
+		return;
+	}
+
+	// Allocate the child nodes and the bucket of the right child in the same order SplitLeaf() does, so that
+	// the result is identical to a tree built on a single thread.
+	int childIndex = AllocateNodePair(dst.nodes);
+	int rightBucketIndex = dst.buckets.size();
+	dst.buckets.push_back(0);
+	KdTreeNode &dstNode = dst.nodes[dstNodeIndex];
+	dstNode.splitAxis = node.splitAxis;
+	dstNode.splitPos = node.splitPos;
+	dstNode.childIndex = childIndex;
+
+	MergeSubtree(dst, src, node.LeftChildIndex(), childIndex, dstBucketIndex, tasks, taskOfNode);
+	MergeSubtree(dst, src, node.RightChildIndex(), childIndex+1, rightBucketIndex, tasks, taskOfNode);
+}
+
+template<typename T>
+struct KdTree<T>::BuildSubtreesFunc
+{
+	const KdTree<T> *tree;
+	std::vector<BuildTask> *tasks;
+	const KdTreeBuildParams *params;
+
+	void operator()(int taskIndex, int /*threadIndex*/)
+	{
+		BuildTask &task = (*tasks)[taskIndex];
+		tree->SplitLeaf(task.subtree, 1, task.aabb, task.numObjects, task.depth, *params);
+	}
+};
+
+template<typename T>
+void KdTree<T>::BuildParallel(BuildContext &ctx, int numThreads, const KdTreeBuildParams &params) const
+{
+	// Split the topmost levels of the tree on this thread, and collect the nodes below them as independent
+	// subtrees. Cutting a few levels deeper than the thread count strictly requires gives more tasks than
+	// threads, which balances the load when the subtrees are of different sizes.
+	int deferDepth = 1;
+	while((1 << (deferDepth-1)) < numThreads * 4 && deferDepth < params.maxTreeDepth)
+		++deferDepth;
+
+	std::vector<BuildTask> tasks;
+	SplitLeaf(ctx, 1, rootAABB, objects.size(), 1, params, &tasks, deferDepth);
+	if (tasks.empty())
+		return;
+
+	std::vector<int> taskOfNode(ctx.nodes.size(), -1);
+	for(size_t i = 0; i < tasks.size(); ++i)
+	{
+		// Each subtree starts as a tree of a single root leaf, which takes over the bucket of the deferred node.
+		BuildTask &task = tasks[i];
+		KdTreeNode root = ctx.nodes[task.nodeIndex];
+		task.subtree.nodes.push_back(ctx.nodes[0]);
+		task.subtree.buckets.push_back(0);
+		task.subtree.buckets.push_back(ctx.buckets[root.bucketIndex]);
+		root.bucketIndex = 1;
+		task.subtree.nodes.push_back(root);
+		taskOfNode[task.nodeIndex] = (int)i;
+	}
+
+	BuildSubtreesFunc func;
+	func.tree = this;
+	func.tasks = &tasks;
+	func.params = &params;
+	ParallelFor((int)tasks.size(), numThreads, func);
+
+	// Stitch the top of the tree and the subtrees together into a single tree.
+	BuildContext merged;
+	merged.nodes.push_back(ctx.nodes[0]);
+	merged.nodes.push_back(ctx.nodes[1]);
+	merged.buckets.push_back(0);
+	merged.buckets.push_back(0);
+	MergeSubtree(merged, ctx, 1, 1, 1, &tasks, &taskOfNode);
+	ctx.nodes.swap(merged.nodes);
+	ctx.buckets.swap(merged.buckets);
 }
 
 template<typename T>
 KdTree<T>::~KdTree()
 {
-	FreeBuckets();
 }
 
 template<typename T>
 u32 *KdTree<T>::Bucket(int bucketIndex)
 {
-	return buckets[bucketIndex];
+	return &bucketPtr[bucketIndex];
 }
 
 template<typename T>
 const u32 *KdTree<T>::Bucket(int bucketIndex) const
 {
-	return buckets[bucketIndex];
+	return &bucketPtr[bucketIndex];
+}
+
+template<typename T>
+KdTreeNode &KdTree<T>::Node(int nodeIndex)
+{
+	return nodePtr[nodeIndex];
+}
+
+template<typename T>
+const KdTreeNode &KdTree<T>::Node(int nodeIndex) const
+{
+	return nodePtr[nodeIndex];
 }
 
 template<typename T>
 T &KdTree<T>::Object(int objectIndex)
 {
-	return objects[objectIndex];
+	return objectPtr[objectIndex];
 }
 
 template<typename T>
 const T &KdTree<T>::Object(int objectIndex) const
 {
-	return objects[objectIndex];
+	return objectPtr[objectIndex];
 }
 
 /// Returns the total number of nodes (all nodes, i.e. inner nodes + leaves) in the tree.
 template<typename T>
 int KdTree<T>::NumNodes() const
 {
-	return nodes.size() - 1;
+	return numNodesStored - 1;
 }
 
 /// Returns the total number of leaf nodes in the tree.
@@ -193,8 +447,8 @@ template<typename T>
 int KdTree<T>::NumLeaves() const
 {
 	int numLeaves = 0;
-	for(size_t i = 1; i < nodes.size(); ++i)
-		if (nodes[i].IsLeaf())
+	for(int i = 1; i < numNodesStored; ++i)
+		if (nodePtr[i].IsLeaf())
 			++numLeaves;
 
 	return numLeaves;
@@ -205,8 +459,8 @@ template<typename T>
 int KdTree<T>::NumInnerNodes() const
 {
 	int numInnerNodes = 0;
-	for(size_t i = 1; i < nodes.size(); ++i)
-		if (!nodes[i].IsLeaf())
+	for(int i = 1; i < numNodesStored; ++i)
+		if (!nodePtr[i].IsLeaf())
 			++numInnerNodes;
 
 	return numInnerNodes;
@@ -215,7 +469,7 @@ int KdTree<T>::NumInnerNodes() const
 template<typename T>
 int KdTree<T>::TreeHeight(int nodeIndex) const
 {
-	const KdTreeNode &node = nodes[nodeIndex];
+	const KdTreeNode &node = nodePtr[nodeIndex];
 	if (node.IsLeaf())
 		return 1;
 	return 1 + std::max(TreeHeight(node.LeftChildIndex()), TreeHeight(node.RightChildIndex()));
@@ -227,72 +481,589 @@ int KdTree<T>::TreeHeight() const
 	return TreeHeight(1);
 }
 
+template<typename T>
+void KdTree<T>::ComputeStats(int nodeIndex, const AABB &nodeAABB, int depth, const KdTreeBuildParams &params, KdTreeStats &stats) const
+{
+	const KdTreeNode &node = nodePtr[nodeIndex];
+	const float surfaceArea = nodeAABB.SurfaceArea();
+	if (node.IsLeaf())
+	{
+		++stats.numLeaves;
+		int numObjects = node.IsEmptyLeaf() ? 0 : node.NumObjects();
+		if (numObjects == 0)
+			++stats.numEmptyLeaves;
+		stats.maxLeafOccupancy = Max(stats.maxLeafOccupancy, numObjects);
+		stats.avgLeafOccupancy += (float)numObjects; // Divided by the number of non-empty leaves at the end.
+		if (numObjects > params.maxLeafObjects && depth >= params.maxTreeDepth)
+			++stats.numDepthLimitedLeaves;
+		stats.sahCost += surfaceArea * params.intersectionCost * numObjects; // Normalized by the root surface area at the end.
+		return;
+	}
+
+	++stats.numInnerNodes;
+	stats.sahCost += surfaceArea * params.traversalCost;
+	AABB leftAABB = nodeAABB;
+	AABB rightAABB = nodeAABB;
+	leftAABB.maxPoint[node.splitAxis] = node.splitPos;
+	rightAABB.minPoint[node.splitAxis] = node.splitPos;
+	ComputeStats(node.LeftChildIndex(), leftAABB, depth + 1, params, stats);
+	ComputeStats(node.RightChildIndex(), rightAABB, depth + 1, params, stats);
+}
+
+template<typename T>
+KdTreeStats KdTree<T>::ComputeStats(const KdTreeBuildParams &params) const
+{
+	KdTreeStats stats;
+	stats.numNodes = NumNodes();
+	stats.numInnerNodes = 0;
+	stats.numLeaves = 0;
+	stats.numEmptyLeaves = 0;
+	stats.treeHeight = 0;
+	stats.maxLeafOccupancy = 0;
+	stats.avgLeafOccupancy = 0.f;
+	stats.emptyLeafRatio = 0.f;
+	stats.numDepthLimitedLeaves = 0;
+	stats.sahCost = 0.f;
+	if (!Root())
+		return stats;
+
+	stats.treeHeight = TreeHeight();
+	ComputeStats(1, rootAABB, 1, params, stats);
+
+	int numNonEmptyLeaves = stats.numLeaves - stats.numEmptyLeaves;
+	stats.avgLeafOccupancy = (numNonEmptyLeaves > 0) ? stats.avgLeafOccupancy / numNonEmptyLeaves : 0.f;
+	stats.emptyLeafRatio = (float)stats.numEmptyLeaves / stats.numLeaves;
+	float rootSurfaceArea = rootAABB.SurfaceArea();
+	stats.sahCost = (rootSurfaceArea > 0.f) ? stats.sahCost / rootSurfaceArea : 0.f;
+	return stats;
+}
+
 template<typename T>
 void KdTree<T>::AddObjects(const T *objects_, int numObjects)
 {
+	assume(!IsMapped());
 	objects.insert(objects.end(), objects_, objects_ + numObjects);
+	UpdateDataPointers();
 #ifdef _DEBUG
 	needsBuilding = true;
 #endif
 }
 
 template<typename T>
-void KdTree<T>::Build()
+void KdTree<T>::Build(const KdTreeBuildParams &params_)
 {
+	assume(params_.maxTreeDepth >= 1 && params_.maxTreeDepth <= maxSupportedTreeDepth);
+	KdTreeBuildParams params = params_;
+	params.maxTreeDepth = Clamp(params.maxTreeDepth, 1, (int)maxSupportedTreeDepth);
+	assume(!IsMapped());
+
 	nodes.clear();
-	FreeBuckets();
+	bucketData.clear();
+
+	BuildContext ctx;
 
 	// Allocate a dummy node to be stored at index 0 (for safety).
 	KdTreeNode dummy;
 	dummy.splitAxis = AxisNone;
 	dummy.childIndex = 0;
 	dummy.bucketIndex = 0;
-	nodes.push_back(dummy); // Index 0 - dummy unused node, "null pointer".
+	ctx.nodes.push_back(dummy); // Index 0 - dummy unused node, "null pointer".
 
 	// Allocate a dummy bucket at index 0, to denote that a leaf is empty.
-	buckets.push_back(0);
+	ctx.buckets.push_back(0);
 
 	// Add a root node for the tree.
 	KdTreeNode rootNode;
 	rootNode.splitAxis = AxisNone;
 	rootNode.childIndex = 0;
 	rootNode.bucketIndex = 1;
-	nodes.push_back(rootNode);
+	ctx.nodes.push_back(rootNode);
 
-	// Initially, add all objects to the root node.
+	// Initially, add all objects to the root node, skipping the objects that have been removed with RemoveObject().
 	u32 *rootBucket = new u32[objects.size()+1];
+	int numObjectsInRoot = 0;
 	for(size_t i = 0; i < objects.size(); ++i)
-		rootBucket[i] = i;
-	rootBucket[objects.size()] = BUCKET_SENTINEL;
-	buckets.push_back(rootBucket);
+		if (!IsObjectRemoved((int)i))
+			rootBucket[numObjectsInRoot++] = i;
+	rootBucket[numObjectsInRoot] = BUCKET_SENTINEL;
+	ctx.buckets.push_back(rootBucket);
 
 	rootAABB = BoundingAABB(rootBucket);
 
 	// We now have a single root leaf node which is unsplit and contains all the objects
 	// in the kD-tree. Now recursively subdivide until the whole tree is built.
-	SplitLeaf(1, rootAABB, objects.size(), 1);
+	int numThreads = (params.numThreads > 0) ? params.numThreads : NumHardwareThreads();
+	if (numThreads > 1 && params.maxNodes <= 0)
+		BuildParallel(ctx, numThreads, params);
+	else
+		SplitLeaf(ctx, 1, rootAABB, numObjectsInRoot, 1, params);
+
+	CompactBuckets(ctx);
+	nodes.swap(ctx.nodes);
+	buildParams = params;
+	numGarbageBucketEntries = 0;
+	UpdateDataPointers();
 
 #ifdef _DEBUG
 	needsBuilding = false;
 #endif
 }
 
+template<typename T>
+u32 KdTree<T>::AppendBucket(const u32 *bucket, int numObjectsInBucket, int capacity)
+{
+	assert(numObjectsInBucket > 0);
+	assert(capacity >= numObjectsInBucket);
+	u32 bucketIndex = (u32)bucketData.size();
+	bucketData.insert(bucketData.end(), bucket, bucket + numObjectsInBucket);
+	bucketData.push_back(BUCKET_SENTINEL);
+	bucketData.insert(bucketData.end(), capacity - numObjectsInBucket, BUCKET_FREE);
+	return bucketIndex;
+}
+
+template<typename T>
+void KdTree<T>::CompactBucketData()
+{
+	std::vector<u32> packed;
+	packed.reserve(bucketData.size() - numGarbageBucketEntries);
+	packed.push_back(BUCKET_SENTINEL);
+	for(size_t i = 1; i < nodes.size(); ++i)
+	{
+		KdTreeNode &node = nodes[i];
+		if (!node.IsLeaf() || node.IsEmptyLeaf())
+			continue;
+		const u32 *bucket = &bucketData[node.bucketIndex];
+		node.bucketIndex = (u32)packed.size();
+		packed.insert(packed.end(), bucket, bucket + node.NumObjects() + 1); // Copy the sentinel as well.
+	}
+	bucketData.swap(packed);
+	numGarbageBucketEntries = 0;
+}
+
+template<typename T>
+bool KdTree<T>::SplitLeafInPlace(int nodeIndex, int leafDepth, const u32 *bucket, int numObjectsInBucket)
+{
+	KdTreeBuildParams params = buildParams;
+	if (params.maxNodes > 0)
+	{
+		// The subtree may only use the nodes that are left in the node budget of the whole tree.
+		params.maxNodes -= (int)nodes.size() - 2;
+		if (params.maxNodes < 3)
+			return false;
+	}
+
+	BuildContext ctx;
+	ctx.nodes.push_back(nodes[0]);
+	ctx.buckets.push_back(0);
+	KdTreeNode root;
+	root.splitAxis = AxisNone;
+	root.childIndex = 0;
+	root.bucketIndex = 1;
+	ctx.nodes.push_back(root);
+	u32 *rootBucket = new u32[numObjectsInBucket+1];
+	std::copy(bucket, bucket + numObjectsInBucket, rootBucket);
+	rootBucket[numObjectsInBucket] = BUCKET_SENTINEL;
+	ctx.buckets.push_back(rootBucket);
+
+	SplitLeaf(ctx, 1, BoundingAABB(rootBucket), numObjectsInBucket, leafDepth, params);
+	if (ctx.nodes.size() == 2)
+	{
+		FreeBuckets(ctx);
+		return false;
+	}
+
+	// Graft the subtree in place of the leaf. The child pairs of the subtree are appended to the end of the node array.
+	const int childIndexOffset = (int)nodes.size() - 2;
+	for(size_t i = 1; i < ctx.nodes.size(); ++i)
+	{
+		KdTreeNode node = ctx.nodes[i];
+		if (node.IsLeaf())
+		{
+			const u32 *leafBucket = ctx.buckets[node.bucketIndex];
+			int numObjects = 0;
+			while(leafBucket[numObjects] != BUCKET_SENTINEL)
+				++numObjects;
+			node.bucketIndex = (numObjects > 0) ? AppendBucket(leafBucket, numObjects, 2 * numObjects) : 0;
+			node.childIndex = numObjects;
+		}
+		else
+			node.childIndex += childIndexOffset;
+
+		if (i == 1)
+			nodes[nodeIndex] = node;
+		else
+			nodes.push_back(node);
+	}
+	FreeBuckets(ctx);
+	return true;
+}
+
+template<typename T>
+void KdTree<T>::InsertToLeaf(int nodeIndex, int leafDepth, int objectIndex)
+{
+	KdTreeNode &leaf = nodes[nodeIndex];
+	const int numObjects = leaf.IsEmptyLeaf() ? 0 : leaf.NumObjects();
+	if (numObjects > 0)
+	{
+		// Grow the bucket in place if the entry after its sentinel is free.
+		const u32 end = leaf.bucketIndex + numObjects;
+		if (end + 1 < bucketData.size() && bucketData[end+1] == BUCKET_FREE)
+		{
+			bucketData[end] = (u32)objectIndex;
+			bucketData[end+1] = BUCKET_SENTINEL;
+			++leaf.childIndex;
+			return;
+		}
+	}
+
+	// The bucket is full. Split the leaf if it has become too large, or otherwise move the bucket to the end
+	// of bucketData with room to grow. Growing the capacity geometrically keeps the number of moves (and split
+	// attempts of leaves that do not benefit from splitting) logarithmic in the number of insertions.
+	std::vector<u32> bucket(numObjects + 1);
+	if (numObjects > 0)
+		std::copy(&bucketData[leaf.bucketIndex], &bucketData[leaf.bucketIndex] + numObjects, bucket.begin());
+	bucket[numObjects] = (u32)objectIndex;
+	if (numObjects > 0)
+		numGarbageBucketEntries += numObjects + 1; // The old bucket is left unused in bucketData.
+
+	if (numObjects + 1 > buildParams.maxLeafObjects && SplitLeafInPlace(nodeIndex, leafDepth, &bucket[0], numObjects + 1))
+		return;
+	u32 bucketIndex = AppendBucket(&bucket[0], numObjects + 1, Max(2 * (numObjects + 1), 4));
+	nodes[nodeIndex].bucketIndex = bucketIndex;
+	nodes[nodeIndex].childIndex = numObjects + 1;
+}
+
+template<typename T>
+void KdTree<T>::RemoveFromLeaf(int nodeIndex, int objectIndex)
+{
+	KdTreeNode &leaf = nodes[nodeIndex];
+	if (leaf.IsEmptyLeaf())
+		return;
+	u32 *bucket = &bucketData[leaf.bucketIndex];
+	const int numObjects = leaf.NumObjects();
+	for(int i = 0; i < numObjects; ++i)
+		if (bucket[i] == (u32)objectIndex)
+		{
+			if (numObjects == 1)
+			{
+				numGarbageBucketEntries += 2;
+				leaf.bucketIndex = 0;
+				leaf.childIndex = 0;
+				return;
+			}
+			bucket[i] = bucket[numObjects-1];
+			bucket[numObjects-1] = BUCKET_SENTINEL;
+			bucket[numObjects] = BUCKET_FREE;
+			--leaf.childIndex;
+			return;
+		}
+}
+
+template<typename T>
+void KdTree<T>::InsertToLeaves(int objectIndex)
+{
+	const AABB aabb = objects[objectIndex].BoundingAABB();
+	// The cells of the leaves on the boundary of the tree extend to infinity, so the tree can hold objects
+	// outside the original root box as long as the root box is grown to enclose them.
+	rootAABB.Enclose(aabb);
+
+	int stack[maxSupportedTreeDepth*2];
+	int depthStack[maxSupportedTreeDepth*2];
+	int stackSize = 1;
+	stack[0] = 1;
+	depthStack[0] = 1;
+	while(stackSize > 0)
+	{
+		--stackSize;
+		const int nodeIndex = stack[stackSize];
+		const int depth = depthStack[stackSize];
+		const KdTreeNode &node = nodes[nodeIndex];
+		if (node.IsLeaf())
+		{
+			InsertToLeaf(nodeIndex, depth, objectIndex); // Note: Invalidates the reference 'node'.
+			continue;
+		}
+		assert(stackSize + 2 <= maxSupportedTreeDepth*2);
+		if (aabb.minPoint[node.splitAxis] <= node.splitPos)
+		{
+			stack[stackSize] = node.LeftChildIndex();
+			depthStack[stackSize++] = depth + 1;
+		}
+		if (aabb.maxPoint[node.splitAxis] >= node.splitPos)
+		{
+			stack[stackSize] = node.RightChildIndex();
+			depthStack[stackSize++] = depth + 1;
+		}
+	}
+}
+
+template<typename T>
+void KdTree<T>::RemoveFromLeaves(int objectIndex)
+{
+	const AABB aabb = objects[objectIndex].BoundingAABB();
+	int stack[maxSupportedTreeDepth*2];
+	int stackSize = 1;
+	stack[0] = 1;
+	while(stackSize > 0)
+	{
+		const KdTreeNode &node = nodes[stack[--stackSize]];
+		if (node.IsLeaf())
+		{
+			RemoveFromLeaf(stack[stackSize], objectIndex);
+			continue;
+		}
+		assert(stackSize + 2 <= maxSupportedTreeDepth*2);
+		if (aabb.minPoint[node.splitAxis] <= node.splitPos)
+			stack[stackSize++] = node.LeftChildIndex();
+		if (aabb.maxPoint[node.splitAxis] >= node.splitPos)
+			stack[stackSize++] = node.RightChildIndex();
+	}
+}
+
+template<typename T>
+int KdTree<T>::InsertObject(const T &object)
+{
+	assume(Root());
+	assume(!IsMapped());
+#ifdef _DEBUG
+	assume(!needsBuilding);
+#endif
+	int objectIndex;
+	if (!freeObjectIndices.empty())
+	{
+		objectIndex = freeObjectIndices.back();
+		freeObjectIndices.pop_back();
+		isObjectRemoved[objectIndex] = false;
+		objects[objectIndex] = object;
+	}
+	else
+	{
+		objectIndex = (int)objects.size();
+		objects.push_back(object);
+	}
+	InsertToLeaves(objectIndex);
+
+	// Moved buckets leave unused entries behind. Reclaim them when they make up half of bucketData.
+	if (numGarbageBucketEntries * 2 > (int)bucketData.size())
+		CompactBucketData();
+	UpdateDataPointers();
+	return objectIndex;
+}
+
+template<typename T>
+void KdTree<T>::RemoveObject(int objectIndex)
+{
+	assume(Root());
+	assume(!IsMapped());
+	assume(objectIndex >= 0 && objectIndex < (int)objects.size());
+	if (IsObjectRemoved(objectIndex))
+	{
+		// Freeing the index twice would make two later insertions share it.
+		assume(false && "KdTree::RemoveObject: The object has already been removed!");
+		return;
+	}
+	RemoveFromLeaves(objectIndex);
+	freeObjectIndices.push_back(objectIndex);
+	if ((int)isObjectRemoved.size() < (int)objects.size())
+		isObjectRemoved.resize(objects.size(), false);
+	isObjectRemoved[objectIndex] = true;
+}
+
+template<typename T>
+void KdTree<T>::MoveObject(int objectIndex, const T &object)
+{
+	assume(Root());
+	assume(!IsMapped());
+	assume(objectIndex >= 0 && objectIndex < (int)objects.size());
+	assume(!IsObjectRemoved(objectIndex));
+	RemoveFromLeaves(objectIndex);
+	objects[objectIndex] = object;
+	InsertToLeaves(objectIndex);
+	if (numGarbageBucketEntries * 2 > (int)bucketData.size())
+		CompactBucketData();
+	UpdateDataPointers();
+}
+
 template<typename T>
 void KdTree<T>::Clear()
 {
 	nodes.clear();
 	objects.clear();
-	buckets.clear();
+	bucketData.clear();
+	freeObjectIndices.clear();
+	isObjectRemoved.clear();
+	numGarbageBucketEntries = 0;
+	mappedBlob = 0;
+	UpdateDataPointers();
 #ifdef _DEBUG
 	needsBuilding = false;
 #endif
 }
 
 template<typename T>
-KdTreeNode *KdTree<T>::Root() { return nodes.size() > 1 ? &nodes[1] : 0; }
+void KdTree<T>::UpdateDataPointers()
+{
+	nodePtr = nodes.empty() ? 0 : &nodes[0];
+	numNodesStored = (int)nodes.size();
+	bucketPtr = bucketData.empty() ? 0 : &bucketData[0];
+	objectPtr = objects.empty() ? 0 : &objects[0];
+}
+
+template<typename T>
+size_t KdTree<T>::SerializedSize() const
+{
+	const size_t align = KdTreeBlobHeader::ALIGNMENT;
+	size_t size = (sizeof(KdTreeBlobHeader) + align - 1) & ~(align - 1);
+	size += (numNodesStored * sizeof(KdTreeNode) + align - 1) & ~(align - 1);
+	size += (bucketData.size() * sizeof(u32) + align - 1) & ~(align - 1);
+	size += objects.size() * sizeof(T);
+	return size;
+}
+
+template<typename T>
+size_t KdTree<T>::SaveToBuffer(void *buffer, size_t bufferSize) const
+{
+	assume(!IsMapped());
+	assume(((uintptr_t)buffer & (KdTreeBlobHeader::ALIGNMENT - 1)) == 0);
+#ifdef _DEBUG
+	assume(!needsBuilding);
+#endif
+	const size_t totalSize = SerializedSize();
+	if (bufferSize < totalSize)
+		return 0;
+
+	const size_t align = KdTreeBlobHeader::ALIGNMENT;
+	KdTreeBlobHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = KdTreeBlobHeader::MAGIC;
+	header.version = KdTreeBlobHeader::VERSION;
+	header.endianTag = KdTreeBlobHeader::ENDIAN_TAG;
+	header.headerSize = sizeof(KdTreeBlobHeader);
+	header.nodeSize = sizeof(KdTreeNode);
+	header.objectSize = sizeof(T);
+	header.numNodes = (u32)nodes.size();
+	header.numBucketEntries = (u32)bucketData.size();
+	header.numObjects = (u32)objects.size();
+	header.nodesOffset = (sizeof(KdTreeBlobHeader) + align - 1) & ~(align - 1);
+	header.bucketsOffset = header.nodesOffset + ((nodes.size() * sizeof(KdTreeNode) + align - 1) & ~(align - 1));
+	header.objectsOffset = header.bucketsOffset + ((bucketData.size() * sizeof(u32) + align - 1) & ~(align - 1));
+	header.totalSize = totalSize;
+	for(int i = 0; i < 3; ++i)
+	{
+		header.rootAABBMin[i] = rootAABB.minPoint[i];
+		header.rootAABBMax[i] = rootAABB.maxPoint[i];
+	}
+
+	// Zero the padding between the arrays so that the same tree always produces identical bytes.
+	u8 *dst = (u8*)buffer;
+	memset(dst, 0, totalSize);
+	memcpy(dst, &header, sizeof(header));
+	if (!nodes.empty())
+		memcpy(dst + header.nodesOffset, &nodes[0], nodes.size() * sizeof(KdTreeNode));
+	if (!bucketData.empty())
+		memcpy(dst + header.bucketsOffset, &bucketData[0], bucketData.size() * sizeof(u32));
+	if (!objects.empty())
+		memcpy(dst + header.objectsOffset, &objects[0], objects.size() * sizeof(T));
+	return totalSize;
+}
+
+template<typename T>
+bool KdTree<T>::LoadFromMappedBuffer(const void *buffer, size_t bufferSize)
+{
+	Clear();
+	if (!buffer || ((uintptr_t)buffer & (KdTreeBlobHeader::ALIGNMENT - 1)) != 0 || bufferSize < sizeof(KdTreeBlobHeader))
+		return false;
+
+	const KdTreeBlobHeader &header = *(const KdTreeBlobHeader*)buffer;
+	if (header.magic != KdTreeBlobHeader::MAGIC || header.version != KdTreeBlobHeader::VERSION
+		|| header.endianTag != KdTreeBlobHeader::ENDIAN_TAG)
+		return false;
+	if (header.headerSize != sizeof(KdTreeBlobHeader) || header.nodeSize != sizeof(KdTreeNode) || header.objectSize != sizeof(T))
+		return false;
+
+	// Check that each array lies aligned within the buffer.
+	const u64 align = KdTreeBlobHeader::ALIGNMENT;
+	if (header.totalSize > bufferSize
+		|| (header.nodesOffset & (align - 1)) != 0 || (header.bucketsOffset & (align - 1)) != 0 || (header.objectsOffset & (align - 1)) != 0
+		|| header.nodesOffset < sizeof(KdTreeBlobHeader)
+		|| header.nodesOffset + (u64)header.numNodes * sizeof(KdTreeNode) > header.bucketsOffset
+		|| header.bucketsOffset + (u64)header.numBucketEntries * sizeof(u32) > header.objectsOffset
+		|| header.objectsOffset + (u64)header.numObjects * sizeof(T) > header.totalSize)
+		return false;
+	// A tree with nodes always has the shared empty bucket at index 0.
+	if (header.numNodes == 1 || (header.numNodes > 1 && header.numBucketEntries == 0))
+		return false;
+
+	const u8 *blob = (const u8*)buffer;
+	if (!IsValidMappedTree((const KdTreeNode*)(blob + header.nodesOffset), header.numNodes,
+		(const u32*)(blob + header.bucketsOffset), header.numBucketEntries, header.numObjects))
+		return false;
+
+	// The queries only read through these pointers, so the const of the blob is cast away only to share
+	// the pointer types with the trees that own their data.
+	u8 *base = (u8*)const_cast<void*>(buffer);
+	nodePtr = header.numNodes > 0 ? (KdTreeNode*)(base + header.nodesOffset) : 0;
+	numNodesStored = (int)header.numNodes;
+	bucketPtr = header.numBucketEntries > 0 ? (u32*)(base + header.bucketsOffset) : 0;
+	objectPtr = header.numObjects > 0 ? (T*)(base + header.objectsOffset) : 0;
+	rootAABB = AABB(float3(header.rootAABBMin[0], header.rootAABBMin[1], header.rootAABBMin[2]),
+		float3(header.rootAABBMax[0], header.rootAABBMax[1], header.rootAABBMax[2]));
+	mappedBlob = buffer;
+	return true;
+}
 
 template<typename T>
-const KdTreeNode *KdTree<T>::Root() const { return nodes.size() > 1 ? &nodes[1] : 0; }
+bool KdTree<T>::IsValidMappedTree(const KdTreeNode *nodes, u32 numNodes, const u32 *buckets, u32 numBucketEntries, u32 numObjects)
+{
+	if (numNodes == 0)
+		return true;
+	if (buckets[0] != BUCKET_SENTINEL)
+		return false;
+
+	// The builders always allocate the children of a node after the node itself, so a single pass in index order
+	// sees each parent before its children. This also rules out cycles. Nodes that no parent points to are never
+	// visited by the queries, and are left with depth 0.
+	std::vector<u8> depth(numNodes, 0);
+	depth[1] = 1;
+	for(u32 i = 1; i < numNodes; ++i)
+	{
+		const KdTreeNode &node = nodes[i];
+		if (!node.IsLeaf())
+		{
+			const u32 child = node.childIndex;
+			if (child <= i || (u64)child + 1 >= numNodes || depth[child] != 0 || depth[child+1] != 0)
+				return false;
+			if (depth[i] != 0)
+			{
+				// The traversal stacks of the queries have room for maxSupportedTreeDepth levels.
+				if (depth[i] >= maxSupportedTreeDepth)
+					return false;
+				depth[child] = depth[child+1] = (u8)(depth[i] + 1);
+			}
+			continue;
+		}
+		if (node.bucketIndex == 0)
+		{
+			if (node.childIndex != 0)
+				return false;
+			continue;
+		}
+		// The bucket must hold NumObjects() valid object indices, followed by the sentinel.
+		const u64 end = (u64)node.bucketIndex + node.childIndex;
+		if (node.childIndex == 0 || end >= numBucketEntries || buckets[end] != BUCKET_SENTINEL)
+			return false;
+		for(u64 j = node.bucketIndex; j < end; ++j)
+			if (buckets[j] >= numObjects)
+				return false;
+	}
+	return true;
+}
+
+template<typename T>
+KdTreeNode *KdTree<T>::Root() { return numNodesStored > 1 ? &nodePtr[1] : 0; }
+
+template<typename T>
+const KdTreeNode *KdTree<T>::Root() const { return numNodesStored > 1 ? &nodePtr[1] : 0; }
 
 template<typename T>
 bool KdTree<T>::IsPartOfThisTree(const KdTreeNode *node) const
@@ -313,23 +1084,23 @@ bool KdTree<T>::IsPartOfThisTree(const KdTreeNode *root, const KdTreeNode *node)
 		return true;
 	if (root->IsLeaf())
 		return false;
-	return IsPartOfThisTree(&nodes[root->LeftChildIndex()], node) || IsPartOfThisTree(&nodes[root->RightChildIndex()], node);
+	return IsPartOfThisTree(&nodePtr[root->LeftChildIndex()], node) || IsPartOfThisTree(&nodePtr[root->RightChildIndex()], node);
 }
 
 // The "recursive B" method from Vlastimil Havran's thesis.
 template<typename T>
-template<typename Func>
-inline void KdTree<T>::RayQuery(const Ray &r, Func &nodeProcessFunc)
+template<typename Tree, typename Func>
+inline void KdTree<T>::RayQueryImpl(Tree &tree, const Ray &r, Func &nodeProcessFunc)
 {
 	float tNear = 0.f, tFar = FLOAT_INF;
 
-	assume(rootAABB.IsFinite());
-	assume(!rootAABB.IsDegenerate());
+	assume(tree.rootAABB.IsFinite());
+	assume(!tree.rootAABB.IsDegenerate());
 #ifdef _DEBUG
-	assume(!needsBuilding);
+	assume(!tree.needsBuilding);
 #endif
 
-	if (!rootAABB.IntersectLineAABB(r.pos, r.dir, tNear, tFar))
+	if (!tree.rootAABB.IntersectLineAABB(r.pos, r.dir, tNear, tFar))
 		return; // The ray doesn't intersect the root, therefore no collision.
 
 	// tNear and tFar are updated above to the enter and exit distances of the root box.
@@ -344,17 +1115,17 @@ inline void KdTree<T>::RayQuery(const Ray &r, Func &nodeProcessFunc)
 	typedef int StackPtr; // Pointer to the traversal stack.
 	struct StackElem
 	{
-		KdTreeNode *node;
+		const KdTreeNode *node;
 		float t;
 		float3 pos; // entry/exit point coordinates
 		StackPtr prev; // index (pointer) to the previous item in stack.
 	};
 
-	const int cMaxStackItems = 50*2;
+	const int cMaxStackItems = maxSupportedTreeDepth*2;
 	StackElem stack[cMaxStackItems];
 
-	KdTreeNode *farChild;
-	KdTreeNode *currentNode = Root();
+	const KdTreeNode *farChild;
+	const KdTreeNode *currentNode = tree.Root();
 	StackPtr entryPoint = 0;
 	stack[entryPoint].t = tNear;
 
@@ -384,28 +1155,28 @@ inline void KdTree<T>::RayQuery(const Ray &r, Func &nodeProcessFunc)
 			{
 				if (stack[exitPoint].pos[axis] <= splitPos)
 				{ // Cases N1,N2,N3,P5,Z2 and Z3.
-					currentNode = &nodes[currentNode->LeftChildIndex()];
+					currentNode = &tree.nodePtr[currentNode->LeftChildIndex()];
 					continue;
 				}
 				if (EqualAbs(stack[exitPoint].pos[axis], splitPos))
 				{ // Case Z1
-					currentNode = &nodes[currentNode->RightChildIndex()];
+					currentNode = &tree.nodePtr[currentNode->RightChildIndex()];
 					continue;
 				}
 				// Case N4:
-				farChild = &nodes[currentNode->RightChildIndex()];
-				currentNode = &nodes[currentNode->LeftChildIndex()];
+				farChild = &tree.nodePtr[currentNode->RightChildIndex()];
+				currentNode = &tree.nodePtr[currentNode->LeftChildIndex()];
 			}
 			else
 			{
 				if (splitPos < stack[exitPoint].pos[axis])
 				{ // Cases P1,P2,P3 and N5
-					currentNode = &nodes[currentNode->RightChildIndex()];
+					currentNode = &tree.nodePtr[currentNode->RightChildIndex()];
 					continue;
 				}
 				// Case P4:
-				farChild = &nodes[currentNode->LeftChildIndex()];
-				currentNode = &nodes[currentNode->RightChildIndex()];
+				farChild = &tree.nodePtr[currentNode->LeftChildIndex()];
+				currentNode = &tree.nodePtr[currentNode->RightChildIndex()];
 			}
 			// From above, only cases N4 and P4 pass us through to here:
 			const float t = (splitPos - r.pos[axis]) / r.dir[axis];
@@ -427,7 +1198,7 @@ inline void KdTree<T>::RayQuery(const Ray &r, Func &nodeProcessFunc)
 		const float dNear = stack[entryPoint].t;
 		const float dFar = stack[exitPoint].t;
 
-		bool traversalFinished = nodeProcessFunc(*this, *currentNode, r, dNear, dFar);
+		bool traversalFinished = nodeProcessFunc(tree, *currentNode, r, dNear, dFar);
 //#ifdef VISSTATS
 //		if (bVisNumIntersections)
 //			statsCounter += nodeProcessFunc.nIntersections;
@@ -444,33 +1215,389 @@ inline void KdTree<T>::RayQuery(const Ray &r, Func &nodeProcessFunc)
 
 template<typename T>
 template<typename Func>
-inline void KdTree<T>::AABBQuery(const AABB &aabb, Func &leafCallback)
+inline void KdTree<T>::RayQuery(const Ray &r, Func &leafCallback)
+{
+	RayQueryImpl(*this, r, leafCallback);
+}
+
+template<typename T>
+template<typename Func>
+inline void KdTree<T>::RayQuery(const Ray &r, Func &leafCallback) const
+{
+	RayQueryImpl(*this, r, leafCallback);
+}
+
+/// Adapts a ray packet leaf callback to the single ray RayQuery(), for traversing one ray of an incoherent packet.
+template<int N, typename Tree, typename Func>
+struct KdTreeRayPacketLaneVisitor
+{
+	Func *packetCallback;
+	const Ray *rays;
+	int lane;
+
+	bool operator()(Tree &tree, const KdTreeNode &leaf, const Ray & /*ray*/, float tNear, float tFar)
+	{
+		float tNears[N], tFars[N];
+		for(int i = 0; i < N; ++i)
+		{
+			tNears[i] = tNear;
+			tFars[i] = tFar;
+		}
+		return ((*packetCallback)(tree, leaf, rays, tNears, tFars, 1u << lane) & (1u << lane)) != 0;
+	}
+};
+
+template<typename T>
+template<int N, typename Tree, typename Func>
+inline void KdTree<T>::RayPacketQueryImpl(Tree &tree, const Ray *rays, Func &leafCallback)
+{
+	assume(N > 0 && N <= 32);
+	assume(tree.rootAABB.IsFinite());
+	assume(!tree.rootAABB.IsDegenerate());
+#ifdef _DEBUG
+	assume(!tree.needsBuilding);
+#endif
+
+	u32 activeMask = 0;
+	for(int i = 0; i < N; ++i)
+	{
+		float tNear = 0.f, tFar = FLOAT_INF;
+		if (tree.rootAABB.IntersectLineAABB(rays[i].pos, rays[i].dir, tNear, tFar))
+			activeMask |= 1u << i;
+	}
+	if (!activeMask)
+		return; // None of the rays intersect the root, therefore no collision.
+
+	// The near and far children of a node are the same for all rays of the packet only if the rays agree on
+	// the direction signs. Otherwise traverse each ray separately.
+	int firstActive = 0;
+	while(!(activeMask & (1u << firstActive)))
+		++firstActive;
+	bool dirNegative[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		dirNegative[axis] = rays[firstActive].dir[axis] < 0.f;
+		for(int i = firstActive+1; i < N; ++i)
+			if ((activeMask & (1u << i)) && (rays[i].dir[axis] < 0.f) != dirNegative[axis])
+			{
+				KdTreeRayPacketLaneVisitor<N, Tree, Func> laneVisitor;
+				laneVisitor.packetCallback = &leafCallback;
+				laneVisitor.rays = rays;
+				for(laneVisitor.lane = 0; laneVisitor.lane < N; ++laneVisitor.lane)
+					if (activeMask & (1u << laneVisitor.lane))
+						RayQueryImpl(tree, rays[laneVisitor.lane], laneVisitor);
+				return;
+			}
+	}
+
+	float origin[3][N];
+	float invDir[3][N];
+	for(int axis = 0; axis < 3; ++axis)
+		for(int i = 0; i < N; ++i)
+		{
+			origin[axis][i] = rays[i].pos[axis];
+			// Nudge zero direction components away from zero so that the distance to a split plane never becomes 0*inf = NaN.
+			float d = rays[i].dir[axis];
+			if (Abs(d) < 1e-30f)
+				d = dirNegative[axis] ? -1e-30f : 1e-30f;
+			invDir[axis][i] = 1.f / d;
+		}
+
+	// As in RayQuery(), the ray ranges are not clipped to the root box, for better numerical precision.
+	float tNear[N], tFar[N];
+	for(int i = 0; i < N; ++i)
+	{
+		tNear[i] = 0.f;
+		tFar[i] = FLOAT_INF;
+	}
+
+	struct StackElem
+	{
+		const KdTreeNode *node;
+		float tNear[N];
+		float tFar[N];
+	};
+	// Each inner node on the path from the root to a leaf pushes at most one far child.
+	StackElem stack[maxSupportedTreeDepth];
+	int stackSize = 0;
+
+	const KdTreeNode *currentNode = tree.Root();
+	for(;;)
+	{
+		while(!currentNode->IsLeaf())
+		{
+			const int axis = currentNode->splitAxis;
+			const float splitPos = currentNode->splitPos;
+			float tSplit[N];
+			u32 nearMask = 0, farMask = 0;
+			for(int i = 0; i < N; ++i)
+			{
+				tSplit[i] = (splitPos - origin[axis][i]) * invDir[axis][i];
+				// Rays with an empty range [tNear, tFar] have already exited this subtree, and are not set in either mask.
+				nearMask |= (u32)(tNear[i] <= tFar[i] && tNear[i] <= tSplit[i]) << i;
+				farMask |= (u32)(tNear[i] <= tFar[i] && tSplit[i] <= tFar[i]) << i;
+			}
+			nearMask &= activeMask;
+			farMask &= activeMask;
+
+			const KdTreeNode *nearChild = &tree.nodePtr[dirNegative[axis] ? currentNode->RightChildIndex() : currentNode->LeftChildIndex()];
+			const KdTreeNode *farChild = &tree.nodePtr[dirNegative[axis] ? currentNode->LeftChildIndex() : currentNode->RightChildIndex()];
+			if (!farMask)
+				currentNode = nearChild;
+			else if (!nearMask)
+				currentNode = farChild;
+			else
+			{
+				assert(stackSize < maxSupportedTreeDepth);
+				StackElem &elem = stack[stackSize++];
+				elem.node = farChild;
+				for(int i = 0; i < N; ++i)
+				{
+					elem.tNear[i] = Max(tNear[i], tSplit[i]);
+					elem.tFar[i] = tFar[i];
+					tFar[i] = Min(tFar[i], tSplit[i]);
+				}
+				currentNode = nearChild;
+			}
+		}
+
+		u32 leafMask = 0;
+		for(int i = 0; i < N; ++i)
+			leafMask |= (u32)(tNear[i] <= tFar[i]) << i;
+		leafMask &= activeMask;
+		if (leafMask)
+		{
+			activeMask &= ~leafCallback(tree, *currentNode, rays, tNear, tFar, leafMask);
+			if (!activeMask)
+				return; // All rays have finished.
+		}
+
+		// Pop from the stack until finding a node that some unfinished ray still needs to visit.
+		for(;;)
+		{
+			if (stackSize == 0)
+				return;
+			const StackElem &elem = stack[--stackSize];
+			u32 mask = 0;
+			for(int i = 0; i < N; ++i)
+				mask |= (u32)(elem.tNear[i] <= elem.tFar[i]) << i;
+			if (mask & activeMask)
+			{
+				currentNode = elem.node;
+				for(int i = 0; i < N; ++i)
+				{
+					tNear[i] = elem.tNear[i];
+					tFar[i] = elem.tFar[i];
+				}
+				break;
+			}
+		}
+	}
+}
+
+template<typename T>
+template<int N, typename Func>
+inline void KdTree<T>::RayPacketQuery(const Ray *rays, Func &leafCallback)
+{
+	RayPacketQueryImpl<N>(*this, rays, leafCallback);
+}
+
+template<typename T>
+template<int N, typename Func>
+inline void KdTree<T>::RayPacketQuery(const Ray *rays, Func &leafCallback) const
+{
+	RayPacketQueryImpl<N>(*this, rays, leafCallback);
+}
+
+template<typename T>
+template<typename Func>
+inline void KdTree<T>::NearestLeavesQuery(const float3 &point, Func &leafCallback) const
+{
+	if (!Root())
+		return;
+
+	// Each stack element holds the per-axis distances from the point to the cell of the node, which allows
+	// computing the distance to the cell of a child by updating only the distance along the split axis.
+	struct StackElem
+	{
+		int nodeIndex;
+		float3 offset;
+		float distanceSq;
+	};
+	StackElem stack[maxSupportedTreeDepth];
+	int stackSize = 1;
+	stack[0].nodeIndex = 1;
+	stack[0].offset = Max(Max(rootAABB.minPoint - point, point - rootAABB.maxPoint), float3::zero);
+	stack[0].distanceSq = stack[0].offset.LengthSq();
+
+	while(stackSize > 0)
+	{
+		const StackElem &elem = stack[--stackSize];
+		if (elem.distanceSq > leafCallback.MaxDistanceSq())
+			continue;
+		int nodeIndex = elem.nodeIndex;
+		float3 offset = elem.offset;
+		float distanceSq = elem.distanceSq;
+		for(;;)
+		{
+			const KdTreeNode &node = nodePtr[nodeIndex];
+			if (node.IsLeaf())
+			{
+				if (!node.IsEmptyLeaf())
+					leafCallback(*this, node);
+				break;
+			}
+			// Descend to the child on the same side of the split plane as the point, and come back to the other
+			// child later, unless it is already farther away than the objects found so far.
+			const int axis = node.splitAxis;
+			const float d = point[axis] - node.splitPos;
+			const float farDistanceSq = distanceSq - offset[axis] * offset[axis] + d * d;
+			if (farDistanceSq <= leafCallback.MaxDistanceSq())
+			{
+				assert(stackSize < maxSupportedTreeDepth);
+				StackElem &farElem = stack[stackSize++];
+				farElem.nodeIndex = (d <= 0.f) ? node.RightChildIndex() : node.LeftChildIndex();
+				farElem.offset = offset;
+				farElem.offset[axis] = Abs(d);
+				farElem.distanceSq = farDistanceSq;
+			}
+			nodeIndex = (d <= 0.f) ? node.LeftChildIndex() : node.RightChildIndex();
+		}
+	}
+}
+
+template<typename T>
+struct KdTree<T>::KNearestFunc
+{
+	float3 point;
+	int k;
+	KdTreeNeighbor *heap; ///< A max-heap of the k nearest objects found so far, the farthest at heap[0].
+	int heapSize;
+
+	float MaxDistanceSq() const
+	{
+		return (heapSize < k) ? FLOAT_INF : heap[0].distance * heap[0].distance;
+	}
+
+	void operator()(const KdTree<T> &tree, const KdTreeNode &leaf)
+	{
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != BUCKET_SENTINEL; ++bucket)
+		{
+			KdTreeNeighbor n;
+			n.objectIndex = (int)*bucket;
+			n.distance = tree.Object(n.objectIndex).Distance(point);
+			if (heapSize == k && !(n < heap[0]))
+				continue;
+			// An object that overlaps several leaves is found once from each of them.
+			bool alreadyFound = false;
+			for(int i = 0; i < heapSize && !alreadyFound; ++i)
+				alreadyFound = (heap[i].objectIndex == n.objectIndex);
+			if (alreadyFound)
+				continue;
+			if (heapSize == k)
+				std::pop_heap(heap, heap + heapSize--);
+			heap[heapSize++] = n;
+			std::push_heap(heap, heap + heapSize);
+		}
+	}
+};
+
+template<typename T>
+int KdTree<T>::KNearest(const float3 &point, int k, KdTreeNeighbor *outNeighbors) const
+{
+	assume(k >= 0);
+	assume(outNeighbors || k == 0);
+	if (k <= 0)
+		return 0;
+	KNearestFunc func;
+	func.point = point;
+	func.k = k;
+	func.heap = outNeighbors;
+	func.heapSize = 0;
+	NearestLeavesQuery(point, func);
+	std::sort_heap(outNeighbors, outNeighbors + func.heapSize);
+	return func.heapSize;
+}
+
+template<typename T>
+struct KdTree<T>::RadiusQueryFunc
+{
+	float3 point;
+	float radius;
+	std::vector<KdTreeNeighbor> *neighbors;
+
+	float MaxDistanceSq() const { return radius * radius; }
+
+	void operator()(const KdTree<T> &tree, const KdTreeNode &leaf)
+	{
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != BUCKET_SENTINEL; ++bucket)
+		{
+			KdTreeNeighbor n;
+			n.objectIndex = (int)*bucket;
+			n.distance = tree.Object(n.objectIndex).Distance(point);
+			if (n.distance <= radius)
+				neighbors->push_back(n);
+		}
+	}
+};
+
+template<typename T>
+void KdTree<T>::RadiusQuery(const float3 &point, float r, std::vector<KdTreeNeighbor> &outNeighbors) const
+{
+	outNeighbors.clear();
+	RadiusQueryFunc func;
+	func.point = point;
+	func.radius = r;
+	func.neighbors = &outNeighbors;
+	NearestLeavesQuery(point, func);
+
+	// An object that overlaps several leaves is found once from each of them. After sorting, the duplicates
+	// are next to each other, since their distances are equal.
+	std::sort(outNeighbors.begin(), outNeighbors.end());
+	size_t numUnique = 0;
+	for(size_t i = 0; i < outNeighbors.size(); ++i)
+		if (numUnique == 0 || outNeighbors[i].objectIndex != outNeighbors[numUnique-1].objectIndex)
+			outNeighbors[numUnique++] = outNeighbors[i];
+	outNeighbors.resize(numUnique);
+}
+
+template<typename T>
+template<typename Tree, typename Func>
+inline void KdTree<T>::AABBQueryImpl(Tree &tree, const AABB &aabb, Func &leafCallback)
 {
-	const int cMaxStackItems = maxTreeDepth*2;
+	const int cMaxStackItems = maxSupportedTreeDepth*2;
 
-	KdTreeNode *stack[cMaxStackItems];
+	// The stack holds node indices, and the nodes are accessed through tree.Node(), so that the callback
+	// receives a const node when querying a const tree.
+	int stack[cMaxStackItems];
 	int stackSize = 1;
-	stack[0] = Root();
+	stack[0] = 1; // The root node.
 
 	// Don't enter the main iteration loop at all if no overlap occurs at the top level.
-	if (!aabb.Intersects(BoundingAABB()))
+	if (!tree.Root() || !aabb.Intersects(tree.BoundingAABB()))
 		return;
 
+	if (tree.Root()->IsLeaf())
+	{
+		leafCallback(tree, tree.Node(1), aabb);
+		return;
+	}
+
 	while(stackSize > 0)
 	{
-		KdTreeNode *cur = stack[--stackSize];
-		assert(!cur->IsLeaf());
+		const KdTreeNode &cur = tree.Node(stack[--stackSize]);
+		assert(!cur.IsLeaf());
 
 		// We know that aabb intersects with the AABB of the current node, which allows
 		// most of the AABB-AABB intersection tests to be ignored.
 
 		// Does the aabb overlap with the left child?
-		if (aabb.minPoint[cur->splitAxis] <= cur->splitPos)
+		if (aabb.minPoint[cur.splitAxis] <= cur.splitPos)
 		{
-			KdTreeNode *leftChild = &nodes[cur->LeftChildIndex()];
-			if (leftChild->IsLeaf()) // Leafs are processed immediately, no need to put them to stack for later.
+			const int leftChild = cur.LeftChildIndex();
+			if (tree.Node(leftChild).IsLeaf()) // Leafs are processed immediately, no need to put them to stack for later.
 			{
-				if (leafCallback(*this, *leftChild, aabb))
+				if (leafCallback(tree, tree.Node(leftChild), aabb))
 					return; // The callback requested to terminate the query, so quit.
 			}
 			else // The left child is an inner node, push it to stack.
@@ -478,12 +1605,12 @@ inline void KdTree<T>::AABBQuery(const AABB &aabb, Func &leafCallback)
 		}
 
 		// Does the aabb overlap with the right child?
-		if (aabb.maxPoint[cur->splitAxis] >= cur->splitPos)
+		if (aabb.maxPoint[cur.splitAxis] >= cur.splitPos)
 		{
-			KdTreeNode *rightChild = &nodes[cur->RightChildIndex()];
-			if (rightChild->IsLeaf()) // Leafs are processed immediately, no need to put them to stack for later.
+			const int rightChild = cur.RightChildIndex();
+			if (tree.Node(rightChild).IsLeaf()) // Leafs are processed immediately, no need to put them to stack for later.
 			{
-				if (leafCallback(*this, *rightChild, aabb))
+				if (leafCallback(tree, tree.Node(rightChild), aabb))
 					return; // The callback requested to terminate the query, so quit.
 			}
 			else // The right child is an inner node, push it to stack.
@@ -492,6 +1619,145 @@ inline void KdTree<T>::AABBQuery(const AABB &aabb, Func &leafCallback)
 	}
 }
 
+template<typename T>
+template<typename Func>
+inline void KdTree<T>::AABBQuery(const AABB &aabb, Func &leafCallback)
+{
+	AABBQueryImpl(*this, aabb, leafCallback);
+}
+
+template<typename T>
+template<typename Func>
+inline void KdTree<T>::AABBQuery(const AABB &aabb, Func &leafCallback) const
+{
+	AABBQueryImpl(*this, aabb, leafCallback);
+}
+
+/// Returns true if AABBQueryBatch() reports the overlap of the given query box and object box at the leaf with the
+/// given cell. An object that overlaps several leaves is stored in each of them, so to report each pair once, the
+/// pair is reported only at the leaf whose cell contains the minimum corner of the overlap region. A corner on a
+/// split plane belongs to the right child only if the object extends past the plane, since the object is always
+/// stored in that child.
+inline bool KdTreeLeafOwnsOverlap(const AABB &cell, const AABB &query, const AABB &object)
+{
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		const float corner = Max(query.minPoint[axis], object.minPoint[axis]);
+		const bool extendsPastCorner = object.maxPoint[axis] > corner;
+		if (corner < cell.minPoint[axis] || (corner == cell.minPoint[axis] && !extendsPastCorner))
+			return false;
+		if (corner > cell.maxPoint[axis] || (corner == cell.maxPoint[axis] && extendsPastCorner))
+			return false;
+	}
+	return true;
+}
+
+template<typename T>
+int KdTree<T>::AABBQueryBatch(const AABB *queries, int numQueries, KdTreeAABBQueryHit *outHits, int maxHits, std::vector<int> &scratch) const
+{
+	scratch.clear();
+	if (!Root())
+		return 0;
+#ifdef _DEBUG
+	assume(!needsBuilding);
+#endif
+
+	for(int i = 0; i < numQueries; ++i)
+		if (queries[i].Intersects(rootAABB))
+			scratch.push_back(i);
+	if (scratch.empty())
+		return 0;
+
+	// Each stack element holds a node, and the range of scratch that lists the queries overlapping the node.
+	// The cells of the nodes on the boundary of the tree extend to infinity, since objects added with
+	// InsertObject() may extend outside the box the tree was built in.
+	struct StackElem
+	{
+		int nodeIndex;
+		int begin;
+		int end;
+		AABB cell;
+	};
+	StackElem stack[maxSupportedTreeDepth*2];
+	int stackSize = 1;
+	stack[0].nodeIndex = 1;
+	stack[0].begin = 0;
+	stack[0].end = (int)scratch.size();
+	stack[0].cell = AABB(float3(-FLOAT_INF, -FLOAT_INF, -FLOAT_INF), float3(FLOAT_INF, FLOAT_INF, FLOAT_INF));
+
+	int numHits = 0;
+	while(stackSize > 0)
+	{
+		const StackElem elem = stack[--stackSize];
+		// The lists above the list of elem in scratch belong to subtrees that have already been traversed.
+		scratch.resize(elem.end);
+
+		const KdTreeNode &node = nodePtr[elem.nodeIndex];
+		if (node.IsLeaf())
+		{
+			if (node.IsEmptyLeaf())
+				continue;
+			for(const u32 *bucket = Bucket(node.bucketIndex); *bucket != BUCKET_SENTINEL; ++bucket)
+			{
+				const AABB objectAABB = objectPtr[*bucket].BoundingAABB();
+				for(int i = elem.begin; i < elem.end; ++i)
+				{
+					const AABB &query = queries[scratch[i]];
+					if (query.Intersects(objectAABB) && KdTreeLeafOwnsOverlap(elem.cell, query, objectAABB))
+					{
+						if (numHits < maxHits)
+						{
+							outHits[numHits].queryIndex = scratch[i];
+							outHits[numHits].objectIndex = (int)*bucket;
+						}
+						++numHits;
+					}
+				}
+			}
+			continue;
+		}
+
+		// Partition the queries to the children. The list of the left child is placed last, since the left
+		// child is traversed first, and everything above the list of the right child is dropped when it is popped.
+		const int axis = node.splitAxis;
+		const int rightBegin = (int)scratch.size();
+		for(int i = elem.begin; i < elem.end; ++i)
+		{
+			const int queryIndex = scratch[i];
+			if (queries[queryIndex].maxPoint[axis] >= node.splitPos)
+				scratch.push_back(queryIndex);
+		}
+		const int leftBegin = (int)scratch.size();
+		for(int i = elem.begin; i < elem.end; ++i)
+		{
+			const int queryIndex = scratch[i];
+			if (queries[queryIndex].minPoint[axis] <= node.splitPos)
+				scratch.push_back(queryIndex);
+		}
+
+		assert(stackSize + 2 <= maxSupportedTreeDepth*2);
+		if (leftBegin > rightBegin)
+		{
+			StackElem &right = stack[stackSize++];
+			right.nodeIndex = node.RightChildIndex();
+			right.begin = rightBegin;
+			right.end = leftBegin;
+			right.cell = elem.cell;
+			right.cell.minPoint[axis] = node.splitPos;
+		}
+		if ((int)scratch.size() > leftBegin)
+		{
+			StackElem &left = stack[stackSize++];
+			left.nodeIndex = node.LeftChildIndex();
+			left.begin = leftBegin;
+			left.end = (int)scratch.size();
+			left.cell = elem.cell;
+			left.cell.maxPoint[axis] = node.splitPos;
+		}
+	}
+	return numHits;
+}
+
 #if 0 ///\bug Doesn't work properly. Fix up!
 
 struct StackElem
@@ -577,8 +1843,8 @@ inline void KdTree<T>::KdTreeQuery(KdTree<T> &tree2, const float3x4 &thisWorldTr
 				continue; // We hit an empty leaf, no need to test the node against this tree further.
 
 			// Test both children of this inner node against the tree2 leaf node.
-			KdTreeNode *leftChild = &nodes[thisNode->LeftChildIndex()];
-			KdTreeNode *rightChild = &nodes[thisNode->RightChildIndex()];
+			KdTreeNode *leftChild = &nodePtr[thisNode->LeftChildIndex()];
+			KdTreeNode *rightChild = &nodePtr[thisNode->RightChildIndex()];
 			AABB leftAABB = thisAABB;
 			AABB rightAABB = thisAABB;
 			leftAABB.maxPoint[thisNode->splitAxis] = thisNode->splitPos;
@@ -602,8 +1868,8 @@ inline void KdTree<T>::KdTreeQuery(KdTree<T> &tree2, const float3x4 &thisWorldTr
 		else
 		{
 			// Test all child node pairs.
-			KdTreeNode *leftChild = &nodes[thisNode->LeftChildIndex()];
-			KdTreeNode *rightChild = &nodes[thisNode->RightChildIndex()];
+			KdTreeNode *leftChild = &nodePtr[thisNode->LeftChildIndex()];
+			KdTreeNode *rightChild = &nodePtr[thisNode->RightChildIndex()];
 			AABB leftAABB = thisAABB;
 			AABB rightAABB = thisAABB;
 			leftAABB.maxPoint[thisNode->splitAxis] = thisNode->splitPos;
@@ -695,14 +1961,14 @@ inline void KdTree<T>::NearestObjects(const float3 &point, Func &leafCallback)
 			// Insert left child node to the traversal queue.
 			n.aabb = t.aabb;
 			n.aabb.maxPoint[t.node->splitAxis] = t.node->splitPos;
-			n.node = &nodes[t.node->LeftChildIndex()];
+			n.node = &nodePtr[t.node->LeftChildIndex()];
 			n.d = n.aabb.Distance(point);
 			queue.Insert(n);
 
 			// Insert right child node to the traversal queue.
 			n.aabb.maxPoint[t.node->splitAxis] = t.aabb.maxPoint[t.node->splitAxis]; /// Restore the change done above.
 			n.aabb.minPoint[t.node->splitAxis] = t.node->splitPos;
-			n.node = &nodes[t.node->RightChildIndex()];
+			n.node = &nodePtr[t.node->RightChildIndex()];
 			n.d = n.aabb.Distance(point);
 			queue.Insert(n);
 		}
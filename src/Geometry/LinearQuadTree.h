@@ -0,0 +1,218 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LinearQuadTree.h
+	@author Jukka Jylnki
+	@brief A pointerless quadtree that stores its cells in a sorted array keyed by Morton codes. */
+#pragma once
+
+#ifdef MATH_GRAPHICSENGINE_INTEROP
+#include "Time/Profiler.h"
+#else
+#define PROFILE(x)
+#endif
+#include "../Math/float2.h"
+#include "../Math/MathTypes.h"
+#include "../Math/BitOps.h"
+#include "AABB2D.h"
+#include <vector>
+
+MATH_BEGIN_NAMESPACE
+
+/// A linear quadtree that stores objects of type T.
+/** Unlike QuadTree, this tree has no node objects or child pointers. Only the cells that contain objects are stored,
+	as a sorted array of 16-byte Cell structures, and the objects themselves are stored in a single contiguous array,
+	grouped by cell. A cell is identified by its level and the Morton code of its corner on the grid of the deepest
+	level, and sorting the cells by this key places them in depth-first order, so that the cells of each subtree form
+	a contiguous range of the array. The queries find the child ranges of the implicit tree by binary search, and skip
+	directly over chains of empty inner nodes.
+
+	The tree is static: Build() places a set of objects into the tree at once, and the tree is changed by building it
+	again. Use QuadTree for data that changes incrementally.
+
+	To store objects of type T in a LinearQuadTree, define the function AABB2D GetAABB2D(const T &object), which
+	returns the bounding rectangle of the object. An object is placed in the smallest cell that contains its bounding
+	rectangle, or in an ancestor of that cell if the subtree of the ancestor holds only a few objects. */
+template<typename T>
+class LinearQuadTree
+{
+public:
+	/// The level of the smallest cells of the tree. The root cell is at level 0, and the cells at level l have a side
+	/// length of 2^-l times the side length of the root.
+	static const int maxLevel = 24;
+
+	/// A cell is subdivided if its subtree would otherwise hold more than this many objects. This is the same rule
+	/// that QuadTree uses to split its leaves.
+	static const int maxCellObjects = 16;
+
+	/// A cell of the tree that contains objects.
+	struct Cell
+	{
+		/// The Morton code of the corner of this cell on the grid of the deepest level, shifted left by 6 bits, with the
+		/// level of this cell in the low 6 bits.
+		u64 key;
+		/// The index of the first object of this cell in the object array of the tree.
+		u32 firstObject;
+		/// The number of objects in this cell.
+		u32 numObjects;
+
+		int Level() const { return (int)(key & 63); }
+		u64 MortonCode() const { return key >> 6; }
+	};
+
+	/// A subtree in the priority queue of a nearest neighbor search. The subtree is a nonempty range of cells.
+	struct NearestRange
+	{
+		/// The squared distance of the subtree to the query point.
+		float d;
+		/// The level of the smallest cell that contains the subtree.
+		int level;
+		/// The Morton code of the corner of the smallest cell that contains the subtree.
+		u64 code;
+		/// The subtree consists of the cells [begin, end[.
+		u32 begin;
+		u32 end;
+
+		/// We compare in reverse order, since we want the range with the smallest distance to be visited first.
+		bool operator <(const NearestRange &t) const { return d > t.d; }
+	};
+
+	/// An object in the priority queue of a nearest neighbor search.
+	struct NearestObject
+	{
+		/// The squared distance of this object to the query point.
+		float d;
+		/// The index of the object in the object array of the tree.
+		u32 objectIndex;
+		/// The index of the cell of the object.
+		u32 cellIndex;
+
+		/// We compare in reverse order, since we want the object with the smallest distance to be visited first.
+		bool operator <(const NearestObject &t) const { return d > t.d; }
+	};
+
+	/// Working memory for the queries of a LinearQuadTree.
+	/** The query overloads that take a QueryScratch keep their traversal stack and priority queues in it, instead of
+		allocating them anew for each call. A QueryScratch can only be used by one query at a time. */
+	struct QueryScratch
+	{
+		std::vector<NearestRange> rangeQueue;
+		std::vector<NearestObject> objectQueue;
+	};
+
+	LinearQuadTree()
+	:boundingAABB(float2(0,0), float2(1,1))
+	{
+	}
+
+	/// Removes all objects from this tree.
+	void Clear();
+
+	/// Replaces the contents of this tree with the given objects.
+	/** The root cell of the tree is set to the bounding rectangle of the objects. Runs in time O(n log n).
+		@param objects A pointer to an array of numObjects objects. The objects are copied to the tree. */
+	void Build(const T *objects, int numObjects);
+
+	/// @return The bounding rectangle of the root cell of the tree.
+	AABB2D BoundingAABB() const { return boundingAABB; }
+
+	/// @return The number of cells in the tree that contain objects. Runs in constant time.
+	int NumCells() const { return (int)cells.size(); }
+
+	/// @return The number of objects in the tree. Runs in constant time.
+	int NumObjects() const { return (int)objects.size(); }
+
+	/// @return The number of bytes of memory that this tree has allocated for its cells and objects.
+	size_t MemoryUsage() const { return cells.capacity() * sizeof(Cell) + objects.capacity() * sizeof(T); }
+
+	/// Returns the cell at the given index [0, NumCells()-1]. The cells are in depth-first order.
+	const Cell &GetCell(int index) const { assert(index >= 0 && index < (int)cells.size()); return cells[index]; }
+
+	/// @return A pointer to the first of the cell.numObjects objects of the given cell.
+	T *CellObjects(const Cell &cell) { return objects.empty() ? 0 : &objects[cell.firstObject]; }
+	const T *CellObjects(const Cell &cell) const { return objects.empty() ? 0 : &objects[cell.firstObject]; }
+
+	/// @return The bounding rectangle of the given cell.
+	AABB2D CellAABB(const Cell &cell) const { return RegionAABB(cell.MortonCode(), cell.Level()); }
+
+	/// Performs an AABB intersection query in this tree, and calls the given callback function for each cell of the
+	/// tree which intersects the given AABB.
+	/** @param callback A function or a function object of prototype
+			bool callbackFunction(LinearQuadTree<T> &tree, const AABB2D &queryAABB, const LinearQuadTree<T>::Cell &cell, const AABB2D &cellAABB);
+		If the callback function returns true, the execution of the query is stopped. The objects of the cell are
+		returned by CellObjects(). */
+	template<typename Func>
+	inline void AABBQuery(const AABB2D &aabb, Func &callback);
+
+	/// Performs an object-granular nearest neighbor search on this tree.
+	/** This query calls the given objectCallback function for each object in this tree, starting from the object
+		closest to the given target point, and proceeding in distance-sorted order. The distance of an object is the
+		distance of the target point to the rectangle returned by GetAABB2D() for the object.
+		@param objectCallback A function or a function object of prototype
+			bool NearestNeighborObjectCallback(LinearQuadTree<T> &tree, const float2 &targetPoint, const LinearQuadTree<T>::Cell &cell,
+			                                   float distanceSquared, const T &nearestNeighborObject, int nearestNeighborIndex);
+			If this function returns true, the execution of the query is immediately stopped. */
+	template<typename Func>
+	inline void NearestNeighborObjects(const float2 &point, Func &objectCallback);
+	template<typename Func>
+	inline void NearestNeighborObjects(const float2 &point, Func &objectCallback, QueryScratch &scratch);
+
+	/// Finds the k objects closest to the given point.
+	/** @param outObjects [out] Receives the found objects, closest first. Must have room for k objects.
+		@param outDistancesSq [out] If not null, receives the squared distances of the found objects to the point.
+		@return The number of objects found, which is k, or the number of objects in the tree if it is smaller. */
+	int KNearestObjects(const float2 &point, int k, T *outObjects, float *outDistancesSq, QueryScratch &scratch);
+
+	/// Performs various consistency checks on the tree. Use only for debugging purposes.
+	void DebugSanityCheck() const;
+
+private:
+	struct BuildItem
+	{
+		/// The key of the smallest cell that contains the object, in the format of Cell::key.
+		u64 key;
+		u32 index;
+
+		bool operator <(const BuildItem &rhs) const { return key < rhs.key; }
+	};
+
+	/// Places the given range of objects, which all lie in the given cell, to cells.
+	void BuildRange(const std::vector<BuildItem> &items, u32 begin, u32 end, u64 code, int level);
+
+	/// Appends a cell with the given objects to the array of cells.
+	void AddCell(u64 code, int level, u32 begin, u32 end);
+
+	/// Fills in the smallest cell that contains the cells [begin, end[ and the squared distance of it to the point.
+	void MakeRange(const float2 &point, u32 begin, u32 end, NearestRange &range) const;
+
+	/// Finds the smallest cell that contains all the cells in the given nonempty range of cells.
+	void CommonAncestor(u32 begin, u32 end, u64 &code, int &level) const;
+
+	/// Returns the index of the first cell in [begin, end[ that is at or after the given Morton code.
+	u32 LowerBound(u32 begin, u32 end, u64 code) const;
+
+	/// Computes the bounding rectangle of the cell at the given level whose corner has the given Morton code.
+	AABB2D RegionAABB(u64 code, int level) const;
+
+	/// Quantizes the given point to the grid of the deepest level.
+	void Quantize(const float2 &point, u32 &x, u32 &y) const;
+
+	std::vector<Cell> cells;
+	std::vector<T> objects;
+	AABB2D boundingAABB;
+};
+
+MATH_END_NAMESPACE
+
+#include "LinearQuadTree.inl"
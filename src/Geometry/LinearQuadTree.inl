@@ -0,0 +1,469 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LinearQuadTree.inl
+	@author Jukka Jylnki
+	@brief Implementation for the LinearQuadTree object. */
+#pragma once
+
+#include "../Math/MathFunc.h"
+#include <algorithm>
+
+MATH_BEGIN_NAMESPACE
+
+template<typename T>
+void LinearQuadTree<T>::Clear()
+{
+	cells.clear();
+	objects.clear();
+	boundingAABB = AABB2D(float2(0,0), float2(1,1));
+}
+
+template<typename T>
+void LinearQuadTree<T>::Quantize(const float2 &point, u32 &x, u32 &y) const
+{
+	// The grid is computed in double precision, so that the cell that RegionAABB() computes for the quantized
+	// coordinates of a point is guaranteed to contain the point.
+	const double gridSize = (double)(1u << maxLevel);
+	double fx = ((double)point.x - (double)boundingAABB.minPoint.x) * gridSize / ((double)boundingAABB.maxPoint.x - (double)boundingAABB.minPoint.x);
+	double fy = ((double)point.y - (double)boundingAABB.minPoint.y) * gridSize / ((double)boundingAABB.maxPoint.y - (double)boundingAABB.minPoint.y);
+	x = (u32)Clamp(fx, 0.0, gridSize - 1.0);
+	y = (u32)Clamp(fy, 0.0, gridSize - 1.0);
+}
+
+template<typename T>
+AABB2D LinearQuadTree<T>::RegionAABB(u64 code, int level) const
+{
+	assert(level >= 0 && level <= maxLevel);
+	u32 x, y;
+	DecodeMortonCode2D(code, x, y);
+	const u32 cellSize = 1u << (maxLevel - level);
+	const double invGridSize = 1.0 / (double)(1u << maxLevel);
+	const double minX = boundingAABB.minPoint.x, minY = boundingAABB.minPoint.y;
+	const double width = (double)boundingAABB.maxPoint.x - minX;
+	const double height = (double)boundingAABB.maxPoint.y - minY;
+	return AABB2D(float2((float)(minX + x * invGridSize * width), (float)(minY + y * invGridSize * height)),
+		float2((float)(minX + (x + cellSize) * invGridSize * width), (float)(minY + (y + cellSize) * invGridSize * height)));
+}
+
+template<typename T>
+void LinearQuadTree<T>::Build(const T *objects_, int numObjects)
+{
+	PROFILE(LinearQuadTree_Build);
+	assume(numObjects >= 0);
+	assume(objects_ || numObjects == 0);
+	cells.clear();
+	objects.clear();
+
+	AABB2D bounds;
+	bounds.SetNegativeInfinity();
+	for(int i = 0; i < numObjects; ++i)
+	{
+		AABB2D aabb = GetAABB2D(objects_[i]);
+		assert(aabb.minPoint.x <= aabb.maxPoint.x);
+		assert(aabb.minPoint.y <= aabb.maxPoint.y);
+		bounds.Enclose(aabb.minPoint);
+		bounds.Enclose(aabb.maxPoint);
+	}
+	if (numObjects == 0)
+	{
+		Clear();
+		return;
+	}
+	assert(bounds.minPoint.IsFinite() && bounds.maxPoint.IsFinite());
+	// The root cell must have a nonzero area, e.g. if all the objects lie on a single line.
+	if (bounds.maxPoint.x <= bounds.minPoint.x)
+		bounds.maxPoint.x = bounds.minPoint.x + 1.f;
+	if (bounds.maxPoint.y <= bounds.minPoint.y)
+		bounds.maxPoint.y = bounds.minPoint.y + 1.f;
+	boundingAABB = bounds;
+
+	// Find the smallest cell that contains each object: The corners of the object lie in the same cell up to the
+	// level where their quantized coordinates first differ.
+	std::vector<BuildItem> items(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+	{
+		AABB2D aabb = GetAABB2D(objects_[i]);
+		u32 x0, y0, x1, y1;
+		Quantize(aabb.minPoint, x0, y0);
+		Quantize(aabb.maxPoint, x1, y1);
+		int level = maxLevel - (HighestSetBitIndex64((x0 ^ x1) | (y0 ^ y1)) + 1);
+		u32 mask = ~((1u << (maxLevel - level)) - 1);
+		items[i].key = (MortonCode2D(x0 & mask, y0 & mask) << 6) | (u64)level;
+		items[i].index = (u32)i;
+	}
+
+	// Sorting by the keys places the objects in depth-first order, with the objects of a cell before the objects of
+	// its subcells.
+	std::sort(items.begin(), items.end());
+
+	objects.reserve(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+		objects.push_back(objects_[items[i].index]);
+
+	BuildRange(items, 0, (u32)numObjects, 0, 0);
+
+	// The tree does not change after it has been built, so release the extra capacity of the cell array.
+	std::vector<Cell>(cells).swap(cells);
+}
+
+template<typename T>
+void LinearQuadTree<T>::AddCell(u64 code, int level, u32 begin, u32 end)
+{
+	assert(begin < end);
+	Cell cell;
+	cell.key = (code << 6) | (u64)level;
+	cell.firstObject = begin;
+	cell.numObjects = end - begin;
+	cells.push_back(cell);
+}
+
+template<typename T>
+void LinearQuadTree<T>::BuildRange(const std::vector<BuildItem> &items, u32 begin, u32 end, u64 code, int level)
+{
+	if (end - begin <= (u32)maxCellObjects || level == maxLevel)
+	{
+		AddCell(code, level, begin, end);
+		return;
+	}
+
+	// The objects that straddle the split lines of this cell stay in this cell. They are first in the range.
+	const u64 cellKey = (code << 6) | (u64)level;
+	u32 mid = begin;
+	while(mid < end && items[mid].key == cellKey)
+		++mid;
+	if (mid > begin)
+		AddCell(code, level, begin, mid);
+
+	const u64 childSize = (u64)1 << (2 * (maxLevel - level - 1));
+	for(int quadrant = 0; quadrant < 4 && mid < end; ++quadrant)
+	{
+		const u64 childCode = code + quadrant * childSize;
+		BuildItem bound;
+		bound.key = (childCode + childSize) << 6;
+		u32 childEnd = (quadrant == 3) ? end : (u32)(std::lower_bound(items.begin() + mid, items.begin() + end, bound) - items.begin());
+		if (childEnd > mid)
+			BuildRange(items, mid, childEnd, childCode, level + 1);
+		mid = childEnd;
+	}
+}
+
+template<typename T>
+void LinearQuadTree<T>::CommonAncestor(u32 begin, u32 end, u64 &code, int &level) const
+{
+	assert(begin < end);
+	const Cell &first = cells[begin];
+	const Cell &last = cells[end-1];
+	level = Min(first.Level(), last.Level());
+	// The Morton codes of two cells differ first at the pair of bits of the level where the cells separate.
+	int highestDifferingBit = HighestSetBitIndex64(first.MortonCode() ^ last.MortonCode());
+	if (highestDifferingBit >= 0)
+		level = Min(level, maxLevel - 1 - highestDifferingBit / 2);
+	code = first.MortonCode() & ~(((u64)1 << (2 * (maxLevel - level))) - 1);
+}
+
+template<typename T>
+u32 LinearQuadTree<T>::LowerBound(u32 begin, u32 end, u64 code) const
+{
+	const u64 key = code << 6;
+	while(begin < end)
+	{
+		u32 mid = begin + (end - begin) / 2;
+		if (cells[mid].key < key)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+template<typename T>
+void LinearQuadTree<T>::MakeRange(const float2 &point, u32 begin, u32 end, NearestRange &range) const
+{
+	range.begin = begin;
+	range.end = end;
+	CommonAncestor(begin, end, range.code, range.level);
+	range.d = RegionAABB(range.code, range.level).DistanceSq(point);
+}
+
+template<typename T>
+template<typename Func>
+inline void LinearQuadTree<T>::AABBQuery(const AABB2D &aabb, Func &callback)
+{
+	PROFILE(LinearQuadTree_AABBQuery);
+	if (cells.empty())
+		return;
+
+	// Each range on the stack is split to at most four child ranges, and the level increases on each split,
+	// so the depth-first traversal never has more than this many ranges on the stack at a time.
+	const int maxStackSize = 4 * (maxLevel + 1);
+	u32 stack[maxStackSize][2];
+	int stackSize = 0;
+	stack[0][0] = 0;
+	stack[0][1] = (u32)cells.size();
+	++stackSize;
+
+	while(stackSize > 0)
+	{
+		--stackSize;
+		u32 begin = stack[stackSize][0];
+		u32 end = stack[stackSize][1];
+
+		if (end - begin == 1)
+		{
+			const Cell &cell = cells[begin];
+			AABB2D cellAABB = CellAABB(cell);
+			if (cellAABB.Intersects(aabb) && callback(*this, aabb, cell, cellAABB))
+				return;
+			continue;
+		}
+
+		// Jump directly to the smallest cell that contains the whole range, past any empty cells above it.
+		u64 code;
+		int level;
+		CommonAncestor(begin, end, code, level);
+		AABB2D cellAABB = RegionAABB(code, level);
+		if (!cellAABB.Intersects(aabb))
+			continue;
+
+		if (cells[begin].key == ((code << 6) | (u64)level))
+		{
+			if (callback(*this, aabb, cells[begin], cellAABB))
+				return;
+			++begin;
+		}
+
+		// Only search for the ranges of the child quadrants that the query overlaps.
+		assert(level < maxLevel);
+		const float2 center = (cellAABB.minPoint + cellAABB.maxPoint) * 0.5f;
+		const bool overlapsHalf[2][2] = { { aabb.minPoint.x <= center.x, aabb.maxPoint.x >= center.x },
+		                                  { aabb.minPoint.y <= center.y, aabb.maxPoint.y >= center.y } };
+		const u64 childSize = (u64)1 << (2 * (maxLevel - level - 1));
+		// Push in reverse order so that the cells are visited in depth-first order.
+		for(int quadrant = 3; quadrant >= 0 && begin < end; --quadrant)
+		{
+			if (!overlapsHalf[0][quadrant & 1] || !overlapsHalf[1][quadrant >> 1])
+				continue;
+			const u64 childCode = code + quadrant * childSize;
+			// The remaining cells all lie in this cell, so the first and the last quadrant need no search for one end.
+			u32 childBegin = (quadrant == 0) ? begin : LowerBound(begin, end, childCode);
+			u32 childEnd = (quadrant == 3) ? end : LowerBound(childBegin, end, childCode + childSize);
+			if (childBegin < childEnd)
+			{
+				assert(stackSize < maxStackSize);
+				stack[stackSize][0] = childBegin;
+				stack[stackSize][1] = childEnd;
+				++stackSize;
+			}
+			end = childBegin;
+		}
+	}
+}
+
+template<typename T>
+template<typename Func>
+inline void LinearQuadTree<T>::NearestNeighborObjects(const float2 &point, Func &objectCallback)
+{
+	QueryScratch scratch;
+	NearestNeighborObjects(point, objectCallback, scratch);
+}
+
+template<typename T>
+template<typename Func>
+inline void LinearQuadTree<T>::NearestNeighborObjects(const float2 &point, Func &objectCallback, QueryScratch &scratch)
+{
+	PROFILE(LinearQuadTree_NearestNeighborObjects);
+	std::vector<NearestRange> &queue = scratch.rangeQueue;
+	std::vector<NearestObject> &objectQueue = scratch.objectQueue;
+	queue.clear();
+	objectQueue.clear();
+	if (cells.empty())
+		return;
+
+	int numObjectsOutputted = 0;
+	NearestRange r;
+	MakeRange(point, 0, (u32)cells.size(), r);
+	queue.push_back(r);
+	while(!queue.empty())
+	{
+		std::pop_heap(queue.begin(), queue.end());
+		r = queue.back();
+		queue.pop_back();
+
+		// Output all objects that are closer than the next closest cell.
+		while(!objectQueue.empty() && objectQueue.front().d <= r.d)
+		{
+			const NearestObject &o = objectQueue.front();
+			if (objectCallback(*this, point, cells[o.cellIndex], o.d, objects[o.objectIndex], numObjectsOutputted++))
+				return;
+			std::pop_heap(objectQueue.begin(), objectQueue.end());
+			objectQueue.pop_back();
+		}
+
+		u32 begin = r.begin;
+		if (cells[begin].key == ((r.code << 6) | (u64)r.level))
+		{
+			const Cell &cell = cells[begin];
+			for(u32 i = cell.firstObject; i < cell.firstObject + cell.numObjects; ++i)
+			{
+				NearestObject o;
+				o.d = GetAABB2D(objects[i]).DistanceSq(point);
+				o.objectIndex = i;
+				o.cellIndex = begin;
+				objectQueue.push_back(o);
+				std::push_heap(objectQueue.begin(), objectQueue.end());
+			}
+			++begin;
+		}
+		if (begin == r.end)
+			continue;
+
+		u32 childBegin[5];
+		childBegin[0] = begin;
+		childBegin[4] = r.end;
+		const u64 childSize = (u64)1 << (2 * (maxLevel - r.level - 1));
+		for(int quadrant = 1; quadrant < 4; ++quadrant)
+			childBegin[quadrant] = LowerBound(childBegin[quadrant-1], r.end, r.code + quadrant * childSize);
+		for(int quadrant = 0; quadrant < 4; ++quadrant)
+			if (childBegin[quadrant] < childBegin[quadrant+1])
+			{
+				NearestRange child;
+				MakeRange(point, childBegin[quadrant], childBegin[quadrant+1], child);
+				queue.push_back(child);
+				std::push_heap(queue.begin(), queue.end());
+			}
+	}
+
+	// All cells have been visited. Output the remaining objects.
+	while(!objectQueue.empty())
+	{
+		const NearestObject &o = objectQueue.front();
+		if (objectCallback(*this, point, cells[o.cellIndex], o.d, objects[o.objectIndex], numObjectsOutputted++))
+			return;
+		std::pop_heap(objectQueue.begin(), objectQueue.end());
+		objectQueue.pop_back();
+	}
+}
+
+/// Orders the objects of the k-nearest heap of LinearQuadTree::KNearestObjects() farthest first.
+template<typename NearestObject>
+struct LinearQuadTreeNearestObjectFartherFirst
+{
+	bool operator ()(const NearestObject &a, const NearestObject &b) const { return a.d < b.d; }
+};
+
+template<typename T>
+int LinearQuadTree<T>::KNearestObjects(const float2 &point, int k, T *outObjects, float *outDistancesSq, QueryScratch &scratch)
+{
+	PROFILE(LinearQuadTree_KNearestObjects);
+	assume(k >= 0);
+	assume(outObjects || k == 0);
+	if (k <= 0 || cells.empty())
+		return 0;
+
+	// Visit the cells closest first, and keep the k closest objects found so far in a heap with the farthest of them
+	// in the front. Once k objects are found, the subtrees farther than the farthest of them can be skipped.
+	std::vector<NearestRange> &queue = scratch.rangeQueue;
+	std::vector<NearestObject> &nearest = scratch.objectQueue;
+	queue.clear();
+	nearest.clear();
+	LinearQuadTreeNearestObjectFartherFirst<NearestObject> fartherFirst;
+	NearestRange r;
+	MakeRange(point, 0, (u32)cells.size(), r);
+	queue.push_back(r);
+	while(!queue.empty())
+	{
+		std::pop_heap(queue.begin(), queue.end());
+		r = queue.back();
+		queue.pop_back();
+		if ((int)nearest.size() == k && r.d >= nearest.front().d)
+			break; // All the remaining subtrees are at least as far.
+
+		u32 begin = r.begin;
+		if (cells[begin].key == ((r.code << 6) | (u64)r.level))
+		{
+			const Cell &cell = cells[begin];
+			for(u32 i = cell.firstObject; i < cell.firstObject + cell.numObjects; ++i)
+			{
+				NearestObject o;
+				o.d = GetAABB2D(objects[i]).DistanceSq(point);
+				if ((int)nearest.size() == k)
+				{
+					if (o.d >= nearest.front().d)
+						continue;
+					std::pop_heap(nearest.begin(), nearest.end(), fartherFirst);
+					nearest.pop_back();
+				}
+				o.objectIndex = i;
+				o.cellIndex = begin;
+				nearest.push_back(o);
+				std::push_heap(nearest.begin(), nearest.end(), fartherFirst);
+			}
+			++begin;
+		}
+		if (begin == r.end)
+			continue;
+
+		u32 childBegin[5];
+		childBegin[0] = begin;
+		childBegin[4] = r.end;
+		const u64 childSize = (u64)1 << (2 * (maxLevel - r.level - 1));
+		for(int quadrant = 1; quadrant < 4; ++quadrant)
+			childBegin[quadrant] = LowerBound(childBegin[quadrant-1], r.end, r.code + quadrant * childSize);
+		for(int quadrant = 0; quadrant < 4; ++quadrant)
+			if (childBegin[quadrant] < childBegin[quadrant+1])
+			{
+				NearestRange child;
+				MakeRange(point, childBegin[quadrant], childBegin[quadrant+1], child);
+				if ((int)nearest.size() == k && child.d >= nearest.front().d)
+					continue;
+				queue.push_back(child);
+				std::push_heap(queue.begin(), queue.end());
+			}
+	}
+
+	std::sort_heap(nearest.begin(), nearest.end(), fartherFirst);
+	for(size_t i = 0; i < nearest.size(); ++i)
+	{
+		outObjects[i] = objects[nearest[i].objectIndex];
+		if (outDistancesSq)
+			outDistancesSq[i] = nearest[i].d;
+	}
+	return (int)nearest.size();
+}
+
+template<typename T>
+void LinearQuadTree<T>::DebugSanityCheck() const
+{
+	u32 numObjectsInCells = 0;
+	for(size_t i = 0; i < cells.size(); ++i)
+	{
+		const Cell &cell = cells[i];
+		assert(cell.Level() <= maxLevel);
+		assert(cell.numObjects > 0);
+		assert(cell.firstObject == numObjectsInCells);
+		assert(i == 0 || cells[i-1].key < cell.key);
+		// The Morton code of a cell is aligned to the size of the cell.
+		assert((cell.MortonCode() & (((u64)1 << (2 * (maxLevel - cell.Level()))) - 1)) == 0);
+		AABB2D cellAABB = CellAABB(cell);
+		for(u32 j = cell.firstObject; j < cell.firstObject + cell.numObjects; ++j)
+			assert(cellAABB.Contains(GetAABB2D(objects[j])));
+		MARK_UNUSED(cellAABB);
+		numObjectsInCells += cell.numObjects;
+	}
+	assert(numObjectsInCells == objects.size());
+	MARK_UNUSED(numObjectsInCells);
+}
+
+MATH_END_NAMESPACE
@@ -0,0 +1,268 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file Octree.h
+	@author Jukka Jylnki
+	@brief An Octree spatial query acceleration structure for dynamic 3D data. */
+#pragma once
+
+#ifdef MATH_GRAPHICSENGINE_INTEROP
+#include "Time/Profiler.h"
+#else
+#define PROFILE(x)
+#endif
+#include "../Math/float3.h"
+#include "../Math/MathTypes.h"
+#include "AABB.h"
+#include "Frustum.h"
+#include "Plane.h"
+#include <vector>
+
+MATH_BEGIN_NAMESPACE
+
+/// A fixed split rule for all Octrees: An Octree leaf node is only ever split if the leaf contains at least this many objects.
+/// Leaves containing fewer than this many objects are always kept as leaves until the object count is exceeded.
+static const int minOctreeNodeObjectCount = 16;
+
+/// A fixed split limit rule for all Octrees: If the Octree node side length is smaller than this, the node will
+/// never be split again into smaller subnodes. This provides a hard limit safety net for infinite/extra long recursion
+/// in case multiple identical overlapping objects are placed into the tree.
+static const float minOctreeOctantSize = 0.05f;
+
+/// Helper for interpreting how to place float3 elements into an Octree<float3>.
+inline AABB GetAABB(const float3 &pt) { return AABB(pt, pt); }
+
+/// Returns the cell of the given child octant [0,7] of an Octree node with the given cell.
+/// Bit 0 of the octant selects the +X half of the cell, bit 1 the +Y half and bit 2 the +Z half.
+inline AABB OctreeChildCell(const AABB &cell, int octant)
+{
+	float3 half = (cell.minPoint + cell.maxPoint) * 0.5f;
+	AABB child = cell;
+	for(int axis = 0; axis < 3; ++axis)
+		if ((octant & (1 << axis)) == 0)
+			child.maxPoint[axis] = half[axis];
+		else
+			child.minPoint[axis] = half[axis];
+	return child;
+}
+
+/// An Octree that stores objects of type T.
+/** This is the 3D counterpart of QuadTree. Each inner node has a group of eight child nodes, which are allocated
+	contiguously in memory. To store objects of type T in an Octree, define the following functions:
+	- AABB GetAABB(const T &object), which returns the bounding box of the object.
+	- void AssociateOctreeNode(const T &object, Octree<T>::Node *node), which the tree calls to notify that the
+	  object was placed to the given node, or removed from the tree if node is null.
+	- Octree<T>::Node *GetOctreeNode(const T &object), which returns the node last associated with the object.
+	  This is only needed for Remove().
+	The nodes are stored in a single array, which Add() grows by reallocating it. After a reallocation, the tree
+	associates every object with its node again, so the pointers stored by AssociateOctreeNode() stay valid, but
+	other node pointers must not be held across calls to Add(). */
+template<typename T>
+class Octree
+{
+public:
+	/// @note For space compactness, an Octree node does not store its own AABB extents.
+	struct Node
+	{
+		/// If 0, this node is the root.
+		Node *parent;
+		/// Indicates the group of eight child nodes for this node, or 0xFFFFFFFF if this node is a leaf.
+		u32 childIndex;
+		/// Stores the actual objects in this node/leaf.
+		std::vector<T> objects;
+
+		bool IsLeaf() const { return childIndex == 0xFFFFFFFF; }
+
+		/// Returns the index of the child node at the given octant [0,7]. @see OctreeChildCell().
+		u32 ChildIndex(int octant) const { return childIndex + octant; }
+
+		/// This assumes that the Octree contains unique objects and never duplicates.
+		void Remove(const T &object)
+		{
+			for(size_t i = 0; i < objects.size(); ++i)
+				if (objects[i] == object)
+				{
+					AssociateOctreeNode(object, (Node*)0); // Mark in the object that it has been removed from the octree.
+					std::swap(objects[i], objects.back());
+					objects.pop_back();
+					return;
+				}
+		}
+	};
+
+	/// Helper struct used when traversing through the tree.
+	struct TraversalStackItem
+	{
+		AABB aabb;
+		Node *node;
+	};
+
+	/// Helper struct used when traversing through the tree in FrustumQuery().
+	struct FrustumStackItem
+	{
+		AABB aabb;
+		Node *node;
+		int planeMask; ///< Bit i is set if the node is not yet known to be inside plane i of the frustum.
+	};
+
+	Octree()
+	:rootNodeIndex(-1),
+	boundingAABB(float3(0,0,0), float3(1,1,1))
+	{
+	}
+
+	/// Removes all nodes and objects in this tree and reinitializes the tree to a single root node.
+	/// Call this function before adding objects to the tree.
+	void Clear(const float3 &minXYZ = float3(-1.f, -1.f, -1.f), const float3 &maxXYZ = float3(1.f, 1.f, 1.f));
+
+	/// Places the given object into the proper (leaf) node of the tree. After placing, if the leaf split rule is
+	/// satisfied, subdivides the leaf node into 8 suboctants and reassigns the objects to new leaves.
+	/// If the object does not fit inside the tree, the root is grown until it does.
+	void Add(const T &object);
+
+	/// Removes the given object from this tree.
+	/// To call this function, you must define a function Octree<T>::Node *GetOctreeNode(const T &object)
+	/// which returns the node of this octree where the object resides in.
+	void Remove(const T &object);
+
+	/// @return The bounding box for the whole tree.
+	/// @note This bounding box does not tightly bound the objects themselves, only the root node of the tree.
+	AABB BoundingAABB() const { return boundingAABB; }
+
+	/// Calculates the bounding box of the cell of the given node.
+	AABB ComputeAABB(const Node *node) const
+	{
+		if (!node->parent)
+			return BoundingAABB();
+		int octant = (int)(node - &nodes[node->parent->childIndex]); // The difference between these pointers is always [0-7], denoting the octant this node is in.
+		assert(octant >= 0 && octant < 8);
+		return OctreeChildCell(ComputeAABB(node->parent), octant);
+	}
+
+	/// @return The topmost node in the tree.
+	Node *Root();
+	const Node *Root() const;
+
+	/// Returns the node at the given index. Use with the child indices of Node to traverse the tree.
+	Node *GetNode(u32 index) { assert(index < nodes.size()); return &nodes[index]; }
+	const Node *GetNode(u32 index) const { assert(index < nodes.size()); return &nodes[index]; }
+
+	/// Returns the total number of nodes (all nodes, i.e. inner nodes + leaves) in the tree.
+	/// Runs in constant time.
+	int NumNodes() const;
+
+	/// Returns the total number of leaf nodes in the tree.
+	/// @warning Runs in time linear 'O(n)' to the number of nodes in the tree.
+	int NumLeaves() const;
+
+	/// Returns the total number of inner nodes in the tree.
+	/// @warning Runs in time linear 'O(n)' to the number of nodes in the tree.
+	int NumInnerNodes() const;
+
+	/// Returns the total number of objects stored in the tree.
+	/// @warning Runs in time linear 'O(n)' to the number of nodes in the tree.
+	int NumObjects() const;
+
+	/// Returns the maximum height of the whole tree (the path from the root to the farthest leaf node).
+	int TreeHeight() const;
+
+	/// Returns the height of the subtree rooted at 'node'.
+	int TreeHeight(const Node *node) const;
+
+	/// Performs an AABB intersection query in this Octree, and calls the given callback function for each non-empty
+	/// node of the tree which intersects the given AABB.
+	/** @param aabb The axis-aligned bounding box to intersect this Octree with.
+		@param callback A function or a function object of prototype
+			bool callbackFunction(Octree<T> &tree, const AABB &queryAABB, Octree<T>::Node &node, const AABB &nodeAABB);
+		If the callback function returns true, the execution of the query is stopped and this function immediately
+		returns afterwards. If the callback function returns false, the execution of the query continues. */
+	template<typename Func>
+	inline void AABBQuery(const AABB &aabb, Func &callback);
+
+	/// Performs a frustum culling query in this Octree, and calls the given callback function for each non-empty
+	/// node of the tree which intersects the given frustum.
+	/** The nodes are culled against the six planes of the frustum. This is conservative: a node near a corner of
+		the frustum may be outside the frustum even though it is not outside any single plane of it, so the callback
+		should test the objects of each node itself. A node that is inside all the planes of the frustum is known to
+		be inside the frustum, and the planes are not tested again for its subtree.
+		@param callback A function or a function object of prototype
+			bool callbackFunction(Octree<T> &tree, const Frustum &frustum, Octree<T>::Node &node, const AABB &nodeAABB);
+		If the callback function returns true, the execution of the query is stopped. */
+	template<typename Func>
+	inline void FrustumQuery(const Frustum &frustum, Func &callback);
+
+	/// Performs a node-granular nearest neighbor search on this Octree.
+	/** This query calls the given nodeCallback function for each node of this Octree that contains objects, sorted by closest first
+		to the target point. At any given time, the nodeCallback function may terminate the search by returning true in its callback.
+		@param point The target point of the search.
+		@param nodeCallback A function or a function object of prototype
+		   bool NodeCallbackFunction(Octree<T> &tree, const float3 &targetPoint, Octree<T>::Node &node, const AABB &aabb, float minDistanceSquared);
+		   If the callback function returns true, the execution of the query is immediately stopped.
+		   aabb specifies the bounding box of node.
+		   minDistanceSquared is the squared minimum distance the objects in this node (and all future nodes to be passed to the
+		   callback) have to the point that is being queried. */
+	template<typename Func>
+	inline void NearestNeighborNodes(const float3 &point, Func &nodeCallback);
+
+	/// Performs an object-granular nearest neighbor search on this Octree.
+	/** This query calls the given objectCallback function for each object in this Octree, starting from the object closest to the
+		given target point, and proceeding in distance-sorted order. The distance of an object is the distance of the
+		given point to the AABB of the object, as returned by GetAABB().
+		@param targetPoint The target point to find the nearest neighbors to.
+		@param objectCallback The function object that should be invoked by the query for each object. This function should be of prototype
+		   bool NearestNeighborObjectCallback(Octree<T> &tree, const float3 &targetPoint, Octree<T>::Node *node, const AABB &aabb,
+		                                      float distanceSquared, const T &nearestNeighborObject, int nearestNeighborIndex);
+		   If this function returns true, the execution of the query is immediately stopped.
+		   node points to the Octree node where nearestNeighborObject resides in, and aabb is the bounding box of that node.
+		   distanceSquared is the squared distance between targetPoint and nearestNeighborObject.
+		   nearestNeighborIndex provides a conveniency counter that tells how many nearest neighbors are closer to targetPoint than this object. */
+	template<typename Func>
+	inline void NearestNeighborObjects(const float3 &targetPoint, Func &objectCallback);
+
+	/// Performs various consistency checks on the given node. Use only for debugging purposes.
+	void DebugSanityCheckNode(Node *n);
+
+private:
+	void Add(const T &object, Node *n, AABB aabb);
+
+	/// Allocates a sequential 8-tuple of Octree nodes, contiguous in memory.
+	/// @param parentIndex The index of the parent node of the new nodes, or -1 if they are the root group.
+	int AllocateNodeGroup(int parentIndex);
+
+	/// Reallocates the node array to hold at least minCapacity nodes, and fixes the parent pointers and the
+	/// object->node associations to point to the new array.
+	void GrowNodeStorage(size_t minCapacity);
+
+	void SplitLeaf(Node *leaf, const AABB &leafAABB);
+
+	/// Returns the child octant [0,7] of a node with the given cell that Add() places an object with the given bounds
+	/// to, or -1 if the object straddles a split plane of the node and stays in the node itself.
+	static int ChildOctant(const AABB &objectAABB, const AABB &cell);
+
+	/// Doubles the size of the root towards the given object, making the old root a child of the new root.
+	void GrowRoot(const AABB &objectAABB);
+
+	std::vector<Node> nodes;
+
+	/// Specifies the index to the root node, or -1 if there is no root (nodes.size() == 0).
+	int rootNodeIndex;
+	AABB boundingAABB;
+};
+
+template<typename Node>
+inline void AssociateOctreeNode(const float3 &, Node *) {}
+
+MATH_END_NAMESPACE
+
+#include "Octree.inl"
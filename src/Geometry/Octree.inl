@@ -0,0 +1,573 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file Octree.inl
+	@author Jukka Jylnki
+	@brief Implementation for the Octree object. */
+#pragma once
+
+#include "../Math/MathFunc.h"
+#include <algorithm>
+
+MATH_BEGIN_NAMESPACE
+
+template<typename T>
+void Octree<T>::Clear(const float3 &minXYZ, const float3 &maxXYZ)
+{
+	nodes.clear();
+
+	boundingAABB.minPoint = minXYZ;
+	boundingAABB.maxPoint = maxXYZ;
+
+	assert(!boundingAABB.IsDegenerate());
+
+	rootNodeIndex = AllocateNodeGroup(-1);
+	assert(Root());
+}
+
+template<typename T>
+void Octree<T>::Add(const T &object)
+{
+	PROFILE(Octree_Add);
+	assert(Root() && "Error: Octree has not been initialized with a root node! Call Octree::Clear() to initialize the root node.");
+
+	assert(boundingAABB.IsFinite());
+	assert(!boundingAABB.IsDegenerate());
+
+	AABB objectAABB = GetAABB(object);
+	assert(objectAABB.IsFinite());
+	assert(objectAABB.minPoint.x <= objectAABB.maxPoint.x && objectAABB.minPoint.y <= objectAABB.maxPoint.y && objectAABB.minPoint.z <= objectAABB.maxPoint.z);
+
+	// Grow the root until the object fits the whole root AABB.
+	while(!boundingAABB.Contains(objectAABB))
+		GrowRoot(objectAABB);
+
+	Add(object, Root(), boundingAABB);
+}
+
+template<typename T>
+void Octree<T>::Remove(const T &object)
+{
+	Node *n = GetOctreeNode(object);
+	if (n)
+		n->Remove(object);
+}
+
+template<typename T>
+int Octree<T>::ChildOctant(const AABB &objectAABB, const AABB &cell)
+{
+	int octant = 0;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float half = (cell.minPoint[axis] + cell.maxPoint[axis]) * 0.5f;
+		bool low = objectAABB.minPoint[axis] < half;
+		bool high = objectAABB.maxPoint[axis] > half;
+		// We must leave this object in this node if the object straddled the parent->child split planes.
+		if (low && high)
+			return -1;
+		// Note: It can happen that !low && !high, in which case the high half is taken.
+		if (!low)
+			octant |= 1 << axis;
+	}
+	return octant;
+}
+
+template<typename T>
+void Octree<T>::Add(const T &object, Node *n, AABB aabb)
+{
+	const AABB objectAABB = GetAABB(object);
+	for(;;)
+	{
+		// Traverse the Octree to decide which octant to place this object into.
+		int octant = ChildOctant(objectAABB, aabb);
+
+		// We must put the object onto this node if
+		// a) the object straddled the parent->child split planes.
+		// b) this object is a leaf.
+		if (n->IsLeaf() || octant < 0)
+		{
+			n->objects.push_back(object);
+			AssociateOctreeNode(object, n);
+			if (n->IsLeaf() && (int)n->objects.size() > minOctreeNodeObjectCount && aabb.Size().MinElement() >= minOctreeOctantSize)
+				SplitLeaf(n, aabb);
+			return;
+		}
+		aabb = OctreeChildCell(aabb, octant);
+		assert(nodes[n->ChildIndex(octant)].parent == n);
+		n = &nodes[n->ChildIndex(octant)];
+	}
+}
+
+template<typename T>
+typename Octree<T>::Node *Octree<T>::Root()
+{
+	return nodes.empty() ? 0 : &nodes[rootNodeIndex];
+}
+
+template<typename T>
+const typename Octree<T>::Node *Octree<T>::Root() const
+{
+	return nodes.empty() ? 0 : &nodes[rootNodeIndex];
+}
+
+template<typename T>
+int Octree<T>::AllocateNodeGroup(int parentIndex)
+{
+	if (nodes.size() + 8 > nodes.capacity())
+		GrowNodeStorage(nodes.size() + 8);
+	int index = (int)nodes.size();
+	Node n;
+	n.parent = (parentIndex >= 0) ? &nodes[parentIndex] : 0;
+	n.childIndex = 0xFFFFFFFF;
+	nodes.insert(nodes.end(), 8, n);
+	return index;
+}
+
+template<typename T>
+void Octree<T>::GrowNodeStorage(size_t minCapacity)
+{
+	// Remember the parent links as indices, since the old pointers cannot be used after the nodes have moved.
+	std::vector<int> parentIndices(nodes.size());
+	for(size_t i = 0; i < nodes.size(); ++i)
+		parentIndices[i] = nodes[i].parent ? (int)(nodes[i].parent - &nodes[0]) : -1;
+
+	nodes.reserve(std::max(minCapacity, nodes.capacity() * 2));
+
+	for(size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node &n = nodes[i];
+		n.parent = (parentIndices[i] >= 0) ? &nodes[parentIndices[i]] : 0;
+		for(size_t j = 0; j < n.objects.size(); ++j)
+			AssociateOctreeNode(n.objects[j], &n);
+	}
+}
+
+template<typename T>
+void Octree<T>::SplitLeaf(Node *leaf, const AABB &leafAABB)
+{
+	assert(leaf->IsLeaf());
+	assert(leaf->childIndex == 0xFFFFFFFF);
+
+	// Allocating the children, and the splits of the children below, may move the nodes in memory, so refer to the
+	// leaf by its index.
+	const int leafIndex = (int)(leaf - &nodes[0]);
+	const u32 childIndex = (u32)AllocateNodeGroup(leafIndex);
+	nodes[leafIndex].childIndex = childIndex;
+
+	size_t i = 0;
+	while(i < nodes[leafIndex].objects.size())
+	{
+		std::vector<T> &objects = nodes[leafIndex].objects;
+		int octant = ChildOctant(GetAABB(objects[i]), leafAABB);
+		if (octant < 0)
+		{
+			++i;
+			continue;
+		}
+
+		// Remove the object from this node before adding it to the child.
+		T object = objects[i];
+		std::swap(objects[i], objects.back());
+		objects.pop_back();
+		Add(object, &nodes[childIndex + octant], OctreeChildCell(leafAABB, octant));
+	}
+}
+
+template<typename T>
+template<typename Func>
+inline void Octree<T>::AABBQuery(const AABB &aabb, Func &callback)
+{
+	PROFILE(Octree_AABBQuery);
+	std::vector<TraversalStackItem> stack;
+	TraversalStackItem n;
+	n.aabb = BoundingAABB();
+	n.node = Root();
+	if (!n.node || !n.aabb.Intersects(aabb))
+		return;
+	stack.push_back(n);
+
+	while(!stack.empty())
+	{
+		TraversalStackItem i = stack.back();
+		stack.pop_back();
+
+		if (i.node->objects.size() > 0)
+		{
+			if (callback(*this, aabb, *i.node, i.aabb))
+				return;
+		}
+		if (!i.node->IsLeaf())
+		{
+			// aabb intersects the node's aabb. Which halves of the node does it intersect on each axis?
+			float3 half = (i.aabb.minPoint + i.aabb.maxPoint) * 0.5f;
+			int lowHalves = (aabb.minPoint.x <= half.x ? 1 : 0) | (aabb.minPoint.y <= half.y ? 2 : 0) | (aabb.minPoint.z <= half.z ? 4 : 0);
+			int highHalves = (aabb.maxPoint.x >= half.x ? 1 : 0) | (aabb.maxPoint.y >= half.y ? 2 : 0) | (aabb.maxPoint.z >= half.z ? 4 : 0);
+
+			// Push in reverse order so that the children are visited in octant order.
+			for(int octant = 7; octant >= 0; --octant)
+				if ((highHalves & octant) == octant && (lowHalves & ~octant & 7) == (~octant & 7))
+				{
+					TraversalStackItem child;
+					child.aabb = OctreeChildCell(i.aabb, octant);
+					child.node = &nodes[i.node->ChildIndex(octant)];
+					stack.push_back(child);
+				}
+		}
+	}
+}
+
+template<typename T>
+template<typename Func>
+inline void Octree<T>::FrustumQuery(const Frustum &frustum, Func &callback)
+{
+	PROFILE(Octree_FrustumQuery);
+	Plane planes[6];
+	frustum.GetPlanes(planes);
+
+	std::vector<FrustumStackItem> stack;
+	FrustumStackItem n;
+	n.aabb = BoundingAABB();
+	n.node = Root();
+	n.planeMask = 63;
+	if (!n.node)
+		return;
+	stack.push_back(n);
+
+	while(!stack.empty())
+	{
+		FrustumStackItem i = stack.back();
+		stack.pop_back();
+
+		// The plane normals point outwards from the frustum. The node is outside a plane if the corner of the node that
+		// is the farthest in the direction opposite to the plane normal is on the positive side of the plane, and
+		// inside the plane if the farthest corner in the direction of the normal is on the negative side of it.
+		bool outside = false;
+		for(int p = 0; p < 6 && !outside; ++p)
+			if (i.planeMask & (1 << p))
+			{
+				const float3 &normal = planes[p].normal;
+				float3 nearCorner(normal.x >= 0.f ? i.aabb.minPoint.x : i.aabb.maxPoint.x,
+				                  normal.y >= 0.f ? i.aabb.minPoint.y : i.aabb.maxPoint.y,
+				                  normal.z >= 0.f ? i.aabb.minPoint.z : i.aabb.maxPoint.z);
+				if (normal.Dot(nearCorner) > planes[p].d)
+					outside = true;
+				else
+				{
+					float3 farCorner(normal.x >= 0.f ? i.aabb.maxPoint.x : i.aabb.minPoint.x,
+					                 normal.y >= 0.f ? i.aabb.maxPoint.y : i.aabb.minPoint.y,
+					                 normal.z >= 0.f ? i.aabb.maxPoint.z : i.aabb.minPoint.z);
+					if (normal.Dot(farCorner) <= planes[p].d)
+						i.planeMask &= ~(1 << p);
+				}
+			}
+		if (outside)
+			continue;
+
+		if (i.node->objects.size() > 0)
+		{
+			if (callback(*this, frustum, *i.node, i.aabb))
+				return;
+		}
+		if (!i.node->IsLeaf())
+			for(int octant = 7; octant >= 0; --octant)
+			{
+				FrustumStackItem child;
+				child.aabb = OctreeChildCell(i.aabb, octant);
+				child.node = &nodes[i.node->ChildIndex(octant)];
+				child.planeMask = i.planeMask;
+				stack.push_back(child);
+			}
+	}
+}
+
+/// Returns the squared distance between the given point and the closest point of the given AABB to it.
+inline float OctreeDistanceSq(const AABB &aabb, const float3 &point)
+{
+	return aabb.ClosestPoint(point).DistanceSq(point);
+}
+
+template<typename T>
+struct OctreeTraversalNode
+{
+	/// The squared distance of this node to the query point.
+	float d;
+	/// Stores the bounding box of this node.
+	AABB aabb;
+	typename Octree<T>::Node *node;
+
+	/// We compare in reverse order, since we want the node with the smallest distance to be visited first,
+	/// and std::push_heap keeps the element that compares largest in the front.
+	bool operator <(const OctreeTraversalNode &t) const { return d > t.d; }
+};
+
+template<typename T>
+template<typename Func>
+inline void Octree<T>::NearestNeighborNodes(const float3 &point, Func &leafCallback)
+{
+	PROFILE(Octree_NearestNeighborNodes);
+	if (!Root())
+		return;
+	std::vector<OctreeTraversalNode<T> > queue;
+	OctreeTraversalNode<T> t;
+	t.d = 0.f;
+	t.aabb = BoundingAABB();
+	t.node = Root();
+	queue.push_back(t);
+
+	while(!queue.empty())
+	{
+		std::pop_heap(queue.begin(), queue.end());
+		t = queue.back();
+		queue.pop_back();
+
+		if (t.node->objects.size() > 0)
+		{
+			bool stopIteration = leafCallback(*this, point, *t.node, t.aabb, t.d);
+			if (stopIteration)
+				return;
+		}
+
+		if (!t.node->IsLeaf())
+			for(int octant = 0; octant < 8; ++octant)
+			{
+				OctreeTraversalNode<T> n;
+				n.aabb = OctreeChildCell(t.aabb, octant);
+				n.node = &nodes[t.node->ChildIndex(octant)];
+				n.d = OctreeDistanceSq(n.aabb, point);
+				queue.push_back(n);
+				std::push_heap(queue.begin(), queue.end());
+			}
+	}
+}
+
+template<typename ObjectCallbackFunc, typename T>
+struct OctreeNearestNeighborObjectSearch
+{
+	OctreeNearestNeighborObjectSearch()
+	:objectCallback(0), numObjectsOutputted(0), stopped(false)
+	{
+	}
+
+	ObjectCallbackFunc *objectCallback;
+
+	struct NearestObject
+	{
+		/// The squared distance of this object to the query point.
+		float d;
+
+		/// Stores the bounding box of the node of this object.
+		AABB aabb;
+		typename Octree<T>::Node *node;
+
+		T *object;
+
+		/// We compare in reverse order, since we want the object with the smallest distance to be visited first,
+		/// and std::push_heap keeps the object that compares largest in the front.
+		bool operator <(const NearestObject &t) const { return d > t.d; }
+	};
+
+	std::vector<NearestObject> queue;
+
+	int numObjectsOutputted;
+
+	/// Set to true when the object callback requests to stop the search.
+	bool stopped;
+
+	bool operator ()(Octree<T> &tree, const float3 &point, typename Octree<T>::Node &leaf, const AABB &aabb, float minDistanceSquared)
+	{
+		// Output all objects that are closer than the next closest node.
+		if (OutputObjectsCloserThan(tree, point, minDistanceSquared))
+			return true;
+
+		// Queue up all objects in the new node.
+		for(size_t i = 0; i < leaf.objects.size(); ++i)
+		{
+			NearestObject obj;
+			obj.d = OctreeDistanceSq(GetAABB(leaf.objects[i]), point);
+			obj.aabb = aabb;
+			obj.node = &leaf;
+			obj.object = &leaf.objects[i];
+			queue.push_back(obj);
+			std::push_heap(queue.begin(), queue.end());
+		}
+
+		return false;
+	}
+
+	/// Outputs the queued objects that are at most at the given squared distance from the point, closest first.
+	/// @return True if the object callback requested to stop the search.
+	bool OutputObjectsCloserThan(Octree<T> &tree, const float3 &point, float maxDistanceSquared)
+	{
+		while(!queue.empty() && queue.front().d <= maxDistanceSquared)
+		{
+			const NearestObject &nextNearestObject = queue.front();
+			if ((*objectCallback)(tree, point, nextNearestObject.node, nextNearestObject.aabb, nextNearestObject.d, *nextNearestObject.object, numObjectsOutputted++))
+			{
+				stopped = true;
+				return true;
+			}
+			std::pop_heap(queue.begin(), queue.end());
+			queue.pop_back();
+		}
+		return false;
+	}
+};
+
+template<typename T>
+template<typename Func>
+inline void Octree<T>::NearestNeighborObjects(const float3 &point, Func &leafCallback)
+{
+	OctreeNearestNeighborObjectSearch<Func, T> search;
+	search.objectCallback = &leafCallback;
+
+	NearestNeighborNodes(point, search);
+
+	// All nodes have been visited. Output the objects of the last visited nodes.
+	if (!search.stopped)
+		search.OutputObjectsCloserThan(*this, point, FLOAT_INF);
+}
+
+template<typename T>
+void Octree<T>::GrowRoot(const AABB &objectAABB)
+{
+	// Grow towards the object on each axis. The old root becomes the child of the new root at the opposite side.
+	int octantForRoot = 0;
+	float3 size = boundingAABB.Size();
+	for(int axis = 0; axis < 3; ++axis)
+		if (objectAABB.minPoint[axis] < boundingAABB.minPoint[axis])
+		{
+			boundingAABB.minPoint[axis] -= size[axis];
+			octantForRoot |= 1 << axis;
+		}
+		else
+			boundingAABB.maxPoint[axis] += size[axis];
+
+	// rootNodeIndex always points to the first index of the eight octants.
+	Node *oldRoot = &nodes[rootNodeIndex+octantForRoot];
+
+	if (octantForRoot != 0)
+	{
+		// Swap the root node to its proper place.
+		Swap(nodes[rootNodeIndex], nodes[rootNodeIndex+octantForRoot]);
+
+		// Fix up the refs to the swapped old root node.
+		if (!oldRoot->IsLeaf())
+			for(int i = 0; i < 8; ++i)
+				nodes[oldRoot->ChildIndex(i)].parent = oldRoot;
+
+		// Fix up object->node associations to the swapped old root node.
+		for(size_t i = 0; i < oldRoot->objects.size(); ++i)
+			AssociateOctreeNode(oldRoot->objects[i], oldRoot);
+	}
+
+	int oldRootNodeIndex = rootNodeIndex;
+	rootNodeIndex = AllocateNodeGroup(-1);
+	Node *newRoot = &nodes[rootNodeIndex];
+	newRoot->childIndex = oldRootNodeIndex;
+	for(int i = 0; i < 8; ++i)
+		nodes[newRoot->ChildIndex(i)].parent = newRoot;
+
+	DebugSanityCheckNode(Root());
+}
+
+template<typename T>
+int Octree<T>::NumNodes() const
+{
+	return std::max<int>(0, (int)nodes.size() - 7); // The nodes rootNodeIndex+1 to rootNodeIndex+7 are dummy unused, since the root node is not an octant.
+}
+
+template<typename T>
+int Octree<T>::NumLeaves() const
+{
+	int numLeaves = 0;
+	for(int i = 0; i < (int)nodes.size(); ++i)
+		if (i <= rootNodeIndex || i >= rootNodeIndex + 8) // The nodes rootNodeIndex+1 to rootNodeIndex+7 are dummy unused, since the root node is not an octant.
+			if (nodes[i].IsLeaf())
+				++numLeaves;
+
+	return numLeaves;
+}
+
+template<typename T>
+int Octree<T>::NumInnerNodes() const
+{
+	int numInnerNodes = 0;
+	for(int i = 0; i < (int)nodes.size(); ++i)
+		if (i <= rootNodeIndex || i >= rootNodeIndex + 8) // The nodes rootNodeIndex+1 to rootNodeIndex+7 are dummy unused, since the root node is not an octant.
+			if (!nodes[i].IsLeaf())
+				++numInnerNodes;
+
+	return numInnerNodes;
+}
+
+template<typename T>
+int Octree<T>::NumObjects() const
+{
+	int numObjects = 0;
+	for(int i = 0; i < (int)nodes.size(); ++i)
+		numObjects += (int)nodes[i].objects.size();
+	return numObjects;
+}
+
+template<typename T>
+int Octree<T>::TreeHeight(const Node *node) const
+{
+	if (node->IsLeaf())
+		return 1;
+	int height = 0;
+	for(int i = 0; i < 8; ++i)
+		height = Max(height, TreeHeight(&nodes[node->ChildIndex(i)]));
+	return 1 + height;
+}
+
+template<typename T>
+int Octree<T>::TreeHeight() const
+{
+	if (!Root())
+		return 0;
+	return TreeHeight(Root());
+}
+
+template<typename T>
+void Octree<T>::DebugSanityCheckNode(Node *n)
+{
+#ifdef _DEBUG
+	assert(n);
+	assert(n->parent || n == Root()); // If no parent, must be root.
+	assert(n != Root() || !n->parent); // If not root, must have a parent.
+
+	// Must have a good AABB.
+	AABB aabb = ComputeAABB(n);
+	assert(aabb.IsFinite());
+	assert(aabb.minPoint.x <= aabb.maxPoint.x);
+	assert(aabb.minPoint.y <= aabb.maxPoint.y);
+	assert(aabb.minPoint.z <= aabb.maxPoint.z);
+
+	// Each object in this node must be contained in this node.
+	for(size_t i = 0; i < n->objects.size(); ++i)
+		assert(aabb.Contains(GetAABB(n->objects[i])));
+
+	// Parent <-> child links must be valid.
+	if (!n->IsLeaf())
+		for(int i = 0; i < 8; ++i)
+		{
+			assert(nodes[n->ChildIndex(i)].parent == n);
+			DebugSanityCheckNode(&nodes[n->ChildIndex(i)]);
+		}
+#else
+	MARK_UNUSED(n);
+#endif
+}
+
+MATH_END_NAMESPACE
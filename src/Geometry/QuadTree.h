@@ -25,10 +25,9 @@
 #include "../Math/float2.h"
 #include "AABB2D.h"
 #include "../Math/MathTypes.h"
-
-#ifdef MATH_CONTAINERLIB_SUPPORT
-#include "Container/MaxHeap.h"
-#endif
+#include "../Algorithm/ParallelFor.h"
+#include <vector>
+#include <utility>
 
 MATH_BEGIN_NAMESPACE
 
@@ -47,12 +46,143 @@ inline float MaxX(const float3 &pt) { return pt.x; }
 inline float MinY(const float3 &pt) { return pt.y; }
 inline float MaxY(const float3 &pt) { return pt.y; }
 
+/// Returns the cell of the given child quadrant [0,3] of a QuadTree node with the given cell.
+/// The quadrants are in the order top-left, top-right, bottom-left, bottom-right.
+inline AABB2D QuadTreeChildCell(const AABB2D &cell, int quadrant)
+{
+	float halfX = (cell.minPoint.x + cell.maxPoint.x) * 0.5f;
+	float halfY = (cell.minPoint.y + cell.maxPoint.y) * 0.5f;
+	AABB2D child = cell;
+	if ((quadrant & 1) == 0)
+		child.maxPoint.x = halfX;
+	else
+		child.minPoint.x = halfX;
+	if ((quadrant & 2) == 0)
+		child.maxPoint.y = halfY;
+	else
+		child.minPoint.y = halfY;
+	return child;
+}
+
+/// Returns the given QuadTree node cell enlarged about its center by the given looseness factor.
+inline AABB2D QuadTreeLooseAABB(const AABB2D &cell, float looseness)
+{
+	if (looseness <= 1.f)
+		return cell;
+	float2 margin = (cell.maxPoint - cell.minPoint) * ((looseness - 1.f) * 0.5f);
+	return AABB2D(cell.minPoint - margin, cell.maxPoint + margin);
+}
+
+/// Returns the child quadrant [0,3] of a loose QuadTree node with the given cell that an object with the given
+/// bounds is placed to, or -1 if the object does not fit the loose bounds of that child and stays in the node itself.
+inline int QuadTreeLooseChildQuadrant(float minX, float minY, float maxX, float maxY, const AABB2D &cell, float looseness)
+{
+	float halfX = (cell.minPoint.x + cell.maxPoint.x) * 0.5f;
+	float halfY = (cell.minPoint.y + cell.maxPoint.y) * 0.5f;
+	int quadrant = ((minX + maxX) * 0.5f < halfX ? 0 : 1) + ((minY + maxY) * 0.5f < halfY ? 0 : 2);
+	AABB2D bounds = QuadTreeLooseAABB(QuadTreeChildCell(cell, quadrant), looseness);
+	if (minX >= bounds.minPoint.x && maxX <= bounds.maxPoint.x && minY >= bounds.minPoint.y && maxY <= bounds.maxPoint.y)
+		return quadrant;
+	return -1;
+}
+
+/// The bounds of an object, used by QuadTree::BulkLoad().
+struct QuadTreeBulkLoadItem
+{
+	float minX, minY, maxX, maxY;
+	u32 index; ///< The index of the object in the array passed to BulkLoad().
+};
+
 //#ifdef _DEBUG
 /// If enabled, QuadTree queries generate debug trace/stats logging when invoked. Use only for debugging/behavioral profiling.
 //#define QUADTREE_VERBOSE_LOGGING
 //#endif
 
+/// The default object storage of a QuadTree: each node stores its objects in a std::vector<T> of its own.
+template<typename T>
+struct QuadTreeVectorStorage
+{
+	typedef std::vector<T> ObjectList;
+
+	void PushBack(ObjectList &list, const T &object) { list.push_back(object); }
+	void Reserve(ObjectList &list, u32 capacity) { list.reserve(capacity); }
+	void Release(ObjectList & /*list*/) {}
+	void Clear() {}
+};
+
+/// The objects of a QuadTree node in a QuadTreePooledStorage: a contiguous array of objects in the pool.
+/// Provides the subset of the std::vector interface that is needed to read and remove the objects.
+template<typename T>
+struct QuadTreePooledObjectList
+{
+	QuadTreePooledObjectList():data(0), count(0), capacity(0) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T &operator [](size_t i) { assert(i < count); return data[i]; }
+	const T &operator [](size_t i) const { assert(i < count); return data[i]; }
+	T &back() { assert(count > 0); return data[count-1]; }
+	const T &back() const { assert(count > 0); return data[count-1]; }
+	void pop_back() { assert(count > 0); --count; }
+
+	T *data;
+	u32 count;
+	u32 capacity;
+};
+
+/// A QuadTree object storage that stores the objects of all nodes of the tree in a shared pool.
+/** The pool is allocated in chunks of chunkSize objects, and the object array of each node is a power-of-two
+	sized block of a chunk. The freed blocks are kept in a free list per block size for reuse, so once the pool
+	has grown to its working size, adding, removing and moving objects does not allocate memory.
+	Type T must be default-constructible and assignable. */
 template<typename T>
+class QuadTreePooledStorage
+{
+public:
+	typedef QuadTreePooledObjectList<T> ObjectList;
+
+	/// The number of objects in each chunk of the pool.
+	static const int chunkSize = 4096;
+	/// The capacity of the smallest block. The block sizes are minBlockSize * 2^i.
+	static const int minBlockSize = 4;
+	static const int numSizeClasses = 24;
+
+	QuadTreePooledStorage():currentChunk(0), chunkUsed(chunkSize) {}
+	~QuadTreePooledStorage() { Clear(); }
+
+	/// Appends an object to the given list, moving the list to a larger block if it is full.
+	void PushBack(ObjectList &list, const T &object);
+
+	/// Makes room for at least the given number of objects in the given list.
+	void Reserve(ObjectList &list, u32 capacity);
+
+	/// Returns the block of the given list to the pool and empties the list.
+	void Release(ObjectList &list);
+
+	/// Frees all the memory of the pool. Invalidates all lists allocated from this pool.
+	void Clear();
+
+private:
+	static int SizeClass(u32 capacity);
+	T *AllocateBlock(int sizeClass);
+	/// Moves the objects of the given list to a new block of the given size class.
+	void MoveToBlock(ObjectList &list, int sizeClass);
+
+	std::vector<T*> chunks;
+	T *currentChunk;
+	int chunkUsed; ///< The number of objects handed out from currentChunk.
+	std::vector<T*> freeBlocks[numSizeClasses];
+
+	QuadTreePooledStorage(const QuadTreePooledStorage &); // Not implemented.
+	void operator =(const QuadTreePooledStorage &); // Not implemented.
+};
+
+/// A QuadTree that stores objects of type T.
+/** @param Storage Specifies how the objects of each node are stored. The default QuadTreeVectorStorage<T> stores
+		the objects of each node in a std::vector<T>. QuadTreePooledStorage<T> stores the objects of all nodes in a
+		shared pool, which avoids a separate heap allocation for each node. The objects of a node are accessed
+		through Node::objects with the same syntax in both cases. */
+template<typename T, typename Storage = QuadTreeVectorStorage<T> >
 class QuadTree
 {
 public:
@@ -64,7 +194,7 @@ public:
 		/// Indicates the quad of child nodes for this node, or 0xFFFFFFFF if this node is a leaf.
 		u32 childIndex;
 		/// Stores the actual objects in this node/leaf.
-		std::vector<T> objects;
+		typename Storage::ObjectList objects;
 
 		bool IsLeaf() const { return childIndex == 0xFFFFFFFF; }
 
@@ -79,7 +209,7 @@ public:
 			for(size_t i = 0; i < objects.size(); ++i)
 				if (objects[i] == object)
 				{
-					AssociateQuadTreeNode(object, 0); // Mark in the object that it has been removed from the quadtree.
+					AssociateQuadTreeNode(object, (Node*)0); // Mark in the object that it has been removed from the quadtree.
 					std::swap(objects[i], objects.back());
 					objects.pop_back();
 					return;
@@ -94,9 +224,50 @@ public:
 		Node *node;
 	};
 
+	/// A node in the priority queue of a nearest neighbor search.
+	struct NearestNode
+	{
+		/// The squared distance of this node to the query point.
+		float d;
+		/// Stores the 2D bounding rectangle of this node.
+		AABB2D aabb;
+		Node *node;
+
+		/// We compare in reverse order, since we want the node with the smallest distance to be visited first,
+		/// and std::push_heap keeps the node that compares largest in the front.
+		bool operator <(const NearestNode &t) const { return d > t.d; }
+	};
+
+	/// An object in the priority queue of a nearest neighbor search.
+	struct NearestObject
+	{
+		/// The squared distance of this object to the query point.
+		float d;
+		/// Stores the 2D bounding rectangle of the node of this object.
+		AABB2D aabb;
+		Node *node;
+		T *object;
+
+		/// We compare in reverse order, since we want the object with the smallest distance to be visited first.
+		bool operator <(const NearestObject &t) const { return d > t.d; }
+	};
+
+	/// Working memory for the queries of a QuadTree.
+	/** The query overloads that take a QueryScratch keep their traversal stack and priority queues in it, instead of
+		allocating them anew for each call. Once the vectors have grown to the size that the queries need, further
+		queries with the same QueryScratch do not allocate memory. A QueryScratch can only be used by one query at a
+		time, so give each thread a QueryScratch of its own. */
+	struct QueryScratch
+	{
+		std::vector<TraversalStackItem> stack;
+		std::vector<NearestNode> nodeQueue;
+		std::vector<NearestObject> objectQueue;
+	};
+
 	QuadTree()
 	:rootNodeIndex(-1),
-	boundingAABB(float2(0,0), float2(1,1))
+	boundingAABB(float2(0,0), float2(1,1)),
+	looseness(1.f)
 #ifdef QUADTREE_VERBOSE_LOGGING
 	,totalNumObjectsInTree(0)
 #endif
@@ -107,22 +278,64 @@ public:
 	}
 
 	/// Removes all nodes and objects in this tree and reinitializes the tree to a single root node.
+	/// Call this function before adding objects to the tree.
 	void Clear(const float2 &minXY = float2(-1.f, -1.f), const float2 &maxXY = float2(1.f, 1.f));
 
 	/// Places the given object into the proper (leaf) node of the tree. After placing, if the leaf split rule is
 	/// satisfied, subdivides the leaf node into 4 subquadrants and reassigns the objects to new leaves.
 	void Add(const T &object);
 
+	/// Clears this tree and rebuilds it to contain the given objects.
+	/** The bounding rectangle of the tree is set to tightly enclose the given objects, and the node hierarchy is built
+		by partitioning the objects recursively to the child quadrants, which sorts them in Morton order, instead of
+		splitting leaves and growing the root one Add() at a time. The resulting tree has the same nodes, and the same set of objects in each node, as
+		Clear(minXY, maxXY) followed by an Add() of each object would produce, where minXY and maxXY are the
+		bounds of the objects. Only the order of the objects inside each node may differ.
+		@param objects An array of numObjects objects. The objects are copied to the tree. */
+	void BulkLoad(const T *objects, int numObjects);
+
 	/// Removes the given object from this tree.
 	/// To call this function, you must define a function QuadTree<T>::Node *GetQuadTreeNode(const T &object)
 	/// which returns the node of this quadtree where the object resides in.
 	void Remove(const T &object);
 
+	/// Moves the given object to its proper node after the bounds of the object have changed.
+	/** The node that Add() would place the object to is found by a descent from the root, and only if that differs
+		from the node the object is in, the object is moved. Objects that move within the bounds of their node, the
+		common case for small per-frame movement, do not modify the tree at all. The object is found via
+		GetQuadTreeNode(), like in Remove(), and its new bounds via the same functions that Add() uses, so the old
+		and new bounds need not be passed in. */
+	void Update(const T &object);
+
+	/// Updates a batch of moved objects, e.g. all the objects that moved during a frame.
+	/** Calls Update() for each given object, and then collapses each group of four sibling leaves that the moves left
+		empty, turning their parent back into a leaf, repeatedly up the tree. This keeps the tree from accumulating
+		empty subtrees behind moving objects. The nodes of the collapsed groups are reused by later leaf splits.
+		@param objects An array of numObjects objects of this tree, whose bounds may have changed. */
+	void UpdateBatch(const T *objects, int numObjects);
+
 	/// @return The bounding rectangle for the whole tree.
 	/// @note This bounding rectangle does not tightly bound the objects themselves, only the root node of the tree.
 	AABB2D BoundingAABB() const { return boundingAABB; }
 
-	/// Calculates the bounding rectangle of the given node.
+	/// Sets the looseness factor of the nodes of this tree. Call this before adding objects to the tree.
+	/** In a loose quadtree, each node can hold objects that extend outside the cell of the node, up to the node cell
+		enlarged by the looseness factor about its center. An object is placed into the child quadrant that contains the
+		center of the object, if the object fits the enlarged bounds of that child. This way objects that straddle a
+		split line sink down to the level of their size, instead of piling up in the inner nodes near the root, where
+		every query has to test them. The default looseness of 1 gives a regular quadtree. Values around 1.5 - 2 are
+		typical for loose quadtrees.
+		@param looseness The ratio of the side length of the node bounds to the side length of the node cell, >= 1.
+		@see LooseAABB(). */
+	void SetLooseness(float looseness);
+	float Looseness() const { return looseness; }
+
+	/// Returns the bounds that contain the objects of a node of this tree.
+	/** @param cell The cell of the node, as returned by ComputeAABB(). Equal to the returned bounds unless this tree is loose.
+		@see SetLooseness(). */
+	AABB2D LooseAABB(const AABB2D &cell) const { return QuadTreeLooseAABB(cell, looseness); }
+
+	/// Calculates the bounding rectangle of the cell of the given node.
 	AABB2D ComputeAABB(const Node *node) const
 	{
 		if (!node->parent)
@@ -161,6 +374,10 @@ public:
 	Node *Root();
 	const Node *Root() const;
 
+	/// Returns the node at the given index. Use with the child indices of Node to traverse the tree.
+	Node *GetNode(u32 index) { assert(index < nodes.size()); return &nodes[index]; }
+	const Node *GetNode(u32 index) const { assert(index < nodes.size()); return &nodes[index]; }
+
 	/// Returns the total number of nodes (all nodes, i.e. inner nodes + leaves) in the tree.
 	/// Runs in constant time.
 	int NumNodes() const;
@@ -189,16 +406,38 @@ public:
 		@param callback A function or a function object of prototype
 			bool callbackFunction(QuadTree<T> &tree, const AABB2D &queryAABB, QuadTree<T>::Node &node, const AABB2D &nodeAABB);
 		If the callback function returns true, the execution of the query is stopped and this function immediately
-		returns afterwards. If the callback function returns false, the execution of the query continues. */
+		returns afterwards. If the callback function returns false, the execution of the query continues.
+		nodeAABB is the cell of the node. In a loose tree, the objects of the node extend to LooseAABB(nodeAABB). */
 	template<typename Func>
 	inline void AABBQuery(const AABB2D &aabb, Func &callback);
 
+	/// Performs the same query as AABBQuery(aabb, callback), using the traversal stack of the given scratch memory.
+	/** @note The callback must not start another query with the same scratch memory. */
+	template<typename Func>
+	inline void AABBQuery(const AABB2D &aabb, Func &callback, QueryScratch &scratch);
+
 	/// Finds all object pairs inside the given AABB which have colliding AABBs. For each such pair, calls the
 	/// specified callback function.
+	/** In a loose tree, each colliding pair of which at least one object intersects the given AABB is reported once. */
 	template<typename Func>
 	inline void CollidingPairsQuery(const AABB2D &aabb, Func &callback);
 
-#ifdef MATH_CONTAINERLIB_SUPPORT
+	/// Finds the same object pairs as CollidingPairsQuery(), distributing the work over multiple threads.
+	/** Each non-empty node that intersects the given AABB is an independent work item, which pairs the objects of
+		the node with each other and with the objects of its ancestors. Each thread appends its pairs to a buffer of
+		its own, and the buffers are concatenated to outPairs after all threads have finished, so the threads never
+		synchronize on the output. The reported pairs are identical to the pairs CollidingPairsQuery() passes to its
+		callback, but their order varies from call to call.
+		@param outPairs [out] The colliding pairs are appended to this vector.
+		@param numThreads The number of threads to use. If <= 0, NumHardwareThreads() threads are used. The threads
+			are started and joined within the call, so for a per-frame broadphase, pass a ParallelForPool instead.
+		@note The tree must not be modified while this function runs. */
+	void CollidingPairsQueryParallel(const AABB2D &aabb, std::vector<std::pair<T, T> > &outPairs, int numThreads = 0);
+
+	/// Performs the same query as CollidingPairsQueryParallel(aabb, outPairs, numThreads) on the threads of the given
+	/// pool, which are kept alive between calls, so that no threads are started per call.
+	void CollidingPairsQueryParallel(const AABB2D &aabb, std::vector<std::pair<T, T> > &outPairs, ParallelForPool &pool);
+
 	/// Performs a node-granular nearest neighbor search on this QuadTree.
 	/** This query calls the given nodeCallback function for each node of this QuadTree that contains objects, sorted by closest first
 		to the target point. At any given time, the nodeCallback function may terminate the search by returning true in its callback.
@@ -216,9 +455,15 @@ public:
 	template<typename Func>
 	inline void NearestNeighborNodes(const float2 &point, Func &nodeCallback);
 
+	/// Performs the same search as NearestNeighborNodes(point, nodeCallback), using the priority queue of the given
+	/// scratch memory. The callback must not start another query with the same scratch memory.
+	template<typename Func>
+	inline void NearestNeighborNodes(const float2 &point, Func &nodeCallback, QueryScratch &scratch);
+
 	/// Performs an object-granular nearest neighbor search on this QuadTree.
 	/** This query calls the given objectCallback function for each object in this QuadTree, starting from the object closest to the
-		given target point, and proceeding in distance-sorted order.
+		given target point, and proceeding in distance-sorted order. The distance of an object is the distance of the
+		target point to the rectangle returned by GetAABB2D() for the object.
 		@param targetPoint The target point to find the nearest neighbors to.
 		@param objectCallback The function object that should be invoked by the query for each object. This function should be of prototype
 		   bool NearestNeighborObjectCallback(QuadTree<T> &tree, const float2 &targetPoint, QuadTree<T>::Node *node, const AABB2D &aabb,
@@ -234,7 +479,20 @@ public:
 		   nearestNeighborIndex provides a conveniency counter that tells how many nearest neighbors are closer to targetPoint than this object. */
 	template<typename Func>
 	inline void NearestNeighborObjects(const float2 &targetPoint, Func &objectCallback);
-#endif
+
+	/// Performs the same search as NearestNeighborObjects(targetPoint, objectCallback), using the priority queues of
+	/// the given scratch memory. The callback must not start another query with the same scratch memory.
+	template<typename Func>
+	inline void NearestNeighborObjects(const float2 &targetPoint, Func &objectCallback, QueryScratch &scratch);
+
+	/// Finds the k objects closest to the given point.
+	/** Keeps the k closest objects found so far, and skips the nodes that are farther than the farthest of them.
+		The search stops as soon as the k closest objects are known. It uses the given scratch memory, so it does
+		not allocate memory once the scratch memory has grown to its working size.
+		@param outObjects [out] Receives the found objects, closest first. Must have room for k objects.
+		@param outDistancesSq [out] If not null, receives the squared distances of the found objects to the point.
+		@return The number of objects found, which is less than k if the tree has fewer than k objects. */
+	int KNearestObjects(const float2 &point, int k, T *outObjects, float *outDistancesSq, QueryScratch &scratch);
 
 	/// Performs various consistency checks on the given node. Use only for debugging purposes.
 	void DebugSanityCheckNode(Node *n);
@@ -247,12 +505,39 @@ private:
 
 	void SplitLeaf(Node *leaf, const AABB2D &leafAABB);
 
+	/// Returns the child quadrant [0,3] of a node with the given cell that Add() places the given object to, or -1 if
+	/// the object stays in the node itself.
+	int ChildQuadrant(const T &object, const AABB2D &cell) const;
+
+	/// Moves the given object to the node that Add() would place it to.
+	/// @return The node the object was moved from, or 0 if the object was not moved within the existing nodes.
+	Node *Relocate(const T &object);
+
+	/// Collapses the children of the given node, and then of its ancestors in turn, while they are all empty leaves.
+	void CollapseEmptySubtrees(Node *n);
+
+	/// Distributes the objects of items[0, numItems-1] to the subtree of the given node. scratch and quadrants are
+	/// temporary buffers with room for numItems elements.
+	void BulkLoadNode(int nodeIndex, const AABB2D &aabb, const T *objects, QuadTreeBulkLoadItem *items, QuadTreeBulkLoadItem *scratch, u8 *quadrants, int numItems);
+
 	std::vector<Node> nodes;
 
+	/// Owns the memory of the object lists of the nodes.
+	Storage storage;
+
+	/// The first indices of the node groups freed by CollapseEmptySubtrees(), for reuse by AllocateNodeGroup().
+	std::vector<u32> freeNodeGroups;
+
+	/// Scratch space of UpdateBatch().
+	std::vector<Node*> emptiedNodes;
+
 	/// Specifies the index to the root node, or -1 if there is no root (nodes.size() == 0).
 	int rootNodeIndex;
 	AABB2D boundingAABB;
 
+	/// The ratio of the node bounds to the node cell, see SetLooseness().
+	float looseness;
+
 	void GrowRootTopLeft();
 	void GrowRootTopRight();
 	void GrowRootBottomLeft();
@@ -265,7 +550,8 @@ private:
 #endif
 };
 
-inline void AssociateQuadTreeNode(const float3 &, QuadTree<float3>::Node *) {}
+template<typename Node>
+inline void AssociateQuadTreeNode(const float3 &, Node *) {}
 
 MATH_END_NAMESPACE
 
@@ -18,13 +18,122 @@
 #pragma once
 
 #include "../Math/MathFunc.h"
+#include <algorithm>
 
 MATH_BEGIN_NAMESPACE
 
 template<typename T>
-void QuadTree<T>::Clear(const float2 &minXY, const float2 &maxXY)
+int QuadTreePooledStorage<T>::SizeClass(u32 capacity)
+{
+	int sizeClass = 0;
+	while((u32)(minBlockSize << sizeClass) < capacity)
+		++sizeClass;
+	return sizeClass;
+}
+
+template<typename T>
+T *QuadTreePooledStorage<T>::AllocateBlock(int sizeClass)
+{
+	assert(sizeClass >= 0 && sizeClass < numSizeClasses);
+	if (!freeBlocks[sizeClass].empty())
+	{
+		T *block = freeBlocks[sizeClass].back();
+		freeBlocks[sizeClass].pop_back();
+		return block;
+	}
+
+	const int blockSize = minBlockSize << sizeClass;
+	if (blockSize > chunkSize)
+	{
+		// Blocks larger than a chunk get a chunk of their own.
+		T *block = new T[blockSize];
+		chunks.push_back(block);
+		return block;
+	}
+
+	if (chunkUsed + blockSize > chunkSize)
+	{
+		// The rest of the current chunk is too small for this block. Hand it out as smaller blocks instead of
+		// wasting it. Since the block sizes are powers of two, the remainder splits without waste.
+		for(int c = sizeClass-1; c >= 0; --c)
+			if (chunkUsed + (minBlockSize << c) <= chunkSize)
+			{
+				freeBlocks[c].push_back(currentChunk + chunkUsed);
+				chunkUsed += minBlockSize << c;
+			}
+		currentChunk = new T[chunkSize];
+		chunks.push_back(currentChunk);
+		chunkUsed = 0;
+	}
+	T *block = currentChunk + chunkUsed;
+	chunkUsed += blockSize;
+	return block;
+}
+
+template<typename T>
+void QuadTreePooledStorage<T>::PushBack(ObjectList &list, const T &object)
+{
+	if (list.count == list.capacity)
+		MoveToBlock(list, (list.capacity == 0) ? 0 : SizeClass(list.capacity) + 1);
+	list.data[list.count++] = object;
+}
+
+template<typename T>
+void QuadTreePooledStorage<T>::Reserve(ObjectList &list, u32 capacity)
+{
+	if (capacity > list.capacity)
+		MoveToBlock(list, SizeClass(capacity));
+}
+
+template<typename T>
+void QuadTreePooledStorage<T>::MoveToBlock(ObjectList &list, int sizeClass)
+{
+	T *data = AllocateBlock(sizeClass);
+	for(u32 i = 0; i < list.count; ++i)
+		data[i] = list.data[i];
+	const u32 count = list.count;
+	Release(list);
+	list.data = data;
+	list.count = count;
+	list.capacity = minBlockSize << sizeClass;
+}
+
+template<typename T>
+void QuadTreePooledStorage<T>::Release(ObjectList &list)
+{
+	if (list.data)
+		freeBlocks[SizeClass(list.capacity)].push_back(list.data);
+	list.data = 0;
+	list.count = 0;
+	list.capacity = 0;
+}
+
+template<typename T>
+void QuadTreePooledStorage<T>::Clear()
+{
+	for(size_t i = 0; i < chunks.size(); ++i)
+		delete[] chunks[i];
+	chunks.clear();
+	for(int i = 0; i < numSizeClasses; ++i)
+		freeBlocks[i].clear();
+	currentChunk = 0;
+	chunkUsed = chunkSize;
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::SetLooseness(float looseness_)
+{
+	assert(looseness_ >= 1.f);
+	assume(NumObjects() == 0 && "QuadTree::SetLooseness() must be called before adding objects to the tree!");
+	looseness = Max(1.f, looseness_);
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::Clear(const float2 &minXY, const float2 &maxXY)
 {
 	nodes.clear();
+	freeNodeGroups.clear();
+	storage.Clear();
 
 	boundingAABB.minPoint = minXY;
 	boundingAABB.maxPoint = maxXY;
@@ -39,8 +148,8 @@ void QuadTree<T>::Clear(const float2 &minXY, const float2 &maxXY)
 #endif
 }
 
-template<typename T>
-void QuadTree<T>::Add(const T &object)
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::Add(const T &object)
 {
 	PROFILE(QuadTree_Add);
 	Node *n = Root();
@@ -57,18 +166,21 @@ void QuadTree<T>::Add(const T &object)
 	++totalNumObjectsInTree;
 #endif
 
-	if (objectAABB.minPoint.x >= boundingAABB.minPoint.x)
+	// The root of a loose tree can hold objects that extend outside its cell.
+	const AABB2D rootBounds = LooseAABB(boundingAABB);
+
+	if (objectAABB.minPoint.x >= rootBounds.minPoint.x)
 	{
 		// Object fits left.
 
-		if (objectAABB.maxPoint.x <= boundingAABB.maxPoint.x)
+		if (objectAABB.maxPoint.x <= rootBounds.maxPoint.x)
 		{
 			// Object fits left and right.
 
-			if (objectAABB.minPoint.y >= boundingAABB.minPoint.y)
+			if (objectAABB.minPoint.y >= rootBounds.minPoint.y)
 			{
 				// Object fits left, right and top.
-				if (objectAABB.maxPoint.y <= boundingAABB.maxPoint.y)
+				if (objectAABB.maxPoint.y <= rootBounds.maxPoint.y)
 				{
 					// Object fits the whole root AABB. Can safely add into the existing tree size.
 					Add(object, n, boundingAABB);
@@ -89,7 +201,7 @@ void QuadTree<T>::Add(const T &object)
 		else
 		{
 			// Object fits left, but not to right. We must grow right. Check whether to grow top or bottom.
-			if (objectAABB.minPoint.y < boundingAABB.minPoint.y)
+			if (objectAABB.minPoint.y < rootBounds.minPoint.y)
 				GrowRootTopRight();
 			else
 				GrowRootBottomRight();
@@ -98,7 +210,7 @@ void QuadTree<T>::Add(const T &object)
 	else
 	{
 		// We must grow left. Check whether to grow top or bottom.
-		if (objectAABB.minPoint.y < boundingAABB.minPoint.y)
+		if (objectAABB.minPoint.y < rootBounds.minPoint.y)
 			GrowRootTopLeft();
 		else
 			GrowRootBottomLeft();
@@ -108,8 +220,147 @@ void QuadTree<T>::Add(const T &object)
 	Add(object);
 }
 
-template<typename T>
-void QuadTree<T>::Remove(const T &object)
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::BulkLoad(const T *objects, int numObjects)
+{
+	PROFILE(QuadTree_BulkLoad);
+	assert(numObjects >= 0);
+	assert(objects || numObjects == 0);
+	if (numObjects <= 0)
+	{
+		Clear();
+		return;
+	}
+
+	// Gather the bounds of the objects into a compact array, so that building the tree does not need to access the
+	// objects themselves. The bounds are read with the same functions that Add() uses.
+	std::vector<QuadTreeBulkLoadItem> items(numObjects);
+	AABB2D bounds;
+	bounds.SetNegativeInfinity();
+	for(int i = 0; i < numObjects; ++i)
+	{
+		QuadTreeBulkLoadItem &item = items[i];
+		item.minX = MinX(objects[i]);
+		item.minY = MinY(objects[i]);
+		item.maxX = MaxX(objects[i]);
+		item.maxY = MaxY(objects[i]);
+		item.index = (u32)i;
+		assert(item.minX <= item.maxX);
+		assert(item.minY <= item.maxY);
+		bounds.Enclose(float2(item.minX, item.minY));
+		bounds.Enclose(float2(item.maxX, item.maxY));
+	}
+	assert(bounds.IsFinite());
+	// The root node must have a nonzero area, e.g. if all the objects lie on a single line.
+	if (bounds.maxPoint.x <= bounds.minPoint.x)
+		bounds.maxPoint.x = bounds.minPoint.x + 1.f;
+	if (bounds.maxPoint.y <= bounds.minPoint.y)
+		bounds.maxPoint.y = bounds.minPoint.y + 1.f;
+	Clear(bounds.minPoint, bounds.maxPoint);
+
+	// The partitioning of the objects to the child quadrants in BulkLoadNode() is a most significant digit first
+	// radix sort of the objects by the Morton codes of their nodes, so it leaves the objects of each node, and of each
+	// subtree, in Morton order with no separate sorting pass.
+	std::vector<QuadTreeBulkLoadItem> scratch(numObjects);
+	std::vector<u8> quadrants(numObjects);
+	BulkLoadNode(rootNodeIndex, boundingAABB, objects, &items[0], &scratch[0], &quadrants[0], numObjects);
+
+	// Nodes are persistently referred to by pointers, so leave the same headroom for later Add() calls as a new
+	// tree has, and only then link up the parent pointers and the object->node associations.
+	if (nodes.capacity() - nodes.size() < 200000)
+		nodes.reserve(nodes.size() + 200000);
+	for(size_t i = 0; i < nodes.size(); ++i)
+	{
+		Node *n = &nodes[i];
+		if (!n->IsLeaf())
+		{
+			nodes[n->TopLeftChildIndex()].parent = n;
+			nodes[n->TopRightChildIndex()].parent = n;
+			nodes[n->BottomLeftChildIndex()].parent = n;
+			nodes[n->BottomRightChildIndex()].parent = n;
+		}
+		for(size_t j = 0; j < n->objects.size(); ++j)
+			AssociateQuadTreeNode(n->objects[j], n);
+	}
+
+#ifdef QUADTREE_VERBOSE_LOGGING
+	totalNumObjectsInTree = numObjects;
+#endif
+}
+
+/// Returns the child quadrant [0,3] that an object with the given bounds is placed to when added to a node with the
+/// given split lines, or -1 if the object straddles a split line and stays in the node itself.
+inline int QuadTreeChildQuadrant(const QuadTreeBulkLoadItem &item, float halfX, float halfY)
+{
+	// These are the same rules that QuadTree::Add() and QuadTree::SplitLeaf() use to place objects.
+	bool left = item.minX < halfX;
+	bool right = item.maxX > halfX;
+	bool top = item.minY < halfY;
+	bool bottom = item.maxY > halfY;
+	if ((left && right) || (top && bottom))
+		return -1;
+	return (left ? 0 : 1) + (top ? 0 : 2);
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::BulkLoadNode(int nodeIndex, const AABB2D &aabb, const T *objects, QuadTreeBulkLoadItem *items, QuadTreeBulkLoadItem *scratch, u8 *quadrants, int numItems)
+{
+	// Incremental insertion splits a leaf when the object count grows past minQuadTreeNodeObjectCount, so a node
+	// is split exactly when more than that many objects are routed to it.
+	if (numItems <= minQuadTreeNodeObjectCount || aabb.Width() < minQuadTreeQuadrantSize || aabb.Height() < minQuadTreeQuadrantSize)
+	{
+		storage.Reserve(nodes[nodeIndex].objects, (u32)numItems);
+		for(int i = 0; i < numItems; ++i)
+			storage.PushBack(nodes[nodeIndex].objects, objects[items[i].index]);
+		return;
+	}
+
+	float halfX = (aabb.minPoint.x + aabb.maxPoint.x) * 0.5f;
+	float halfY = (aabb.minPoint.y + aabb.maxPoint.y) * 0.5f;
+
+	// Stable partition of the items to scratch: the objects that stay in this node, followed by the objects of each
+	// child quadrant in Morton order.
+	int offsets[6] = {};
+	for(int i = 0; i < numItems; ++i)
+	{
+		const QuadTreeBulkLoadItem &item = items[i];
+		int quadrant = (looseness > 1.f) ? QuadTreeLooseChildQuadrant(item.minX, item.minY, item.maxX, item.maxY, aabb, looseness)
+		                                 : QuadTreeChildQuadrant(item, halfX, halfY);
+		quadrants[i] = (u8)(quadrant + 1);
+		++offsets[quadrants[i] + 1];
+	}
+	for(int i = 1; i < 6; ++i)
+		offsets[i] += offsets[i-1];
+	for(int i = 0; i < numItems; ++i)
+		scratch[offsets[quadrants[i]]++] = items[i];
+	// Now the objects that stay in this node are at scratch[0, offsets[0]), and the objects of child quadrant q
+	// are at scratch[offsets[q], offsets[q+1]).
+
+	storage.Reserve(nodes[nodeIndex].objects, (u32)offsets[0]);
+	for(int i = 0; i < offsets[0]; ++i)
+		storage.PushBack(nodes[nodeIndex].objects, objects[scratch[i].index]);
+
+	// The parent pointers are linked up after the whole tree is built, since the nodes vector may reallocate here.
+	u32 childIndex = (u32)nodes.size();
+	Node child;
+	child.parent = 0;
+	child.childIndex = 0xFFFFFFFF;
+	nodes.push_back(child);
+	nodes.push_back(child);
+	nodes.push_back(child);
+	nodes.push_back(child);
+	nodes[nodeIndex].childIndex = childIndex;
+
+	for(int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		int begin = offsets[quadrant];
+		// The partitioned scratch becomes the input of the children, and items their scratch.
+		BulkLoadNode(childIndex + quadrant, QuadTreeChildCell(aabb, quadrant), objects, scratch + begin, items + begin, quadrants + begin, offsets[quadrant+1] - begin);
+	}
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::Remove(const T &object)
 {
 	Node *n = GetQuadTreeNode(object);
 	if (n)
@@ -122,86 +373,174 @@ void QuadTree<T>::Remove(const T &object)
 	}
 }
 
-template<typename T>
-void QuadTree<T>::Add(const T &object, Node *n, AABB2D aabb)
+template<typename T, typename Storage>
+typename QuadTree<T, Storage>::Node *QuadTree<T, Storage>::Relocate(const T &object)
+{
+	Node *oldNode = GetQuadTreeNode(object);
+	assume(oldNode && "QuadTree::Update() called for an object that is not in the tree!");
+	if (!oldNode)
+		return 0;
+
+	if (!LooseAABB(boundingAABB).Contains(GetAABB2D(object)))
+	{
+		// The object moved outside the tree, so the root needs to grow. Growing moves nodes around, so do not report
+		// the old node for collapsing.
+		Remove(object);
+		Add(object);
+		return 0;
+	}
+
+	// Find the node Add() would place the object to.
+	Node *n = Root();
+	AABB2D cell = boundingAABB;
+	while(!n->IsLeaf())
+	{
+		int quadrant = ChildQuadrant(object, cell);
+		if (quadrant < 0)
+			break;
+		cell = QuadTreeChildCell(cell, quadrant);
+		n = &nodes[n->childIndex + quadrant];
+	}
+	if (n == oldNode)
+		return 0;
+
+	oldNode->Remove(object);
+	Add(object, n, cell);
+	return oldNode;
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::Update(const T &object)
+{
+	PROFILE(QuadTree_Update);
+	Relocate(object);
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::UpdateBatch(const T *objects, int numObjects)
+{
+	PROFILE(QuadTree_UpdateBatch);
+	assert(objects || numObjects == 0);
+	emptiedNodes.clear();
+	for(int i = 0; i < numObjects; ++i)
+	{
+		Node *oldNode = Relocate(objects[i]);
+		if (oldNode && oldNode->objects.empty())
+			emptiedNodes.push_back(oldNode);
+	}
+
+	// All the moves are done before collapsing, so that the nodes that objects only pass through in the middle of the
+	// batch are not collapsed and split again. No nodes are allocated below, so the emptied node pointers stay valid,
+	// and a node that was freed as a part of a collapsed group has no parent.
+	for(size_t i = 0; i < emptiedNodes.size(); ++i)
+	{
+		Node *n = emptiedNodes[i];
+		CollapseEmptySubtrees(n->IsLeaf() ? n->parent : n);
+	}
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::CollapseEmptySubtrees(Node *n)
+{
+	while(n && !n->IsLeaf())
+	{
+		Node *children = &nodes[n->childIndex];
+		for(int i = 0; i < 4; ++i)
+			if (!children[i].IsLeaf() || !children[i].objects.empty())
+				return;
+
+		for(int i = 0; i < 4; ++i)
+		{
+			storage.Release(children[i].objects);
+			children[i].parent = 0;
+		}
+		freeNodeGroups.push_back(n->childIndex);
+		n->childIndex = 0xFFFFFFFF;
+
+		// The parent can only collapse if this node, now a leaf, is empty too.
+		if (!n->objects.empty())
+			return;
+		n = n->parent;
+	}
+}
+
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::ChildQuadrant(const T &object, const AABB2D &cell) const
+{
+	if (looseness > 1.f)
+		return QuadTreeLooseChildQuadrant(MinX(object), MinY(object), MaxX(object), MaxY(object), cell, looseness);
+
+	float halfX = (cell.minPoint.x + cell.maxPoint.x) * 0.5f;
+	float halfY = (cell.minPoint.y + cell.maxPoint.y) * 0.5f;
+	assert(MinX(object) <= MaxX(object));
+	bool left = MinX(object) < halfX;
+	bool right = MaxX(object) > halfX;
+	assert(MinY(object) <= MaxY(object));
+	bool top = MinY(object) < halfY;
+	bool bottom = MaxY(object) > halfY;
+
+	// We must leave this object in this node if the object straddled the parent->child split lines.
+	if ((left && right) || (top && bottom))
+		return -1;
+
+	// Note: It can happen that !left && !right, or !top && !bottom, in which case right/bottom is taken.
+	return (left ? 0 : 1) + (top ? 0 : 2);
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::Add(const T &object, Node *n, AABB2D aabb)
 {
 	for(;;)
 	{
-		float halfX = (aabb.minPoint.x + aabb.maxPoint.x) * 0.5f;
-		float halfY = (aabb.minPoint.y + aabb.maxPoint.y) * 0.5f;
 		// Traverse the QuadTree to decide which quad to place this object into.
-		assert(MinX(object) <= MaxX(object));
-		bool left = MinX(object) < halfX;
-		bool right = MaxX(object) > halfX;
-		assert(MinY(object) <= MaxY(object));
-		bool top = MinY(object) < halfY;
-		bool bottom = MaxY(object) > halfY;
-
-		// Note: It can happen that !left && !right, or !top && !bottom,
-		// but the if()s below are set up so that right/bottom is taken if no left/top, so that is ok.
+		int quadrant = ChildQuadrant(object, aabb);
 
 		// We must put the object onto this node if
 		// a) the object straddled the parent->child split lines.
 		// b) this object is a leaf.
-		if (n->IsLeaf() || (left && right) || (top && bottom))
+		if (n->IsLeaf() || quadrant < 0)
 		{
 //			n->bucket.push_back(objectId);
-			n->objects.push_back(object);
+			storage.PushBack(n->objects, object);
 			AssociateQuadTreeNode(object, n);
 			if (n->IsLeaf() && (int)n->objects.size() > minQuadTreeNodeObjectCount && aabb.Width() >= minQuadTreeQuadrantSize && aabb.Height() >= minQuadTreeQuadrantSize)
 				SplitLeaf(n, aabb);
 			return;
 		}
-		if (left)
-		{
-			aabb.maxPoint.x = halfX;
-			if (top)
-			{
-				aabb.maxPoint.y = halfY;
-				assert(nodes[n->TopLeftChildIndex()].parent == n);
-				n = &nodes[n->TopLeftChildIndex()];
-			}
-			else
-			{
-				aabb.minPoint.y = halfY;
-				assert(nodes[n->BottomLeftChildIndex()].parent == n);
-				n = &nodes[n->BottomLeftChildIndex()];
-			}
-		}
-		else
-		{
-			aabb.minPoint.x = halfX;
-			if (top)
-			{
-				aabb.maxPoint.y = halfY;
-				assert(nodes[n->TopRightChildIndex()].parent == n);
-				n = &nodes[n->TopRightChildIndex()];
-			}
-			else
-			{
-				aabb.minPoint.y = halfY;
-				assert(nodes[n->BottomRightChildIndex()].parent == n);
-				n = &nodes[n->BottomRightChildIndex()];
-			}
-		}
+		aabb = QuadTreeChildCell(aabb, quadrant);
+		assert(nodes[n->childIndex + quadrant].parent == n);
+		n = &nodes[n->childIndex + quadrant];
 	}
 }
 
-template<typename T>
-typename QuadTree<T>::Node *QuadTree<T>::Root()
+template<typename T, typename Storage>
+typename QuadTree<T, Storage>::Node *QuadTree<T, Storage>::Root()
 {
 	return nodes.empty() ? 0 : &nodes[rootNodeIndex];
 }
 
-template<typename T>
-const typename QuadTree<T>::Node *QuadTree<T>::Root() const
+template<typename T, typename Storage>
+const typename QuadTree<T, Storage>::Node *QuadTree<T, Storage>::Root() const
 {
 	return nodes.empty() ? 0 : &nodes[rootNodeIndex];
 }
 
-template<typename T>
-int QuadTree<T>::AllocateNodeGroup(Node *parent)
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::AllocateNodeGroup(Node *parent)
 {
+	if (!freeNodeGroups.empty())
+	{
+		int index = (int)freeNodeGroups.back();
+		freeNodeGroups.pop_back();
+		for(int i = index; i < index + 4; ++i)
+		{
+			assert(nodes[i].objects.empty());
+			nodes[i].parent = parent;
+			nodes[i].childIndex = 0xFFFFFFFF;
+		}
+		return index;
+	}
+
 #ifdef _DEBUG
 	size_t oldCap = nodes.capacity();
 #endif
@@ -219,92 +558,55 @@ int QuadTree<T>::AllocateNodeGroup(Node *parent)
 	return index;
 }
 
-template<typename T>
-void QuadTree<T>::SplitLeaf(Node *leaf, const AABB2D &leafAABB)
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::SplitLeaf(Node *leaf, const AABB2D &leafAABB)
 {
 	assert(leaf->IsLeaf());
 	assert(leaf->childIndex == 0xFFFFFFFF);
 
 	leaf->childIndex = AllocateNodeGroup(leaf);
 
-	float halfX = (leafAABB.minPoint.x + leafAABB.maxPoint.x) * 0.5f;
-	float halfY = (leafAABB.minPoint.y + leafAABB.maxPoint.y) * 0.5f;
-
 	size_t i = 0;
 	while(i < leaf->objects.size())
 	{
 		const T &object = leaf->objects[i];
 
-		// Traverse the QuadTree to decide which quad to place this object into.
-		assert(MinX(object) <= MaxX(object));
-		bool left = MinX(object) < halfX;
-		bool right = MaxX(object) > halfX;
-		assert(MinY(object) <= MaxY(object));
-		bool top = MinY(object) < halfY;
-		bool bottom = MaxY(object) > halfY;
-
-		// Note: It can happen that !left && !right, or !top && !bottom,
-		// but the if()s below are set up so that right/bottom is taken if no left/top, so that is ok.
-
-		// We must leave this object in this node if the object straddled the parent->child split lines.
-		if ((left && right) || (top && bottom))
+		int quadrant = ChildQuadrant(object, leafAABB);
+		if (quadrant < 0)
 		{
 			++i;
 			continue;
 		}
-
-		AABB2D child;
-		if (left)
-		{
-			child.minPoint.x = leafAABB.minPoint.x;
-			child.maxPoint.x = halfX;
-			if (top)
-			{
-				child.minPoint.y = leafAABB.minPoint.y;
-				child.maxPoint.y = halfY;
-				Add(object, &nodes[leaf->TopLeftChildIndex()], child);
-			}
-			else
-			{
-				child.minPoint.y = halfY;
-				child.maxPoint.y = leafAABB.maxPoint.y;
-				Add(object, &nodes[leaf->BottomLeftChildIndex()], child);
-			}
-		}
-		else
-		{
-			child.minPoint.x = halfX;
-			child.maxPoint.x = leafAABB.maxPoint.x;
-			if (top)
-			{
-				child.minPoint.y = leafAABB.minPoint.y;
-				child.maxPoint.y = halfY;
-				Add(object, &nodes[leaf->TopRightChildIndex()], child);
-			}
-			else
-			{
-				child.minPoint.y = halfY;
-				child.maxPoint.y = leafAABB.maxPoint.y;
-				Add(object, &nodes[leaf->BottomRightChildIndex()], child);
-			}
-		}
+		Add(object, &nodes[leaf->childIndex + quadrant], QuadTreeChildCell(leafAABB, quadrant));
 
 		// Remove the object we added to a child from this node.
 		std::swap(leaf->objects[i], leaf->objects.back());
 		leaf->objects.pop_back();
 	}
+
+	if (leaf->objects.empty())
+		storage.Release(leaf->objects);
 }
 
-template<typename T>
+template<typename T, typename Storage>
 template<typename Func>
-inline void QuadTree<T>::AABBQuery(const AABB2D &aabb, Func &callback)
+inline void QuadTree<T, Storage>::AABBQuery(const AABB2D &aabb, Func &callback)
+{
+	QueryScratch scratch;
+	AABBQuery(aabb, callback, scratch);
+}
+
+template<typename T, typename Storage>
+template<typename Func>
+inline void QuadTree<T, Storage>::AABBQuery(const AABB2D &aabb, Func &callback, QueryScratch &scratch)
 {
 	PROFILE(QuadTree_AABBQuery);
-	std::vector<TraversalStackItem> stack;
+	std::vector<TraversalStackItem> &stack = scratch.stack;
+	stack.clear();
 	TraversalStackItem n;
 	n.aabb = BoundingAABB();
 	n.node = Root();
-	if (!n.node || !n.aabb.Intersects(aabb))
+	if (!n.node || !LooseAABB(n.aabb).Intersects(aabb))
 		return;
 	stack.push_back(n);
 
@@ -324,7 +626,21 @@ inline void QuadTree<T>::AABBQuery(const AABB2D &aabb, Func &callback)
 			if (callback(*this, aabb, *i.node, i.aabb))
 				return;
 		}
-		if (!i.node->IsLeaf())
+		if (!i.node->IsLeaf() && looseness > 1.f)
+		{
+			// The loose bounds of the children overlap each other, so test each of them.
+			for(int quadrant = 3; quadrant >= 0; --quadrant)
+			{
+				TraversalStackItem child;
+				child.aabb = QuadTreeChildCell(i.aabb, quadrant);
+				if (LooseAABB(child.aabb).Intersects(aabb))
+				{
+					child.node = &nodes[i.node->childIndex + quadrant];
+					stack.push_back(child);
+				}
+			}
+		}
+		else if (!i.node->IsLeaf())
 		{
 			if (aabb.minPoint.x <= halfX && aabb.minPoint.y <= halfY)
 			{
@@ -370,14 +686,61 @@ inline void QuadTree<T>::AABBQuery(const AABB2D &aabb, Func &callback)
 	}
 }
 
-template<typename T, typename Func>
+/// Finds the objects of a loose QuadTree that collide with one given object, see FindCollidingPairs.
+template<typename T, typename Storage, typename Func>
+struct FindLooseCollidingPairsOfObject
+{
+	Func *collisionCallback;
+	AABB2D queryAABB;
+	typename QuadTree<T, Storage>::Node *objectNode;
+	size_t objectIndex;
+	AABB2D objectAABB;
+
+	bool operator ()(QuadTree<T, Storage> & /*tree*/, const AABB2D & /*queryAABB*/, typename QuadTree<T, Storage>::Node &node, const AABB2D & /*nodeAABB*/)
+	{
+		for(size_t j = 0; j < node.objects.size(); ++j)
+		{
+			AABB2D aabbJ = GetAABB2D(node.objects[j]);
+			if (!objectAABB.Intersects(aabbJ))
+				continue;
+			// A pair of two objects that both intersect the query is reported by the object that comes first in
+			// (node, index) order. This also skips the object itself.
+			bool otherComesFirst = (&node < objectNode) || (&node == objectNode && j <= objectIndex);
+			if (otherComesFirst && queryAABB.Intersects(aabbJ))
+				continue;
+			(*collisionCallback)(objectNode->objects[objectIndex], node.objects[j]);
+		}
+		return false;
+	}
+};
+
+template<typename T, typename Storage, typename Func>
 class FindCollidingPairs
 {
 public:
 	Func *collisionCallback;
+	/// The traversal stack of the per-object queries of a loose tree, shared by all of them.
+	typename QuadTree<T, Storage>::QueryScratch *scratch;
 
-	bool operator ()(QuadTree<T> & /*tree*/, const AABB2D &queryAABB, typename QuadTree<T>::Node &node, const AABB2D & /*nodeAABB*/)
+	bool operator ()(QuadTree<T, Storage> &tree, const AABB2D &queryAABB, typename QuadTree<T, Storage>::Node &node, const AABB2D & /*nodeAABB*/)
 	{
+		if (tree.Looseness() > 1.f)
+		{
+			// The objects of a loose tree can collide with objects in the sibling subtrees of their node, and not only
+			// with the objects of the ancestors, so do a full query for each object.
+			FindLooseCollidingPairsOfObject<T, Storage, Func> func;
+			func.collisionCallback = collisionCallback;
+			func.queryAABB = queryAABB;
+			func.objectNode = &node;
+			for(func.objectIndex = 0; func.objectIndex < node.objects.size(); ++func.objectIndex)
+			{
+				func.objectAABB = GetAABB2D(node.objects[func.objectIndex]);
+				if (queryAABB.Intersects(func.objectAABB))
+					tree.AABBQuery(func.objectAABB, func, *scratch);
+			}
+			return false;
+		}
+
 		for(size_t i = 0; i < node.objects.size(); ++i)
 		{
 			AABB2D aabbI = GetAABB2D(node.objects[i]);
@@ -391,7 +754,7 @@ public:
 					(*collisionCallback)(node.objects[i], node.objects[j]);
 			}
 
-			typename QuadTree<T>::Node *n = node.parent;
+			typename QuadTree<T, Storage>::Node *n = node.parent;
 			while(n)
 			{
 				for(size_t j = 0; j < n->objects.size(); ++j)
@@ -408,47 +771,133 @@ public:
 	}
 };
 
-template<typename T>
+template<typename T, typename Storage>
 template<typename Func>
-inline void QuadTree<T>::CollidingPairsQuery(const AABB2D &aabb, Func &callback)
+inline void QuadTree<T, Storage>::CollidingPairsQuery(const AABB2D &aabb, Func &callback)
 {
 	PROFILE(QuadTree_CollidingPairsQuery);
-	FindCollidingPairs<T, Func> func;
+	QueryScratch scratch;
+	FindCollidingPairs<T, Storage, Func> func;
 	func.collisionCallback = &callback;
+	func.scratch = &scratch;
 	AABBQuery(aabb, func);
 }
 
-template<typename T>
-struct TraversalNode
-{
-	/// The squared distance of this node to the query point.
-	float d;
-	/// Stores the 2D bounding rectangle of this node.
-	AABB2D aabb;
-	typename QuadTree<T>::Node *node;
-
-	/// We compare in reverse order, since we want the node with the smallest distance to be visited first,
-	/// and MaxHeap stores the node that compares largest in the root.
-	bool operator <(const TraversalNode &t) const { return d > t.d; }
-	bool operator ==(const TraversalNode &t) const { return d == t.d; }
+/// Collects the nodes visited by QuadTree::AABBQuery().
+template<typename T, typename Storage>
+struct CollectQuadTreeNodes
+{
+	std::vector<typename QuadTree<T, Storage>::Node *> nodes;
+
+	bool operator ()(QuadTree<T, Storage> & /*tree*/, const AABB2D & /*queryAABB*/, typename QuadTree<T, Storage>::Node &node, const AABB2D & /*nodeAABB*/)
+	{
+		nodes.push_back(&node);
+		return false;
+	}
 };
 
-#ifdef MATH_CONTAINERLIB_SUPPORT
+/// Appends the pairs reported by FindCollidingPairs to a vector.
 template<typename T>
+struct AppendCollidingPair
+{
+	std::vector<std::pair<T, T> > *pairs;
+
+	void operator ()(const T &a, const T &b) { pairs->push_back(std::make_pair(a, b)); }
+};
+
+/// The work item function of QuadTree::CollidingPairsQueryParallel(): finds the colliding pairs of one node.
+template<typename T, typename Storage>
+struct FindCollidingPairsParallel
+{
+	QuadTree<T, Storage> *tree;
+	AABB2D queryAABB;
+	typename QuadTree<T, Storage>::Node * const *nodes;
+	/// The output buffers of each thread.
+	std::vector<std::vector<std::pair<T, T> > > *threadPairs;
+	/// The query scratch memory of each thread.
+	std::vector<typename QuadTree<T, Storage>::QueryScratch> *threadScratch;
+
+	void operator ()(int nodeIndex, int threadIndex)
+	{
+		AppendCollidingPair<T> append;
+		append.pairs = &(*threadPairs)[threadIndex];
+		FindCollidingPairs<T, Storage, AppendCollidingPair<T> > func;
+		func.collisionCallback = &append;
+		func.scratch = &(*threadScratch)[threadIndex];
+		// FindCollidingPairs does not use the node AABB.
+		func(*tree, queryAABB, *nodes[nodeIndex], queryAABB);
+	}
+};
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::CollidingPairsQueryParallel(const AABB2D &aabb, std::vector<std::pair<T, T> > &outPairs, int numThreads)
+{
+	ParallelForPool pool(numThreads);
+	CollidingPairsQueryParallel(aabb, outPairs, pool);
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::CollidingPairsQueryParallel(const AABB2D &aabb, std::vector<std::pair<T, T> > &outPairs, ParallelForPool &pool)
+{
+	PROFILE(QuadTree_CollidingPairsQueryParallel);
+	CollectQuadTreeNodes<T, Storage> collect;
+	AABBQuery(aabb, collect);
+	if (collect.nodes.empty())
+		return;
+
+	const int numThreads = pool.NumThreads();
+	std::vector<std::vector<std::pair<T, T> > > threadPairs(numThreads);
+	std::vector<QueryScratch> threadScratch(numThreads);
+	// The calling thread is thread 0, so it can write directly to the output.
+	threadPairs[0].swap(outPairs);
+
+	FindCollidingPairsParallel<T, Storage> func;
+	func.tree = this;
+	func.queryAABB = aabb;
+	func.nodes = &collect.nodes[0];
+	func.threadPairs = &threadPairs;
+	func.threadScratch = &threadScratch;
+	ParallelFor((int)collect.nodes.size(), pool, func);
+
+	threadPairs[0].swap(outPairs);
+	size_t numPairs = outPairs.size();
+	for(int i = 1; i < numThreads; ++i)
+		numPairs += threadPairs[i].size();
+	outPairs.reserve(numPairs);
+	for(int i = 1; i < numThreads; ++i)
+		outPairs.insert(outPairs.end(), threadPairs[i].begin(), threadPairs[i].end());
+}
+
+template<typename T, typename Storage>
+template<typename Func>
+inline void QuadTree<T, Storage>::NearestNeighborNodes(const float2 &point, Func &leafCallback)
+{
+	QueryScratch scratch;
+	NearestNeighborNodes(point, leafCallback, scratch);
+}
+
+template<typename T, typename Storage>
 template<typename Func>
-inline void QuadTree<T>::NearestNeighborNodes(const float2 &point, Func &leafCallback)
+inline void QuadTree<T, Storage>::NearestNeighborNodes(const float2 &point, Func &leafCallback, QueryScratch &scratch)
 {
-	MaxHeap<TraversalNode<T> > queue;
-	TraversalNode<T> t;
+	PROFILE(QuadTree_NearestNeighborNodes);
+	std::vector<NearestNode> &queue = scratch.nodeQueue;
+	queue.clear();
+	NearestNode t;
 	t.d = 0.f;
 	t.aabb = BoundingAABB();
 	t.node = Root();
-	queue.Insert(t);
+	if (!t.node)
+		return;
+	queue.push_back(t);
+
+	// The distances to the nodes are measured to the bounds that contain their objects, see LooseAABB().
 
-	while(queue.Size() > 0)
+	while(!queue.empty())
 	{
-		t = queue.Front();
-		queue.PopFront();
+		std::pop_heap(queue.begin(), queue.end());
+		t = queue.back();
+		queue.pop_back();
 
 		if (t.node->objects.size() > 0)
 		{
@@ -456,52 +905,27 @@ inline void QuadTree<T>::NearestNeighborNodes(const float2 &point, Func &leafCal
 			if (stopIteration)
 				return;
 		}
-		
+
 		if (!t.node->IsLeaf())
-		{
-			TraversalNode<T> n;
-
-			float halfX = (t.aabb.minPoint.x + t.aabb.maxPoint.x) * 0.5f;
-			float halfY = (t.aabb.minPoint.y + t.aabb.maxPoint.y) * 0.5f;
-
-			// Insert bottom-left child node to the traversal queue.
-			n.aabb.minPoint.x = t.aabb.minPoint.x;
-			n.aabb.maxPoint.x = halfX;
-			n.aabb.minPoint.y = halfY;
-			n.aabb.maxPoint.y = t.aabb.maxPoint.y;
-			n.node = &nodes[t.node->BottomLeftChildIndex()];
-			n.d = n.aabb.DistanceSq(point);
-			queue.Insert(n);
-
-			// Insert bottom-right child node to the traversal queue.
-			n.aabb.minPoint.x = halfX;
-			n.aabb.maxPoint.x = t.aabb.maxPoint.x;
-			n.node = &nodes[t.node->BottomRightChildIndex()];
-			n.d = n.aabb.DistanceSq(point);
-			queue.Insert(n);
-
-			// Insert top-right child node to the traversal queue.
-			n.aabb.minPoint.y = t.aabb.minPoint.y;
-			n.aabb.maxPoint.y = halfY;
-			n.node = &nodes[t.node->TopRightChildIndex()];
-			n.d = n.aabb.DistanceSq(point);
-			queue.Insert(n);
-
-			// Insert top-left child node to the traversal queue.
-			n.aabb.minPoint.x = t.aabb.minPoint.x;
-			n.aabb.maxPoint.x = halfX;
-			n.node = &nodes[t.node->TopLeftChildIndex()];
-			n.d = n.aabb.DistanceSq(point);
-			queue.Insert(n);
-		}
+			for(int quadrant = 0; quadrant < 4; ++quadrant)
+			{
+				NearestNode n;
+				n.aabb = QuadTreeChildCell(t.aabb, quadrant);
+				n.node = &nodes[t.node->childIndex + quadrant];
+				n.d = LooseAABB(n.aabb).DistanceSq(point);
+				queue.push_back(n);
+				std::push_heap(queue.begin(), queue.end());
+			}
 	}
 }
 
-template<typename ObjectCallbackFunc, typename T>
+template<typename ObjectCallbackFunc, typename T, typename Storage = QuadTreeVectorStorage<T> >
 struct NearestNeighborObjectSearch
 {
+	typedef typename QuadTree<T, Storage>::NearestObject NearestObject;
+
 	NearestNeighborObjectSearch()
-	:objectCallback(0), numObjectsOutputted(0)
+	:objectCallback(0), queue(0), numObjectsOutputted(0), stopped(false)
 #ifdef QUADTREE_VERBOSE_LOGGING
 	,numNodesVisited(0)
 #endif
@@ -510,41 +934,50 @@ struct NearestNeighborObjectSearch
 
 	ObjectCallbackFunc *objectCallback;
 
-	struct NearestObject
-	{
-		/// The squared distance of this node to the query point.
-		float d;
-
-		/// Stores the 2D bounding rectangle of this node.
-		AABB2D aabb;
-		typename QuadTree<T>::Node *node;
-
-		T *object;
-
-		/// We compare in reverse order, since we want the object with the smallest distance to be visited first,
-		/// and MaxHeap stores the object that compares largest in the root.
-		bool operator <(const NearestObject &t) const { return d > t.d; }
-		bool operator ==(const NearestObject &t) const { return d == t.d; }
-	};
-
-	MaxHeap<NearestObject> queue;
+	/// The objects of the visited nodes that have not been output yet, as a heap with the closest object in the front.
+	std::vector<NearestObject> *queue;
 
 	int numObjectsOutputted;
 
+	/// Set to true when the object callback requests to stop the search.
+	bool stopped;
+
 #ifdef QUADTREE_VERBOSE_LOGGING
 	int numNodesVisited;
 #endif
 
-	bool operator ()(QuadTree<T> &tree, const float2 &point, typename QuadTree<T>::Node &leaf, const AABB2D &aabb, float minDistanceSquared)
+	bool operator ()(QuadTree<T, Storage> &tree, const float2 &point, typename QuadTree<T, Storage>::Node &leaf, const AABB2D &aabb, float minDistanceSquared)
 	{
 #ifdef QUADTREE_VERBOSE_LOGGING
 		++numNodesVisited;
 #endif
 
 		// Output all points that are closer than the next closest AABB node.
-		while(queue.Size() > 0 && queue.Front().d <= minDistanceSquared)
+		if (OutputObjectsCloserThan(tree, point, minDistanceSquared))
+			return true;
+
+		// Queue up all points in the new AABB node.
+		for(size_t i = 0; i < leaf.objects.size(); ++i)
+		{
+			NearestObject obj;
+			obj.d = GetAABB2D(leaf.objects[i]).DistanceSq(point);
+			obj.aabb = aabb;
+			obj.node = &leaf;
+			obj.object = &leaf.objects[i];
+			queue->push_back(obj);
+			std::push_heap(queue->begin(), queue->end());
+		}
+
+		return false;
+	}
+
+	/// Outputs the queued objects that are at most at the given squared distance from the point, closest first.
+	/// @return True if the object callback requested to stop the search.
+	bool OutputObjectsCloserThan(QuadTree<T, Storage> &tree, const float2 &point, float maxDistanceSquared)
+	{
+		while(!queue->empty() && queue->front().d <= maxDistanceSquared)
 		{
-			const NearestObject &nextNearestPoint = queue.Front();
+			const NearestObject &nextNearestPoint = queue->front();
 			bool shouldStopIteration = (*objectCallback)(tree, point, nextNearestPoint.node, nextNearestPoint.aabb, nextNearestPoint.d, *nextNearestPoint.object, numObjectsOutputted++);
 			if (shouldStopIteration)
 			{
@@ -552,43 +985,123 @@ struct NearestNeighborObjectSearch
 				int numPoints = tree.NumObjects();
 				LOGI("Visited %d/%d (%.2f%%) of QuadTree nodes (tree height: %d). Saw %d/%d (%.2f%%) points of the QuadTree before outputting %d points.",
 					numNodesVisited, tree.NumNodes(), 100.f * numNodesVisited / tree.NumNodes(), -1/*tree.TreeHeight()*/,
-					(int)queue.Size() + numObjectsOutputted, numPoints, ((int)queue.Size() + numObjectsOutputted) * 100.f / numPoints,
+					(int)queue->size() + numObjectsOutputted, numPoints, ((int)queue->size() + numObjectsOutputted) * 100.f / numPoints,
 					numObjectsOutputted);
 #endif
+				stopped = true;
 				return true;
 			}
 
-			queue.PopFront();
+			std::pop_heap(queue->begin(), queue->end());
+			queue->pop_back();
 		}
-
-		// Queue up all points in the new AABB node.
-		for(size_t i = 0; i < leaf.objects.size(); ++i)
-		{
-			NearestObject obj;
-			obj.d = leaf.objects[i].DistanceSq(point);
-			obj.aabb = aabb;
-			obj.node = &leaf;
-			obj.object = &leaf.objects[i];
-			queue.Insert(obj);
-		}
-
 		return false;
 	}
 };
 
-template<typename T>
+template<typename T, typename Storage>
 template<typename Func>
-inline void QuadTree<T>::NearestNeighborObjects(const float2 &point, Func &leafCallback)
+inline void QuadTree<T, Storage>::NearestNeighborObjects(const float2 &point, Func &leafCallback)
 {
-	NearestNeighborObjectSearch<Func, T> search;
+	QueryScratch scratch;
+	NearestNeighborObjects(point, leafCallback, scratch);
+}
+
+template<typename T, typename Storage>
+template<typename Func>
+inline void QuadTree<T, Storage>::NearestNeighborObjects(const float2 &point, Func &leafCallback, QueryScratch &scratch)
+{
+	NearestNeighborObjectSearch<Func, T, Storage> search;
 	search.objectCallback = &leafCallback;
+	search.queue = &scratch.objectQueue;
+	scratch.objectQueue.clear();
+
+	NearestNeighborNodes(point, search, scratch);
 
-	NearestNeighborNodes(point, search);
+	// All nodes have been visited. Output the objects of the last visited nodes.
+	if (!search.stopped)
+		search.OutputObjectsCloserThan(*this, point, FLOAT_INF);
 }
-#endif
 
-template<typename T>
-void QuadTree<T>::GrowRootTopLeft()
+/// Orders the objects of the k-nearest heap of QuadTree::KNearestObjects() farthest first.
+template<typename NearestObject>
+struct QuadTreeNearestObjectFartherFirst
+{
+	bool operator ()(const NearestObject &a, const NearestObject &b) const { return a.d < b.d; }
+};
+
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::KNearestObjects(const float2 &point, int k, T *outObjects, float *outDistancesSq, QueryScratch &scratch)
+{
+	PROFILE(QuadTree_KNearestObjects);
+	assume(k >= 0);
+	assume(outObjects || k == 0);
+	if (k <= 0 || !Root())
+		return 0;
+
+	// Visit the nodes closest first, and keep the k closest objects found so far in a heap with the farthest of them
+	// in the front. Once k objects are found, the nodes farther than the farthest of them can be skipped.
+	std::vector<NearestNode> &queue = scratch.nodeQueue;
+	std::vector<NearestObject> &nearest = scratch.objectQueue;
+	queue.clear();
+	nearest.clear();
+	QuadTreeNearestObjectFartherFirst<NearestObject> fartherFirst;
+	NearestNode t;
+	t.d = 0.f;
+	t.aabb = BoundingAABB();
+	t.node = Root();
+	queue.push_back(t);
+	while(!queue.empty())
+	{
+		std::pop_heap(queue.begin(), queue.end());
+		t = queue.back();
+		queue.pop_back();
+		if ((int)nearest.size() == k && t.d >= nearest.front().d)
+			break; // All the remaining nodes are at least as far.
+
+		for(size_t i = 0; i < t.node->objects.size(); ++i)
+		{
+			NearestObject obj;
+			obj.d = GetAABB2D(t.node->objects[i]).DistanceSq(point);
+			if ((int)nearest.size() == k)
+			{
+				if (obj.d >= nearest.front().d)
+					continue;
+				std::pop_heap(nearest.begin(), nearest.end(), fartherFirst);
+				nearest.pop_back();
+			}
+			obj.node = t.node;
+			obj.object = &t.node->objects[i];
+			nearest.push_back(obj);
+			std::push_heap(nearest.begin(), nearest.end(), fartherFirst);
+		}
+
+		if (!t.node->IsLeaf())
+			for(int quadrant = 0; quadrant < 4; ++quadrant)
+			{
+				NearestNode n;
+				n.aabb = QuadTreeChildCell(t.aabb, quadrant);
+				n.d = LooseAABB(n.aabb).DistanceSq(point);
+				if ((int)nearest.size() == k && n.d >= nearest.front().d)
+					continue;
+				n.node = &nodes[t.node->childIndex + quadrant];
+				queue.push_back(n);
+				std::push_heap(queue.begin(), queue.end());
+			}
+	}
+
+	std::sort_heap(nearest.begin(), nearest.end(), fartherFirst);
+	for(size_t i = 0; i < nearest.size(); ++i)
+	{
+		outObjects[i] = *nearest[i].object;
+		if (outDistancesSq)
+			outDistancesSq[i] = nearest[i].d;
+	}
+	return (int)nearest.size();
+}
+
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::GrowRootTopLeft()
 {
 	boundingAABB.minPoint.x -= boundingAABB.maxPoint.x - boundingAABB.minPoint.x;
 	boundingAABB.minPoint.y -= boundingAABB.maxPoint.y - boundingAABB.minPoint.y;
@@ -597,8 +1110,8 @@ void QuadTree<T>::GrowRootTopLeft()
 	GrowImpl(3);
 }
 
-template<typename T>
-void QuadTree<T>::GrowRootTopRight()
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::GrowRootTopRight()
 {
 	boundingAABB.maxPoint.x += boundingAABB.maxPoint.x - boundingAABB.minPoint.x;
 	boundingAABB.minPoint.y -= boundingAABB.maxPoint.y - boundingAABB.minPoint.y;
@@ -607,8 +1120,8 @@ void QuadTree<T>::GrowRootTopRight()
 	GrowImpl(2);
 }
 
-template<typename T>
-void QuadTree<T>::GrowRootBottomLeft()
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::GrowRootBottomLeft()
 {
 	boundingAABB.minPoint.x -= boundingAABB.maxPoint.x - boundingAABB.minPoint.x;
 	boundingAABB.maxPoint.y += boundingAABB.maxPoint.y - boundingAABB.minPoint.y;
@@ -617,8 +1130,8 @@ void QuadTree<T>::GrowRootBottomLeft()
 	GrowImpl(1);
 }
 
-template<typename T>
-void QuadTree<T>::GrowRootBottomRight()
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::GrowRootBottomRight()
 {
 	boundingAABB.maxPoint.x += boundingAABB.maxPoint.x - boundingAABB.minPoint.x;
 	boundingAABB.maxPoint.y += boundingAABB.maxPoint.y - boundingAABB.minPoint.y;
@@ -627,8 +1140,8 @@ void QuadTree<T>::GrowRootBottomRight()
 	GrowImpl(0);
 }
 
-template<typename T>
-void QuadTree<T>::GrowImpl(int quadrantForRoot)
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::GrowImpl(int quadrantForRoot)
 {
 	// quadrantForRoot specifies the child quadrant the old root is put to in the new root node.
 
@@ -666,38 +1179,39 @@ void QuadTree<T>::GrowImpl(int quadrantForRoot)
 	DebugSanityCheckNode(Root());
 }
 
-template<typename T>
-int QuadTree<T>::NumNodes() const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::NumNodes() const
 {
-	return std::max<int>(0, nodes.size() - 3); // The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant.
+	// The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant.
+	return std::max<int>(0, (int)nodes.size() - 3 - 4 * (int)freeNodeGroups.size());
 }
 
-template<typename T>
-int QuadTree<T>::NumLeaves() const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::NumLeaves() const
 {
 	int numLeaves = 0;
 	for(int i = 0; i < (int)nodes.size(); ++i)
-		if (i <= rootNodeIndex || i >= rootNodeIndex + 4) // The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant.
+		if (i == rootNodeIndex || nodes[i].parent) // The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant, and the nodes of freeNodeGroups are unused.
 			if (nodes[i].IsLeaf())
 				++numLeaves;
 
 	return numLeaves;
 }
 
-template<typename T>
-int QuadTree<T>::NumInnerNodes() const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::NumInnerNodes() const
 {
 	int numInnerNodes = 0;
 	for(int i = 0; i < (int)nodes.size(); ++i)
-		if (i <= rootNodeIndex || i >= rootNodeIndex + 4) // The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant.
+		if (i == rootNodeIndex || nodes[i].parent) // The nodes rootNodeIndex+1, rootNodeIndex+2 and rootNodeIndex+3 are dummy unused, since the root node is not a quadrant, and the nodes of freeNodeGroups are unused.
 			if (!nodes[i].IsLeaf())
 				++numInnerNodes;
 
 	return numInnerNodes;
 }
 
-template<typename T>
-int QuadTree<T>::NumObjects() const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::NumObjects() const
 {
 #ifdef QUADTREE_VERBOSE_LOGGING
 	return totalNumObjectsInTree;
@@ -709,8 +1223,8 @@ int QuadTree<T>::NumObjects() const
 #endif
 }
 
-template<typename T>
-int QuadTree<T>::TreeHeight(const Node *node) const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::TreeHeight(const Node *node) const
 {
 	if (node->IsLeaf())
 		return 1;
@@ -720,16 +1234,16 @@ int QuadTree<T>::TreeHeight(const Node *node) const
 	               TreeHeight(&nodes[node->BottomRightChildIndex()]));
 }
 
-template<typename T>
-int QuadTree<T>::TreeHeight() const
+template<typename T, typename Storage>
+int QuadTree<T, Storage>::TreeHeight() const
 {
 	if (!Root())
 		return 0;
 	return TreeHeight(Root());
 }
 
-template<typename T>
-void QuadTree<T>::DebugSanityCheckNode(Node *n)
+template<typename T, typename Storage>
+void QuadTree<T, Storage>::DebugSanityCheckNode(Node *n)
 {
 #ifdef _DEBUG
 	assert(n);
@@ -743,6 +1257,7 @@ void QuadTree<T>::DebugSanityCheckNode(Node *n)
 	assert(aabb.minPoint.y <= aabb.maxPoint.y);
 
 	LOGI("Node AABB: %s.", aabb.ToString().c_str());
+	aabb = LooseAABB(aabb);
 	// Each object in this node must be contained in this node.
 	for(size_t i = 0; i < n->objects.size(); ++i)
 	{
@@ -110,6 +110,11 @@ AABB Sphere::MinimalEnclosingAABB() const
 	return aabb;
 }
 
+AABB Sphere::BoundingAABB() const
+{
+	return MinimalEnclosingAABB();
+}
+
 AABB Sphere::MaximalContainedAABB() const
 {
 	AABB aabb;
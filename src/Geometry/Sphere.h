@@ -79,6 +79,11 @@ public:
 		@see MinimalEnclosingAABB(). */
 	AABB MaximalContainedAABB() const;
 
+	/// Returns the smallest AABB that encloses this sphere.
+	/** This is the same as MinimalEnclosingAABB(). Provided so that spheres can be stored in a KdTree<Sphere>.
+		@see MinimalEnclosingAABB(). */
+	AABB BoundingAABB() const;
+
 	/// Sets pos = (0,0,0) and r = -inf.
 	/** After a call to this function, both IsFinite() and IsDegenerate() will return true.
 		@see IsFinite(), IsDegenerate(). */
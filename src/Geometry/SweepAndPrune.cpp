@@ -0,0 +1,481 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SweepAndPrune.cpp
+	@author Jukka Jylnki
+	@brief Implementation for the incremental sweep-and-prune broadphase. */
+#include "SweepAndPrune.h"
+#include "AABB.h"
+#include "../Math/MathFunc.h"
+#include "../Math/SSEMath.h"
+#include <algorithm>
+
+MATH_BEGIN_NAMESPACE
+
+static const u64 freePairSlot = 0xFFFFFFFFFFFFFFFFULL;
+
+SweepAndPrune::SweepAndPrune()
+:numBoxes(0), numPrevBoxes(0), numPairs(0), pairHashShift(64)
+{
+}
+
+void SweepAndPrune::Clear()
+{
+	for(int axis = 0; axis < 3; ++axis)
+		endpoints[axis].clear();
+	bounds.clear();
+	prevBounds.clear();
+	numBoxes = 0;
+	numPrevBoxes = 0;
+	pairSlots.clear();
+	numPairs = 0;
+	pairHashShift = 64;
+}
+
+void SweepAndPrune::Update(const AABB *aabbs, int numAabbs, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs)
+{
+	assume(numAabbs >= 0);
+	assume(aabbs || numAabbs == 0);
+
+	const int oldNumBoxes = numBoxes;
+
+	// Drop the boxes past the end of the new array.
+	if (numAabbs < numBoxes)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			std::vector<Endpoint> &list = endpoints[axis];
+			size_t numKept = 0;
+			for(size_t i = 0; i < list.size(); ++i)
+				if ((int)list[i].Box() < numAabbs)
+					list[numKept++] = list[i];
+			list.resize(numKept);
+		}
+
+		// Erasing from the table moves the other keys around, so collect the keys to erase first.
+		std::vector<u64> removedKeys;
+		for(size_t i = 0; i < pairSlots.size(); ++i)
+			if (pairSlots[i] != freePairSlot && (int)(u32)pairSlots[i] >= numAabbs)
+				removedKeys.push_back(pairSlots[i]);
+		for(size_t i = 0; i < removedKeys.size(); ++i)
+		{
+			ErasePair(removedKeys[i]);
+			if (removedPairs)
+			{
+				Pair p = { (u32)(removedKeys[i] >> 32), (u32)removedKeys[i] };
+				removedPairs->push_back(p);
+			}
+		}
+	}
+
+	// Keep the bounds of the previous frame, to tell which pairs can be in the pair table during the sort.
+	bounds.swap(prevBounds);
+	numPrevBoxes = Min(oldNumBoxes, numAabbs);
+	numBoxes = numAabbs;
+	bounds.resize(numBoxes * 8);
+	for(int i = 0; i < numBoxes; ++i)
+	{
+		const AABB &aabb = aabbs[i];
+		assume(aabb.IsFinite());
+		assume(aabb.minPoint.x <= aabb.maxPoint.x && aabb.minPoint.y <= aabb.maxPoint.y && aabb.minPoint.z <= aabb.maxPoint.z);
+		float *b = &bounds[i * 8];
+		b[0] = aabb.minPoint.x; b[1] = aabb.minPoint.y; b[2] = aabb.minPoint.z; b[3] = 0.f;
+		b[4] = aabb.maxPoint.x; b[5] = aabb.maxPoint.y; b[6] = aabb.maxPoint.z; b[7] = 0.f;
+	}
+
+	// Inserting a box into the sorted lists costs time linear in the number of boxes, so when many boxes are added
+	// at once, it is faster to sort everything from scratch.
+	const int numAdded = numBoxes - oldNumBoxes;
+	if (oldNumBoxes == 0 || (numAdded > 0 && numAdded * 8 > numBoxes))
+	{
+		Rebuild(aabbs, addedPairs, removedPairs);
+		return;
+	}
+
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<Endpoint> &list = endpoints[axis];
+		for(size_t i = 0; i < list.size(); ++i)
+			list[i].value = bounds[list[i].Box() * 8 + (list[i].IsMin() ? axis : 4 + axis)];
+
+		// Append the new boxes with all their maximum endpoints before all their minimum endpoints. This way each new
+		// box starts out as not overlapping any other box on this axis, and every overlap it has is found when its
+		// minimum endpoint is sorted past the maximum endpoint of the other box.
+		for(int i = oldNumBoxes; i < numBoxes; ++i)
+		{
+			Endpoint e = { bounds[i * 8 + 4 + axis], (u32)i << 1 };
+			list.push_back(e);
+		}
+		for(int i = oldNumBoxes; i < numBoxes; ++i)
+		{
+			Endpoint e = { bounds[i * 8 + axis], ((u32)i << 1) | 1 };
+			list.push_back(e);
+		}
+	}
+
+	for(int axis = 0; axis < 3; ++axis)
+		SortAxis(axis, addedPairs, removedPairs);
+}
+
+void SweepAndPrune::SortAxis(int axis, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs)
+{
+	std::vector<Endpoint> &list = endpoints[axis];
+	const size_t n = list.size();
+	for(size_t i = 1; i < n; ++i)
+	{
+		const Endpoint e = list[i];
+		size_t j = i;
+		while(j > 0 && EndpointLess(e, list[j-1]))
+		{
+			const Endpoint &prev = list[j-1];
+			// A minimum endpoint passing a maximum endpoint, or vice versa, changes whether the two boxes overlap
+			// on this axis. Two minimum or two maximum endpoints passing each other changes nothing.
+			if (e.IsMin() != prev.IsMin() && e.Box() != prev.Box())
+			{
+				if (e.IsMin())
+					AddPairIfOverlapping(e.Box(), prev.Box(), addedPairs);
+				else
+					RemovePairIfOverlapped(e.Box(), prev.Box(), removedPairs);
+			}
+			list[j] = prev;
+			--j;
+		}
+		list[j] = e;
+	}
+}
+
+void SweepAndPrune::AddPairIfOverlapping(u32 a, u32 b, std::vector<Pair> *addedPairs)
+{
+	// All the bounds of the new frame are already known, so the full overlap test gives the final state of the pair.
+	// Most boxes that start overlapping on one axis do not overlap on the others, and this test keeps them away from
+	// the pair table. The pair may have been added already during the sort of another axis.
+	if (!BoxesOverlap(bounds, a, b))
+		return;
+	const u64 key = PairKey(a, b);
+	if (InsertPair(key) && addedPairs)
+	{
+		Pair p = { (u32)(key >> 32), (u32)key };
+		addedPairs->push_back(p);
+	}
+}
+
+void SweepAndPrune::RemovePairIfOverlapped(u32 a, u32 b, std::vector<Pair> *removedPairs)
+{
+	// The boxes end up separated on this axis, so the pair cannot have been added during this frame, and it is in
+	// the pair table only if the boxes overlapped in the previous frame. The pair may have been removed already during
+	// the sort of another axis.
+	if ((int)a >= numPrevBoxes || (int)b >= numPrevBoxes || !BoxesOverlap(prevBounds, a, b))
+		return;
+	const u64 key = PairKey(a, b);
+	if (ErasePair(key) && removedPairs)
+	{
+		Pair p = { (u32)(key >> 32), (u32)key };
+		removedPairs->push_back(p);
+	}
+}
+
+bool SweepAndPrune::BoxesOverlap(const std::vector<float> &boxBounds, u32 a, u32 b)
+{
+	const float *ba = &boxBounds[a * 8];
+	const float *bb = &boxBounds[b * 8];
+#ifdef MATH_SSE
+	// Test all three axes at once. The padding lanes compare 0 < 0, which is false, so they are masked out.
+	simd4f overlap = _mm_and_ps(_mm_cmplt_ps(_mm_loadu_ps(ba), _mm_loadu_ps(bb + 4)), _mm_cmplt_ps(_mm_loadu_ps(bb), _mm_loadu_ps(ba + 4)));
+	return (_mm_movemask_ps(overlap) & 7) == 7;
+#else
+	return ba[0] < bb[4] && bb[0] < ba[4]
+		&& ba[1] < bb[5] && bb[1] < ba[5]
+		&& ba[2] < bb[6] && bb[2] < ba[6];
+#endif
+}
+
+struct SweepAndPruneMinXKey
+{
+	float minX;
+	u32 index;
+
+	bool operator <(const SweepAndPruneMinXKey &rhs) const { return minX < rhs.minX || (minX == rhs.minX && index < rhs.index); }
+};
+
+static inline void AppendPair(u32 a, u32 b, std::vector<SweepAndPrune::Pair> &outPairs)
+{
+	SweepAndPrune::Pair p = { Min(a, b), Max(a, b) };
+	outPairs.push_back(p);
+}
+
+void SweepAndPrune::FindOverlappingPairs(const AABB *aabbs, int numAabbs, std::vector<Pair> &outPairs)
+{
+	assume(numAabbs >= 0);
+	if (numAabbs < 2)
+		return;
+
+	std::vector<SweepAndPruneMinXKey> order(numAabbs);
+	for(int i = 0; i < numAabbs; ++i)
+	{
+		order[i].minX = aabbs[i].minPoint.x;
+		order[i].index = (u32)i;
+	}
+	std::sort(order.begin(), order.end());
+
+	// Store the bounds in structure-of-arrays form in the sorted order, followed by four sentinels that start after
+	// every other box ends, so that the sweeps below stop without extra bounds checks.
+	const int n = numAabbs;
+	std::vector<float> minX(n + 4, FLOAT_INF), maxX(n + 4, FLOAT_INF);
+	std::vector<float> minY(n + 4, 0.f), maxY(n + 4, 0.f), minZ(n + 4, 0.f), maxZ(n + 4, 0.f);
+	for(int i = 0; i < n; ++i)
+	{
+		const AABB &aabb = aabbs[order[i].index];
+		assume(aabb.IsFinite());
+		minX[i] = aabb.minPoint.x; maxX[i] = aabb.maxPoint.x;
+		minY[i] = aabb.minPoint.y; maxY[i] = aabb.maxPoint.y;
+		minZ[i] = aabb.minPoint.z; maxZ[i] = aabb.maxPoint.z;
+	}
+
+	for(int i = 0; i < n; ++i)
+	{
+		const u32 boxI = order[i].index;
+#ifdef MATH_SSE
+		const simd4f minXi = _mm_set1_ps(minX[i]), maxXi = _mm_set1_ps(maxX[i]);
+		const simd4f minYi = _mm_set1_ps(minY[i]), maxYi = _mm_set1_ps(maxY[i]);
+		const simd4f minZi = _mm_set1_ps(minZ[i]), maxZi = _mm_set1_ps(maxZ[i]);
+		for(int j = i + 1; ; j += 4)
+		{
+			// The boxes are sorted by minX, so once one candidate starts after box i ends, so do all the rest.
+			simd4f inRange = _mm_cmplt_ps(_mm_loadu_ps(&minX[j]), maxXi);
+			int rangeMask = _mm_movemask_ps(inRange);
+			if (rangeMask == 0)
+				break;
+			simd4f overlap = _mm_and_ps(inRange, _mm_cmplt_ps(minXi, _mm_loadu_ps(&maxX[j])));
+			overlap = _mm_and_ps(overlap, _mm_cmplt_ps(_mm_loadu_ps(&minY[j]), maxYi));
+			overlap = _mm_and_ps(overlap, _mm_cmplt_ps(minYi, _mm_loadu_ps(&maxY[j])));
+			overlap = _mm_and_ps(overlap, _mm_cmplt_ps(_mm_loadu_ps(&minZ[j]), maxZi));
+			overlap = _mm_and_ps(overlap, _mm_cmplt_ps(minZi, _mm_loadu_ps(&maxZ[j])));
+			int overlapMask = _mm_movemask_ps(overlap);
+			for(int k = 0; overlapMask != 0; ++k, overlapMask >>= 1)
+				if (overlapMask & 1)
+					AppendPair(boxI, order[j + k].index, outPairs);
+			if (rangeMask != 0xF)
+				break;
+		}
+#else
+		const float maxXi = maxX[i];
+		for(int j = i + 1; minX[j] < maxXi; ++j)
+			if (minX[i] < maxX[j]
+				&& minY[j] < maxY[i] && minY[i] < maxY[j]
+				&& minZ[j] < maxZ[i] && minZ[i] < maxZ[j])
+				AppendPair(boxI, order[j].index, outPairs);
+#endif
+	}
+}
+
+void SweepAndPrune::Rebuild(const AABB *aabbs, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs)
+{
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<Endpoint> &list = endpoints[axis];
+		list.resize(numBoxes * 2);
+		for(int i = 0; i < numBoxes; ++i)
+		{
+			list[2*i].value = bounds[i * 8 + 4 + axis];
+			list[2*i].data = (u32)i << 1;
+			list[2*i+1].value = bounds[i * 8 + axis];
+			list[2*i+1].data = ((u32)i << 1) | 1;
+		}
+		std::sort(list.begin(), list.end(), EndpointLess);
+	}
+
+	std::vector<Pair> pairs;
+	FindOverlappingPairs(aabbs, numBoxes, pairs);
+
+	std::vector<u64> oldKeys, newKeys;
+	oldKeys.reserve(numPairs);
+	for(size_t i = 0; i < pairSlots.size(); ++i)
+		if (pairSlots[i] != freePairSlot)
+			oldKeys.push_back(pairSlots[i]);
+	newKeys.reserve(pairs.size());
+	for(size_t i = 0; i < pairs.size(); ++i)
+		newKeys.push_back(PairKey(pairs[i].a, pairs[i].b));
+	std::sort(oldKeys.begin(), oldKeys.end());
+	std::sort(newKeys.begin(), newKeys.end());
+
+	// Report the differences between the old and the new pairs by walking the two sorted key lists in step.
+	size_t o = 0, n = 0;
+	while(o < oldKeys.size() || n < newKeys.size())
+	{
+		if (n >= newKeys.size() || (o < oldKeys.size() && oldKeys[o] < newKeys[n]))
+		{
+			if (removedPairs)
+			{
+				Pair p = { (u32)(oldKeys[o] >> 32), (u32)oldKeys[o] };
+				removedPairs->push_back(p);
+			}
+			++o;
+		}
+		else if (o >= oldKeys.size() || newKeys[n] < oldKeys[o])
+		{
+			if (addedPairs)
+			{
+				Pair p = { (u32)(newKeys[n] >> 32), (u32)newKeys[n] };
+				addedPairs->push_back(p);
+			}
+			++n;
+		}
+		else
+		{
+			++o;
+			++n;
+		}
+	}
+
+	pairSlots.clear();
+	numPairs = 0;
+	pairHashShift = 64;
+	for(size_t i = 0; i < newKeys.size(); ++i)
+		InsertPair(newKeys[i]);
+}
+
+bool SweepAndPrune::IsOverlapping(u32 a, u32 b) const
+{
+	return a != b && FindPairSlot(PairKey(a, b)) != 0xFFFFFFFF;
+}
+
+void SweepAndPrune::GetOverlappingPairs(std::vector<Pair> &outPairs) const
+{
+	for(size_t i = 0; i < pairSlots.size(); ++i)
+		if (pairSlots[i] != freePairSlot)
+		{
+			Pair p = { (u32)(pairSlots[i] >> 32), (u32)pairSlots[i] };
+			outPairs.push_back(p);
+		}
+}
+
+u32 SweepAndPrune::FindPairSlot(u64 key) const
+{
+	if (pairSlots.empty())
+		return 0xFFFFFFFF;
+	const u32 mask = (u32)pairSlots.size() - 1;
+	u32 index = HomeSlot(key);
+	while(pairSlots[index] != freePairSlot)
+	{
+		if (pairSlots[index] == key)
+			return index;
+		index = (index + 1) & mask;
+	}
+	return 0xFFFFFFFF;
+}
+
+bool SweepAndPrune::InsertPair(u64 key)
+{
+	// Keep the table at most half full, so that the probe sequences stay short.
+	if ((size_t)(numPairs + 1) * 2 > pairSlots.size())
+		GrowPairTable();
+	const u32 mask = (u32)pairSlots.size() - 1;
+	u32 index = HomeSlot(key);
+	while(pairSlots[index] != freePairSlot)
+	{
+		if (pairSlots[index] == key)
+			return false;
+		index = (index + 1) & mask;
+	}
+	pairSlots[index] = key;
+	++numPairs;
+	return true;
+}
+
+bool SweepAndPrune::ErasePair(u64 key)
+{
+	u32 index = FindPairSlot(key);
+	if (index == 0xFFFFFFFF)
+		return false;
+
+	// Shift back the following keys of the same probe sequences, so that no search passes through a free slot before
+	// reaching its key.
+	const u32 mask = (u32)pairSlots.size() - 1;
+	u32 next = index;
+	for(;;)
+	{
+		next = (next + 1) & mask;
+		if (pairSlots[next] == freePairSlot)
+			break;
+		u32 home = HomeSlot(pairSlots[next]);
+		// The key can be moved to the free slot if its home slot is not cyclically in ]index, next].
+		bool homeBetween = (index <= next) ? (index < home && home <= next) : (index < home || home <= next);
+		if (homeBetween)
+			continue;
+		pairSlots[index] = pairSlots[next];
+		index = next;
+	}
+	pairSlots[index] = freePairSlot;
+	--numPairs;
+	return true;
+}
+
+void SweepAndPrune::GrowPairTable()
+{
+	std::vector<u64> oldSlots;
+	oldSlots.swap(pairSlots);
+	pairSlots.resize(oldSlots.empty() ? 16 : oldSlots.size() * 2, freePairSlot);
+	pairHashShift = 64;
+	for(size_t size = pairSlots.size(); size > 1; size >>= 1)
+		--pairHashShift;
+
+	const u32 mask = (u32)pairSlots.size() - 1;
+	for(size_t i = 0; i < oldSlots.size(); ++i)
+		if (oldSlots[i] != freePairSlot)
+		{
+			u32 index = HomeSlot(oldSlots[i]);
+			while(pairSlots[index] != freePairSlot)
+				index = (index + 1) & mask;
+			pairSlots[index] = oldSlots[i];
+		}
+}
+
+void SweepAndPrune::DebugSanityCheck() const
+{
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		const std::vector<Endpoint> &list = endpoints[axis];
+		assert((int)list.size() == numBoxes * 2);
+		std::vector<int> numEndpoints(numBoxes, 0);
+		for(size_t i = 0; i < list.size(); ++i)
+		{
+			assert((int)list[i].Box() < numBoxes);
+			assert(i == 0 || EndpointLess(list[i-1], list[i]));
+			assert(list[i].value == bounds[list[i].Box() * 8 + (list[i].IsMin() ? axis : 4 + axis)]);
+			++numEndpoints[list[i].Box()];
+		}
+		for(int i = 0; i < numBoxes; ++i)
+			assert(numEndpoints[i] == 2);
+		MARK_UNUSED(numEndpoints);
+	}
+
+	int numStoredPairs = 0;
+	for(size_t i = 0; i < pairSlots.size(); ++i)
+		if (pairSlots[i] != freePairSlot)
+		{
+			u32 a = (u32)(pairSlots[i] >> 32);
+			u32 b = (u32)pairSlots[i];
+			assert(a < b);
+			assert((int)b < numBoxes);
+			assert(BoxesOverlap(bounds, a, b));
+			assert(FindPairSlot(pairSlots[i]) == i);
+			MARK_UNUSED(a);
+			MARK_UNUSED(b);
+			++numStoredPairs;
+		}
+	assert(numStoredPairs == numPairs);
+	MARK_UNUSED(numStoredPairs);
+}
+
+MATH_END_NAMESPACE
@@ -0,0 +1,155 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SweepAndPrune.h
+	@author Jukka Jylnki
+	@brief An incremental sort-based broadphase that tracks the overlapping pairs of an array of AABBs over frames. */
+#pragma once
+
+#include "../MathBuildConfig.h"
+#include "../Math/MathNamespace.h"
+#include "../Math/MathTypes.h"
+#include "../MathGeoLibFwd.h"
+#include <vector>
+
+MATH_BEGIN_NAMESPACE
+
+/// An incremental sweep-and-prune broadphase over an array of AABBs.
+/** The broadphase keeps the endpoints of the boxes sorted along each of the three coordinate axes. When the boxes
+	move, the endpoint lists from the previous frame are resorted with insertion sort, which runs in close to linear
+	time when the boxes move only a little between frames. Two boxes can start or stop overlapping only if an endpoint
+	of one passes an endpoint of the other on some axis, so only the pairs whose endpoints swap places during the sort
+	need to be tested, and the set of overlapping pairs is updated incrementally.
+
+	The cost of a frame grows with the number of endpoints that the boxes move past, so when most of the boxes move
+	far compared to the spacing of the endpoints, finding the pairs from scratch with FindOverlappingPairs() can be
+	faster. Update() has the advantage of reporting which pairs started and stopped overlapping.
+
+	The boxes are identified by their indices in the array passed to Update(). The overlap test is the same as in
+	AABB::Intersects(const AABB &), so boxes that only touch each other do not overlap. */
+class SweepAndPrune
+{
+public:
+	/// A pair of overlapping boxes, identified by their indices. Always a < b.
+	struct Pair
+	{
+		u32 a;
+		u32 b;
+
+		bool operator ==(const Pair &rhs) const { return a == rhs.a && b == rhs.b; }
+		bool operator !=(const Pair &rhs) const { return !(*this == rhs); }
+		bool operator <(const Pair &rhs) const { return a < rhs.a || (a == rhs.a && b < rhs.b); }
+	};
+
+	SweepAndPrune();
+
+	/// Removes all boxes and pairs from the broadphase.
+	void Clear();
+
+	/// Sets the boxes for a new frame, and reports the changes in the set of overlapping pairs since the previous frame.
+	/** The box at index i of the array is the new position of the box at index i of the previous frame. If the array
+		is longer than in the previous frame, the extra boxes are added to the broadphase, and if it is shorter, the
+		boxes past its end are removed. The first frame, and frames that add many boxes at once, rebuild the endpoint
+		lists from scratch with FindOverlappingPairs().
+		@param addedPairs [out] If not null, the pairs that started overlapping are appended to this array.
+		@param removedPairs [out] If not null, the pairs that stopped overlapping are appended to this array. This
+			includes the pairs of the removed boxes. */
+	void Update(const AABB *aabbs, int numAabbs, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs);
+
+	/// Returns the number of boxes given to the last call to Update().
+	int NumBoxes() const { return numBoxes; }
+
+	/// Returns the number of overlapping pairs after the last call to Update().
+	int NumOverlappingPairs() const { return numPairs; }
+
+	/// Returns true if the given boxes overlapped in the last call to Update().
+	bool IsOverlapping(u32 a, u32 b) const;
+
+	/// Appends all the overlapping pairs after the last call to Update() to the given array, in no particular order.
+	void GetOverlappingPairs(std::vector<Pair> &outPairs) const;
+
+	/// Finds all the overlapping pairs of the given boxes from scratch, and appends them to the given array.
+	/** The boxes are sorted by their minimum x coordinate, and each box is tested against the boxes that start before
+		it ends on the x axis. When SSE is enabled, the y and z axes of four candidate boxes are tested at once. */
+	static void FindOverlappingPairs(const AABB *aabbs, int numAabbs, std::vector<Pair> &outPairs);
+
+	/// Checks the internal invariants of the broadphase. For debugging.
+	void DebugSanityCheck() const;
+
+private:
+	/// An endpoint of a box on one axis.
+	struct Endpoint
+	{
+		float value;
+		/// The index of the box shifted left by one, with the lowest bit set if this is the minimum endpoint.
+		u32 data;
+
+		u32 Box() const { return data >> 1; }
+		bool IsMin() const { return (data & 1) != 0; }
+	};
+
+	/// Returns true if the endpoint a is sorted before the endpoint b. At equal values, the maximum endpoints are sorted
+	/// first, so that boxes that only touch each other are not considered overlapping.
+	static bool EndpointLess(const Endpoint &a, const Endpoint &b)
+	{
+		if (a.value != b.value)
+			return a.value < b.value;
+		if ((a.data & 1) != (b.data & 1))
+			return (a.data & 1) < (b.data & 1);
+		return a.data < b.data;
+	}
+
+	/// Sorts the endpoints of the given axis with insertion sort, and updates the pairs of the boxes whose minimum and
+	/// maximum endpoints swap places.
+	void SortAxis(int axis, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs);
+
+	/// Called when the minimum endpoint of box a passes the maximum endpoint of box b on some axis.
+	void AddPairIfOverlapping(u32 a, u32 b, std::vector<Pair> *addedPairs);
+
+	/// Called when the maximum endpoint of box a passes the minimum endpoint of box b on some axis.
+	void RemovePairIfOverlapped(u32 a, u32 b, std::vector<Pair> *removedPairs);
+
+	/// Rebuilds the endpoint lists and the pair set from scratch.
+	void Rebuild(const AABB *aabbs, std::vector<Pair> *addedPairs, std::vector<Pair> *removedPairs);
+
+	/// Returns true if the boxes at the given indices of the given bounds array overlap.
+	static bool BoxesOverlap(const std::vector<float> &boxBounds, u32 a, u32 b);
+
+	static u64 PairKey(u32 a, u32 b) { return a < b ? (((u64)a << 32) | b) : (((u64)b << 32) | a); }
+	u32 HomeSlot(u64 key) const { return (u32)((key * 0x9E3779B97F4A7C15ULL) >> pairHashShift); }
+	u32 FindPairSlot(u64 key) const;
+	/// @return True if the pair was not in the set before.
+	bool InsertPair(u64 key);
+	/// @return True if the pair was in the set.
+	bool ErasePair(u64 key);
+	void GrowPairTable();
+
+	/// The sorted endpoints of each axis.
+	std::vector<Endpoint> endpoints[3];
+	/// The bounds of each box, stored as eight floats: the minimum point, one float of padding, the maximum point and
+	/// another float of padding.
+	std::vector<float> bounds;
+	/// The bounds of the boxes in the previous frame, in the same format.
+	std::vector<float> prevBounds;
+	int numBoxes;
+	/// The number of boxes in prevBounds that are still in the broadphase.
+	int numPrevBoxes;
+
+	/// The set of overlapping pairs, as an open addressing hash table of pair keys. Free slots hold 0xFFFFFFFFFFFFFFFF.
+	std::vector<u64> pairSlots;
+	int numPairs;
+	int pairHashShift;
+};
+
+MATH_END_NAMESPACE
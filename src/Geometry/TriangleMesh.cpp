@@ -18,153 +18,155 @@
 #include "TriangleMesh.h"
 #include <stdlib.h>
 #include <string.h>
+#include "../Math/float2.h"
 #include "../Math/float3.h"
 #include "Triangle.h"
 #include "Ray.h"
 #include "Polyhedron.h"
+#include "AABB.h"
+#include "../Algorithm/ParallelFor.h"
 #include "../MathGeoLibFwd.h"
 #include "../Math/MathConstants.h"
+#include "../Math/MathFunc.h"
 #include "../Math/myassert.h"
 
 #include <vector>
+#include <algorithm>
 
 #include "../Math/SSEMath.h"
 
+#ifdef MATH_TRIANGLEMESH_RUNTIME_DISPATCH
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
+// The SIMD routines are compiled for their own instruction sets, independent of the flags MathGeoLib is built with.
+// Visual Studio allows the intrinsics of any instruction set in any function.
+#if defined(MATH_TRIANGLEMESH_RUNTIME_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define MATH_TARGET_SSE2 __attribute__((target("sse2")))
+#define MATH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define MATH_TARGET_AVX __attribute__((target("avx")))
+#define MATH_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define MATH_TARGET_SSE2
+#define MATH_TARGET_SSE41
+#define MATH_TARGET_AVX
+#define MATH_TARGET_AVX512
+#endif
+
 // If defined, we preprocess our TriangleMesh data structure to contain (v0, v1-v0, v2-v0)
 // instead of (v0, v1, v2) triplets for faster ray-triangle mesh intersection.
 #define SOA_HAS_EDGES
 
 MATH_BEGIN_NAMESPACE
 
-enum SIMDCapability
-{
-	SIMD_NONE,
-	SIMD_SSE,
-	SIMD_SSE2,
-//	SIMD_SSE3,
-//	SIMD_SSSE3,
-//	SIMD_SSE4,
-	SIMD_SSE41,
-//	SIMD_SSE42,
-	SIMD_AVX
-};
-
-SIMDCapability DetectSIMDCapability()
-{
-#ifdef WIN32 ///\todo SIMD detection for other x86 platforms.
-
-#ifdef MATH_SSE
-	int CPUInfo[4] = {-1};
-
-	unsigned    nIds;//, nExIds, i;
-	int nFeatureInfo = 0;
-//	bool    bSSE3Instructions = false;
-//	bool    bSupplementalSSE3 = false;
-//	bool    bCMPXCHG16B = false;
-#ifdef MATH_SSE41
-	bool    bSSE41Extensions = false;
-#endif
-//	bool    bSSE42Extensions = false;
-//	bool    bPOPCNT = false;
-
-//	bool    bLAHF_SAHFAvailable = false;
-//	bool    bCmpLegacy = false;
-//	bool    bLZCNT = false;
-//	bool    bSSE4A = false;
-//	bool    bMisalignedSSE = false;
-//	bool    bPREFETCH = false;
-//	bool    bMMXExtensions = false;
-//	bool    b3DNowExt = false;
-//	bool    b3DNow = false;
-//	bool    bFP128 = false;
-#ifdef MATH_AVX
-	bool    hasAVX = false;
-#endif
-//	bool    bMOVOptimization = false;
-
-	__cpuid(CPUInfo, 0);
-	nIds = CPUInfo[0];
-
-	// Get the information associated with each valid Id
-//	for (i=0; i<=nIds; ++i)
-	if (nIds >= 1)
+#ifdef MATH_TRIANGLEMESH_RUNTIME_DISPATCH
+/// Returns the EAX, EBX, ECX and EDX registers of the given CPUID function and subfunction, or zeros if the CPU does
+/// not support the function.
+static void CPUID(unsigned int function, unsigned int subfunction, unsigned int outRegs[4])
+{
+	outRegs[0] = outRegs[1] = outRegs[2] = outRegs[3] = 0;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if ((unsigned int)info[0] >= function)
 	{
-	//	__cpuid(CPUInfo, i);
-
-		__cpuid(CPUInfo, 1);
-		// Interpret CPU feature information.
-//		if  (i == 1)
-		{
-//			bSSE3Instructions = (CPUInfo[2] & 0x1) || false;
-//			bSupplementalSSE3 = (CPUInfo[2] & 0x200) || false;
-//			bCMPXCHG16B= (CPUInfo[2] & 0x2000) || false;
-//			bSSE41Extensions = (CPUInfo[2] & 0x80000) || false;
-//			bSSE42Extensions = (CPUInfo[2] & 0x100000) || false;
-//			bPOPCNT= (CPUInfo[2] & 0x800000) || false;
-#ifdef MATH_AVX
-			hasAVX = (CPUInfo[2] & 0x10000000) || false;
-#endif
-			nFeatureInfo = CPUInfo[3];
-		}
+		__cpuidex(info, (int)function, (int)subfunction);
+		for(int i = 0; i < 4; ++i)
+			outRegs[i] = (unsigned int)info[i];
 	}
+#else
+	if (__get_cpuid_max(0, 0) >= function)
+		__cpuid_count(function, subfunction, outRegs[0], outRegs[1], outRegs[2], outRegs[3]);
+#endif
+}
 
-//	const bool hasMMX = (nFeatureInfo & (1 << 23)) != 0;
-
-	// Calling __cpuid with 0x80000000 as the InfoType argument
-	// gets the number of valid extended IDs.
-//	__cpuid(CPUInfo, 0x80000000);
-//	nExIds = CPUInfo[0];
-/*
-	// Get the information associated with each extended ID.
-	for (i=0x80000000; i<=nExIds; ++i)
-	{
-		__cpuid(CPUInfo, i);
-
-		if  (i == 0x80000001)
-		{
-			bLAHF_SAHFAvailable = (CPUInfo[2] & 0x1) || false;
-			bCmpLegacy = (CPUInfo[2] & 0x2) || false;
-			bLZCNT = (CPUInfo[2] & 0x20) || false;
-			bSSE4A = (CPUInfo[2] & 0x40) || false;
-			bMisalignedSSE = (CPUInfo[2] & 0x80) || false;
-			bPREFETCH = (CPUInfo[2] & 0x100) || false;
-			bMMXExtensions = (CPUInfo[3] & 0x40000) || false;
-			b3DNowExt = (CPUInfo[3] & 0x40000000) || false;
-			b3DNow = (CPUInfo[3] & 0x80000000) || false;
-		}
-
-		if  (i == 0x8000001A)
-		{
-			bFP128 = (CPUInfo[0] & 0x1) || false;
-			bMOVOptimization = (CPUInfo[0] & 0x2) || false;
-		}
-	}
-*/
-#ifdef MATH_AVX
-	if (hasAVX)
-		return SIMD_AVX;
+/// Returns the lowest 32 bits of the extended control register XCR0, which tells which register states the OS saves
+/// on context switches. Only call if CPUID reports OSXSAVE.
+static unsigned int ReadXCR0()
+{
+#ifdef _MSC_VER
+	return (unsigned int)_xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
 #endif
-#ifdef MATH_SSE41
-	if (bSSE41Extensions)
-		return SIMD_SSE41;
+}
 #endif
-#ifdef MATH_SSE2
-	const bool hasSSE2 = (nFeatureInfo & (1 << 26)) != 0;
-	if (hasSSE2)
-		return SIMD_SSE2;
+
+static TriangleMesh::SIMDCapability DetectSIMDCapability()
+{
+#ifdef MATH_TRIANGLEMESH_RUNTIME_DISPATCH
+	unsigned int features[4];
+	CPUID(1, 0, features);
+	const unsigned int ecx = features[2];
+	const unsigned int edx = features[3];
+
+	const bool hasOSXSAVE = (ecx & (1 << 27)) != 0;
+	const bool hasAVX = (ecx & (1 << 28)) != 0;
+	// Besides the CPU, the OS must support AVX by saving the SSE and AVX registers (bits 1 and 2 of XCR0), and for
+	// AVX-512 also the mask registers and the upper halves and upper 16 of the ZMM registers (bits 5, 6 and 7).
+	const unsigned int xcr0 = hasOSXSAVE ? ReadXCR0() : 0;
+	if (hasAVX && (xcr0 & 6) == 6)
+	{
+#ifdef MATH_TRIANGLEMESH_AVX512
+		unsigned int extendedFeatures[4];
+		CPUID(7, 0, extendedFeatures);
+		const bool hasAVX512F = (extendedFeatures[1] & (1 << 16)) != 0;
+		if (hasAVX512F && (xcr0 & 0xE6) == 0xE6)
+			return TriangleMesh::SIMD_AVX512;
 #endif
-#ifdef MATH_SSE
-	const bool hasSSE = (nFeatureInfo & (1 << 25)) != 0;
-	if (hasSSE)
-		return SIMD_SSE;
+		return TriangleMesh::SIMD_AVX;
+	}
+	if ((ecx & (1 << 19)) != 0)
+		return TriangleMesh::SIMD_SSE41;
+	if ((edx & (1 << 26)) != 0)
+		return TriangleMesh::SIMD_SSE2;
+	return TriangleMesh::SIMD_NONE;
+#elif defined(MATH_TRIANGLEMESH_AVX512)
+	// MathGeoLib was built to require these instruction sets.
+	return TriangleMesh::SIMD_AVX512;
+#elif defined(MATH_TRIANGLEMESH_AVX)
+	return TriangleMesh::SIMD_AVX;
+#elif defined(MATH_TRIANGLEMESH_SSE41)
+	return TriangleMesh::SIMD_SSE41;
+#elif defined(MATH_TRIANGLEMESH_SSE2)
+	return TriangleMesh::SIMD_SSE2;
+#else
+	return TriangleMesh::SIMD_NONE;
 #endif
+}
 
-#endif // ~ MATH_SSE not defined.
-#endif
-	return SIMD_NONE;
+TriangleMesh::SIMDCapability TriangleMesh::ActiveSIMDCapability()
+{
+	// Detected on first use rather than during static initialization, so that meshes created by the static
+	// initializers of other files get the same layout as the routines that are later called on them.
+	static const SIMDCapability simdCapability = DetectSIMDCapability();
+	return simdCapability;
+}
+
+const char *TriangleMesh::SIMDCapabilityToString(SIMDCapability capability)
+{
+	switch(capability)
+	{
+	case SIMD_SSE2: return "SSE2";
+	case SIMD_SSE41: return "SSE4.1";
+	case SIMD_AVX: return "AVX";
+	case SIMD_AVX512: return "AVX-512";
+	default: return "None";
+	}
 }
 
-const int simdCapability = DetectSIMDCapability();
+bool TriangleMesh::IsSIMDCapabilitySupported(SIMDCapability capability)
+{
+	// Each instruction set is a superset of the previous ones.
+	return capability <= ActiveSIMDCapability();
+}
 
 TriangleMesh::TriangleMesh()
 :data(0), numTriangles(0)
@@ -177,42 +179,42 @@ TriangleMesh::~TriangleMesh()
 	AlignedFree(data);
 }
 
-void TriangleMesh::Set(const Polyhedron &polyhedron)
+void TriangleMesh::Set(const Polyhedron &polyhedron, bool buildBVH)
 {
 	std::vector<Triangle> tris = polyhedron.Triangulate();
 	if (!tris.empty())
-	{
-		int alignment = (simdCapability == SIMD_AVX) ? 8 : ((simdCapability == SIMD_SSE41 || simdCapability == SIMD_SSE2) ? 4 : 1);
-		float3 degen(-FLOAT_INF, -FLOAT_INF, -FLOAT_INF);
-		Triangle degent(degen, degen, degen);
-		while(tris.size() % alignment != 0)
-			tris.push_back(degent);
-		Set(&tris[0], tris.size());
-	}
+		Set(&tris[0], (int)tris.size(), buildBVH);
 }
 
-void TriangleMesh::Set(const float *triangleMesh, int numTriangles)
+void TriangleMesh::Set(const float *triangleMesh, int numTriangles, bool buildBVH)
 {
-	if (simdCapability == SIMD_AVX)
-		SetSoA8(triangleMesh, numTriangles);
+	const SIMDCapability simdCapability = ActiveSIMDCapability();
+	if (simdCapability == SIMD_AVX512)
+		SetSoA16(triangleMesh, numTriangles, buildBVH);
+	else if (simdCapability == SIMD_AVX)
+		SetSoA8(triangleMesh, numTriangles, buildBVH);
 	else if (simdCapability == SIMD_SSE41 || simdCapability == SIMD_SSE2)
-		SetSoA4(triangleMesh, numTriangles);
+		SetSoA4(triangleMesh, numTriangles, buildBVH);
 	else
-		SetAoS(triangleMesh, numTriangles);
+		SetAoS(triangleMesh, numTriangles, buildBVH);
 }
 
 float TriangleMesh::IntersectRay(const Ray &ray) const
 {
-#ifdef MATH_AVX
-	if (simdCapability == SIMD_AVX)
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (ActiveSIMDCapability() == SIMD_AVX512)
+		return IntersectRay_AVX512(ray);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (ActiveSIMDCapability() == SIMD_AVX)
 		return IntersectRay_AVX(ray);
 #endif
-#ifdef MATH_SSE41
-	if (simdCapability == SIMD_SSE41)
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (ActiveSIMDCapability() == SIMD_SSE41)
 		return IntersectRay_SSE41(ray);
 #endif
-#ifdef MATH_SSE2
-	if (simdCapability == SIMD_SSE2)
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (ActiveSIMDCapability() == SIMD_SSE2)
 		return IntersectRay_SSE2(ray);
 #endif
 
@@ -223,16 +225,20 @@ float TriangleMesh::IntersectRay(const Ray &ray) const
 
 float TriangleMesh::IntersectRay_TriangleIndex(const Ray &ray, int &outTriangleIndex) const
 {
-#ifdef MATH_AVX
-	if (simdCapability == SIMD_AVX)
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (ActiveSIMDCapability() == SIMD_AVX512)
+		return IntersectRay_TriangleIndex_AVX512(ray, outTriangleIndex);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (ActiveSIMDCapability() == SIMD_AVX)
 		return IntersectRay_TriangleIndex_AVX(ray, outTriangleIndex);
 #endif
-#ifdef MATH_SSE41
-	if (simdCapability == SIMD_SSE41)
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (ActiveSIMDCapability() == SIMD_SSE41)
 		return IntersectRay_TriangleIndex_SSE41(ray, outTriangleIndex);
 #endif
-#ifdef MATH_SSE2
-	if (simdCapability == SIMD_SSE2)
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (ActiveSIMDCapability() == SIMD_SSE2)
 		return IntersectRay_TriangleIndex_SSE2(ray, outTriangleIndex);
 #endif
 
@@ -242,31 +248,190 @@ float TriangleMesh::IntersectRay_TriangleIndex(const Ray &ray, int &outTriangleI
 
 float TriangleMesh::IntersectRay_TriangleIndex_UV(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
 {
-#ifdef MATH_AVX
-	if (simdCapability == SIMD_AVX)
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (ActiveSIMDCapability() == SIMD_AVX512)
+		return IntersectRay_TriangleIndex_UV_AVX512(ray, outTriangleIndex, outU, outV);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (ActiveSIMDCapability() == SIMD_AVX)
 		return IntersectRay_TriangleIndex_UV_AVX(ray, outTriangleIndex, outU, outV);
 #endif
-#ifdef MATH_SSE41
-	if (simdCapability == SIMD_SSE41)
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (ActiveSIMDCapability() == SIMD_SSE41)
 		return IntersectRay_TriangleIndex_UV_SSE41(ray, outTriangleIndex, outU, outV);
 #endif
-#ifdef MATH_SSE2
-	if (simdCapability == SIMD_SSE2)
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (ActiveSIMDCapability() == SIMD_SSE2)
 		return IntersectRay_TriangleIndex_UV_SSE2(ray, outTriangleIndex, outU, outV);
 #endif
 
 	return IntersectRay_TriangleIndex_UV_CPP(ray, outTriangleIndex, outU, outV);
 }
 
+bool TriangleMesh::IntersectRayAny(const Ray &ray, float maxDistance) const
+{
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (ActiveSIMDCapability() == SIMD_AVX512)
+		return IntersectRayAny_AVX512(ray, maxDistance);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (ActiveSIMDCapability() == SIMD_AVX)
+		return IntersectRayAny_AVX(ray, maxDistance);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (ActiveSIMDCapability() == SIMD_SSE41)
+		return IntersectRayAny_SSE41(ray, maxDistance);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (ActiveSIMDCapability() == SIMD_SSE2)
+		return IntersectRayAny_SSE2(ray, maxDistance);
+#endif
+
+	return IntersectRayAny_CPP(ray, maxDistance);
+}
+
+/// The number of rays that IntersectRays() processes together, and hands out to a thread at a time.
+static const int rayTileSize = 64;
+/// The number of triangles that a tile of rays is tested against at a time when the mesh has no BVH. 512 triangles
+/// take 18KB, which fits in the L1 data cache.
+static const int triangleChunkSize = 512;
+
+struct TriangleMesh::IntersectRayTileFunc
+{
+	const TriangleMesh *mesh;
+	const Ray *rays;
+	int numRays;
+	RangeKernel kernel;
+	float *outT;
+	int *outTriangleIndex;
+	float2 *outUV;
+
+	void operator()(int tileIndex, int /*threadIndex*/)
+	{
+		int rayBegin = tileIndex * rayTileSize;
+		mesh->IntersectRayTile(rays, rayBegin, Min(rayBegin + rayTileSize, numRays), kernel, outT, outTriangleIndex, outUV);
+	}
+};
+
+void TriangleMesh::IntersectRays(const Ray *rays, int numRays, float *outT, int *outTriangleIndex, float2 *outUV, int numThreads) const
+{
+	assume(rays || numRays == 0);
+	assume(outT || numRays == 0);
+
+	IntersectRayTileFunc func;
+	func.mesh = this;
+	func.rays = rays;
+	func.numRays = numRays;
+	func.kernel = NearestHitKernel(outTriangleIndex != 0, outUV != 0);
+	func.outT = outT;
+	func.outTriangleIndex = outTriangleIndex;
+	func.outUV = outUV;
+	ParallelFor((numRays + rayTileSize - 1) / rayTileSize, numThreads, func);
+}
+
+TriangleMesh::RangeKernel TriangleMesh::NearestHitKernel(bool needTriangleIndex, bool needUV) const
+{
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (ActiveSIMDCapability() == SIMD_AVX512)
+		return needUV ? &TriangleMesh::IntersectRay_TriangleIndex_UV_AVX512_Range
+			: (needTriangleIndex ? &TriangleMesh::IntersectRay_TriangleIndex_AVX512_Range : &TriangleMesh::IntersectRay_AVX512_Range);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (ActiveSIMDCapability() == SIMD_AVX)
+		return needUV ? &TriangleMesh::IntersectRay_TriangleIndex_UV_AVX_Range
+			: (needTriangleIndex ? &TriangleMesh::IntersectRay_TriangleIndex_AVX_Range : &TriangleMesh::IntersectRay_AVX_Range);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (ActiveSIMDCapability() == SIMD_SSE41)
+		return needUV ? &TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41_Range
+			: (needTriangleIndex ? &TriangleMesh::IntersectRay_TriangleIndex_SSE41_Range : &TriangleMesh::IntersectRay_SSE41_Range);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (ActiveSIMDCapability() == SIMD_SSE2)
+		return needUV ? &TriangleMesh::IntersectRay_TriangleIndex_UV_SSE2_Range
+			: (needTriangleIndex ? &TriangleMesh::IntersectRay_TriangleIndex_SSE2_Range : &TriangleMesh::IntersectRay_SSE2_Range);
+#endif
+
+	MARK_UNUSED(needTriangleIndex);
+	MARK_UNUSED(needUV);
+	return &TriangleMesh::IntersectRay_TriangleIndex_UV_CPP_Range;
+}
+
+void TriangleMesh::IntersectRayTile(const Ray *rays, int rayBegin, int rayEnd, RangeKernel kernel, float *outT, int *outTriangleIndex, float2 *outUV) const
+{
+	// The routines leave the index and the UV untouched when they find no hit, and not all of them compute these.
+	int triangleIndex[rayTileSize];
+	float u[rayTileSize];
+	float v[rayTileSize];
+	const int numTileRays = rayEnd - rayBegin;
+	assert(numTileRays <= rayTileSize);
+	for(int i = 0; i < numTileRays; ++i)
+	{
+		triangleIndex[i] = -1;
+		u[i] = v[i] = 0.f;
+	}
+
+	if (!bvhNodes.empty())
+	{
+		for(int i = 0; i < numTileRays; ++i)
+			outT[rayBegin+i] = IntersectRayWithKernel(rays[rayBegin+i], kernel, triangleIndex[i], u[i], v[i]);
+	}
+	else
+	{
+		for(int i = 0; i < numTileRays; ++i)
+			outT[rayBegin+i] = FLOAT_INF;
+		// The chunk boundaries are multiples of the SoA4, SoA8 and SoA16 block sizes.
+		for(int chunkBegin = 0; chunkBegin < numTriangles; chunkBegin += triangleChunkSize)
+		{
+			const int chunkEnd = Min(chunkBegin + triangleChunkSize, numTriangles);
+			for(int i = 0; i < numTileRays; ++i)
+				outT[rayBegin+i] = (this->*kernel)(rays[rayBegin+i], chunkBegin, chunkEnd, outT[rayBegin+i], triangleIndex[i], u[i], v[i]);
+		}
+	}
+
+	if (outTriangleIndex)
+		for(int i = 0; i < numTileRays; ++i)
+			outTriangleIndex[rayBegin+i] = triangleIndex[i];
+	if (outUV)
+		for(int i = 0; i < numTileRays; ++i)
+			outUV[rayBegin+i] = float2(u[i], v[i]);
+}
+
+/// Pads the given vertex data with triangles of zero area up to a multiple of clusterSize triangles, for the SoA
+/// layouts. All the intersection routines reject the padding triangles. (Padding with infinite coordinates would
+/// produce NaNs in the SIMD routines, which do not compare as misses.)
+static void PadVertexData(const float *&vertexData, int &numTriangles, int clusterSize, std::vector<float> &paddedVertexData)
+{
+	if (numTriangles % clusterSize == 0)
+		return;
+	paddedVertexData.assign(vertexData, vertexData + numTriangles*9);
+	numTriangles = (numTriangles + clusterSize - 1) / clusterSize * clusterSize;
+	paddedVertexData.resize(numTriangles*9, 0.f);
+	vertexData = &paddedVertexData[0];
+}
+
 void TriangleMesh::ReallocVertexBuffer(int numTris)
 {
 	AlignedFree(data);
-	data = (float*)AlignedMalloc(numTris*3*3*sizeof(float), 32);
+	data = (float*)AlignedMalloc(numTris*3*3*sizeof(float), 64);
 	numTriangles = numTris;
 }
 
-void TriangleMesh::SetAoS(const float *vertexData, int numTriangles)
+void TriangleMesh::SetAoS(const float *vertexData, int numTriangles, bool buildBVH)
 {
+	std::vector<float> bvhVertexData;
+	if (buildBVH && numTriangles > 0)
+	{
+		BuildBVH(vertexData, numTriangles, 1, bvhVertexData);
+		vertexData = &bvhVertexData[0];
+		numTriangles = (int)bvhVertexData.size() / 9;
+	}
+	else
+	{
+		bvhNodes.clear();
+		bvhTriangleIndices.clear();
+	}
+
 	ReallocVertexBuffer(numTriangles);
 #ifdef _DEBUG
 	vertexDataLayout = 0; // AoS
@@ -275,14 +440,28 @@ void TriangleMesh::SetAoS(const float *vertexData, int numTriangles)
 	memcpy(data, vertexData, numTriangles*3*3*4);
 }
 
-void TriangleMesh::SetSoA4(const float *vertexData, int numTriangles)
+void TriangleMesh::SetSoA4(const float *vertexData, int numTriangles, bool buildBVH)
 {
+	std::vector<float> bvhVertexData;
+	if (buildBVH && numTriangles > 0)
+	{
+		BuildBVH(vertexData, numTriangles, 4, bvhVertexData);
+		vertexData = &bvhVertexData[0];
+		numTriangles = (int)bvhVertexData.size() / 9;
+	}
+	else
+	{
+		bvhNodes.clear();
+		bvhTriangleIndices.clear();
+		PadVertexData(vertexData, numTriangles, 4, bvhVertexData);
+	}
+
 	ReallocVertexBuffer(numTriangles);
 #ifdef _DEBUG
 	vertexDataLayout = 1; // SoA4
 #endif
 
-	assert(numTriangles % 4 == 0); // We must have an evenly divisible amount of triangles, so that the SoA swizzling succeeds.
+	assert(numTriangles % 4 == 0); // The padding above guarantees an evenly divisible amount of triangles, so that the SoA swizzling succeeds.
 
 	// From (xyz xyz xyz) (xyz xyz xyz) (xyz xyz xyz) (xyz xyz xyz)
 	// To xxxx yyyy zzzz xxxx yyyy zzzz xxxx yyyy zzzz
@@ -314,14 +493,28 @@ void TriangleMesh::SetSoA4(const float *vertexData, int numTriangles)
 #endif
 }
 
-void TriangleMesh::SetSoA8(const float *vertexData, int numTriangles)
+void TriangleMesh::SetSoA8(const float *vertexData, int numTriangles, bool buildBVH)
 {
+	std::vector<float> bvhVertexData;
+	if (buildBVH && numTriangles > 0)
+	{
+		BuildBVH(vertexData, numTriangles, 8, bvhVertexData);
+		vertexData = &bvhVertexData[0];
+		numTriangles = (int)bvhVertexData.size() / 9;
+	}
+	else
+	{
+		bvhNodes.clear();
+		bvhTriangleIndices.clear();
+		PadVertexData(vertexData, numTriangles, 8, bvhVertexData);
+	}
+
 	ReallocVertexBuffer(numTriangles);
 #ifdef _DEBUG
 	vertexDataLayout = 2; // SoA8
 #endif
 
-	assert(numTriangles % 8 == 0); // We must have an evenly divisible amount of triangles, so that the SoA swizzling succeeds.
+	assert(numTriangles % 8 == 0); // The padding above guarantees an evenly divisible amount of triangles, so that the SoA swizzling succeeds.
 
 	// From (xyz xyz xyz) (xyz xyz xyz) (xyz xyz xyz) (xyz xyz xyz)
 	// To xxxxxxxx yyyyyyyy zzzzzzzz xxxxxxxx yyyyyyyy zzzzzzzz xxxxxxxx yyyyyyyy zzzzzzzz
@@ -357,7 +550,63 @@ void TriangleMesh::SetSoA8(const float *vertexData, int numTriangles)
 #endif
 }
 
+void TriangleMesh::SetSoA16(const float *vertexData, int numTriangles, bool buildBVH)
+{
+	std::vector<float> bvhVertexData;
+	if (buildBVH && numTriangles > 0)
+	{
+		BuildBVH(vertexData, numTriangles, 16, bvhVertexData);
+		vertexData = &bvhVertexData[0];
+		numTriangles = (int)bvhVertexData.size() / 9;
+	}
+	else
+	{
+		bvhNodes.clear();
+		bvhTriangleIndices.clear();
+		PadVertexData(vertexData, numTriangles, 16, bvhVertexData);
+	}
+
+	ReallocVertexBuffer(numTriangles);
+#ifdef _DEBUG
+	vertexDataLayout = 3; // SoA16
+#endif
+
+	assert(numTriangles % 16 == 0); // The padding above guarantees an evenly divisible amount of triangles, so that the SoA swizzling succeeds.
+
+	// From (xyz xyz xyz) (xyz xyz xyz) ... 16 triangles
+	// To 16*x 16*y 16*z 16*x 16*y 16*z 16*x 16*y 16*z
+
+	float *o = data;
+	for(int i = 0; i + 16 <= numTriangles; i += 16)
+	{
+		for(int j = 0; j < 9; ++j)
+		{
+			for(int k = 0; k < 16; ++k)
+				*o++ = vertexData[k*9];
+			++vertexData;
+		}
+		vertexData += 9 * 15;
+	}
+
+#ifdef SOA_HAS_EDGES
+	o = data;
+	for(int i = 0; i + 16 <= numTriangles; i += 16)
+	{
+		for(int j = 48; j < 96; ++j)
+			o[j] -= o[j-48];
+		for(int j = 96; j < 144; ++j)
+			o[j] -= o[j-96];
+		o += 144;
+	}
+#endif
+}
+
 float TriangleMesh::IntersectRay_TriangleIndex_UV_CPP(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+{
+	return IntersectRayWithKernel(ray, &TriangleMesh::IntersectRay_TriangleIndex_UV_CPP_Range, outTriangleIndex, outU, outV);
+}
+
+float TriangleMesh::IntersectRay_TriangleIndex_UV_CPP_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const
 {
 	assert(sizeof(float3) == 3*sizeof(float));
 	assert(sizeof(Triangle) == 3*sizeof(float3));
@@ -365,10 +614,10 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_CPP(const Ray &ray, int &outTr
 	assert(vertexDataLayout == 0); // Must be AoS structured!
 #endif
 
-	float nearestD = FLOAT_INF;
+	float nearestD = maxDistance;
 
-	const Triangle *tris = reinterpret_cast<const Triangle*>(data);
-	for(int i = 0; i < numTriangles; ++i)
+	const Triangle *tris = reinterpret_cast<const Triangle*>(data) + triangleBegin;
+	for(int i = triangleBegin; i < triangleEnd; ++i)
 	{
 		float u, v;
 		float d = Triangle::IntersectLineTri(ray.pos, ray.dir, tris->a, tris->b, tris->c, u, v);
@@ -385,9 +634,327 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_CPP(const Ray &ray, int &outTr
 	return nearestD;
 }
 
+bool TriangleMesh::IntersectRayAny_CPP(const Ray &ray, float maxDistance) const
+{
+	return IntersectRayAnyWithKernel(ray, maxDistance, &TriangleMesh::IntersectRayAny_CPP_Range);
+}
+
+float TriangleMesh::IntersectRayAny_CPP_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const
+{
+	MARK_UNUSED(outTriangleIndex);
+	MARK_UNUSED(outU);
+	MARK_UNUSED(outV);
+#ifdef _DEBUG
+	assert(vertexDataLayout == 0); // Must be AoS structured!
+#endif
+
+	const Triangle *tris = reinterpret_cast<const Triangle*>(data) + triangleBegin;
+	for(int i = triangleBegin; i < triangleEnd; ++i)
+	{
+		float u, v;
+		float d = Triangle::IntersectLineTri(ray.pos, ray.dir, tris->a, tris->b, tris->c, u, v);
+		if (d >= 0.f && d < maxDistance)
+			return d;
+		++tris;
+	}
+	return maxDistance;
+}
+
+bool TriangleMesh::IntersectRayAnyWithKernel(const Ray &ray, float maxDistance, RangeKernel kernel) const
+{
+	int triangleIndex;
+	float u, v;
+	float d;
+	if (!bvhNodes.empty())
+		d = IntersectRayBVH(ray, maxDistance, true, kernel, triangleIndex, u, v);
+	else
+		d = (this->*kernel)(ray, 0, numTriangles, maxDistance, triangleIndex, u, v);
+	return d < maxDistance;
+}
+
+float TriangleMesh::IntersectRayWithKernel(const Ray &ray, RangeKernel kernel, int &outTriangleIndex, float &outU, float &outV) const
+{
+	// The routines that do not compute the triangle index leave this at -1.
+	int triangleIndex = -1;
+	float d;
+	if (!bvhNodes.empty())
+		d = IntersectRayBVH(ray, FLOAT_INF, false, kernel, triangleIndex, outU, outV);
+	else
+		d = (this->*kernel)(ray, 0, numTriangles, FLOAT_INF, triangleIndex, outU, outV);
+
+	if (triangleIndex >= 0)
+		outTriangleIndex = bvhTriangleIndices.empty() ? triangleIndex : bvhTriangleIndices[triangleIndex];
+	return d;
+}
+
+/// The maximum depth of the BVH. Deeper subtrees are stored as leaves.
+static const int bvhMaxDepth = 64;
+
+/// Computes the interval of the ray inside the given BVH node bounds, clipped to [0, maxDistance].
+/** If the ray starts on a bounding plane and runs parallel to it, the slab distances are NaN. All the comparisons
+	with NaN are false, so such an axis leaves the interval as it is, and the node is conservatively not culled.
+	@return True if the interval is not empty. tNear receives the start of the interval. */
+static inline bool RayIntersectsBVHNode(const float *nodeMin, const float *nodeMax, const float3 &rayPos, const float3 &invDir, float maxDistance, float &tNear)
+{
+	float t0 = 0.f;
+	float t1 = maxDistance;
+	for(int i = 0; i < 3; ++i)
+	{
+		float a = (nodeMin[i] - rayPos[i]) * invDir[i];
+		float b = (nodeMax[i] - rayPos[i]) * invDir[i];
+		if (a > b)
+			Swap(a, b);
+		if (a > t0)
+			t0 = a;
+		if (b < t1)
+			t1 = b;
+	}
+	tNear = t0;
+	return t0 <= t1;
+}
+
+float TriangleMesh::IntersectRayBVH(const Ray &ray, float maxDistance, bool stopAtFirstHit, RangeKernel kernel, int &outTriangleIndex, float &outU, float &outV) const
+{
+	const float3 invDir(1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z);
+
+	float nearestD = maxDistance;
+	float tNear;
+	if (!RayIntersectsBVHNode(&bvhNodes[0].minX, &bvhNodes[0].maxX, ray.pos, invDir, nearestD, tNear))
+		return maxDistance;
+
+	// Each level of the tree pops one node and pushes at most two, so the stack never holds more than the depth of
+	// the tree plus one nodes.
+	int stack[bvhMaxDepth + 2];
+	float stackT[bvhMaxDepth + 2];
+	int stackSize = 0;
+	stack[stackSize] = 0;
+	stackT[stackSize++] = tNear;
+	while(stackSize > 0)
+	{
+		--stackSize;
+		// A nearer hit may have been found after this node was pushed.
+		if (stackT[stackSize] >= nearestD)
+			continue;
+		const BVHNode &node = bvhNodes[stack[stackSize]];
+		if (node.numLeafTriangles > 0)
+		{
+			int triangleIndex = -1;
+			float u = 0.f, v = 0.f;
+			float d = (this->*kernel)(ray, node.firstChildOrTriangle, node.firstChildOrTriangle + node.numLeafTriangles, nearestD, triangleIndex, u, v);
+			if (d < nearestD)
+			{
+				nearestD = d;
+				outTriangleIndex = triangleIndex;
+				outU = u;
+				outV = v;
+				if (stopAtFirstHit)
+					return d;
+			}
+		}
+		else
+		{
+			// Visit the nearer child first, so that its hits can cull the farther one.
+			const int left = node.firstChildOrTriangle;
+			float tLeft, tRight;
+			bool hitLeft = RayIntersectsBVHNode(&bvhNodes[left].minX, &bvhNodes[left].maxX, ray.pos, invDir, nearestD, tLeft);
+			bool hitRight = RayIntersectsBVHNode(&bvhNodes[left+1].minX, &bvhNodes[left+1].maxX, ray.pos, invDir, nearestD, tRight);
+			if (hitLeft && hitRight)
+			{
+				const bool leftFirst = tLeft <= tRight;
+				stack[stackSize] = leftFirst ? left + 1 : left;
+				stackT[stackSize++] = leftFirst ? tRight : tLeft;
+				stack[stackSize] = leftFirst ? left : left + 1;
+				stackT[stackSize++] = leftFirst ? tLeft : tRight;
+			}
+			else if (hitLeft || hitRight)
+			{
+				stack[stackSize] = hitLeft ? left : left + 1;
+				stackT[stackSize++] = hitLeft ? tLeft : tRight;
+			}
+		}
+	}
+	return nearestD;
+}
+
+/// A range of triangles to be made into a BVH node.
+struct BVHBuildTask
+{
+	int node;
+	int begin;
+	int end;
+	int depth;
+};
+
+/// Tells whether the centroid of a triangle falls to the left of the chosen split in the binned SAH build.
+struct BVHCentroidLeftOfSplit
+{
+	const float3 *centroids;
+	int axis;
+	float binMin;
+	float binScale;
+	int splitBin;
+
+	bool operator ()(int triangle) const
+	{
+		int bin = Min((int)((centroids[triangle][axis] - binMin) * binScale), numBins - 1);
+		return bin <= splitBin;
+	}
+
+	static const int numBins = 16;
+};
+
+void TriangleMesh::BuildBVH(const float *vertexData, int numTris, int clusterSize, std::vector<float> &outVertexData)
+{
+	bvhNodes.clear();
+	bvhTriangleIndices.clear();
+	outVertexData.clear();
+
+	const float3 *vertices = reinterpret_cast<const float3*>(vertexData);
+	std::vector<AABB> triangleAABBs(numTris);
+	std::vector<float3> centroids(numTris);
+	std::vector<int> order(numTris);
+	for(int i = 0; i < numTris; ++i)
+	{
+		AABB &aabb = triangleAABBs[i];
+		aabb.SetNegativeInfinity();
+		aabb.Enclose(vertices[3*i]);
+		aabb.Enclose(vertices[3*i+1]);
+		aabb.Enclose(vertices[3*i+2]);
+		assume(aabb.IsFinite());
+		// The intersection routines accept hits slightly outside the triangle edges, and the SIMD routines compute
+		// the barycentric coordinates with an approximate reciprocal, so grow the bounds to not cull such hits.
+		float pad = 1e-3f * aabb.Size().MaxElement() + 1e-6f * Max(aabb.minPoint.Abs().MaxElement(), aabb.maxPoint.Abs().MaxElement());
+		aabb.minPoint -= float3(pad, pad, pad);
+		aabb.maxPoint += float3(pad, pad, pad);
+		centroids[i] = aabb.CenterPoint();
+		order[i] = i;
+	}
+
+	// The cost of a leaf is the number of clusters of triangles it has, and the cost of testing the two children of
+	// an inner node is given relative to that.
+	const float traversalCost = 0.5f;
+	// Split larger leaves even if the surface area heuristic does not see a benefit.
+	const int maxLeafTriangles = 8 * clusterSize;
+	const int numBins = BVHCentroidLeftOfSplit::numBins;
+
+	std::vector<BVHBuildTask> tasks;
+	BVHBuildTask root = { 0, 0, numTris, 0 };
+	tasks.push_back(root);
+	bvhNodes.push_back(BVHNode());
+	while(!tasks.empty())
+	{
+		BVHBuildTask task = tasks.back();
+		tasks.pop_back();
+		const int count = task.end - task.begin;
+
+		AABB bounds, centroidBounds;
+		bounds.SetNegativeInfinity();
+		centroidBounds.SetNegativeInfinity();
+		for(int i = task.begin; i < task.end; ++i)
+		{
+			bounds.Enclose(triangleAABBs[order[i]]);
+			centroidBounds.Enclose(centroids[order[i]]);
+		}
+
+		int mid = -1;
+		const float3 centroidExtent = centroidBounds.Size();
+		const int axis = centroidExtent.MaxElementIndex();
+		if (count > clusterSize && task.depth < bvhMaxDepth && centroidExtent[axis] > 0.f)
+		{
+			// Binned SAH: sort the centroids into bins along the longest axis, and evaluate a split between each
+			// pair of adjacent bins.
+			BVHCentroidLeftOfSplit classify = { &centroids[0], axis, centroidBounds.minPoint[axis], numBins / centroidExtent[axis], 0 };
+			int binCount[numBins];
+			AABB binBounds[numBins];
+			for(int b = 0; b < numBins; ++b)
+			{
+				binCount[b] = 0;
+				binBounds[b].SetNegativeInfinity();
+			}
+			for(int i = task.begin; i < task.end; ++i)
+			{
+				int bin = Min((int)((centroids[order[i]][axis] - classify.binMin) * classify.binScale), numBins - 1);
+				++binCount[bin];
+				binBounds[bin].Enclose(triangleAABBs[order[i]]);
+			}
+
+			float rightCost[numBins];
+			AABB rightBounds;
+			rightBounds.SetNegativeInfinity();
+			int rightCount = 0;
+			for(int b = numBins - 1; b > 0; --b)
+			{
+				rightCount += binCount[b];
+				rightBounds.Enclose(binBounds[b]);
+				rightCost[b] = rightCount > 0 ? ((rightCount + clusterSize - 1) / clusterSize) * rightBounds.SurfaceArea() : 0.f;
+			}
+
+			float bestCost = FLOAT_INF;
+			int bestBin = -1;
+			AABB leftBounds;
+			leftBounds.SetNegativeInfinity();
+			int leftCount = 0;
+			for(int b = 0; b + 1 < numBins; ++b)
+			{
+				leftCount += binCount[b];
+				leftBounds.Enclose(binBounds[b]);
+				if (leftCount == 0 || leftCount == count)
+					continue;
+				float cost = ((leftCount + clusterSize - 1) / clusterSize) * leftBounds.SurfaceArea() + rightCost[b+1];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestBin = b;
+				}
+			}
+
+			const float area = bounds.SurfaceArea();
+			const float leafCost = ((count + clusterSize - 1) / clusterSize) * area;
+			if (bestBin >= 0 && (bestCost + traversalCost * area < leafCost || count > maxLeafTriangles))
+			{
+				classify.splitBin = bestBin;
+				mid = (int)(std::partition(order.begin() + task.begin, order.begin() + task.end, classify) - order.begin());
+				assert(mid > task.begin && mid < task.end);
+			}
+		}
+
+		BVHNode &node = bvhNodes[task.node];
+		node.minX = bounds.minPoint.x; node.minY = bounds.minPoint.y; node.minZ = bounds.minPoint.z;
+		node.maxX = bounds.maxPoint.x; node.maxY = bounds.maxPoint.y; node.maxZ = bounds.maxPoint.z;
+		if (mid < 0)
+		{
+			// Store the triangles of the leaf, padded to a whole number of clusters with degenerate triangles, which
+			// the intersection routines reject.
+			const int numPadded = (count + clusterSize - 1) / clusterSize * clusterSize;
+			node.firstChildOrTriangle = (int)bvhTriangleIndices.size();
+			node.numLeafTriangles = numPadded;
+			for(int i = 0; i < numPadded; ++i)
+			{
+				const int triangle = (i < count) ? order[task.begin + i] : -1;
+				bvhTriangleIndices.push_back(triangle);
+				for(int j = 0; j < 9; ++j)
+					outVertexData.push_back(triangle >= 0 ? vertexData[triangle*9 + j] : 0.f);
+			}
+		}
+		else
+		{
+			const int left = (int)bvhNodes.size();
+			node.firstChildOrTriangle = left;
+			node.numLeafTriangles = 0;
+			bvhNodes.push_back(BVHNode());
+			bvhNodes.push_back(BVHNode());
+			// Build the left child first, so that the leaves are stored in depth-first order.
+			BVHBuildTask rightTask = { left + 1, mid, task.end, task.depth + 1 };
+			BVHBuildTask leftTask = { left, task.begin, mid, task.depth + 1 };
+			tasks.push_back(rightTask);
+			tasks.push_back(leftTask);
+		}
+	}
+}
+
 MATH_END_NAMESPACE
 
-#ifdef MATH_SSE2
+#ifdef MATH_TRIANGLEMESH_SSE2
 #define MATH_GEN_SSE2
 #include "TriangleMesh_IntersectRay_SSE.inl"
 
@@ -399,9 +966,13 @@ MATH_END_NAMESPACE
 #define MATH_GEN_TRIANGLEINDEX
 #define MATH_GEN_UV
 #include "TriangleMesh_IntersectRay_SSE.inl"
+
+#define MATH_GEN_SSE2
+#define MATH_GEN_ANYHIT
+#include "TriangleMesh_IntersectRay_SSE.inl"
 #endif
 
-#ifdef MATH_SSE41
+#ifdef MATH_TRIANGLEMESH_SSE41
 #define MATH_GEN_SSE41
 #include "TriangleMesh_IntersectRay_SSE.inl"
 
@@ -413,9 +984,13 @@ MATH_END_NAMESPACE
 #define MATH_GEN_TRIANGLEINDEX
 #define MATH_GEN_UV
 #include "TriangleMesh_IntersectRay_SSE.inl"
+
+#define MATH_GEN_SSE41
+#define MATH_GEN_ANYHIT
+#include "TriangleMesh_IntersectRay_SSE.inl"
 #endif
 
-#ifdef MATH_AVX
+#ifdef MATH_TRIANGLEMESH_AVX
 #define MATH_GEN_AVX
 #include "TriangleMesh_IntersectRay_AVX.inl"
 
@@ -427,4 +1002,22 @@ MATH_END_NAMESPACE
 #define MATH_GEN_TRIANGLEINDEX
 #define MATH_GEN_UV
 #include "TriangleMesh_IntersectRay_AVX.inl"
+
+#define MATH_GEN_AVX
+#define MATH_GEN_ANYHIT
+#include "TriangleMesh_IntersectRay_AVX.inl"
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+#include "TriangleMesh_IntersectRay_AVX512.inl"
+
+#define MATH_GEN_TRIANGLEINDEX
+#include "TriangleMesh_IntersectRay_AVX512.inl"
+
+#define MATH_GEN_TRIANGLEINDEX
+#define MATH_GEN_UV
+#include "TriangleMesh_IntersectRay_AVX512.inl"
+
+#define MATH_GEN_ANYHIT
+#include "TriangleMesh_IntersectRay_AVX512.inl"
 #endif
@@ -18,59 +18,227 @@
 #pragma once
 
 #include "../MathGeoLibFwd.h"
+#include <vector>
+
+// On x86, the SSE2, SSE4.1, AVX and AVX-512 ray intersection routines are each compiled for their own instruction set, even
+// when MathGeoLib itself is built for an older one (or without MATH_SSE2), and the best routines that the CPU
+// supports are picked at runtime. See TriangleMesh::ActiveSIMDCapability(). Otherwise only the routines of the
+// instruction sets MathGeoLib is built for are available.
+#if !defined(MATH_TRIANGLEMESH_NO_RUNTIME_DISPATCH) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) \
+	&& ((defined(_MSC_VER) && _MSC_VER >= 1600) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define MATH_TRIANGLEMESH_RUNTIME_DISPATCH
+#define MATH_TRIANGLEMESH_SSE2
+#define MATH_TRIANGLEMESH_SSE41
+#define MATH_TRIANGLEMESH_AVX
+#if !defined(_MSC_VER) || _MSC_VER >= 1910 || defined(__clang__) // The AVX-512 intrinsics need Visual Studio 2017.
+#define MATH_TRIANGLEMESH_AVX512
+#endif
+#else
+#ifdef MATH_SSE2
+#define MATH_TRIANGLEMESH_SSE2
+#endif
+#ifdef MATH_SSE41
+#define MATH_TRIANGLEMESH_SSE41
+#endif
+#ifdef MATH_AVX
+#define MATH_TRIANGLEMESH_AVX
+#endif
+#ifdef __AVX512F__
+#define MATH_TRIANGLEMESH_AVX512
+#endif
+#endif
 
 MATH_BEGIN_NAMESPACE
 
 /// Represents an unindiced triangle mesh.
-/** This class stores a triangle mesh as flat array, optimized for ray intersections. */
+/** This class stores a triangle mesh as flat array, optimized for ray intersections.
+
+	By default, the ray intersection functions test every triangle of the mesh. For large meshes, pass buildBVH=true
+	to Set() to build a bounding volume hierarchy over the triangles. The triangles are then reordered so that the
+	triangles of each leaf of the hierarchy are stored together, in clusters of 4, 8 or 16 triangles in the SoA4, SoA8
+	and SoA16 layouts, and the intersection functions test only the leaves that the ray passes through, using the same SIMD
+	routines as for the whole mesh. The triangle indices returned by the intersection functions always refer to the
+	original order of the triangles given to Set(). */
 class TriangleMesh
 {
 public:
 	TriangleMesh();
 	~TriangleMesh();
 
+	/// Identifies the instruction set of a group of ray intersection routines.
+	enum SIMDCapability
+	{
+		SIMD_NONE, ///< The portable C++ routines, which use the AoS vertex layout.
+		SIMD_SSE2, ///< The SSE2 routines, which use the SoA4 vertex layout.
+		SIMD_SSE41, ///< The SSE4.1 routines, which use the SoA4 vertex layout.
+		SIMD_AVX, ///< The AVX routines, which use the SoA8 vertex layout.
+		SIMD_AVX512 ///< The AVX-512 routines, which use the SoA16 vertex layout.
+	};
+
+	/// Returns the instruction set of the vertex layout that Set() picks, and of the routines that IntersectRay(),
+	/// IntersectRayAny() and IntersectRays() call. This is the best instruction set that was compiled in and that
+	/// the CPU supports, detected with CPUID the first time it is needed. Useful for telemetry.
+	static SIMDCapability ActiveSIMDCapability();
+
+	/// Returns the name of the given instruction set, e.g. "AVX".
+	static const char *SIMDCapabilityToString(SIMDCapability capability);
+
+	/// Returns true if the routines of the given instruction set were compiled in and the CPU can run them. Calling
+	/// the routines of an unsupported instruction set directly crashes with an illegal instruction.
+	static bool IsSIMDCapabilitySupported(SIMDCapability capability);
+
 	/// Specifies the vertex data of this triangle mesh. Replaces any old
 	/// specified geometry.
-	void Set(const float *triangleMesh, int numTriangles);
-	void Set(const float3 *triangleMesh, int numTriangles) { Set(reinterpret_cast<const float *>(triangleMesh), numTriangles); }
-	void Set(const Triangle *triangleMesh, int numTriangles) { Set(reinterpret_cast<const float *>(triangleMesh), numTriangles); }
+	/** @param buildBVH If true, a bounding volume hierarchy is built over the triangles to speed up the ray
+			intersection functions. Building the hierarchy takes O(n log n) time. */
+	void Set(const float *triangleMesh, int numTriangles, bool buildBVH = false);
+	void Set(const float3 *triangleMesh, int numTriangles, bool buildBVH = false) { Set(reinterpret_cast<const float *>(triangleMesh), numTriangles, buildBVH); }
+	void Set(const Triangle *triangleMesh, int numTriangles, bool buildBVH = false) { Set(reinterpret_cast<const float *>(triangleMesh), numTriangles, buildBVH); }
+
+	void Set(const Polyhedron &polyhedron, bool buildBVH = false);
 
-	void Set(const Polyhedron &polyhedron);
+	/// Returns true if a bounding volume hierarchy was built for the current geometry.
+	bool HasBVH() const { return !bvhNodes.empty(); }
 
 	float IntersectRay(const Ray &ray) const;
 	float IntersectRay_TriangleIndex(const Ray &ray, int &outTriangleIndex) const;
 	float IntersectRay_TriangleIndex_UV(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
 
-	void SetAoS(const float *vertexData, int numTriangles);
-	void SetSoA4(const float *vertexData, int numTriangles);
-	void SetSoA8(const float *vertexData, int numTriangles);
+	/// Tests whether the given ray hits any triangle of this mesh nearer than maxDistance.
+	/** Unlike IntersectRay(), which must test all the triangles to find the nearest hit, this returns as soon as any
+		hit is found, so use this for shadow and line of sight tests. Pass FLOAT_INF as maxDistance to accept hits at
+		any distance. */
+	bool IntersectRayAny(const Ray &ray, float maxDistance) const;
+
+	/// Intersects a batch of rays with this mesh, finding the nearest hit of each ray.
+	/** The results are the same as calling IntersectRay_TriangleIndex_UV() for each ray, but the rays are processed in
+		tiles: without a BVH, each tile of rays is tested against one cache-sized chunk of triangles at a time, so the
+		vertex data is streamed from memory once per tile instead of once per ray. The tiles are independent, and can
+		be spread over multiple threads.
+		@param outT [out] For each ray, the distance to the nearest hit, or FLOAT_INF if the ray does not hit the mesh.
+		@param outTriangleIndex [out] If not null, receives for each ray the index of the hit triangle, or -1.
+		@param outUV [out] If not null, receives for each ray the barycentric UV coordinates of the hit, or (0,0).
+		@param numThreads The number of threads to use. If <= 0, NumHardwareThreads() threads are used. */
+	void IntersectRays(const Ray *rays, int numRays, float *outT, int *outTriangleIndex, float2 *outUV, int numThreads = 1) const;
+
+	/// Sets the vertex data in a specific layout. These are called by Set(), and are exposed for testing the
+	/// individual intersection routines, which may only be called if IsSIMDCapabilitySupported(). Without a BVH,
+	/// SetSoA4, SetSoA8 and SetSoA16 pad the triangles with degenerate ones up to a multiple of 4, 8 and 16. With a
+	/// BVH, each leaf is padded instead.
+	void SetAoS(const float *vertexData, int numTriangles, bool buildBVH = false);
+	void SetSoA4(const float *vertexData, int numTriangles, bool buildBVH = false);
+	void SetSoA8(const float *vertexData, int numTriangles, bool buildBVH = false);
+	void SetSoA16(const float *vertexData, int numTriangles, bool buildBVH = false);
 
 	float IntersectRay_TriangleIndex_UV_CPP(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
+	bool IntersectRayAny_CPP(const Ray &ray, float maxDistance) const;
 
-#ifdef MATH_SSE2
+#ifdef MATH_TRIANGLEMESH_SSE2
 	float IntersectRay_SSE2(const Ray &ray) const;
 	float IntersectRay_TriangleIndex_SSE2(const Ray &ray, int &outTriangleIndex) const;
 	float IntersectRay_TriangleIndex_UV_SSE2(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
+	bool IntersectRayAny_SSE2(const Ray &ray, float maxDistance) const;
 #endif
 
-#ifdef MATH_SSE41
+#ifdef MATH_TRIANGLEMESH_SSE41
 	float IntersectRay_SSE41(const Ray &ray) const;
 	float IntersectRay_TriangleIndex_SSE41(const Ray &ray, int &outTriangleIndex) const;
 	float IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
+	bool IntersectRayAny_SSE41(const Ray &ray, float maxDistance) const;
 #endif
 
-#ifdef MATH_AVX
+#ifdef MATH_TRIANGLEMESH_AVX
 	float IntersectRay_AVX(const Ray &ray) const;
 	float IntersectRay_TriangleIndex_AVX(const Ray &ray, int &outTriangleIndex) const;
 	float IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
+	bool IntersectRayAny_AVX(const Ray &ray, float maxDistance) const;
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+	float IntersectRay_AVX512(const Ray &ray) const;
+	float IntersectRay_TriangleIndex_AVX512(const Ray &ray, int &outTriangleIndex) const;
+	float IntersectRay_TriangleIndex_UV_AVX512(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const;
+	bool IntersectRayAny_AVX512(const Ray &ray, float maxDistance) const;
 #endif
 
 private:
+	/// A node of the bounding volume hierarchy.
+	struct BVHNode
+	{
+		float minX, minY, minZ;
+		/// For an inner node, the index of the first of its two consecutive child nodes. For a leaf, the index of
+		/// the first triangle of the leaf in the vertex data.
+		int firstChildOrTriangle;
+		float maxX, maxY, maxZ;
+		/// The number of triangles in a leaf, including the padding triangles, or 0 for an inner node.
+		int numLeafTriangles;
+	};
+
+	/// The common signature of the ray intersection routines, which test the triangles [triangleBegin, triangleEnd[
+	/// of the vertex data, and report a hit only if it is nearer than maxDistance. The index and the UV outputs are
+	/// written only when a hit is found, and only by the routines that compute them. The any-hit routines return
+	/// the distance of the first hit they find instead of the nearest one.
+	typedef float (TriangleMesh::*RangeKernel)(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+
+	/// Runs the given routine over the whole mesh, or over the leaves of the BVH that the ray passes through, and
+	/// maps the index of the hit triangle back to the original order of the triangles.
+	float IntersectRayWithKernel(const Ray &ray, RangeKernel kernel, int &outTriangleIndex, float &outU, float &outV) const;
+	/// Runs the given any-hit routine over the whole mesh or over the BVH, until the first hit.
+	bool IntersectRayAnyWithKernel(const Ray &ray, float maxDistance, RangeKernel kernel) const;
+	/// @param stopAtFirstHit If true, returns the distance of the first hit found instead of the nearest hit.
+	float IntersectRayBVH(const Ray &ray, float maxDistance, bool stopAtFirstHit, RangeKernel kernel, int &outTriangleIndex, float &outU, float &outV) const;
+
+	/// Returns the routine that IntersectRays() uses, computing only the outputs that are needed.
+	RangeKernel NearestHitKernel(bool needTriangleIndex, bool needUV) const;
+	/// Intersects the rays [rayBegin, rayEnd[ of a batch with this mesh. Called by IntersectRays() for each tile.
+	void IntersectRayTile(const Ray *rays, int rayBegin, int rayEnd, RangeKernel kernel, float *outT, int *outTriangleIndex, float2 *outUV) const;
+	struct IntersectRayTileFunc;
+
+	/// Builds the BVH over the given triangles, and outputs the triangles reordered and padded into leaf clusters of
+	/// the given size.
+	void BuildBVH(const float *vertexData, int numTriangles, int clusterSize, std::vector<float> &outVertexData);
+
+	float IntersectRay_TriangleIndex_UV_CPP_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRayAny_CPP_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+
+#ifdef MATH_TRIANGLEMESH_SSE2
+	float IntersectRay_SSE2_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_SSE2_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_UV_SSE2_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRayAny_SSE2_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+#endif
+
+#ifdef MATH_TRIANGLEMESH_SSE41
+	float IntersectRay_SSE41_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_SSE41_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_UV_SSE41_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRayAny_SSE41_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX
+	float IntersectRay_AVX_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_AVX_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_UV_AVX_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRayAny_AVX_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+	float IntersectRay_AVX512_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_AVX512_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRay_TriangleIndex_UV_AVX512_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+	float IntersectRayAny_AVX512_Range(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const;
+#endif
+
 	float *data;
 #ifdef _DEBUG
-	int vertexDataLayout; // 0 - AoS, 1 - SoA4, 2 - SoA8
+	int vertexDataLayout; // 0 - AoS, 1 - SoA4, 2 - SoA8, 3 - SoA16
 #endif
 	int numTriangles;
+	/// The nodes of the BVH, with the root at index 0. Empty if no BVH was built.
+	std::vector<BVHNode> bvhNodes;
+	/// For each triangle of the vertex data, the index of the triangle in the array given to Set(), or -1 for the
+	/// padding triangles. Empty if no BVH was built.
+	std::vector<int> bvhTriangleIndices;
 	void ReallocVertexBuffer(int numTriangles);
 };
 
@@ -20,13 +20,48 @@
 
 MATH_BEGIN_NAMESPACE
 
-#if !defined(MATH_GEN_TRIANGLEINDEX)
-float TriangleMesh::IntersectRay_AVX(const Ray &ray) const
+#if defined(MATH_GEN_ANYHIT)
+#define MATH_GEN_FUNC IntersectRayAny_AVX
+#define MATH_GEN_RANGE_FUNC IntersectRayAny_AVX_Range
+#elif !defined(MATH_GEN_TRIANGLEINDEX)
+#define MATH_GEN_FUNC IntersectRay_AVX
+#define MATH_GEN_RANGE_FUNC IntersectRay_AVX_Range
 #elif defined(MATH_GEN_TRIANGLEINDEX) && !defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_AVX(const Ray &ray, int &outTriangleIndex) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_AVX
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_AVX_Range
 #elif defined(MATH_GEN_TRIANGLEINDEX) && defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_UV_AVX
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_UV_AVX_Range
 #endif
+
+#define MATH_GEN_TARGET MATH_TARGET_AVX
+
+#if defined(MATH_GEN_ANYHIT)
+bool TriangleMesh::MATH_GEN_FUNC(const Ray &ray, float maxDistance) const
+{
+	return IntersectRayAnyWithKernel(ray, maxDistance, &TriangleMesh::MATH_GEN_RANGE_FUNC);
+}
+#elif !defined(MATH_GEN_TRIANGLEINDEX)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray) const
+{
+	int triangleIndex;
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, triangleIndex, u, v);
+}
+#elif !defined(MATH_GEN_UV)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex) const
+{
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, u, v);
+}
+#else
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+{
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, outU, outV);
+}
+#endif
+
+MATH_GEN_TARGET float TriangleMesh::MATH_GEN_RANGE_FUNC(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const
 {
 //	std::cout << numTris << " tris: ";
 //	TRACESTART(RayTriMeshIntersectAVX);
@@ -39,9 +74,18 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 
 //	hitTriangleIndex = -1;
 //	float3 pt;
-	const float inf = FLOAT_INF;
-	__m256 nearestD = _mm256_set1_ps(inf);
+#ifndef MATH_GEN_TRIANGLEINDEX
+	MARK_UNUSED(outTriangleIndex);
+#endif
+#ifndef MATH_GEN_UV
+	MARK_UNUSED(outU);
+	MARK_UNUSED(outV);
+#endif
+	assert(triangleBegin % 8 == 0);
+
+	__m256 nearestD = _mm256_set1_ps(maxDistance);
 #ifdef MATH_GEN_UV
+	const float inf = FLOAT_INF;
 	__m256 nearestU = _mm256_set1_ps(inf);
 	__m256 nearestV = _mm256_set1_ps(inf);
 #endif
@@ -63,9 +107,9 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 
 	assert(((uintptr_t)data & 0x1F) == 0);
 
-	const float *tris = reinterpret_cast<const float*>(data);
+	const float *tris = reinterpret_cast<const float*>(data) + triangleBegin * 9;
 
-	for(int i = 0; i+8 <= numTriangles; i += 8)
+	for(int i = triangleBegin; i+8 <= triangleEnd; i += 8)
 	{
 		__m256 v0x = _mm256_load_ps(tris);
 		__m256 v0y = _mm256_load_ps(tris+8);
@@ -112,7 +156,7 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 //			return FLOAT_INF;
 		__m256 recipDet = _mm256_rcp_ps(det);
 
-		__m256 absdet = abs_ps256(det);
+		__m256 absdet = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
 		__m256 out = _mm256_cmp_ps(absdet, epsilon, _CMP_LT_OQ);
 
 		// Calculate distance from v0 to ray origin
@@ -157,6 +201,19 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 		out2 = _mm256_cmp_ps(t, nearestD, _CMP_GE_OQ);
 		out = _mm256_or_ps(out, out2);
 
+#ifdef MATH_GEN_ANYHIT
+		// Stop at the first triangle that is hit nearer than maxDistance.
+		int hitMask = _mm256_movemask_ps(out) ^ 0xFF;
+		if (hitMask != 0)
+		{
+			float hitT[8];
+			_mm256_storeu_ps(hitT, t);
+			int lane = 0;
+			while((hitMask & (1 << lane)) == 0)
+				++lane;
+			return hitT[lane];
+		}
+#else
 		// Store the index of the triangle that was hit.
 #ifdef MATH_GEN_TRIANGLEINDEX
 		__m256i hitIndex = _mm256_set1_epi32(i);
@@ -172,9 +229,14 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 		// 0x00 in indices which are better.
 		nearestD = _mm256_blendv_ps(t, nearestD, out);
 
+#endif
+
 		tris += 72;
 	}
 
+#ifdef MATH_GEN_ANYHIT
+	return maxDistance;
+#else
 	float ds[32];
 	float *alignedDS = (float*)(((uintptr_t)ds + 0x1F) & ~0x1F);
 
@@ -198,7 +260,7 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 
 	_mm256_store_ps(alignedDS, nearestD);
 
-	float smallestT = FLOAT_INF;
+	float smallestT = maxDistance;
 //	float u = FLOAT_NAN, v = FLOAT_NAN;
 	for(int i = 0; i < 8; ++i)
 		if (alignedDS[i] < smallestT)
@@ -228,14 +290,21 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_AVX(const Ray &ray, int &outTr
 //	std::cout << "(AVX) " << processedBytes / avgtimes * 1000.0 / 1024.0 / 1024.0 / 1024.0 << "GB/sec." << std::endl;
 
 	return smallestT;
+#endif
 }
 
 
+#undef MATH_GEN_FUNC
+#undef MATH_GEN_RANGE_FUNC
+#undef MATH_GEN_TARGET
 #ifdef MATH_GEN_TRIANGLEINDEX
 #undef MATH_GEN_TRIANGLEINDEX
 #endif
 #ifdef MATH_GEN_UV
 #undef MATH_GEN_UV
 #endif
+#ifdef MATH_GEN_ANYHIT
+#undef MATH_GEN_ANYHIT
+#endif
 
 MATH_END_NAMESPACE
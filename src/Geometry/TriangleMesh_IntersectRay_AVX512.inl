@@ -0,0 +1,261 @@
+/* Copyright Jukka Jylnki
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file TriangleMesh_IntersectRay_AVX512.inl
+	@author Jukka Jylnki
+	@brief AVX-512 implementation of ray-mesh intersection routines. */
+
+MATH_BEGIN_NAMESPACE
+
+#if defined(MATH_GEN_ANYHIT)
+#define MATH_GEN_FUNC IntersectRayAny_AVX512
+#define MATH_GEN_RANGE_FUNC IntersectRayAny_AVX512_Range
+#elif !defined(MATH_GEN_TRIANGLEINDEX)
+#define MATH_GEN_FUNC IntersectRay_AVX512
+#define MATH_GEN_RANGE_FUNC IntersectRay_AVX512_Range
+#elif defined(MATH_GEN_TRIANGLEINDEX) && !defined(MATH_GEN_UV)
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_AVX512
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_AVX512_Range
+#elif defined(MATH_GEN_TRIANGLEINDEX) && defined(MATH_GEN_UV)
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_UV_AVX512
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_UV_AVX512_Range
+#endif
+
+#if defined(MATH_GEN_ANYHIT)
+bool TriangleMesh::MATH_GEN_FUNC(const Ray &ray, float maxDistance) const
+{
+	return IntersectRayAnyWithKernel(ray, maxDistance, &TriangleMesh::MATH_GEN_RANGE_FUNC);
+}
+#elif !defined(MATH_GEN_TRIANGLEINDEX)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray) const
+{
+	int triangleIndex;
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, triangleIndex, u, v);
+}
+#elif !defined(MATH_GEN_UV)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex) const
+{
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, u, v);
+}
+#else
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+{
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, outU, outV);
+}
+#endif
+
+MATH_TARGET_AVX512 float TriangleMesh::MATH_GEN_RANGE_FUNC(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const
+{
+	assert(sizeof(float3) == 3*sizeof(float));
+	assert(sizeof(Triangle) == 3*sizeof(float3));
+#ifdef _DEBUG
+	assert(vertexDataLayout == 3); // Must be SoA16 structured!
+#endif
+
+#ifndef MATH_GEN_TRIANGLEINDEX
+	MARK_UNUSED(outTriangleIndex);
+#endif
+#ifndef MATH_GEN_UV
+	MARK_UNUSED(outU);
+	MARK_UNUSED(outV);
+#endif
+	assert(triangleBegin % 16 == 0);
+
+	__m512 nearestD = _mm512_set1_ps(maxDistance);
+#ifdef MATH_GEN_UV
+	__m512 nearestU = _mm512_setzero_ps();
+	__m512 nearestV = _mm512_setzero_ps();
+#endif
+#ifdef MATH_GEN_TRIANGLEINDEX
+	__m512i nearestIndex = _mm512_set1_epi32(-1);
+#endif
+
+	const __m512 lX = _mm512_set1_ps(ray.pos.x);
+	const __m512 lY = _mm512_set1_ps(ray.pos.y);
+	const __m512 lZ = _mm512_set1_ps(ray.pos.z);
+
+	const __m512 dX = _mm512_set1_ps(ray.dir.x);
+	const __m512 dY = _mm512_set1_ps(ray.dir.y);
+	const __m512 dZ = _mm512_set1_ps(ray.dir.z);
+
+	const __m512 epsilon = _mm512_set1_ps(1e-4f);
+	const __m512 negEpsilon = _mm512_set1_ps(-1e-4f);
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 one = _mm512_set1_ps(1.f);
+
+	assert(((uintptr_t)data & 0x3F) == 0);
+
+	const float *tris = reinterpret_cast<const float*>(data) + triangleBegin * 9;
+
+	for(int i = triangleBegin; i+16 <= triangleEnd; i += 16)
+	{
+		__m512 v0x = _mm512_load_ps(tris);
+		__m512 v0y = _mm512_load_ps(tris+16);
+		__m512 v0z = _mm512_load_ps(tris+32);
+
+#ifdef SOA_HAS_EDGES
+		// Edge vectors
+		__m512 e1x = _mm512_load_ps(tris+48);
+		__m512 e1y = _mm512_load_ps(tris+64);
+		__m512 e1z = _mm512_load_ps(tris+80);
+
+		__m512 e2x = _mm512_load_ps(tris+96);
+		__m512 e2y = _mm512_load_ps(tris+112);
+		__m512 e2z = _mm512_load_ps(tris+128);
+#else
+		__m512 v1x = _mm512_load_ps(tris+48);
+		__m512 v1y = _mm512_load_ps(tris+64);
+		__m512 v1z = _mm512_load_ps(tris+80);
+
+		__m512 v2x = _mm512_load_ps(tris+96);
+		__m512 v2y = _mm512_load_ps(tris+112);
+		__m512 v2z = _mm512_load_ps(tris+128);
+
+		// Edge vectors
+		__m512 e1x = _mm512_sub_ps(v1x, v0x);
+		__m512 e1y = _mm512_sub_ps(v1y, v0y);
+		__m512 e1z = _mm512_sub_ps(v1z, v0z);
+
+		__m512 e2x = _mm512_sub_ps(v2x, v0x);
+		__m512 e2y = _mm512_sub_ps(v2y, v0y);
+		__m512 e2z = _mm512_sub_ps(v2z, v0z);
+#endif
+		// begin calculating determinant - also used to calculate U parameter
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dY, e2z), _mm512_mul_ps(dZ, e2y));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dZ, e2x), _mm512_mul_ps(dX, e2z));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dX, e2y), _mm512_mul_ps(dY, e2x));
+
+		// If det < 0, intersecting backfacing tri, > 0, intersecting frontfacing tri, 0, parallel to plane.
+		__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+
+		// The mask hit collects the lanes that pass all the tests below. Unlike the blend masks of the SSE and AVX
+		// routines, the comparisons are false for NaNs, so NaNs never count as hits.
+
+		// If determinant is near zero, ray lies in plane of triangle.
+		__mmask16 hit = _mm512_cmp_ps_mask(det, epsilon, _CMP_GE_OQ) | _mm512_cmp_ps_mask(det, negEpsilon, _CMP_LE_OQ);
+
+		// The reciprocal is accurate to 14 bits, more than the 12 bits of _mm256_rcp_ps. (The masked form is used
+		// because the unmasked one passes an undefined register through, which GCC warns about as uninitialized.)
+		__m512 recipDet = _mm512_mask_rcp14_ps(det, (__mmask16)0xFFFF, det);
+
+		// Calculate distance from v0 to ray origin
+		__m512 tx = _mm512_sub_ps(lX, v0x);
+		__m512 ty = _mm512_sub_ps(lY, v0y);
+		__m512 tz = _mm512_sub_ps(lZ, v0z);
+
+		// Output barycentric u
+		__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz)), recipDet);
+
+		// Barycentric U must be inside the triangle.
+		hit = _mm512_mask_cmp_ps_mask(hit, u, zero, _CMP_GE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, u, one, _CMP_LE_OQ);
+
+		// Prepare to test V parameter
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+
+		// Output barycentric v
+		__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dX, qx), _mm512_mul_ps(dY, qy)), _mm512_mul_ps(dZ, qz)), recipDet);
+
+		// Barycentric V and the combination of U and V must be inside the triangle.
+		hit = _mm512_mask_cmp_ps_mask(hit, v, zero, _CMP_GE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+
+		// Output signed distance from ray to triangle.
+		__m512 t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), recipDet);
+
+		// In front of the ray, and better than the previous result?
+		hit = _mm512_mask_cmp_ps_mask(hit, t, zero, _CMP_GE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, t, nearestD, _CMP_LT_OQ);
+
+#ifdef MATH_GEN_ANYHIT
+		// Stop at the first triangle that is hit nearer than maxDistance.
+		if (hit != 0)
+		{
+			float hitT[16];
+			_mm512_storeu_ps(hitT, t);
+			int lane = 0;
+			while((hit & (1 << lane)) == 0)
+				++lane;
+			return hitT[lane];
+		}
+#else
+		// Store the index of the triangle that was hit.
+#ifdef MATH_GEN_TRIANGLEINDEX
+		nearestIndex = _mm512_mask_mov_epi32(nearestIndex, hit, _mm512_set1_epi32(i));
+#endif
+
+#ifdef MATH_GEN_UV
+		nearestU = _mm512_mask_mov_ps(nearestU, hit, u);
+		nearestV = _mm512_mask_mov_ps(nearestV, hit, v);
+#endif
+
+		nearestD = _mm512_mask_mov_ps(nearestD, hit, t);
+#endif
+
+		tris += 144;
+	}
+
+#ifdef MATH_GEN_ANYHIT
+	return maxDistance;
+#else
+	float ds[16];
+	_mm512_storeu_ps(ds, nearestD);
+
+#ifdef MATH_GEN_UV
+	float us[16];
+	float vs[16];
+	_mm512_storeu_ps(us, nearestU);
+	_mm512_storeu_ps(vs, nearestV);
+#endif
+
+#ifdef MATH_GEN_TRIANGLEINDEX
+	int indices[16];
+	_mm512_storeu_si512(indices, nearestIndex);
+#endif
+
+	float smallestT = maxDistance;
+	for(int i = 0; i < 16; ++i)
+		if (ds[i] < smallestT)
+		{
+			smallestT = ds[i];
+#ifdef MATH_GEN_TRIANGLEINDEX
+			outTriangleIndex = indices[i]+i;
+#endif
+#ifdef MATH_GEN_UV
+			outU = us[i];
+			outV = vs[i];
+#endif
+		}
+
+	return smallestT;
+#endif
+}
+
+#undef MATH_GEN_FUNC
+#undef MATH_GEN_RANGE_FUNC
+#ifdef MATH_GEN_TRIANGLEINDEX
+#undef MATH_GEN_TRIANGLEINDEX
+#endif
+#ifdef MATH_GEN_UV
+#undef MATH_GEN_UV
+#endif
+#ifdef MATH_GEN_ANYHIT
+#undef MATH_GEN_ANYHIT
+#endif
+
+MATH_END_NAMESPACE
@@ -17,19 +17,64 @@
 	@brief SSE implementation of ray-mesh intersection routines. */
 MATH_BEGIN_NAMESPACE
 
-#if defined(MATH_GEN_SSE2) && !defined(MATH_GEN_TRIANGLEINDEX)
-float TriangleMesh::IntersectRay_SSE2(const Ray &ray) const
+#if defined(MATH_GEN_SSE2) && defined(MATH_GEN_ANYHIT)
+#define MATH_GEN_FUNC IntersectRayAny_SSE2
+#define MATH_GEN_RANGE_FUNC IntersectRayAny_SSE2_Range
+#elif defined(MATH_GEN_SSE41) && defined(MATH_GEN_ANYHIT)
+#define MATH_GEN_FUNC IntersectRayAny_SSE41
+#define MATH_GEN_RANGE_FUNC IntersectRayAny_SSE41_Range
+#elif defined(MATH_GEN_SSE2) && !defined(MATH_GEN_TRIANGLEINDEX)
+#define MATH_GEN_FUNC IntersectRay_SSE2
+#define MATH_GEN_RANGE_FUNC IntersectRay_SSE2_Range
 #elif defined(MATH_GEN_SSE2) && defined(MATH_GEN_TRIANGLEINDEX) && !defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_SSE2(const Ray &ray, int &outTriangleIndex) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_SSE2
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_SSE2_Range
 #elif defined(MATH_GEN_SSE2) && defined(MATH_GEN_TRIANGLEINDEX) && defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE2(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_UV_SSE2
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_UV_SSE2_Range
 #elif defined(MATH_GEN_SSE41) && !defined(MATH_GEN_TRIANGLEINDEX)
-float TriangleMesh::IntersectRay_SSE41(const Ray &ray) const
+#define MATH_GEN_FUNC IntersectRay_SSE41
+#define MATH_GEN_RANGE_FUNC IntersectRay_SSE41_Range
 #elif defined(MATH_GEN_SSE41) && defined(MATH_GEN_TRIANGLEINDEX) && !defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_SSE41(const Ray &ray, int &outTriangleIndex) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_SSE41
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_SSE41_Range
 #elif defined(MATH_GEN_SSE41) && defined(MATH_GEN_TRIANGLEINDEX) && defined(MATH_GEN_UV)
-float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+#define MATH_GEN_FUNC IntersectRay_TriangleIndex_UV_SSE41
+#define MATH_GEN_RANGE_FUNC IntersectRay_TriangleIndex_UV_SSE41_Range
 #endif
+
+#ifdef MATH_GEN_SSE41
+#define MATH_GEN_TARGET MATH_TARGET_SSE41
+#else
+#define MATH_GEN_TARGET MATH_TARGET_SSE2
+#endif
+
+#if defined(MATH_GEN_ANYHIT)
+bool TriangleMesh::MATH_GEN_FUNC(const Ray &ray, float maxDistance) const
+{
+	return IntersectRayAnyWithKernel(ray, maxDistance, &TriangleMesh::MATH_GEN_RANGE_FUNC);
+}
+#elif !defined(MATH_GEN_TRIANGLEINDEX)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray) const
+{
+	int triangleIndex;
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, triangleIndex, u, v);
+}
+#elif !defined(MATH_GEN_UV)
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex) const
+{
+	float u, v;
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, u, v);
+}
+#else
+float TriangleMesh::MATH_GEN_FUNC(const Ray &ray, int &outTriangleIndex, float &outU, float &outV) const
+{
+	return IntersectRayWithKernel(ray, &TriangleMesh::MATH_GEN_RANGE_FUNC, outTriangleIndex, outU, outV);
+}
+#endif
+
+MATH_GEN_TARGET float TriangleMesh::MATH_GEN_RANGE_FUNC(const Ray &ray, int triangleBegin, int triangleEnd, float maxDistance, int &outTriangleIndex, float &outU, float &outV) const
 {
 //	std::cout << numTris << " tris: ";
 //	TRACESTART(RayTriMeshIntersectSSE);
@@ -40,9 +85,18 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 	assert(vertexDataLayout == 1); // Must be SoA4 structured!
 #endif
 	
-	const float inf = FLOAT_INF;
-	__m128 nearestD = _mm_set1_ps(inf);
+#ifndef MATH_GEN_TRIANGLEINDEX
+	MARK_UNUSED(outTriangleIndex);
+#endif
+#ifndef MATH_GEN_UV
+	MARK_UNUSED(outU);
+	MARK_UNUSED(outV);
+#endif
+	assert(triangleBegin % 4 == 0);
+
+	__m128 nearestD = _mm_set1_ps(maxDistance);
 #ifdef MATH_GEN_UV
+	const float inf = FLOAT_INF;
 	__m128 nearestU = _mm_set1_ps(inf);
 	__m128 nearestV = _mm_set1_ps(inf);
 #endif
@@ -66,9 +120,9 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 
 	assert(((uintptr_t)data & 0xF) == 0);
 
-	const float *tris = reinterpret_cast<const float*>(data);
+	const float *tris = reinterpret_cast<const float*>(data) + triangleBegin * 9;
 
-	for(int i = 0; i+4 <= numTriangles; i += 4)
+	for(int i = triangleBegin; i+4 <= triangleEnd; i += 4)
 	{
 		__m128 v0x = _mm_load_ps(tris);
 		__m128 v0y = _mm_load_ps(tris+4);
@@ -164,6 +218,19 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 		// The mask 'out' now contains 0xFF in all indices which are worse than previous, and
 		// 0x00 in indices which are better.
 
+#ifdef MATH_GEN_ANYHIT
+		// Stop at the first triangle that is hit nearer than maxDistance.
+		int hitMask = _mm_movemask_ps(out) ^ 0xF;
+		if (hitMask != 0)
+		{
+			float hitT[4];
+			_mm_storeu_ps(hitT, t);
+			int lane = 0;
+			while((hitMask & (1 << lane)) == 0)
+				++lane;
+			return hitT[lane];
+		}
+#else
 #ifdef MATH_GEN_SSE41
 		nearestD = _mm_blendv_ps(t, nearestD, out);
 #else
@@ -202,11 +269,16 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 		nearestIndex = _mm_or_si128(hitIndex, nearestIndex);
 #endif
 
+#endif
+
 #endif
 
 		tris += 36;
 	}
 
+#ifdef MATH_GEN_ANYHIT
+	return maxDistance;
+#else
 	float ds[16];
 	float *alignedDS = (float*)(((uintptr_t)ds + 0xF) & ~0xF);
 
@@ -230,7 +302,7 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 
 	_mm_store_ps(alignedDS, nearestD);
 
-	float smallestT = FLOAT_INF;
+	float smallestT = maxDistance;
 //	float u = FLOAT_NAN, v = FLOAT_NAN;
 	for(int i = 0; i < 4; ++i)
 		if (alignedDS[i] < smallestT)
@@ -260,6 +332,7 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 //	std::cout << "(SSE) " << processedBytes / avgtimes * 1000.0 / 1024.0 / 1024.0 / 1024.0 << "GB/sec." << std::endl;
 
 	return smallestT;
+#endif
 }
 
 
@@ -270,6 +343,9 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 
 
 
+#undef MATH_GEN_FUNC
+#undef MATH_GEN_RANGE_FUNC
+#undef MATH_GEN_TARGET
 #ifdef MATH_GEN_SSE2
 #undef MATH_GEN_SSE2
 #endif
@@ -282,5 +358,8 @@ float TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41(const Ray &ray, int &out
 #ifdef MATH_GEN_UV
 #undef MATH_GEN_UV
 #endif
+#ifdef MATH_GEN_ANYHIT
+#undef MATH_GEN_ANYHIT
+#endif
 
 MATH_END_NAMESPACE
@@ -175,4 +175,58 @@ void ExtractBits(int pos, int bits, ResultType &out, const InputType &in)
 	out = (ResultType)(in >> pos & BitMask(0, bits));
 }
 
+/// @return The index of the most significant set bit of the given value, or -1 if value == 0.
+inline int HighestSetBitIndex64(u64 value)
+{
+	if (!value)
+		return -1;
+	int index = 0;
+	for(int shift = 32; shift > 0; shift >>= 1)
+		if (value >> shift)
+		{
+			value >>= shift;
+			index += shift;
+		}
+	return index;
+}
+
+/// Spreads the bits of the given value to the even bit positions of a 64-bit value, i.e. inserts a zero bit above each bit.
+inline u64 SpreadBitsToEven(u32 value)
+{
+	u64 v = value;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v;
+}
+
+/// Gathers the even bits of the given value to a 32-bit value. This is the inverse of SpreadBitsToEven().
+inline u32 GatherEvenBits(u64 value)
+{
+	u64 v = value & 0x5555555555555555ULL;
+	v = (v | (v >> 1)) & 0x3333333333333333ULL;
+	v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v >> 4)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v >> 16)) & 0x00000000FFFFFFFFULL;
+	return (u32)v;
+}
+
+/** @return The 2D Morton code, i.e. the index on the Z-order curve, of the given integer coordinates. The bits of x
+		are interleaved to the even and the bits of y to the odd bit positions of the result.
+	@see DecodeMortonCode2D(). */
+inline u64 MortonCode2D(u32 x, u32 y)
+{
+	return SpreadBitsToEven(x) | (SpreadBitsToEven(y) << 1);
+}
+
+/// Extracts the integer coordinates from a 2D Morton code. This is the inverse of MortonCode2D().
+inline void DecodeMortonCode2D(u64 code, u32 &x, u32 &y)
+{
+	x = GatherEvenBits(code);
+	y = GatherEvenBits(code >> 1);
+}
+
 MATH_END_NAMESPACE
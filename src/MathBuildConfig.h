@@ -79,6 +79,12 @@
 #define MATH_ENABLE_STL_SUPPORT
 #endif
 
+// If MATH_THREADING_SUPPORT is defined, MathGeoLib uses C++11 std::thread to spread some expensive operations
+// (e.g. building a KdTree) over multiple threads. Otherwise these operations always run on the calling thread.
+#if !defined(MATH_THREADING_SUPPORT) && (__cplusplus >= 201103L || _MSC_VER >= 1700) && !defined(EMSCRIPTEN) && !defined(FLASCC) && !defined(__native_client__)
+#define MATH_THREADING_SUPPORT
+#endif
+
 // If MATH_TINYXML_INTEROP is defined, MathGeoLib integrates with TinyXML to provide
 // serialization and deserialization to XML for the data structures.
 #ifndef MATH_TINYXML_INTEROP
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// A 2D object type for testing HashGrid2D, stored by pointer. The same objects can also be placed in a QuadTree.
+struct HashGridTestObject2D
+{
+	float2 pos;
+	float halfSize;
+};
+
+float MinX(HashGridTestObject2D * const &o) { return o->pos.x - o->halfSize; }
+float MaxX(HashGridTestObject2D * const &o) { return o->pos.x + o->halfSize; }
+float MinY(HashGridTestObject2D * const &o) { return o->pos.y - o->halfSize; }
+float MaxY(HashGridTestObject2D * const &o) { return o->pos.y + o->halfSize; }
+
+AABB2D GetAABB2D(HashGridTestObject2D * const &o)
+{
+	return AABB2D(float2(MinX(o), MinY(o)), float2(MaxX(o), MaxY(o)));
+}
+
+template<typename Node>
+void AssociateQuadTreeNode(HashGridTestObject2D * const &, Node *) {}
+
+/// A 3D object type for testing HashGrid3D, stored by pointer.
+struct HashGridTestObject3D
+{
+	float3 pos;
+	float3 halfSize;
+};
+
+AABB GetAABB(HashGridTestObject3D * const &o)
+{
+	return AABB(o->pos - o->halfSize, o->pos + o->halfSize);
+}
+
+/// Returns a deterministic set of small square objects scattered over a world of the given size. Every 100th object
+/// is larger than the cells of the test grids.
+std::vector<HashGridTestObject2D> HashGridTestObjects2D(int numObjects, float worldSize, int seed)
+{
+	LCG lcg(seed);
+	std::vector<HashGridTestObject2D> objects(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+	{
+		objects[i].pos = float2(lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize));
+		objects[i].halfSize = (i % 100 == 0) ? lcg.Float(2.f, 20.f) : lcg.Float(0.f, 2.f);
+	}
+	return objects;
+}
+
+std::vector<HashGridTestObject3D> HashGridTestObjects3D(int numObjects, float worldSize, int seed)
+{
+	LCG lcg(seed);
+	std::vector<HashGridTestObject3D> objects(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+	{
+		objects[i].pos = float3(lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize));
+		float maxHalfSize = (i % 100 == 0) ? 20.f : 2.f;
+		objects[i].halfSize = float3(lcg.Float(0.f, maxHalfSize), lcg.Float(0.f, maxHalfSize), lcg.Float(0.f, maxHalfSize));
+	}
+	return objects;
+}
+
+/// Collects the objects found by a query of a HashGrid2D or a HashGrid3D.
+template<typename Object, typename Bounds>
+struct CollectHashGridObjects
+{
+	std::vector<Object*> objects;
+
+	template<typename Grid>
+	bool operator()(Grid & /*grid*/, const Bounds & /*queryAABB*/, Object *&object, const Bounds & /*objectAABB*/)
+	{
+		objects.push_back(object);
+		return false;
+	}
+};
+
+/// Collects the pairs reported by CollidingPairsQuery(), with the lower address first in each pair.
+template<typename Object>
+struct CollectHashGridPairs
+{
+	std::vector<std::pair<Object*, Object*> > pairs;
+
+	void operator()(Object *a, Object *b)
+	{
+		assert(a != b);
+		pairs.push_back(a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+	}
+};
+
+template<typename Object>
+std::vector<Object*> SortedHashGridObjects(std::vector<Object*> objects)
+{
+	std::sort(objects.begin(), objects.end());
+	return objects;
+}
+
+/// Checks the queries and the colliding pairs of the given 2D grid against brute force over the objects in it.
+void CheckHashGrid2D(HashGrid2D<HashGridTestObject2D*> &grid, const std::vector<HashGridTestObject2D*> &objects, float worldSize)
+{
+	assert(grid.NumObjects() == (int)objects.size());
+	LCG lcg(17);
+	for(int q = 0; q < 50; ++q)
+	{
+		// The last queries cover the whole world, and visit the occupied cells instead of the cells in the range.
+		float extent = (q < 45) ? lcg.Float(0.f, 30.f) : 2.f * worldSize;
+		float2 center(lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize));
+		AABB2D query(center - float2(extent, extent), center + float2(lcg.Float(0.f, extent), extent));
+		CollectHashGridObjects<HashGridTestObject2D, AABB2D> collect;
+		grid.AABBQuery(query, collect);
+		std::vector<HashGridTestObject2D*> expected;
+		for(size_t i = 0; i < objects.size(); ++i)
+			if (GetAABB2D(objects[i]).Intersects(query))
+				expected.push_back(objects[i]);
+		assert(SortedHashGridObjects(collect.objects) == SortedHashGridObjects(expected));
+
+		CollectHashGridObjects<HashGridTestObject2D, AABB2D> circle;
+		grid.CircleQuery(center, extent, circle);
+		expected.clear();
+		for(size_t i = 0; i < objects.size(); ++i)
+			if (GetAABB2D(objects[i]).DistanceSq(center) <= extent * extent)
+				expected.push_back(objects[i]);
+		assert(SortedHashGridObjects(circle.objects) == SortedHashGridObjects(expected));
+	}
+
+	CollectHashGridPairs<HashGridTestObject2D> pairs;
+	grid.CollidingPairsQuery(pairs);
+	std::vector<std::pair<HashGridTestObject2D*, HashGridTestObject2D*> > expectedPairs;
+	for(size_t i = 0; i < objects.size(); ++i)
+		for(size_t j = i+1; j < objects.size(); ++j)
+			if (GetAABB2D(objects[i]).Intersects(GetAABB2D(objects[j])))
+				expectedPairs.push_back(objects[i] < objects[j] ? std::make_pair(objects[i], objects[j]) : std::make_pair(objects[j], objects[i]));
+	std::sort(pairs.pairs.begin(), pairs.pairs.end());
+	std::sort(expectedPairs.begin(), expectedPairs.end());
+	assert(pairs.pairs == expectedPairs);
+}
+
+UNIQUE_TEST(HashGrid2DMatchesBruteForce)
+{
+	const float worldSize = 200.f;
+	std::vector<HashGridTestObject2D> objects = HashGridTestObjects2D(3000, worldSize, 3);
+	HashGrid2D<HashGridTestObject2D*> grid(4.f);
+	std::vector<HashGridTestObject2D*> inGrid;
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		grid.Add(&objects[i]);
+		inGrid.push_back(&objects[i]);
+	}
+	CheckHashGrid2D(grid, inGrid, worldSize);
+
+	// Remove every other object, which also empties cells and shifts the slots of the hash table.
+	LCG lcg(5);
+	std::vector<HashGridTestObject2D*> remaining;
+	for(size_t i = 0; i < inGrid.size(); ++i)
+	{
+		if (lcg.Int(0, 1) == 0)
+		{
+			bool removed = grid.Remove(inGrid[i]);
+			assert(removed);
+			// An object that is not in the grid is not found again.
+			assert(!grid.Remove(inGrid[i]));
+			MARK_UNUSED(removed);
+		}
+		else
+			remaining.push_back(inGrid[i]);
+	}
+	CheckHashGrid2D(grid, remaining, worldSize);
+
+	// Move the remaining objects, and check that the grid finds them at their new positions.
+	for(size_t i = 0; i < remaining.size(); ++i)
+	{
+		grid.Remove(remaining[i]);
+		remaining[i]->pos += float2(lcg.Float(-10.f, 10.f), lcg.Float(-10.f, 10.f));
+		grid.Add(remaining[i]);
+	}
+	CheckHashGrid2D(grid, remaining, worldSize);
+
+	for(size_t i = 0; i < remaining.size(); ++i)
+		grid.Remove(remaining[i]);
+	assert(grid.NumObjects() == 0);
+	assert(grid.NumOccupiedCells() == 0);
+	grid.Clear(8.f);
+	assert(grid.CellSize() == 8.f);
+}
+
+UNIQUE_TEST(HashGrid3DMatchesBruteForce)
+{
+	const float worldSize = 60.f;
+	std::vector<HashGridTestObject3D> objects = HashGridTestObjects3D(2000, worldSize, 7);
+	HashGrid3D<HashGridTestObject3D*> grid(4.f);
+	for(size_t i = 0; i < objects.size(); ++i)
+		grid.Add(&objects[i]);
+	// Remove a part of the objects to exercise the removal of slots.
+	std::vector<HashGridTestObject3D*> inGrid;
+	for(size_t i = 0; i < objects.size(); ++i)
+		if (i % 3 == 0)
+			grid.Remove(&objects[i]);
+		else
+			inGrid.push_back(&objects[i]);
+	assert(grid.NumObjects() == (int)inGrid.size());
+
+	LCG lcg(19);
+	for(int q = 0; q < 50; ++q)
+	{
+		float extent = (q < 45) ? lcg.Float(0.f, 20.f) : 2.f * worldSize;
+		float3 center(lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize));
+		AABB query(center - float3(extent, extent, extent), center + float3(extent, lcg.Float(0.f, extent), extent));
+		CollectHashGridObjects<HashGridTestObject3D, AABB> collect;
+		grid.AABBQuery(query, collect);
+		std::vector<HashGridTestObject3D*> expected;
+		for(size_t i = 0; i < inGrid.size(); ++i)
+			if (GetAABB(inGrid[i]).Intersects(query))
+				expected.push_back(inGrid[i]);
+		assert(SortedHashGridObjects(collect.objects) == SortedHashGridObjects(expected));
+
+		Sphere sphere(center, extent);
+		CollectHashGridObjects<HashGridTestObject3D, AABB> inSphere;
+		grid.SphereQuery(sphere, inSphere);
+		expected.clear();
+		for(size_t i = 0; i < inGrid.size(); ++i)
+			if (GetAABB(inGrid[i]).Intersects(sphere))
+				expected.push_back(inGrid[i]);
+		assert(SortedHashGridObjects(inSphere.objects) == SortedHashGridObjects(expected));
+	}
+
+	CollectHashGridPairs<HashGridTestObject3D> pairs;
+	grid.CollidingPairsQuery(pairs);
+	std::vector<std::pair<HashGridTestObject3D*, HashGridTestObject3D*> > expectedPairs;
+	for(size_t i = 0; i < inGrid.size(); ++i)
+		for(size_t j = i+1; j < inGrid.size(); ++j)
+			if (GetAABB(inGrid[i]).Intersects(GetAABB(inGrid[j])))
+				expectedPairs.push_back(std::make_pair(inGrid[i], inGrid[j]));
+	std::sort(pairs.pairs.begin(), pairs.pairs.end());
+	std::sort(expectedPairs.begin(), expectedPairs.end());
+	assert(expectedPairs.size() > 100);
+	assert(pairs.pairs == expectedPairs);
+}
+
+/// Holds identical objects in a QuadTree and in a HashGrid2D for the colliding pairs benchmarks. The objects are
+/// generated the same way as in the QuadTree colliding pairs benchmark.
+struct HashGridCollidingPairsBenchmarkData
+{
+	std::vector<HashGridTestObject2D> objects;
+	QuadTree<HashGridTestObject2D*> tree;
+	HashGrid2D<HashGridTestObject2D*> grid;
+	CollectHashGridPairs<HashGridTestObject2D> pairs;
+
+	explicit HashGridCollidingPairsBenchmarkData(int numObjects)
+	:grid(12.f)
+	{
+		// Keep the density of the objects the same as in the QuadTree benchmark of 10000 objects in a 1000x1000 world.
+		const float worldSize = 1000.f * Sqrt(numObjects / 10000.f);
+		LCG lcg(1234);
+		objects.resize(numObjects);
+		for(int i = 0; i < numObjects; ++i)
+		{
+			objects[i].pos = float2(lcg.Float(0.f, worldSize), lcg.Float(0.f, worldSize));
+			objects[i].halfSize = lcg.Float(0.1f, 2.f) * 3.f;
+		}
+		tree.Clear(float2(0, 0), float2(worldSize, worldSize));
+		for(int i = 0; i < numObjects; ++i)
+		{
+			tree.Add(&objects[i]);
+			grid.Add(&objects[i]);
+		}
+	}
+};
+
+HashGridCollidingPairsBenchmarkData &HashGridCollidingPairsBenchmark(int numObjects)
+{
+	static HashGridCollidingPairsBenchmarkData small(10000);
+	if (numObjects == 10000)
+		return small;
+	static HashGridCollidingPairsBenchmarkData large(100000);
+	return large;
+}
+
+UNIQUE_TEST(HashGrid2DCollidingPairsMatchQuadTree)
+{
+	HashGridCollidingPairsBenchmarkData &data = HashGridCollidingPairsBenchmark(10000);
+	CollectHashGridPairs<HashGridTestObject2D> treePairs;
+	data.tree.CollidingPairsQuery(data.tree.BoundingAABB(), treePairs);
+	CollectHashGridPairs<HashGridTestObject2D> gridPairs;
+	data.grid.CollidingPairsQuery(gridPairs);
+	std::sort(treePairs.pairs.begin(), treePairs.pairs.end());
+	std::sort(gridPairs.pairs.begin(), gridPairs.pairs.end());
+	assert(treePairs.pairs.size() > 1000);
+	assert(gridPairs.pairs == treePairs.pairs);
+}
+
+BENCHMARK_ITERS(HashGridCollidingPairs_10000_QuadTree, 5, 5, "QuadTree::CollidingPairsQuery over 10000 objects, for comparison with HashGrid2D")
+{
+	HashGridCollidingPairsBenchmarkData &data = HashGridCollidingPairsBenchmark(10000);
+	data.pairs.pairs.clear();
+	data.tree.CollidingPairsQuery(data.tree.BoundingAABB(), data.pairs);
+	globalPokedData += (int)data.pairs.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(HashGridCollidingPairs_10000_HashGrid2D, 5, 5, "HashGrid2D::CollidingPairsQuery over the same 10000 objects")
+{
+	HashGridCollidingPairsBenchmarkData &data = HashGridCollidingPairsBenchmark(10000);
+	data.pairs.pairs.clear();
+	data.grid.CollidingPairsQuery(data.pairs);
+	globalPokedData += (int)data.pairs.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(HashGridCollidingPairs_100000_QuadTree, 1, 1, "QuadTree::CollidingPairsQuery over 100000 objects, for comparison with HashGrid2D")
+{
+	HashGridCollidingPairsBenchmarkData &data = HashGridCollidingPairsBenchmark(100000);
+	data.pairs.pairs.clear();
+	data.tree.CollidingPairsQuery(data.tree.BoundingAABB(), data.pairs);
+	globalPokedData += (int)data.pairs.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(HashGridCollidingPairs_100000_HashGrid2D, 1, 1, "HashGrid2D::CollidingPairsQuery over the same 100000 objects")
+{
+	HashGridCollidingPairsBenchmarkData &data = HashGridCollidingPairsBenchmark(100000);
+	data.pairs.pairs.clear();
+	data.grid.CollidingPairsQuery(data.pairs);
+	globalPokedData += (int)data.pairs.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(HashGrid2DMove_10000, 5, 5, "Moving 10000 objects a small step in a HashGrid2D with Remove() and Add()")
+{
+	static std::vector<HashGridTestObject2D> objects = HashGridTestObjects2D(10000, 500.f, 11);
+	static HashGrid2D<HashGridTestObject2D*> grid(4.f);
+	if (grid.NumObjects() == 0)
+		for(size_t i = 0; i < objects.size(); ++i)
+			grid.Add(&objects[i]);
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		HashGridTestObject2D *object = &objects[i];
+		grid.Remove(object);
+		object->pos.x += (i % 2 == 0) ? 0.5f : -0.5f;
+		grid.Add(object);
+	}
+	globalPokedData += grid.NumOccupiedCells();
+}
+BENCHMARK_ITERS_END;
@@ -0,0 +1,1082 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// Generates a deterministic triangle soup where the triangles are packed into a few dense clusters
+/// scattered inside a large volume. This is the worst case for midpoint splitting.
+std::vector<Triangle> ClusteredTriangleSoup(int numClusters, int numTrianglesPerCluster)
+{
+	LCG lcg(1234);
+	std::vector<Triangle> tris;
+	tris.reserve(numClusters * numTrianglesPerCluster);
+	for(int i = 0; i < numClusters; ++i)
+	{
+		float3 clusterCenter = float3::RandomBox(lcg, -SCALE, SCALE);
+		float clusterRadius = lcg.Float(1.f, 5.f);
+		for(int j = 0; j < numTrianglesPerCluster; ++j)
+		{
+			float3 a = float3::RandomSphere(lcg, clusterCenter, clusterRadius);
+			float3 b = a + float3::RandomDir(lcg, 0.5f);
+			float3 c = a + float3::RandomDir(lcg, 0.5f);
+			tris.push_back(Triangle(a, b, c));
+		}
+	}
+	return tris;
+}
+
+/// Returns a ray that starts outside the given clustered triangle soup and is aimed towards one of its triangles.
+Ray RayTowardsTriangle(LCG &lcg, const std::vector<Triangle> &tris)
+{
+	const Triangle &target = tris[lcg.Int(0, (int)tris.size()-1)];
+	float3 pos = float3::RandomDir(lcg, 2.f * SCALE);
+	return Ray(pos, (target.Centroid() - pos).Normalized());
+}
+
+float BruteForceRayIntersect(const std::vector<Triangle> &tris, const Ray &ray)
+{
+	float nearestT = FLOAT_INF;
+	for(size_t i = 0; i < tris.size(); ++i)
+	{
+		float u, v;
+		float t = Triangle::IntersectLineTri(ray.pos, ray.dir, tris[i].a, tris[i].b, tris[i].c, u, v);
+		if (t >= 0.f && t < nearestT)
+			nearestT = t;
+	}
+	return nearestT;
+}
+
+/// Wraps the nearest hit visitor to count how much work a ray query performs.
+struct CountingNearestHitVisitor
+{
+	CountingNearestHitVisitor():numLeavesVisited(0), numObjectsTested(0) {}
+
+	TriangleKdTreeRayQueryNearestHitVisitor nearestHit;
+	int numLeavesVisited;
+	int numObjectsTested;
+
+	bool operator()(KdTree<Triangle> &tree, const KdTreeNode &leaf, const Ray &ray, float tNear, float tFar)
+	{
+		++numLeavesVisited;
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != KdTree<Triangle>::BUCKET_SENTINEL; ++bucket)
+			++numObjectsTested;
+		return nearestHit(tree, leaf, ray, tNear, tFar);
+	}
+};
+
+static const int numKdTreeTestClusters = 50;
+static const int numKdTreeTestTrianglesPerCluster = 200;
+
+KdTree<Triangle> &ClusteredKdTree(KdTreeSplitStrategy splitStrategy)
+{
+	static KdTree<Triangle> trees[2];
+	KdTree<Triangle> &tree = trees[splitStrategy];
+	if (!tree.Root())
+	{
+		std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		tree.AddObjects(&tris[0], (int)tris.size());
+		KdTreeBuildParams params;
+		params.splitStrategy = splitStrategy;
+		tree.Build(params);
+	}
+	return tree;
+}
+
+UNIQUE_TEST(KdTreeSAHBuildRayQueryMatchesBruteForce)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	LCG lcg(42);
+	for(int i = 0; i < 1000; ++i)
+	{
+		Ray ray = RayTowardsTriangle(lcg, tris);
+		TriangleKdTreeRayQueryNearestHitVisitor result;
+		tree.RayQuery(ray, result);
+		float expected = BruteForceRayIntersect(tris, ray);
+		assert(expected < FLOAT_INF);
+		assert2(EqualAbs(result.rayT, expected, 1e-3f), result.rayT, expected);
+	}
+}
+
+UNIQUE_TEST(KdTreeSAHVsMidpointTraversalSteps)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	const KdTreeSplitStrategy strategies[] = { KdTreeSplitMidpoint, KdTreeSplitSAH };
+	const char * const names[] = { "Midpoint", "SAH" };
+	for(int s = 0; s < 2; ++s)
+	{
+		KdTree<Triangle> &tree = ClusteredKdTree(strategies[s]);
+		LCG lcg(42);
+		const int numRays = 1000;
+		CountingNearestHitVisitor total;
+		for(int i = 0; i < numRays; ++i)
+		{
+			CountingNearestHitVisitor visitor;
+			tree.RayQuery(RayTowardsTriangle(lcg, tris), visitor);
+			total.numLeavesVisited += visitor.numLeavesVisited;
+			total.numObjectsTested += visitor.numObjectsTested;
+		}
+		LOGI("%s kD-tree: %d nodes, height %d. Per ray: %.2f leaves visited, %.2f triangles tested.", names[s],
+			tree.NumNodes(), tree.TreeHeight(), (float)total.numLeavesVisited / numRays, (float)total.numObjectsTested / numRays);
+	}
+}
+
+void AssertKdTreesIdentical(const KdTree<Triangle> &a, const KdTree<Triangle> &b)
+{
+	assert2(a.NumNodes() == b.NumNodes(), a.NumNodes(), b.NumNodes());
+	for(int i = 1; i <= a.NumNodes(); ++i)
+	{
+		const KdTreeNode &na = a.Node(i);
+		const KdTreeNode &nb = b.Node(i);
+		assert(na.IsLeaf() == nb.IsLeaf());
+		if (na.IsLeaf())
+		{
+			assert(na.bucketIndex == nb.bucketIndex);
+			const u32 *bucketA = a.Bucket(na.bucketIndex);
+			const u32 *bucketB = b.Bucket(nb.bucketIndex);
+			while(*bucketA != KdTree<Triangle>::BUCKET_SENTINEL)
+				assert(*bucketA++ == *bucketB++);
+			assert(*bucketB == KdTree<Triangle>::BUCKET_SENTINEL);
+			MARK_UNUSED(bucketB);
+		}
+		else
+		{
+			assert(na.splitAxis == nb.splitAxis);
+			assert(na.splitPos == nb.splitPos);
+			assert(na.childIndex == nb.childIndex);
+		}
+	}
+}
+
+UNIQUE_TEST(KdTreeParallelBuildIsIdenticalToSerialBuild)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	const KdTreeSplitStrategy strategies[] = { KdTreeSplitMidpoint, KdTreeSplitSAH };
+	for(int s = 0; s < 2; ++s)
+	{
+		KdTreeBuildParams params;
+		params.splitStrategy = strategies[s];
+		KdTree<Triangle> serial;
+		serial.AddObjects(&tris[0], (int)tris.size());
+		serial.Build(params);
+
+		params.numThreads = 4;
+		KdTree<Triangle> parallel;
+		parallel.AddObjects(&tris[0], (int)tris.size());
+		parallel.Build(params);
+
+		AssertKdTreesIdentical(serial, parallel);
+	}
+}
+
+UNIQUE_TEST(KdTreeParallelBuildScaling)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(200, 500);
+	const int maxThreads = Max(4, NumHardwareThreads());
+	for(int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+	{
+		KdTree<Triangle> tree;
+		tree.AddObjects(&tris[0], (int)tris.size());
+		KdTreeBuildParams params;
+		params.splitStrategy = KdTreeSplitSAH;
+		params.numThreads = numThreads;
+		tick_t start = Clock::Tick();
+		tree.Build(params);
+		tick_t end = Clock::Tick();
+		LOGI("Built a SAH kD-tree of %d triangles with %d thread(s) in %s.", (int)tris.size(), numThreads, FormatTime((double)(end - start)).c_str());
+	}
+}
+
+UNIQUE_TEST(KdTreeBucketsAreStoredContiguously)
+{
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	const u32 *prevBucketEnd = tree.Bucket(0);
+	assert(*prevBucketEnd == KdTree<Triangle>::BUCKET_SENTINEL);
+	for(int i = 1; i <= tree.NumNodes(); ++i)
+	{
+		const KdTreeNode &node = tree.Node(i);
+		if (!node.IsLeaf() || node.IsEmptyLeaf())
+			continue;
+		const u32 *bucket = tree.Bucket(node.bucketIndex);
+		// Leaves are packed back to back in node order, each bucket directly following the sentinel of the previous one.
+		assert(bucket == prevBucketEnd + 1);
+		assert(node.NumObjects() > 0);
+		for(int j = 0; j < node.NumObjects(); ++j)
+			assert(bucket[j] < (u32)(numKdTreeTestClusters * numKdTreeTestTrianglesPerCluster));
+		assert(bucket[node.NumObjects()] == KdTree<Triangle>::BUCKET_SENTINEL);
+		prevBucketEnd = bucket + node.NumObjects();
+	}
+	MARK_UNUSED(prevBucketEnd);
+}
+
+void AssertKdTreeRayQueriesMatchBruteForce(KdTree<Triangle> &tree, const std::vector<Triangle> &tris, int numRays)
+{
+	LCG lcg(42);
+	for(int i = 0; i < numRays; ++i)
+	{
+		Ray ray = RayTowardsTriangle(lcg, tris);
+		TriangleKdTreeRayQueryNearestHitVisitor result;
+		tree.RayQuery(ray, result);
+		float expected = BruteForceRayIntersect(tris, ray);
+		assert2(result.rayT == expected || EqualAbs(result.rayT, expected, 1e-3f), result.rayT, expected);
+	}
+}
+
+UNIQUE_TEST(KdTreeBuildLimits)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTreeBuildParams params;
+	params.splitStrategy = KdTreeSplitSAH;
+	params.numThreads = 4;
+
+	params.maxNodes = 101;
+	KdTree<Triangle> budgeted;
+	budgeted.AddObjects(&tris[0], (int)tris.size());
+	budgeted.Build(params);
+	assert2(budgeted.NumNodes() <= params.maxNodes, budgeted.NumNodes(), params.maxNodes);
+	assert(budgeted.NumNodes() >= params.maxNodes - 1);
+	AssertKdTreeRayQueriesMatchBruteForce(budgeted, tris, 100);
+
+	params.maxNodes = 0;
+	params.maxTreeDepth = 5;
+	KdTree<Triangle> shallow;
+	shallow.AddObjects(&tris[0], (int)tris.size());
+	shallow.Build(params);
+	assert(shallow.TreeHeight() <= 5);
+	assert(shallow.ComputeStats(params).numDepthLimitedLeaves > 0);
+	AssertKdTreeRayQueriesMatchBruteForce(shallow, tris, 100);
+
+	// Deeper trees than the old fixed limit of 30 levels must be traversable. Triangles at geometrically
+	// shrinking distances from the origin force midpoint splitting to peel off one triangle per level.
+	std::vector<Triangle> chain;
+	for(int i = 0; i < 50; ++i)
+	{
+		float x = 1000.f * Pow(0.5f, (float)i);
+		chain.push_back(Triangle(float3(x, 0.f, 0.f), float3(1.2f * x, x, 0.f), float3(x, 0.f, x)));
+	}
+	params.splitStrategy = KdTreeSplitMidpoint;
+	params.maxLeafObjects = 1;
+	params.maxTreeDepth = KdTree<Triangle>::maxSupportedTreeDepth;
+	KdTree<Triangle> deep;
+	deep.AddObjects(&chain[0], (int)chain.size());
+	deep.Build(params);
+	assert1(deep.TreeHeight() > 30, deep.TreeHeight());
+	assert(deep.TreeHeight() <= params.maxTreeDepth);
+	AssertKdTreeRayQueriesMatchBruteForce(deep, chain, 100);
+}
+
+UNIQUE_TEST(KdTreeComputeStats)
+{
+	const KdTreeSplitStrategy strategies[] = { KdTreeSplitMidpoint, KdTreeSplitSAH };
+	const char * const names[] = { "Midpoint", "SAH" };
+	float sahCost[2];
+	for(int s = 0; s < 2; ++s)
+	{
+		KdTreeBuildParams params;
+		params.splitStrategy = strategies[s];
+		KdTree<Triangle> &tree = ClusteredKdTree(strategies[s]);
+		KdTreeStats stats = tree.ComputeStats(params);
+		assert(stats.numNodes == tree.NumNodes());
+		assert(stats.numLeaves == tree.NumLeaves());
+		assert(stats.numInnerNodes == tree.NumInnerNodes());
+		assert(stats.numLeaves == stats.numInnerNodes + 1);
+		assert(stats.treeHeight == tree.TreeHeight());
+		assert(stats.maxLeafOccupancy >= stats.avgLeafOccupancy);
+		assert(stats.avgLeafOccupancy > 0.f);
+		assert(stats.emptyLeafRatio >= 0.f && stats.emptyLeafRatio < 1.f);
+		assert(stats.numDepthLimitedLeaves == 0);
+		assert(stats.sahCost > 0.f);
+		sahCost[s] = stats.sahCost;
+		LOGI("%s kD-tree: %d nodes, %d leaves (%.1f%% empty), %.2f objects per leaf on average, at most %d. SAH cost %.2f.",
+			names[s], stats.numNodes, stats.numLeaves, stats.emptyLeafRatio * 100.f, stats.avgLeafOccupancy, stats.maxLeafOccupancy, stats.sahCost);
+	}
+	assert(sahCost[1] < sahCost[0]);
+	MARK_UNUSED(sahCost);
+}
+
+/// Checks that every object of the tree is in the buckets of exactly the leaves its bounding box overlaps,
+/// and that the removed objects are not in any bucket.
+void AssertKdTreeBucketsMatchObjects(const KdTree<Triangle> &tree, const std::vector<bool> &isLive)
+{
+	std::vector<int> numLeavesOfObject(isLive.size(), 0);
+	std::vector<int> numOverlappedLeaves(isLive.size(), 0);
+	std::vector<std::pair<int, AABB> > stack;
+	stack.push_back(std::make_pair(1, AABB(float3(-FLOAT_INF, -FLOAT_INF, -FLOAT_INF), float3(FLOAT_INF, FLOAT_INF, FLOAT_INF))));
+	while(!stack.empty())
+	{
+		int nodeIndex = stack.back().first;
+		AABB cell = stack.back().second;
+		stack.pop_back();
+		const KdTreeNode &node = tree.Node(nodeIndex);
+		if (!node.IsLeaf())
+		{
+			AABB left = cell, right = cell;
+			left.maxPoint[node.splitAxis] = node.splitPos;
+			right.minPoint[node.splitAxis] = node.splitPos;
+			stack.push_back(std::make_pair(node.LeftChildIndex(), left));
+			stack.push_back(std::make_pair(node.RightChildIndex(), right));
+			continue;
+		}
+		for(const u32 *bucket = tree.Bucket(node.bucketIndex); *bucket != KdTree<Triangle>::BUCKET_SENTINEL; ++bucket)
+		{
+			assert1(*bucket < isLive.size() && isLive[*bucket], *bucket);
+			++numLeavesOfObject[*bucket];
+		}
+		for(size_t i = 0; i < isLive.size(); ++i)
+			if (isLive[i] && tree.Object((int)i).BoundingAABB().Intersects(cell))
+				++numOverlappedLeaves[i];
+	}
+	for(size_t i = 0; i < isLive.size(); ++i)
+		if (isLive[i])
+			assert3(numLeavesOfObject[i] >= 1 && numLeavesOfObject[i] <= numOverlappedLeaves[i], (int)i, numLeavesOfObject[i], numOverlappedLeaves[i]);
+}
+
+UNIQUE_TEST(KdTreeIncrementalUpdate)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(10, 100);
+	KdTree<Triangle> tree;
+	tree.AddObjects(&tris[0], (int)tris.size());
+	KdTreeBuildParams params;
+	params.splitStrategy = KdTreeSplitSAH;
+	tree.Build(params);
+
+	std::vector<bool> isLive(tris.size(), true);
+	LCG lcg(7);
+	for(int frame = 0; frame < 20; ++frame)
+	{
+		// Move 5% of the objects, remove a few and insert a few new ones, some of them outside the original bounds.
+		for(int i = 0; i < (int)tris.size() / 20; ++i)
+		{
+			int objectIndex = lcg.Int(0, (int)tris.size()-1);
+			if (!isLive[objectIndex])
+				continue;
+			tris[objectIndex].Translate(float3::RandomDir(lcg, 3.f));
+			tree.MoveObject(objectIndex, tris[objectIndex]);
+		}
+		for(int i = 0; i < 5; ++i)
+		{
+			int objectIndex = lcg.Int(0, (int)tris.size()-1);
+			if (!isLive[objectIndex])
+				continue;
+			tree.RemoveObject(objectIndex);
+			isLive[objectIndex] = false;
+		}
+		for(int i = 0; i < 10; ++i)
+		{
+			float3 a = float3::RandomBox(lcg, -1.5f * SCALE, 1.5f * SCALE);
+			Triangle tri(a, a + float3::RandomDir(lcg, 0.5f), a + float3::RandomDir(lcg, 0.5f));
+			int objectIndex = tree.InsertObject(tri);
+			if (objectIndex == (int)tris.size())
+			{
+				tris.push_back(tri);
+				isLive.push_back(true);
+			}
+			else
+			{
+				assert(!isLive[objectIndex]);
+				tris[objectIndex] = tri;
+				isLive[objectIndex] = true;
+			}
+		}
+		AssertKdTreeBucketsMatchObjects(tree, isLive);
+	}
+
+	std::vector<Triangle> liveTris;
+	for(size_t i = 0; i < tris.size(); ++i)
+		if (isLive[i])
+			liveTris.push_back(tris[i]);
+	AssertKdTreeRayQueriesMatchBruteForce(tree, liveTris, 200);
+
+	// Rebuilding the tree drops the removed objects.
+	tree.Build(params);
+	AssertKdTreeBucketsMatchObjects(tree, isLive);
+	AssertKdTreeRayQueriesMatchBruteForce(tree, liveTris, 200);
+}
+
+UNIQUE_TEST(KdTreeInsertSplitsOvergrownLeaves)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(10, 100);
+	KdTree<Triangle> tree;
+	tree.AddObjects(&tris[0], (int)tris.size());
+	KdTreeBuildParams params;
+	tree.Build(params);
+	const int numNodesBefore = tree.NumNodes();
+
+	// Pile many new objects into a small region, which overflows the leaves there.
+	LCG lcg(3);
+	std::vector<bool> isLive(tris.size(), true);
+	for(int i = 0; i < 2000; ++i)
+	{
+		float3 a = float3::RandomBox(lcg, float3(0,0,0), float3(20.f, 20.f, 20.f));
+		tris.push_back(Triangle(a, a + float3::RandomDir(lcg, 0.5f), a + float3::RandomDir(lcg, 0.5f)));
+		isLive.push_back(true);
+		int objectIndex = tree.InsertObject(tris.back());
+		assert(objectIndex == (int)tris.size()-1);
+		MARK_UNUSED(objectIndex);
+	}
+	KdTreeStats stats = tree.ComputeStats(params);
+	LOGI("Tree grew from %d to %d nodes, the largest leaf has %d objects.", numNodesBefore, stats.numNodes, stats.maxLeafOccupancy);
+	assert(stats.numNodes > numNodesBefore);
+	assert(stats.maxLeafOccupancy < 4 * params.maxLeafObjects);
+	AssertKdTreeBucketsMatchObjects(tree, isLive);
+	AssertKdTreeRayQueriesMatchBruteForce(tree, tris, 200);
+}
+
+/// Returns the k objects closest to point, sorted by increasing distance, by testing every object.
+template<typename T>
+std::vector<KdTreeNeighbor> BruteForceKNearest(const std::vector<T> &objects, const float3 &point, int k)
+{
+	std::vector<KdTreeNeighbor> neighbors(objects.size());
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		neighbors[i].objectIndex = (int)i;
+		neighbors[i].distance = objects[i].Distance(point);
+	}
+	k = Min(k, (int)neighbors.size());
+	std::partial_sort(neighbors.begin(), neighbors.begin() + k, neighbors.end());
+	neighbors.resize(k);
+	return neighbors;
+}
+
+template<typename T>
+void AssertNeighborsEqual(const KdTreeNeighbor *neighbors, int numNeighbors, const std::vector<KdTreeNeighbor> &expected)
+{
+	assert2(numNeighbors == (int)expected.size(), numNeighbors, (int)expected.size());
+	for(int i = 0; i < numNeighbors; ++i)
+	{
+		assert2(neighbors[i].objectIndex == expected[i].objectIndex, neighbors[i].objectIndex, expected[i].objectIndex);
+		assert2(neighbors[i].distance == expected[i].distance, neighbors[i].distance, expected[i].distance);
+	}
+}
+
+/// Returns numPoints random points inside the box [-SCALE, SCALE]^3, as spheres of zero radius.
+std::vector<Sphere> RandomPointSpheres(int numPoints)
+{
+	LCG lcg(5678);
+	std::vector<Sphere> points(numPoints);
+	for(int i = 0; i < numPoints; ++i)
+		points[i] = Sphere(float3::RandomBox(lcg, -SCALE, SCALE), 0.f);
+	return points;
+}
+
+UNIQUE_TEST(KdTreeKNearestMatchesBruteForce)
+{
+	std::vector<Sphere> points = RandomPointSpheres(10000);
+	KdTree<Sphere> pointTree;
+	pointTree.AddObjects(&points[0], (int)points.size());
+	pointTree.Build();
+
+	// The triangles overlap several leaves, which the queries must not return twice.
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTree<Triangle> &triangleTree = ClusteredKdTree(KdTreeSplitSAH);
+
+	LCG lcg(9);
+	KdTreeNeighbor neighbors[32];
+	for(int i = 0; i < 200; ++i)
+	{
+		float3 point = float3::RandomBox(lcg, -1.2f * SCALE, 1.2f * SCALE);
+		int k = lcg.Int(1, 32);
+		int numNeighbors = pointTree.KNearest(point, k, neighbors);
+		AssertNeighborsEqual<Sphere>(neighbors, numNeighbors, BruteForceKNearest(points, point, k));
+
+		numNeighbors = triangleTree.KNearest(point, k, neighbors);
+		AssertNeighborsEqual<Triangle>(neighbors, numNeighbors, BruteForceKNearest(tris, point, k));
+	}
+
+	// Asking for more objects than there are in the tree returns all of them.
+	KdTree<Sphere> smallTree;
+	smallTree.AddObjects(&points[0], 5);
+	smallTree.Build();
+	assert(smallTree.KNearest(float3::zero, 32, neighbors) == 5);
+}
+
+UNIQUE_TEST(KdTreeRadiusQueryMatchesBruteForce)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	LCG lcg(10);
+	std::vector<KdTreeNeighbor> neighbors;
+	for(int i = 0; i < 200; ++i)
+	{
+		// Query around the triangles, so that most queries find something.
+		float3 point = tris[lcg.Int(0, (int)tris.size()-1)].a + float3::RandomDir(lcg, lcg.Float(0.f, 5.f));
+		float r = lcg.Float(0.f, 5.f);
+		tree.RadiusQuery(point, r, neighbors);
+
+		std::vector<KdTreeNeighbor> expected = BruteForceKNearest(tris, point, (int)tris.size());
+		size_t numExpected = 0;
+		while(numExpected < expected.size() && expected[numExpected].distance <= r)
+			++numExpected;
+		expected.resize(numExpected);
+		AssertNeighborsEqual<Triangle>(neighbors.empty() ? 0 : &neighbors[0], (int)neighbors.size(), expected);
+	}
+}
+
+UNIQUE_TEST(KdTreeSaveAndLoadFromMappedBuffer)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTreeBuildParams params;
+	params.splitStrategy = KdTreeSplitSAH;
+	KdTree<Triangle> tree;
+	tree.AddObjects(&tris[0], (int)tris.size());
+	tree.Build(params);
+
+	const size_t size = tree.SerializedSize();
+	u8 *blob = (u8*)AlignedMalloc(size + KdTreeBlobHeader::ALIGNMENT, KdTreeBlobHeader::ALIGNMENT);
+	size_t written = tree.SaveToBuffer(blob, size - 1);
+	assert(written == 0);
+	written = tree.SaveToBuffer(blob, size);
+	assert(written == size);
+
+	KdTree<Triangle> loaded;
+	bool success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(success);
+	assert(loaded.IsMapped());
+	assert(loaded.BoundingAABB().minPoint.Equals(tree.BoundingAABB().minPoint));
+	assert(loaded.BoundingAABB().maxPoint.Equals(tree.BoundingAABB().maxPoint));
+	AssertKdTreesIdentical(tree, loaded);
+	AssertKdTreeRayQueriesMatchBruteForce(loaded, tris, 200);
+
+	// The loaded tree reads the blob in place.
+	assert((const u8*)loaded.Root() >= blob && (const u8*)loaded.Root() < blob + size);
+	assert((const u8*)&loaded.Object(0) >= blob && (const u8*)&loaded.Object(0) < blob + size);
+
+	// Truncated, misaligned and corrupted blobs are rejected.
+	success = loaded.LoadFromMappedBuffer(blob, size - 1);
+	assert(!success);
+	assert(!loaded.IsMapped());
+	assert(loaded.NumNodes() == -1);
+	memmove(blob + 4, blob, size);
+	success = loaded.LoadFromMappedBuffer(blob + 4, size);
+	assert(!success);
+	memmove(blob, blob + 4, size);
+
+	KdTreeBlobHeader *header = (KdTreeBlobHeader*)blob;
+	++header->version;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	--header->version;
+	header->endianTag = 0x04030201;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	header->endianTag = KdTreeBlobHeader::ENDIAN_TAG;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(success);
+
+	// A blob of a different object type is rejected.
+	KdTree<Sphere> sphereTree;
+	success = sphereTree.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+
+	// Blobs with child indices or bucket entries that point outside of the arrays are rejected.
+	KdTreeNode *nodes = (KdTreeNode*)(blob + header->nodesOffset);
+	u32 *buckets = (u32*)(blob + header->bucketsOffset);
+	assert(!nodes[1].IsLeaf());
+	const u32 rootChildIndex = nodes[1].childIndex;
+	nodes[1].childIndex = 1; // A cycle.
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	nodes[1].childIndex = header->numNodes - 1;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	nodes[1].childIndex = rootChildIndex;
+	u32 leafIndex = 1;
+	while(!nodes[leafIndex].IsLeaf() || nodes[leafIndex].IsEmptyLeaf())
+		++leafIndex;
+	const u32 objectIndex = buckets[nodes[leafIndex].bucketIndex];
+	buckets[nodes[leafIndex].bucketIndex] = header->numObjects;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	buckets[nodes[leafIndex].bucketIndex] = objectIndex;
+	++nodes[leafIndex].childIndex; // The sentinel is no longer at the end of the bucket.
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(!success);
+	--nodes[leafIndex].childIndex;
+	success = loaded.LoadFromMappedBuffer(blob, size);
+	assert(success);
+	MARK_UNUSED(written);
+	MARK_UNUSED(success);
+
+	loaded.Clear();
+	AlignedFree(blob);
+}
+
+/// Generates a coherent packet of numRays rays: the rays start from a common origin outside the triangle soup
+/// and are aimed at a small grid of points around one of its triangles, like the rays of neighboring pixels.
+void CoherentRayPacket(LCG &lcg, const std::vector<Triangle> &tris, Ray *rays, int numRays)
+{
+	const Triangle &target = tris[lcg.Int(0, (int)tris.size()-1)];
+	float3 pos = float3::RandomDir(lcg, 2.f * SCALE);
+	float3 dir = (target.Centroid() - pos).Normalized();
+	float3 right = dir.Perpendicular();
+	float3 up = dir.AnotherPerpendicular();
+	for(int i = 0; i < numRays; ++i)
+	{
+		float3 pixelTarget = target.Centroid() + 0.25f * ((i % 4) - 1.5f) * right + 0.25f * ((i / 4) - 0.5f) * up;
+		rays[i] = Ray(pos, (pixelTarget - pos).Normalized());
+	}
+}
+
+template<int N>
+void AssertRayPacketMatchesSingleRays(KdTree<Triangle> &tree, const Ray *rays)
+{
+	TriangleKdTreeRayPacketQueryNearestHitVisitor<N> packet;
+	tree.RayPacketQuery<N>(rays, packet);
+	for(int i = 0; i < N; ++i)
+	{
+		TriangleKdTreeRayQueryNearestHitVisitor single;
+		tree.RayQuery(rays[i], single);
+		assert2(packet.hits[i].triangleIndex == single.triangleIndex, packet.hits[i].triangleIndex, single.triangleIndex);
+		// The packet visitor computes the same math as Triangle::IntersectLineTri(), but the compiler may contract it to
+		// FMA instructions differently, so compare the distances with a relative tolerance.
+		if (single.rayT < FLOAT_INF)
+		{
+			assert2(EqualAbs(packet.hits[i].rayT, single.rayT, 1e-3f * Max(1.f, single.rayT)), packet.hits[i].rayT, single.rayT);
+		}
+		else
+		{
+			assert(packet.hits[i].rayT == FLOAT_INF);
+		}
+	}
+}
+
+UNIQUE_TEST(KdTreeRayPacketQueryMatchesRayQuery)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	const KdTreeSplitStrategy strategies[] = { KdTreeSplitMidpoint, KdTreeSplitSAH };
+	for(int s = 0; s < 2; ++s)
+	{
+		KdTree<Triangle> &tree = ClusteredKdTree(strategies[s]);
+		LCG lcg(42);
+		Ray rays[8];
+		for(int i = 0; i < 500; ++i)
+		{
+			CoherentRayPacket(lcg, tris, rays, 8);
+			AssertRayPacketMatchesSingleRays<4>(tree, rays);
+			AssertRayPacketMatchesSingleRays<8>(tree, rays);
+
+			// Incoherent packets, where the rays are traversed one at a time.
+			for(int j = 0; j < 8; ++j)
+				rays[j] = RayTowardsTriangle(lcg, tris);
+			AssertRayPacketMatchesSingleRays<4>(tree, rays);
+			AssertRayPacketMatchesSingleRays<8>(tree, rays);
+		}
+	}
+}
+
+/// Returns a fixed set of rays aimed at the triangles of the clustered triangle soup, for benchmarking.
+const Ray *ClusteredKdTreeBenchmarkRays()
+{
+	static std::vector<Ray> rays;
+	if (rays.empty())
+	{
+		std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		LCG lcg(42);
+		for(int i = 0; i < testrunner_numItersPerTest; ++i)
+			rays.push_back(RayTowardsTriangle(lcg, tris));
+	}
+	return &rays[0];
+}
+
+BENCHMARK(KdTreeRayQuery_Midpoint, "KdTree<Triangle>::RayQuery on a midpoint-split tree")
+{
+	TriangleKdTreeRayQueryNearestHitVisitor result;
+	ClusteredKdTree(KdTreeSplitMidpoint).RayQuery(ClusteredKdTreeBenchmarkRays()[i], result);
+	globalPokedData += (result.triangleIndex != KdTree<Triangle>::BUCKET_SENTINEL);
+}
+BENCHMARK_END;
+
+BENCHMARK(KdTreeRayQuery_SAH, "KdTree<Triangle>::RayQuery on a SAH-split tree")
+{
+	TriangleKdTreeRayQueryNearestHitVisitor result;
+	ClusteredKdTree(KdTreeSplitSAH).RayQuery(ClusteredKdTreeBenchmarkRays()[i], result);
+	globalPokedData += (result.triangleIndex != KdTree<Triangle>::BUCKET_SENTINEL);
+}
+BENCHMARK_END;
+
+struct CountObjectsAABBVisitor
+{
+	CountObjectsAABBVisitor():numObjects(0) {}
+	int numObjects;
+
+	bool operator()(const KdTree<Triangle> &tree, const KdTreeNode &leaf, const AABB &aabb)
+	{
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != KdTree<Triangle>::BUCKET_SENTINEL; ++bucket)
+			if (tree.Object(*bucket).BoundingAABB().Intersects(aabb))
+				++numObjects;
+		return false;
+	}
+};
+
+BENCHMARK(KdTreeAABBQuery, "KdTree<Triangle>::AABBQuery on a SAH-split tree")
+{
+	const Ray &ray = ClusteredKdTreeBenchmarkRays()[i];
+	AABB aabb = AABB::FromCenterAndSize(ray.GetPoint(ray.pos.Length()), float3(10.f, 10.f, 10.f));
+	CountObjectsAABBVisitor visitor;
+	ClusteredKdTree(KdTreeSplitSAH).AABBQuery(aabb, visitor);
+	globalPokedData += visitor.numObjects;
+}
+BENCHMARK_END;
+
+/// Runs a ray query and an AABB query for each item on a shared const kD-tree, for ParallelFor().
+struct KdTreeConstQueriesFunc
+{
+	const KdTree<Triangle> *tree;
+	const Ray *rays;
+	float *rayT;
+	int *numObjectsInAABB;
+
+	void operator()(int i, int /*threadIndex*/)
+	{
+		TriangleKdTreeRayQueryNearestHitVisitor result;
+		tree->RayQuery(rays[i], result);
+		rayT[i] = result.rayT;
+		if (numObjectsInAABB)
+		{
+			CountObjectsAABBVisitor visitor;
+			tree->AABBQuery(AABB::FromCenterAndSize(rays[i].GetPoint(rays[i].pos.Length()), float3(10.f, 10.f, 10.f)), visitor);
+			numObjectsInAABB[i] = visitor.numObjects;
+		}
+	}
+};
+
+UNIQUE_TEST(KdTreeConcurrentConstQueries)
+{
+	const KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	const Ray *rays = ClusteredKdTreeBenchmarkRays();
+	const int numRays = testrunner_numItersPerTest;
+
+	std::vector<float> rayT(numRays), expectedRayT(numRays);
+	std::vector<int> numObjects(numRays), expectedNumObjects(numRays);
+	KdTreeConstQueriesFunc func;
+	func.tree = &tree;
+	func.rays = rays;
+	func.rayT = &expectedRayT[0];
+	func.numObjectsInAABB = &expectedNumObjects[0];
+	ParallelFor(numRays, 1, func);
+
+	func.rayT = &rayT[0];
+	func.numObjectsInAABB = &numObjects[0];
+	ParallelFor(numRays, Max(4, NumHardwareThreads()), func);
+
+	for(int i = 0; i < numRays; ++i)
+	{
+		assert2(rayT[i] == expectedRayT[i], rayT[i], expectedRayT[i]);
+		assert2(numObjects[i] == expectedNumObjects[i], numObjects[i], expectedNumObjects[i]);
+	}
+}
+
+static const int numKdTreeThroughputBenchmarkRays = 10000;
+
+/// Returns rays aimed at the triangles of the clustered triangle soup, for the throughput benchmarks.
+const Ray *KdTreeThroughputBenchmarkRays()
+{
+	static std::vector<Ray> rays;
+	if (rays.empty())
+	{
+		std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		LCG lcg(43);
+		for(int i = 0; i < numKdTreeThroughputBenchmarkRays; ++i)
+			rays.push_back(RayTowardsTriangle(lcg, tris));
+	}
+	return &rays[0];
+}
+
+void BenchmarkKdTreeConstRayQueries(int numThreads)
+{
+	static std::vector<float> rayT(numKdTreeThroughputBenchmarkRays);
+	KdTreeConstQueriesFunc func;
+	func.tree = &ClusteredKdTree(KdTreeSplitSAH);
+	func.rays = KdTreeThroughputBenchmarkRays();
+	func.rayT = &rayT[0];
+	func.numObjectsInAABB = 0;
+	ParallelFor(numKdTreeThroughputBenchmarkRays, numThreads, func);
+	globalPokedData += (rayT[0] < FLOAT_INF);
+}
+
+BENCHMARK_ITERS(KdTreeRayQuery_10000Rays_1Thread, 5, 5, "10000 const KdTree<Triangle>::RayQuery calls on one thread")
+{
+	BenchmarkKdTreeConstRayQueries(1);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(KdTreeRayQuery_10000Rays_AllThreads, 5, 5, "10000 const KdTree<Triangle>::RayQuery calls spread over all hardware threads")
+{
+	BenchmarkKdTreeConstRayQueries(NumHardwareThreads());
+}
+BENCHMARK_ITERS_END;
+
+/// Returns query boxes of varying sizes around the triangles of the given triangle soup. Every fourth box has its
+/// minimum corner exactly on a split plane of the given tree, to exercise the reporting of pairs at cell boundaries.
+std::vector<AABB> RandomQueryBoxes(LCG &lcg, const std::vector<Triangle> &tris, const KdTree<Triangle> &tree, int numQueries, float maxSize)
+{
+	std::vector<AABB> queries;
+	for(int i = 0; i < numQueries; ++i)
+	{
+		float3 center = tris[lcg.Int(0, (int)tris.size()-1)].Centroid() + float3::RandomBox(lcg, -2.f, 2.f);
+		AABB aabb = AABB::FromCenterAndSize(center, float3::RandomBox(lcg, 0.f, maxSize));
+		if (i % 4 == 0)
+		{
+			const KdTreeNode &node = tree.Node(lcg.Int(1, tree.NumNodes()));
+			if (!node.IsLeaf())
+			{
+				const int axis = node.splitAxis;
+				const float size = aabb.maxPoint[axis] - aabb.minPoint[axis];
+				aabb.minPoint[axis] = node.splitPos;
+				aabb.maxPoint[axis] = node.splitPos + size;
+			}
+		}
+		queries.push_back(aabb);
+	}
+	return queries;
+}
+
+UNIQUE_TEST(KdTreeAABBQueryBatchMatchesBruteForce)
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	LCG lcg(7);
+	std::vector<AABB> queries = RandomQueryBoxes(lcg, tris, tree, 1000, 10.f);
+
+	std::vector<KdTreeAABBQueryHit> expected;
+	for(size_t i = 0; i < queries.size(); ++i)
+		for(size_t j = 0; j < tris.size(); ++j)
+			if (queries[i].Intersects(tris[j].BoundingAABB()))
+			{
+				KdTreeAABBQueryHit hit;
+				hit.queryIndex = (int)i;
+				hit.objectIndex = (int)j;
+				expected.push_back(hit);
+			}
+	assert(!expected.empty());
+
+	std::vector<int> scratch;
+	std::vector<KdTreeAABBQueryHit> hits(expected.size() + 1);
+	int numHits = tree.AABBQueryBatch(&queries[0], (int)queries.size(), &hits[0], (int)hits.size(), scratch);
+	assert2(numHits == (int)expected.size(), numHits, (int)expected.size());
+	hits.resize(numHits);
+	std::sort(hits.begin(), hits.end());
+	for(int i = 0; i < numHits; ++i)
+	{
+		assert(hits[i].queryIndex == expected[i].queryIndex);
+		assert(hits[i].objectIndex == expected[i].objectIndex);
+	}
+
+	// A too small output buffer receives as many pairs as fit, and the total number of pairs is still returned.
+	std::vector<KdTreeAABBQueryHit> someHits(expected.size() / 2);
+	numHits = tree.AABBQueryBatch(&queries[0], (int)queries.size(), &someHits[0], (int)someHits.size(), scratch);
+	assert2(numHits == (int)expected.size(), numHits, (int)expected.size());
+	for(size_t i = 0; i < someHits.size(); ++i)
+		assert(std::binary_search(expected.begin(), expected.end(), someHits[i]));
+}
+
+static const int numKdTreeBatchBenchmarkQueries = 10000;
+
+const std::vector<AABB> &KdTreeBatchBenchmarkQueries()
+{
+	static std::vector<AABB> queries;
+	if (queries.empty())
+	{
+		std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		LCG lcg(8);
+		queries = RandomQueryBoxes(lcg, tris, ClusteredKdTree(KdTreeSplitSAH), numKdTreeBatchBenchmarkQueries, 2.f);
+	}
+	return queries;
+}
+
+/// Collects the objects that overlap a query box as (query, object) pairs. Unlike AABBQueryBatch(), reports the
+/// objects that span several leaves more than once.
+struct CollectHitsAABBVisitor
+{
+	std::vector<KdTreeAABBQueryHit> *hits;
+	int queryIndex;
+
+	bool operator()(const KdTree<Triangle> &tree, const KdTreeNode &leaf, const AABB &aabb)
+	{
+		for(const u32 *bucket = tree.Bucket(leaf.bucketIndex); *bucket != KdTree<Triangle>::BUCKET_SENTINEL; ++bucket)
+			if (tree.Object(*bucket).BoundingAABB().Intersects(aabb))
+			{
+				KdTreeAABBQueryHit hit;
+				hit.queryIndex = queryIndex;
+				hit.objectIndex = (int)*bucket;
+				hits->push_back(hit);
+			}
+		return false;
+	}
+};
+
+BENCHMARK_ITERS(KdTreeAABBQuery_10000Boxes, 5, 5, "10000 KdTree<Triangle>::AABBQuery calls, collecting (query, object) pairs")
+{
+	static std::vector<KdTreeAABBQueryHit> hits;
+	const std::vector<AABB> &queries = KdTreeBatchBenchmarkQueries();
+	const KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	hits.clear();
+	CollectHitsAABBVisitor visitor;
+	visitor.hits = &hits;
+	for(visitor.queryIndex = 0; visitor.queryIndex < (int)queries.size(); ++visitor.queryIndex)
+		tree.AABBQuery(queries[visitor.queryIndex], visitor);
+	globalPokedData += (int)hits.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(KdTreeAABBQueryBatch_10000Boxes, 5, 5, "KdTree<Triangle>::AABBQueryBatch of 10000 boxes")
+{
+	static std::vector<KdTreeAABBQueryHit> hits(1 << 20);
+	static std::vector<int> scratch;
+	const std::vector<AABB> &queries = KdTreeBatchBenchmarkQueries();
+	int numHits = ClusteredKdTree(KdTreeSplitSAH).AABBQueryBatch(&queries[0], (int)queries.size(), &hits[0], (int)hits.size(), scratch);
+	globalPokedData += numHits;
+}
+BENCHMARK_ITERS_END;
+
+/// Returns a fixed set of coherent 8-ray packets aimed at the triangles of the clustered triangle soup, for benchmarking.
+const Ray *ClusteredKdTreeBenchmarkRayPackets()
+{
+	static std::vector<Ray> rays;
+	if (rays.empty())
+	{
+		std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		LCG lcg(42);
+		rays.resize(testrunner_numItersPerTest * 8);
+		for(int i = 0; i < testrunner_numItersPerTest; ++i)
+			CoherentRayPacket(lcg, tris, &rays[i*8], 8);
+	}
+	return &rays[0];
+}
+
+// The three benchmarks below trace the same 8 coherent rays per iteration, so their timings are directly comparable.
+BENCHMARK(KdTreeRayQuery_Coherent8, "8x KdTree<Triangle>::RayQuery of coherent rays on a SAH-split tree")
+{
+	const Ray *rays = ClusteredKdTreeBenchmarkRayPackets() + i*8;
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	for(int j = 0; j < 8; ++j)
+	{
+		TriangleKdTreeRayQueryNearestHitVisitor result;
+		tree.RayQuery(rays[j], result);
+		globalPokedData += (result.triangleIndex != KdTree<Triangle>::BUCKET_SENTINEL);
+	}
+}
+BENCHMARK_END;
+
+BENCHMARK(KdTreeRayPacketQuery4_Coherent8, "2x KdTree<Triangle>::RayPacketQuery<4> of coherent rays on a SAH-split tree")
+{
+	const Ray *rays = ClusteredKdTreeBenchmarkRayPackets() + i*8;
+	KdTree<Triangle> &tree = ClusteredKdTree(KdTreeSplitSAH);
+	for(int j = 0; j < 8; j += 4)
+	{
+		TriangleKdTreeRayPacketQueryNearestHitVisitor<4> result;
+		tree.RayPacketQuery<4>(rays + j, result);
+		globalPokedData += (result.hits[0].triangleIndex != KdTree<Triangle>::BUCKET_SENTINEL);
+	}
+}
+BENCHMARK_END;
+
+BENCHMARK(KdTreeRayPacketQuery8_Coherent8, "KdTree<Triangle>::RayPacketQuery<8> of coherent rays on a SAH-split tree")
+{
+	const Ray *rays = ClusteredKdTreeBenchmarkRayPackets() + i*8;
+	TriangleKdTreeRayPacketQueryNearestHitVisitor<8> result;
+	ClusteredKdTree(KdTreeSplitSAH).RayPacketQuery<8>(rays, result);
+	globalPokedData += (result.hits[0].triangleIndex != KdTree<Triangle>::BUCKET_SENTINEL);
+}
+BENCHMARK_END;
+
+static const int numKdTreeUpdateBenchmarkTriangles = numKdTreeTestClusters * numKdTreeTestTrianglesPerCluster;
+
+/// Returns the clustered triangle soup of the update benchmarks. The first call builds a SAH kD-tree of it into tree.
+std::vector<Triangle> &KdTreeUpdateBenchmarkTriangles(KdTree<Triangle> &tree)
+{
+	static std::vector<Triangle> tris;
+	if (tris.empty())
+	{
+		tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+		tree.AddObjects(&tris[0], (int)tris.size());
+		KdTreeBuildParams params;
+		params.splitStrategy = KdTreeSplitSAH;
+		tree.Build(params);
+	}
+	return tris;
+}
+
+// Moves 3% of the objects of the tree per iteration (one simulation frame). Compare with KdTreeFullRebuild below.
+BENCHMARK_ITERS(KdTreeMoveObjects_3Percent, 5, 20, "KdTree<Triangle>::MoveObject for 3% of 10000 triangles on a SAH-split tree")
+{
+	static KdTree<Triangle> tree;
+	static LCG lcg(11);
+	std::vector<Triangle> &tris = KdTreeUpdateBenchmarkTriangles(tree);
+	for(int j = 0; j < numKdTreeUpdateBenchmarkTriangles * 3 / 100; ++j)
+	{
+		int objectIndex = lcg.Int(0, numKdTreeUpdateBenchmarkTriangles-1);
+		tris[objectIndex].Translate(float3::RandomDir(lcg, 0.5f));
+		tree.MoveObject(objectIndex, tris[objectIndex]);
+	}
+	globalPokedData += tree.NumNodes();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(KdTreeFullRebuild, 5, 2, "KdTree<Triangle>::Build of 10000 triangles with the SAH split strategy")
+{
+	std::vector<Triangle> tris = ClusteredTriangleSoup(numKdTreeTestClusters, numKdTreeTestTrianglesPerCluster);
+	KdTree<Triangle> tree;
+	tree.AddObjects(&tris[0], (int)tris.size());
+	KdTreeBuildParams params;
+	params.splitStrategy = KdTreeSplitSAH;
+	tree.Build(params);
+	globalPokedData += tree.NumNodes();
+}
+BENCHMARK_ITERS_END;
+
+static const int numKdTreeNearestBenchmarkPoints = 1000000;
+
+/// Returns a kD-tree of a million random points, for benchmarking nearest neighbor queries.
+KdTree<Sphere> &PointKdTree()
+{
+	static KdTree<Sphere> tree;
+	if (!tree.Root())
+	{
+		std::vector<Sphere> points = RandomPointSpheres(numKdTreeNearestBenchmarkPoints);
+		tree.AddObjects(&points[0], (int)points.size());
+		tree.Build();
+	}
+	return tree;
+}
+
+BENCHMARK(KdTreeKNearest_1M, "KdTree<Sphere>::KNearest with k=8 on 1M points")
+{
+	KdTreeNeighbor neighbors[8];
+	const Ray &ray = ClusteredKdTreeBenchmarkRays()[i];
+	globalPokedData += PointKdTree().KNearest(ray.pos * 0.5f, 8, neighbors);
+}
+BENCHMARK_END;
+
+BENCHMARK(KdTreeRadiusQuery_1M, "KdTree<Sphere>::RadiusQuery with r=5 on 1M points")
+{
+	static std::vector<KdTreeNeighbor> neighbors;
+	const Ray &ray = ClusteredKdTreeBenchmarkRays()[i];
+	PointKdTree().RadiusQuery(ray.pos * 0.5f, 5.f, neighbors);
+	globalPokedData += neighbors.size();
+}
+BENCHMARK_END;
+
+BENCHMARK_ITERS(KdTreeKNearest_1M_BruteForce, 3, 5, "Brute force k=8 nearest neighbor search on 1M points")
+{
+	KdTree<Sphere> &tree = PointKdTree();
+	const float3 point = ClusteredKdTreeBenchmarkRays()[i].pos * 0.5f;
+	KdTreeNeighbor neighbors[8];
+	int numNeighbors = 0;
+	for(int j = 0; j < numKdTreeNearestBenchmarkPoints; ++j)
+	{
+		KdTreeNeighbor n;
+		n.objectIndex = j;
+		n.distance = tree.Object(j).Distance(point);
+		if (numNeighbors == 8 && !(n < neighbors[0]))
+			continue;
+		if (numNeighbors == 8)
+			std::pop_heap(neighbors, neighbors + numNeighbors--);
+		neighbors[numNeighbors++] = n;
+		std::push_heap(neighbors, neighbors + numNeighbors);
+	}
+	globalPokedData += neighbors[0].objectIndex;
+}
+BENCHMARK_ITERS_END;
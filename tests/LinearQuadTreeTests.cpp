@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// An object type for testing LinearQuadTree<T>, stored in the tree by value.
+struct LinearQuadTreeTestObject
+{
+	float2 pos;
+	float halfSize;
+	int id;
+};
+
+AABB2D GetAABB2D(const LinearQuadTreeTestObject &o)
+{
+	return AABB2D(o.pos - float2(o.halfSize, o.halfSize), o.pos + float2(o.halfSize, o.halfSize));
+}
+
+/// Generates objects of mixed sizes: mostly small, some larger ones that straddle the split lines of large cells.
+std::vector<LinearQuadTreeTestObject> LinearQuadTreeTestObjects(int n, float worldSize, int seed)
+{
+	LCG lcg(seed);
+	std::vector<LinearQuadTreeTestObject> objects(n);
+	for(int i = 0; i < n; ++i)
+	{
+		objects[i].pos = float2(lcg.Float(0.f, worldSize), lcg.Float(0.f, worldSize));
+		objects[i].halfSize = (i % 50 == 0) ? lcg.Float(0.f, worldSize * 0.05f) : lcg.Float(0.f, worldSize * 0.002f);
+		objects[i].id = i;
+	}
+	return objects;
+}
+
+/// Collects the ids of the objects of the cells that intersect the query AABB.
+struct CollectLinearQuadTreeObjectIds
+{
+	std::vector<int> ids;
+
+	bool operator()(LinearQuadTree<LinearQuadTreeTestObject> &tree, const AABB2D &queryAABB,
+		const LinearQuadTree<LinearQuadTreeTestObject>::Cell &cell, const AABB2D &cellAABB)
+	{
+		assert(cellAABB.Intersects(queryAABB));
+		MARK_UNUSED(cellAABB);
+		const LinearQuadTreeTestObject *objects = tree.CellObjects(cell);
+		for(u32 i = 0; i < cell.numObjects; ++i)
+			if (GetAABB2D(objects[i]).Intersects(queryAABB))
+				ids.push_back(objects[i].id);
+		return false;
+	}
+};
+
+/// Collects the objects output by LinearQuadTree::NearestNeighborObjects(), up to the given count.
+struct CollectLinearQuadTreeNearestObjects
+{
+	int maxCount;
+	std::vector<int> ids;
+	std::vector<float> distancesSq;
+
+	bool operator()(LinearQuadTree<LinearQuadTreeTestObject> & /*tree*/, const float2 & /*targetPoint*/,
+		const LinearQuadTree<LinearQuadTreeTestObject>::Cell & /*cell*/, float distanceSquared,
+		const LinearQuadTreeTestObject &object, int nearestNeighborIndex)
+	{
+		assert(nearestNeighborIndex == (int)ids.size());
+		MARK_UNUSED(nearestNeighborIndex);
+		ids.push_back(object.id);
+		distancesSq.push_back(distanceSquared);
+		return (int)ids.size() >= maxCount;
+	}
+};
+
+/// Checks the AABB and nearest neighbor queries of a tree built from the given objects against brute force.
+void TestLinearQuadTreeQueries(const std::vector<LinearQuadTreeTestObject> &objects, const AABB2D &queryArea, int seed)
+{
+	LinearQuadTree<LinearQuadTreeTestObject> tree;
+	tree.Build(&objects[0], (int)objects.size());
+	tree.DebugSanityCheck();
+	assert(tree.NumObjects() == (int)objects.size());
+
+	LCG lcg(seed);
+	LinearQuadTree<LinearQuadTreeTestObject>::QueryScratch scratch;
+	const int k = 16;
+	LinearQuadTreeTestObject nearest[k];
+	float nearestDistancesSq[k];
+	for(int q = 0; q < 100; ++q)
+	{
+		float2 a(lcg.Float(queryArea.minPoint.x, queryArea.maxPoint.x), lcg.Float(queryArea.minPoint.y, queryArea.maxPoint.y));
+		float2 b(lcg.Float(queryArea.minPoint.x, queryArea.maxPoint.x), lcg.Float(queryArea.minPoint.y, queryArea.maxPoint.y));
+		AABB2D query(Min(a, b), Max(a, b));
+
+		CollectLinearQuadTreeObjectIds collect;
+		tree.AABBQuery(query, collect);
+		std::sort(collect.ids.begin(), collect.ids.end());
+		std::vector<int> expected;
+		for(size_t i = 0; i < objects.size(); ++i)
+			if (GetAABB2D(objects[i]).Intersects(query))
+				expected.push_back(objects[i].id);
+		assert(collect.ids == expected);
+
+		int numFound = tree.KNearestObjects(a, k, nearest, nearestDistancesSq, scratch);
+		assert(numFound == Min(k, (int)objects.size()));
+		std::vector<float> distancesSq;
+		for(size_t i = 0; i < objects.size(); ++i)
+			distancesSq.push_back(GetAABB2D(objects[i]).DistanceSq(a));
+		std::sort(distancesSq.begin(), distancesSq.end());
+		for(int i = 0; i < numFound; ++i)
+		{
+			assert(nearestDistancesSq[i] == distancesSq[i]);
+			assert(GetAABB2D(nearest[i]).DistanceSq(a) == distancesSq[i]);
+		}
+
+		CollectLinearQuadTreeNearestObjects nn;
+		nn.maxCount = k;
+		tree.NearestNeighborObjects(a, nn, scratch);
+		assert(nn.distancesSq == std::vector<float>(nearestDistancesSq, nearestDistancesSq + numFound));
+		MARK_UNUSED(numFound);
+	}
+
+	// Without an early out, the search outputs each object once, closest first.
+	CollectLinearQuadTreeNearestObjects all;
+	all.maxCount = (int)objects.size() + 1;
+	tree.NearestNeighborObjects((queryArea.minPoint + queryArea.maxPoint) * 0.5f, all);
+	assert(all.ids.size() == objects.size());
+	for(size_t i = 1; i < all.distancesSq.size(); ++i)
+		assert(all.distancesSq[i-1] <= all.distancesSq[i]);
+	std::sort(all.ids.begin(), all.ids.end());
+	for(size_t i = 0; i < objects.size(); ++i)
+		assert(all.ids[i] == objects[i].id);
+}
+
+UNIQUE_TEST(LinearQuadTreeMatchesBruteForce)
+{
+	std::vector<LinearQuadTreeTestObject> objects = LinearQuadTreeTestObjects(5000, 1000.f, 5);
+	TestLinearQuadTreeQueries(objects, AABB2D(float2(-100.f, -100.f), float2(1100.f, 1100.f)), 6);
+}
+
+UNIQUE_TEST(LinearQuadTreeSparseClusteredWorld)
+{
+	// A few dense clusters far apart in a huge world, which leaves long chains of empty cells above each cluster.
+	LCG lcg(12);
+	std::vector<LinearQuadTreeTestObject> objects;
+	for(int c = 0; c < 5; ++c)
+	{
+		float2 center(lcg.Float(-1e6f, 1e6f), lcg.Float(-1e6f, 1e6f));
+		for(int i = 0; i < 400; ++i)
+		{
+			LinearQuadTreeTestObject o;
+			o.pos = center + float2(lcg.Float(-10.f, 10.f), lcg.Float(-10.f, 10.f));
+			o.halfSize = lcg.Float(0.f, 0.1f);
+			o.id = (int)objects.size();
+			objects.push_back(o);
+		}
+	}
+	// Identical objects cannot be separated, and end up together in a cell of the deepest level.
+	for(int i = 0; i < 100; ++i)
+	{
+		LinearQuadTreeTestObject o;
+		o.pos = float2(1.f, 2.f);
+		o.halfSize = 0.f;
+		o.id = (int)objects.size();
+		objects.push_back(o);
+	}
+	TestLinearQuadTreeQueries(objects, AABB2D(float2(-1.1e6f, -1.1e6f), float2(1.1e6f, 1.1e6f)), 13);
+
+	LinearQuadTree<LinearQuadTreeTestObject> tree;
+	tree.Build(&objects[0], (int)objects.size());
+	assert(tree.NumCells() < (int)objects.size() / 4);
+
+	// A single object and an empty tree.
+	tree.Build(&objects[0], 1);
+	tree.DebugSanityCheck();
+	assert(tree.NumCells() == 1);
+	tree.Clear();
+	assert(tree.NumCells() == 0);
+	assert(tree.NumObjects() == 0);
+	LinearQuadTreeTestObject nearest;
+	LinearQuadTree<LinearQuadTreeTestObject>::QueryScratch scratch;
+	assert(tree.KNearestObjects(float2(0, 0), 1, &nearest, 0, scratch) == 0);
+}
+
+UNIQUE_TEST(LinearQuadTreeMemoryUsage)
+{
+	const int numPoints = 100000;
+	LCG lcg(21);
+	std::vector<float3> points(numPoints);
+	for(int i = 0; i < numPoints; ++i)
+		points[i] = float3(lcg.Float(0.f, 1000.f), lcg.Float(0.f, 1000.f), 0.f);
+
+	QuadTree<float3> quadTree;
+	quadTree.BulkLoad(&points[0], numPoints);
+	LinearQuadTree<float3> linearTree;
+	linearTree.Build(&points[0], numPoints);
+	linearTree.DebugSanityCheck();
+
+	// The objects take the same space in both trees, so compare the memory that the tree structures themselves take.
+	size_t quadTreeBytes = quadTree.NumNodes() * sizeof(QuadTree<float3>::Node);
+	size_t linearTreeBytes = linearTree.MemoryUsage() - linearTree.NumObjects() * sizeof(float3);
+	LOGI("Tree structure of %d points: QuadTree %d nodes, %d bytes. LinearQuadTree %d cells, %d bytes (%.1fx smaller).",
+		numPoints, quadTree.NumNodes(), (int)quadTreeBytes, linearTree.NumCells(), (int)linearTreeBytes,
+		(double)quadTreeBytes / linearTreeBytes);
+	assert(linearTreeBytes * 2 < quadTreeBytes);
+}
+
+/// Holds the trees and search points for the benchmarks comparing LinearQuadTree to QuadTree.
+struct LinearQuadTreeBenchmarkData
+{
+	std::vector<float3> points;
+	QuadTree<float3> quadTree;
+	LinearQuadTree<float3> linearTree;
+	QuadTree<float3>::QueryScratch quadTreeScratch;
+	LinearQuadTree<float3>::QueryScratch linearTreeScratch;
+	std::vector<AABB2D> queries;
+
+	LinearQuadTreeBenchmarkData()
+	{
+		LCG lcg(77);
+		for(int i = 0; i < 10000; ++i)
+			points.push_back(float3(lcg.Float(0.f, 1000.f), lcg.Float(0.f, 1000.f), 0.f));
+		quadTree.BulkLoad(&points[0], (int)points.size());
+		linearTree.Build(&points[0], (int)points.size());
+		for(int i = 0; i < 1000; ++i)
+		{
+			float2 pos(lcg.Float(0.f, 1000.f), lcg.Float(0.f, 1000.f));
+			queries.push_back(AABB2D(pos, pos + float2(20.f, 20.f)));
+		}
+	}
+};
+
+LinearQuadTreeBenchmarkData &LinearQuadTreeBenchmark()
+{
+	static LinearQuadTreeBenchmarkData data;
+	return data;
+}
+
+/// Counts the objects in the nodes or cells visited by an AABB query.
+struct CountLinearQuadTreeBenchmarkObjects
+{
+	CountLinearQuadTreeBenchmarkObjects():count(0) {}
+	int count;
+
+	bool operator()(QuadTree<float3> &, const AABB2D &, QuadTree<float3>::Node &node, const AABB2D &)
+	{
+		count += (int)node.objects.size();
+		return false;
+	}
+
+	bool operator()(LinearQuadTree<float3> &, const AABB2D &, const LinearQuadTree<float3>::Cell &cell, const AABB2D &)
+	{
+		count += (int)cell.numObjects;
+		return false;
+	}
+};
+
+BENCHMARK_ITERS(LinearQuadTreeBuild_10000, 5, 5, "Building a LinearQuadTree of 10000 points")
+{
+	LinearQuadTreeBenchmarkData &data = LinearQuadTreeBenchmark();
+	data.linearTree.Build(&data.points[0], (int)data.points.size());
+	globalPokedData += data.linearTree.NumCells();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(LinearQuadTreeAABBQuery_1000, 5, 5, "1000 AABBQuery calls on a LinearQuadTree of 10000 points")
+{
+	LinearQuadTreeBenchmarkData &data = LinearQuadTreeBenchmark();
+	CountLinearQuadTreeBenchmarkObjects count;
+	for(size_t i = 0; i < data.queries.size(); ++i)
+		data.linearTree.AABBQuery(data.queries[i], count);
+	globalPokedData += count.count;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(LinearQuadTreeAABBQuery_1000_QuadTree, 5, 5, "1000 AABBQuery calls on a QuadTree of 10000 points, for comparison")
+{
+	LinearQuadTreeBenchmarkData &data = LinearQuadTreeBenchmark();
+	CountLinearQuadTreeBenchmarkObjects count;
+	for(size_t i = 0; i < data.queries.size(); ++i)
+		data.quadTree.AABBQuery(data.queries[i], count);
+	globalPokedData += count.count;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(LinearQuadTreeKNearestObjects_1000x8, 5, 5, "1000 searches of the 8 nearest points in a LinearQuadTree of 10000 points")
+{
+	LinearQuadTreeBenchmarkData &data = LinearQuadTreeBenchmark();
+	float3 nearest[8];
+	float distancesSq[8];
+	float sum = 0.f;
+	for(size_t i = 0; i < data.queries.size(); ++i)
+	{
+		data.linearTree.KNearestObjects(data.queries[i].minPoint, 8, nearest, distancesSq, data.linearTreeScratch);
+		sum += distancesSq[7];
+	}
+	globalPokedData += (int)sum;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(LinearQuadTreeKNearestObjects_1000x8_QuadTree, 5, 5, "1000 searches of the 8 nearest points in a QuadTree of 10000 points, for comparison")
+{
+	LinearQuadTreeBenchmarkData &data = LinearQuadTreeBenchmark();
+	float3 nearest[8];
+	float distancesSq[8];
+	float sum = 0.f;
+	for(size_t i = 0; i < data.queries.size(); ++i)
+	{
+		data.quadTree.KNearestObjects(data.queries[i].minPoint, 8, nearest, distancesSq, data.quadTreeScratch);
+		sum += distancesSq[7];
+	}
+	globalPokedData += (int)sum;
+}
+BENCHMARK_ITERS_END;
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// An object type for testing Octree<T>, stored in the tree by pointer. Each object remembers the node it is stored
+/// in, so that it can be removed from the tree.
+struct OctreeTestObject
+{
+	typedef Octree<OctreeTestObject*> Tree;
+
+	float3 pos;
+	float halfSize;
+	Tree::Node *node;
+};
+
+AABB GetAABB(OctreeTestObject * const &o)
+{
+	return AABB(o->pos - float3(o->halfSize, o->halfSize, o->halfSize), o->pos + float3(o->halfSize, o->halfSize, o->halfSize));
+}
+
+void AssociateOctreeNode(OctreeTestObject * const &o, OctreeTestObject::Tree::Node *node)
+{
+	o->node = node;
+}
+
+OctreeTestObject::Tree::Node *GetOctreeNode(OctreeTestObject * const &o)
+{
+	return o->node;
+}
+
+const float octreeTestWorldSize = 1000.f;
+const int numOctreeTestObjects = 10000;
+
+/// Returns a deterministic set of small cubes scattered over the test world.
+std::vector<OctreeTestObject> OctreeTestObjects(int numObjects)
+{
+	LCG lcg(1234);
+	std::vector<OctreeTestObject> objects(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+	{
+		objects[i].pos = float3(lcg.Float(0.f, octreeTestWorldSize), lcg.Float(0.f, octreeTestWorldSize), lcg.Float(0.f, octreeTestWorldSize));
+		objects[i].halfSize = lcg.Float(0.1f, 5.f);
+		objects[i].node = 0;
+	}
+	return objects;
+}
+
+/// Returns a deterministic set of query boxes inside the test world.
+std::vector<AABB> OctreeTestQueries(int numQueries)
+{
+	LCG lcg(4321);
+	std::vector<AABB> queries(numQueries);
+	for(int i = 0; i < numQueries; ++i)
+	{
+		float3 minPoint(lcg.Float(0.f, octreeTestWorldSize), lcg.Float(0.f, octreeTestWorldSize), lcg.Float(0.f, octreeTestWorldSize));
+		queries[i] = AABB(minPoint, minPoint + float3(lcg.Float(1.f, 100.f), lcg.Float(1.f, 100.f), lcg.Float(1.f, 100.f)));
+	}
+	return queries;
+}
+
+/// Returns a perspective frustum at the given position, looking towards the center of the test world.
+Frustum OctreeTestFrustum(const float3 &pos, float farPlaneDistance)
+{
+	Frustum f;
+	f.type = PerspectiveFrustum;
+	f.handedness = FrustumRightHanded;
+	f.projectiveSpace = FrustumSpaceGL;
+	f.pos = pos;
+	f.front = (float3(0.5f, 0.5f, 0.5f) * octreeTestWorldSize - pos).Normalized();
+	f.up = f.front.Perpendicular();
+	f.nearPlaneDistance = 1.f;
+	f.farPlaneDistance = farPlaneDistance;
+	f.horizontalFov = pi / 3.f;
+	f.verticalFov = pi / 4.f;
+	return f;
+}
+
+/// Collects the indices of all objects that overlap the query box.
+struct CollectOctreeAABBQueryIndices
+{
+	const OctreeTestObject *first;
+	std::vector<int> indices;
+
+	bool operator()(OctreeTestObject::Tree & /*tree*/, const AABB &queryAABB, OctreeTestObject::Tree::Node &node, const AABB & /*nodeAABB*/)
+	{
+		for(size_t i = 0; i < node.objects.size(); ++i)
+			if (GetAABB(node.objects[i]).Intersects(queryAABB))
+				indices.push_back((int)(node.objects[i] - first));
+		return false;
+	}
+};
+
+/// Collects the indices of all objects that intersect the query frustum.
+struct CollectOctreeFrustumQueryIndices
+{
+	const OctreeTestObject *first;
+	std::vector<int> indices;
+	int numObjectsTested;
+
+	bool operator()(OctreeTestObject::Tree & /*tree*/, const Frustum &frustum, OctreeTestObject::Tree::Node &node, const AABB & /*nodeAABB*/)
+	{
+		numObjectsTested += (int)node.objects.size();
+		for(size_t i = 0; i < node.objects.size(); ++i)
+			if (frustum.Intersects(GetAABB(node.objects[i])))
+				indices.push_back((int)(node.objects[i] - first));
+		return false;
+	}
+};
+
+/// Collects the objects in nearest first order, up to the given count.
+struct CollectOctreeNearestNeighbors
+{
+	const OctreeTestObject *first;
+	int maxCount;
+	std::vector<int> indices;
+	std::vector<float> distancesSq;
+
+	bool operator()(OctreeTestObject::Tree & /*tree*/, const float3 & /*targetPoint*/, OctreeTestObject::Tree::Node * /*node*/, const AABB & /*aabb*/,
+		float distanceSquared, OctreeTestObject * const &object, int nearestNeighborIndex)
+	{
+		assert(nearestNeighborIndex == (int)indices.size());
+		MARK_UNUSED(nearestNeighborIndex);
+		indices.push_back((int)(object - first));
+		distancesSq.push_back(distanceSquared);
+		return (int)indices.size() >= maxCount;
+	}
+};
+
+std::vector<int> OctreeAABBQueryIndices(OctreeTestObject::Tree &tree, const std::vector<OctreeTestObject> &objects, const AABB &queryAABB)
+{
+	CollectOctreeAABBQueryIndices collect;
+	collect.first = &objects[0];
+	tree.AABBQuery(queryAABB, collect);
+	std::sort(collect.indices.begin(), collect.indices.end());
+	return collect.indices;
+}
+
+UNIQUE_TEST(OctreeAddRemoveAABBQuery)
+{
+	std::vector<OctreeTestObject> objects = OctreeTestObjects(numOctreeTestObjects);
+	OctreeTestObject::Tree tree;
+	// Start with a small tree, so that the root has to grow in all directions.
+	tree.Clear(float3(400.f, 400.f, 400.f), float3(600.f, 600.f, 600.f));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+	assert(tree.NumObjects() == (int)objects.size());
+	assert(tree.BoundingAABB().Contains(AABB(float3(0,0,0), float3(octreeTestWorldSize, octreeTestWorldSize, octreeTestWorldSize))));
+	assert(tree.NumLeaves() + tree.NumInnerNodes() == tree.NumNodes());
+	assert(tree.NumInnerNodes() > 0);
+	assert(tree.TreeHeight() > 2);
+	tree.DebugSanityCheckNode(tree.Root());
+
+	// Remove every third object and move every seventh object, also outside the current bounds of the tree.
+	LCG lcg(99);
+	for(size_t i = 0; i < objects.size(); ++i)
+		if (i % 3 == 0)
+		{
+			tree.Remove(&objects[i]);
+			assert(objects[i].node == 0);
+		}
+		else if (i % 7 == 0)
+		{
+			tree.Remove(&objects[i]);
+			objects[i].pos = float3(lcg.Float(-500.f, 1500.f), lcg.Float(-500.f, 1500.f), lcg.Float(-500.f, 1500.f));
+			tree.Add(&objects[i]);
+		}
+	assert(tree.NumObjects() == (int)objects.size() - ((int)objects.size() + 2) / 3);
+	tree.DebugSanityCheckNode(tree.Root());
+
+	std::vector<AABB> queries = OctreeTestQueries(200);
+	queries.push_back(AABB(float3(-1e6f, -1e6f, -1e6f), float3(1e6f, 1e6f, 1e6f)));
+	for(size_t q = 0; q < queries.size(); ++q)
+	{
+		std::vector<int> expected;
+		for(size_t i = 0; i < objects.size(); ++i)
+			if (i % 3 != 0 && GetAABB(&objects[i]).Intersects(queries[q]))
+				expected.push_back((int)i);
+		assert(OctreeAABBQueryIndices(tree, objects, queries[q]) == expected);
+	}
+}
+
+UNIQUE_TEST(OctreeNodeArrayGrowthKeepsNodeLinks)
+{
+	// Dense clusters of tiny objects split the tree deeply, so the node array is reallocated many times while the
+	// objects are added.
+	std::vector<OctreeTestObject> objects(20000);
+	LCG lcg(2024);
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		float3 clusterCenter = float3((float)(i % 5), (float)(i % 7), (float)(i % 3)) * 150.f;
+		objects[i].pos = clusterCenter + float3::RandomBox(lcg, float3(0,0,0), float3(5.f, 5.f, 5.f));
+		objects[i].halfSize = 0.01f;
+		objects[i].node = 0;
+	}
+	OctreeTestObject::Tree tree;
+	tree.Clear(float3(0,0,0), float3(octreeTestWorldSize, octreeTestWorldSize, octreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+	assert1(tree.NumNodes() > 1000, tree.NumNodes());
+	tree.DebugSanityCheckNode(tree.Root());
+
+	// Each object must be associated with the node that stores it.
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		const OctreeTestObject::Tree::Node *node = objects[i].node;
+		assert(node);
+		assert(std::find(node->objects.begin(), node->objects.end(), &objects[i]) != node->objects.end());
+		MARK_UNUSED(node);
+	}
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Remove(&objects[i]);
+	assert(tree.NumObjects() == 0);
+}
+
+UNIQUE_TEST(OctreeFrustumQuery)
+{
+	std::vector<OctreeTestObject> objects = OctreeTestObjects(2000);
+	OctreeTestObject::Tree tree;
+	tree.Clear(float3(0,0,0), float3(octreeTestWorldSize, octreeTestWorldSize, octreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+
+	const float3 eyes[] = { float3(-100.f, 500.f, 500.f), float3(500.f, 500.f, 500.f) - float3(1,2,3), float3(1200.f, 1300.f, -200.f) };
+	for(int e = 0; e < 3; ++e)
+	{
+		Frustum frustum = OctreeTestFrustum(eyes[e], 700.f);
+		CollectOctreeFrustumQueryIndices collect;
+		collect.first = &objects[0];
+		collect.numObjectsTested = 0;
+		tree.FrustumQuery(frustum, collect);
+		std::sort(collect.indices.begin(), collect.indices.end());
+
+		std::vector<int> expected;
+		for(size_t i = 0; i < objects.size(); ++i)
+			if (frustum.Intersects(GetAABB(&objects[i])))
+				expected.push_back((int)i);
+		assert(!expected.empty());
+		assert(collect.indices == expected);
+		// The culling must have skipped a good part of the tree.
+		assert(collect.numObjectsTested < (int)objects.size() / 2);
+	}
+}
+
+UNIQUE_TEST(OctreeNearestNeighborObjects)
+{
+	std::vector<OctreeTestObject> objects = OctreeTestObjects(numOctreeTestObjects);
+	OctreeTestObject::Tree tree;
+	tree.Clear(float3(0,0,0), float3(octreeTestWorldSize, octreeTestWorldSize, octreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+
+	LCG lcg(7);
+	for(int q = 0; q < 20; ++q)
+	{
+		// Also query from outside the tree.
+		float3 point(lcg.Float(-200.f, 1200.f), lcg.Float(-200.f, 1200.f), lcg.Float(-200.f, 1200.f));
+		CollectOctreeNearestNeighbors collect;
+		collect.first = &objects[0];
+		collect.maxCount = 10;
+		tree.NearestNeighborObjects(point, collect);
+		assert(collect.indices.size() == 10);
+
+		std::vector<float> distancesSq;
+		for(size_t i = 0; i < objects.size(); ++i)
+			distancesSq.push_back(GetAABB(&objects[i]).ClosestPoint(point).DistanceSq(point));
+		std::sort(distancesSq.begin(), distancesSq.end());
+		for(int i = 0; i < 10; ++i)
+		{
+			assert(collect.distancesSq[i] == distancesSq[i]);
+			assert(GetAABB(&objects[collect.indices[i]]).ClosestPoint(point).DistanceSq(point) == distancesSq[i]);
+		}
+	}
+
+	// Without an early exit, the search outputs all objects exactly once, in sorted order.
+	CollectOctreeNearestNeighbors collect;
+	collect.first = &objects[0];
+	collect.maxCount = numOctreeTestObjects + 1;
+	tree.NearestNeighborObjects(float3(10.f, 20.f, 30.f), collect);
+	assert(collect.indices.size() == objects.size());
+	for(size_t i = 1; i < collect.distancesSq.size(); ++i)
+		assert(collect.distancesSq[i-1] <= collect.distancesSq[i]);
+	std::sort(collect.indices.begin(), collect.indices.end());
+	for(size_t i = 0; i < objects.size(); ++i)
+		assert(collect.indices[i] == (int)i);
+}
+
+struct CountOctreeFloat3Points
+{
+	int numPoints;
+
+	bool operator()(Octree<float3> & /*tree*/, const AABB &queryAABB, Octree<float3>::Node &node, const AABB & /*nodeAABB*/)
+	{
+		for(size_t i = 0; i < node.objects.size(); ++i)
+			if (queryAABB.Contains(node.objects[i]))
+				++numPoints;
+		return false;
+	}
+};
+
+UNIQUE_TEST(OctreeFloat3)
+{
+	Octree<float3> tree;
+	tree.Clear();
+	LCG lcg(3);
+	std::vector<float3> points;
+	for(int i = 0; i < 1000; ++i)
+	{
+		points.push_back(float3(lcg.Float(-10.f, 10.f), lcg.Float(-10.f, 10.f), lcg.Float(-10.f, 10.f)));
+		tree.Add(points.back());
+	}
+	assert(tree.NumObjects() == 1000);
+	tree.DebugSanityCheckNode(tree.Root());
+
+	AABB query(float3(-2.f, -3.f, -4.f), float3(5.f, 6.f, 7.f));
+	CountOctreeFloat3Points count;
+	count.numPoints = 0;
+	tree.AABBQuery(query, count);
+	int expected = 0;
+	for(size_t i = 0; i < points.size(); ++i)
+		if (query.Contains(points[i]))
+			++expected;
+	assert(count.numPoints == expected);
+}
+
+/// Holds an octree of test objects and queries into it, for the benchmarks.
+struct OctreeBenchmarkData
+{
+	std::vector<OctreeTestObject> objects;
+	OctreeTestObject::Tree tree;
+	std::vector<AABB> queries;
+
+	OctreeBenchmarkData()
+	:objects(OctreeTestObjects(numOctreeTestObjects)),
+	queries(OctreeTestQueries(1000))
+	{
+		Rebuild();
+	}
+
+	void Rebuild()
+	{
+		tree.Clear(float3(0,0,0), float3(octreeTestWorldSize, octreeTestWorldSize, octreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+	}
+};
+
+OctreeBenchmarkData &OctreeBenchmark()
+{
+	static OctreeBenchmarkData data;
+	return data;
+}
+
+BENCHMARK_ITERS(OctreeInsert_10000, 5, 5, "Clearing and inserting 10000 objects into an Octree")
+{
+	OctreeBenchmark().Rebuild();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(OctreeAABBQuery_1000, 5, 5, "1000 AABBQuery calls on an Octree of 10000 objects")
+{
+	OctreeBenchmarkData &data = OctreeBenchmark();
+	CollectOctreeAABBQueryIndices collect;
+	collect.first = &data.objects[0];
+	collect.indices.reserve(1024);
+	for(size_t i = 0; i < data.queries.size(); ++i)
+	{
+		collect.indices.clear();
+		data.tree.AABBQuery(data.queries[i], collect);
+		globalPokedData += (int)collect.indices.size();
+	}
+}
+BENCHMARK_ITERS_END;
+
+/// Counts the objects in the nodes reported by a frustum query, without testing the objects themselves.
+struct CountOctreeFrustumQueryObjects
+{
+	int numObjects;
+
+	bool operator()(OctreeTestObject::Tree & /*tree*/, const Frustum & /*frustum*/, OctreeTestObject::Tree::Node &node, const AABB & /*nodeAABB*/)
+	{
+		numObjects += (int)node.objects.size();
+		return false;
+	}
+};
+
+BENCHMARK_ITERS(OctreeFrustumQuery_100, 5, 5, "100 FrustumQuery calls on an Octree of 10000 objects")
+{
+	OctreeBenchmarkData &data = OctreeBenchmark();
+	CountOctreeFrustumQueryObjects count;
+	count.numObjects = 0;
+	for(int i = 0; i < 100; ++i)
+	{
+		Frustum frustum = OctreeTestFrustum(data.queries[i].minPoint, 500.f);
+		data.tree.FrustumQuery(frustum, count);
+	}
+	globalPokedData += count.numObjects;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(OctreeNearestNeighborObjects_100x10, 5, 5, "100 searches of the 10 nearest objects in an Octree of 10000 objects")
+{
+	OctreeBenchmarkData &data = OctreeBenchmark();
+	CollectOctreeNearestNeighbors collect;
+	collect.first = &data.objects[0];
+	collect.maxCount = 10;
+	for(int i = 0; i < 100; ++i)
+	{
+		collect.indices.clear();
+		collect.distancesSq.clear();
+		data.tree.NearestNeighborObjects(data.queries[i].minPoint, collect);
+		globalPokedData += collect.indices[0];
+	}
+}
+BENCHMARK_ITERS_END;
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Algorithm/ParallelFor.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// Counts the number of times each item is processed, and records the largest thread index seen, for ParallelFor().
+struct CountParallelForItems
+{
+	std::vector<int> *counts;
+	std::vector<int> *threadOfItem;
+
+	void operator()(int itemIndex, int threadIndex)
+	{
+		// Each item is written by exactly one thread, so no synchronization is needed.
+		++(*counts)[itemIndex];
+		(*threadOfItem)[itemIndex] = threadIndex;
+	}
+};
+
+UNIQUE_TEST(ParallelForPoolProcessesEachItemOnce)
+{
+	for(int numThreads = 1; numThreads <= 4; ++numThreads)
+	{
+		ParallelForPool pool(numThreads);
+		assert(pool.NumThreads() == numThreads || pool.NumThreads() == 1);
+		// Run several loops of different sizes on the same pool, including empty loops and loops of fewer items
+		// than threads.
+		const int numItems[] = { 1000, 0, 1, 3, 10000, 7 };
+		for(int loop = 0; loop < 6; ++loop)
+		{
+			std::vector<int> counts(numItems[loop], 0);
+			std::vector<int> threadOfItem(numItems[loop], -1);
+			CountParallelForItems func;
+			func.counts = &counts;
+			func.threadOfItem = &threadOfItem;
+			ParallelFor(numItems[loop], pool, func);
+			for(int i = 0; i < numItems[loop]; ++i)
+			{
+				assert1(counts[i] == 1, counts[i]);
+				assert2(threadOfItem[i] >= 0 && threadOfItem[i] < pool.NumThreads(), threadOfItem[i], pool.NumThreads());
+			}
+		}
+	}
+}
+
+/// An empty work item, for measuring the overhead of ParallelFor() itself.
+struct EmptyParallelForItem
+{
+	void operator()(int itemIndex, int threadIndex) { globalPokedData += itemIndex + threadIndex; }
+};
+
+BENCHMARK(ParallelFor_StartThreads_4Threads, "ParallelFor over 4 empty items on 4 threads, starting the threads for each call")
+{
+	EmptyParallelForItem func;
+	ParallelFor(4, 4, func);
+}
+BENCHMARK_END;
+
+BENCHMARK(ParallelFor_Pool_4Threads, "ParallelFor over 4 empty items on a persistent pool of 4 threads")
+{
+	static ParallelForPool pool(4);
+	EmptyParallelForItem func;
+	ParallelFor(4, pool, func);
+}
+BENCHMARK_END;
@@ -0,0 +1,1026 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// An object type for testing QuadTree<T, Storage>, stored in the tree by pointer. Each object remembers the node it
+/// is stored in, so that it can be removed from the tree. The storage of the tree is StorageT<QuadTreeTestObject*>.
+template<template<typename> class StorageT>
+struct QuadTreeTestObject
+{
+	typedef QuadTree<QuadTreeTestObject*, StorageT<QuadTreeTestObject*> > Tree;
+
+	float2 pos;
+	float halfSize;
+	typename Tree::Node *node;
+};
+
+template<template<typename> class S> float MinX(QuadTreeTestObject<S> * const &o) { return o->pos.x - o->halfSize; }
+template<template<typename> class S> float MaxX(QuadTreeTestObject<S> * const &o) { return o->pos.x + o->halfSize; }
+template<template<typename> class S> float MinY(QuadTreeTestObject<S> * const &o) { return o->pos.y - o->halfSize; }
+template<template<typename> class S> float MaxY(QuadTreeTestObject<S> * const &o) { return o->pos.y + o->halfSize; }
+
+template<template<typename> class S>
+AABB2D GetAABB2D(QuadTreeTestObject<S> * const &o)
+{
+	return AABB2D(float2(MinX(o), MinY(o)), float2(MaxX(o), MaxY(o)));
+}
+
+template<template<typename> class S, typename Node>
+void AssociateQuadTreeNode(QuadTreeTestObject<S> * const &o, Node *node)
+{
+	o->node = node;
+}
+
+template<template<typename> class S>
+typename QuadTreeTestObject<S>::Tree::Node *GetQuadTreeNode(QuadTreeTestObject<S> * const &o)
+{
+	return o->node;
+}
+
+const float quadTreeTestWorldSize = 1000.f;
+const int numQuadTreeTestObjects = 10000;
+const int numQuadTreeTestQueries = 1000;
+
+/// Returns a deterministic set of small square objects scattered over the test world.
+template<template<typename> class S>
+std::vector<QuadTreeTestObject<S> > QuadTreeTestObjects(int numObjects)
+{
+	LCG lcg(1234);
+	std::vector<QuadTreeTestObject<S> > objects(numObjects);
+	for(int i = 0; i < numObjects; ++i)
+	{
+		objects[i].pos = float2(lcg.Float(0.f, quadTreeTestWorldSize), lcg.Float(0.f, quadTreeTestWorldSize));
+		objects[i].halfSize = lcg.Float(0.1f, 2.f);
+		objects[i].node = 0;
+	}
+	return objects;
+}
+
+/// Returns a deterministic set of query rectangles inside the test world.
+std::vector<AABB2D> QuadTreeTestQueries(int numQueries)
+{
+	LCG lcg(4321);
+	std::vector<AABB2D> queries(numQueries);
+	for(int i = 0; i < numQueries; ++i)
+	{
+		float2 minPoint(lcg.Float(0.f, quadTreeTestWorldSize), lcg.Float(0.f, quadTreeTestWorldSize));
+		queries[i] = AABB2D(minPoint, minPoint + float2(lcg.Float(1.f, 50.f), lcg.Float(1.f, 50.f)));
+	}
+	return queries;
+}
+
+/// Collects the indices of all objects that overlap the query rectangle.
+template<template<typename> class S>
+struct CollectObjectIndicesQuadTreeVisitor
+{
+	typedef typename QuadTreeTestObject<S>::Tree Tree;
+
+	const QuadTreeTestObject<S> *first;
+	std::vector<int> indices;
+
+	bool operator()(Tree & /*tree*/, const AABB2D &queryAABB, typename Tree::Node &node, const AABB2D & /*nodeAABB*/)
+	{
+		for(size_t i = 0; i < node.objects.size(); ++i)
+			if (GetAABB2D(node.objects[i]).Intersects(queryAABB))
+				indices.push_back((int)(node.objects[i] - first));
+		return false;
+	}
+};
+
+template<template<typename> class S>
+std::vector<int> QuadTreeQueryIndices(typename QuadTreeTestObject<S>::Tree &tree, const std::vector<QuadTreeTestObject<S> > &objects, const AABB2D &queryAABB)
+{
+	CollectObjectIndicesQuadTreeVisitor<S> visitor;
+	visitor.first = &objects[0];
+	tree.AABBQuery(queryAABB, visitor);
+	std::sort(visitor.indices.begin(), visitor.indices.end());
+	return visitor.indices;
+}
+
+UNIQUE_TEST(QuadTreePooledStorageMatchesVectorStorage)
+{
+	std::vector<QuadTreeTestObject<QuadTreeVectorStorage> > vecObjects = QuadTreeTestObjects<QuadTreeVectorStorage>(numQuadTreeTestObjects);
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage> > poolObjects = QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects);
+	QuadTreeTestObject<QuadTreeVectorStorage>::Tree vecTree;
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree poolTree;
+	vecTree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	poolTree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	for(int i = 0; i < numQuadTreeTestObjects; ++i)
+	{
+		vecTree.Add(&vecObjects[i]);
+		poolTree.Add(&poolObjects[i]);
+	}
+	assert(vecTree.NumObjects() == numQuadTreeTestObjects);
+	assert(poolTree.NumObjects() == numQuadTreeTestObjects);
+	assert(vecTree.NumNodes() == poolTree.NumNodes());
+
+	// Remove every third object and move every seventh object to a new location.
+	LCG lcg(99);
+	int numRemoved = 0;
+	for(int i = 0; i < numQuadTreeTestObjects; ++i)
+		if (i % 3 == 0)
+		{
+			vecTree.Remove(&vecObjects[i]);
+			poolTree.Remove(&poolObjects[i]);
+			assert(vecObjects[i].node == 0);
+			assert(poolObjects[i].node == 0);
+			++numRemoved;
+		}
+		else if (i % 7 == 0)
+		{
+			float2 newPos(lcg.Float(0.f, quadTreeTestWorldSize), lcg.Float(0.f, quadTreeTestWorldSize));
+			vecTree.Remove(&vecObjects[i]);
+			poolTree.Remove(&poolObjects[i]);
+			vecObjects[i].pos = poolObjects[i].pos = newPos;
+			vecTree.Add(&vecObjects[i]);
+			poolTree.Add(&poolObjects[i]);
+		}
+	assert(vecTree.NumObjects() == numQuadTreeTestObjects - numRemoved);
+	assert(poolTree.NumObjects() == numQuadTreeTestObjects - numRemoved);
+
+	std::vector<AABB2D> queries = QuadTreeTestQueries(numQuadTreeTestQueries);
+	for(size_t i = 0; i < queries.size(); ++i)
+	{
+		std::vector<int> vecHits = QuadTreeQueryIndices<QuadTreeVectorStorage>(vecTree, vecObjects, queries[i]);
+		std::vector<int> poolHits = QuadTreeQueryIndices<QuadTreePooledStorage>(poolTree, poolObjects, queries[i]);
+		assert(vecHits == poolHits);
+		for(size_t j = 0; j < vecHits.size(); ++j)
+			assert(vecHits[j] % 3 != 0);
+	}
+}
+
+/// Holds the objects and the tree of a QuadTree benchmark, so that the setup is not included in the timings.
+template<template<typename> class S>
+struct QuadTreeBenchmarkData
+{
+	std::vector<QuadTreeTestObject<S> > objects;
+	typename QuadTreeTestObject<S>::Tree tree;
+	std::vector<AABB2D> queries;
+
+	QuadTreeBenchmarkData()
+	:objects(QuadTreeTestObjects<S>(numQuadTreeTestObjects)),
+	queries(QuadTreeTestQueries(numQuadTreeTestQueries))
+	{
+		Rebuild();
+	}
+
+	void Rebuild()
+	{
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+	}
+
+	/// Removes each object from the tree and adds it back, as happens when objects move.
+	void RemoveAndReinsert()
+	{
+		for(size_t i = 0; i < objects.size(); ++i)
+		{
+			tree.Remove(&objects[i]);
+			tree.Add(&objects[i]);
+		}
+	}
+
+	int Query()
+	{
+		CollectObjectIndicesQuadTreeVisitor<S> visitor;
+		visitor.first = &objects[0];
+		visitor.indices.reserve(1024);
+		int numHits = 0;
+		for(size_t i = 0; i < queries.size(); ++i)
+		{
+			visitor.indices.clear();
+			tree.AABBQuery(queries[i], visitor);
+			numHits += (int)visitor.indices.size();
+		}
+		return numHits;
+	}
+};
+
+template<template<typename> class S>
+QuadTreeBenchmarkData<S> &QuadTreeBenchmark()
+{
+	static QuadTreeBenchmarkData<S> data;
+	return data;
+}
+
+BENCHMARK_ITERS(QuadTreeInsert_10000_VectorStorage, 5, 5, "Clearing and inserting 10000 objects into a QuadTree with per-node std::vectors")
+{
+	QuadTreeBenchmark<QuadTreeVectorStorage>().Rebuild();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeInsert_10000_PooledStorage, 5, 5, "Clearing and inserting 10000 objects into a QuadTree with pooled node storage")
+{
+	QuadTreeBenchmark<QuadTreePooledStorage>().Rebuild();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeRemoveAndReinsert_10000_VectorStorage, 5, 5, "Removing and reinserting 10000 objects in a QuadTree with per-node std::vectors")
+{
+	QuadTreeBenchmark<QuadTreeVectorStorage>().RemoveAndReinsert();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeRemoveAndReinsert_10000_PooledStorage, 5, 5, "Removing and reinserting 10000 objects in a QuadTree with pooled node storage")
+{
+	QuadTreeBenchmark<QuadTreePooledStorage>().RemoveAndReinsert();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeAABBQuery_1000_VectorStorage, 5, 5, "1000 AABBQuery calls on a QuadTree of 10000 objects with per-node std::vectors")
+{
+	globalPokedData += QuadTreeBenchmark<QuadTreeVectorStorage>().Query();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeAABBQuery_1000_PooledStorage, 5, 5, "1000 AABBQuery calls on a QuadTree of 10000 objects with pooled node storage")
+{
+	globalPokedData += QuadTreeBenchmark<QuadTreePooledStorage>().Query();
+}
+BENCHMARK_ITERS_END;
+
+/// Checks that the subtrees rooted at the given nodes have the same structure and the same objects in each node.
+template<template<typename> class S>
+void AssertQuadTreeSubtreesEqual(const typename QuadTreeTestObject<S>::Tree &a, const typename QuadTreeTestObject<S>::Tree::Node *nodeA,
+                                 const typename QuadTreeTestObject<S>::Tree &b, const typename QuadTreeTestObject<S>::Tree::Node *nodeB,
+                                 const QuadTreeTestObject<S> *first)
+{
+	assert(nodeA->IsLeaf() == nodeB->IsLeaf());
+	std::vector<int> objectsA, objectsB;
+	for(size_t i = 0; i < nodeA->objects.size(); ++i)
+	{
+		assert(nodeA->objects[i]->node == nodeA);
+		objectsA.push_back((int)(nodeA->objects[i] - first));
+	}
+	for(size_t i = 0; i < nodeB->objects.size(); ++i)
+		objectsB.push_back((int)(nodeB->objects[i] - first));
+	std::sort(objectsA.begin(), objectsA.end());
+	std::sort(objectsB.begin(), objectsB.end());
+	assert(objectsA == objectsB);
+	if (!nodeA->IsLeaf())
+		for(u32 i = 0; i < 4; ++i)
+		{
+			const typename QuadTreeTestObject<S>::Tree::Node *childA = a.GetNode(nodeA->childIndex + i);
+			assert(childA->parent == nodeA);
+			AssertQuadTreeSubtreesEqual<S>(a, childA, b, b.GetNode(nodeB->childIndex + i), first);
+		}
+}
+
+template<template<typename> class S>
+void TestQuadTreeBulkLoadMatchesIncrementalAdd(float looseness)
+{
+	std::vector<QuadTreeTestObject<S> > objects = QuadTreeTestObjects<S>(numQuadTreeTestObjects);
+	// Add clusters of identical objects, which can not be separated by splitting.
+	for(int i = 0; i < 100; ++i)
+		objects.push_back(objects[i % 3]);
+	std::vector<QuadTreeTestObject<S>*> pointers;
+	for(size_t i = 0; i < objects.size(); ++i)
+		pointers.push_back(&objects[i]);
+
+	typename QuadTreeTestObject<S>::Tree bulkTree;
+	bulkTree.SetLooseness(looseness);
+	bulkTree.BulkLoad(&pointers[0], (int)pointers.size());
+	assert(bulkTree.NumObjects() == (int)objects.size());
+	AABB2D bounds = bulkTree.BoundingAABB();
+	for(size_t i = 0; i < objects.size(); ++i)
+		assert(bounds.Contains(GetAABB2D(&objects[i])));
+
+	typename QuadTreeTestObject<S>::Tree addTree;
+	addTree.SetLooseness(looseness);
+	addTree.Clear(bounds.minPoint, bounds.maxPoint);
+	LCG lcg(5);
+	std::vector<QuadTreeTestObject<S>*> shuffled = pointers;
+	for(int i = (int)shuffled.size()-1; i > 0; --i)
+		std::swap(shuffled[i], shuffled[lcg.Int(0, i)]);
+	for(size_t i = 0; i < shuffled.size(); ++i)
+		addTree.Add(shuffled[i]);
+
+	assert(bulkTree.NumNodes() == addTree.NumNodes());
+	assert(bulkTree.TreeHeight() == addTree.TreeHeight());
+	// The associations now point to the nodes of addTree, so redo them for bulkTree.
+	bulkTree.BulkLoad(&pointers[0], (int)pointers.size());
+	AssertQuadTreeSubtreesEqual<S>(bulkTree, bulkTree.Root(), addTree, addTree.Root(), &objects[0]);
+
+	// The tree must remain usable with incremental updates after a bulk load.
+	for(size_t i = 0; i < objects.size(); i += 2)
+		bulkTree.Remove(&objects[i]);
+	for(size_t i = 0; i < objects.size(); i += 2)
+		bulkTree.Add(&objects[i]);
+	assert(bulkTree.NumObjects() == (int)objects.size());
+}
+
+UNIQUE_TEST(QuadTreeBulkLoadMatchesIncrementalAdd)
+{
+	TestQuadTreeBulkLoadMatchesIncrementalAdd<QuadTreeVectorStorage>(1.f);
+	TestQuadTreeBulkLoadMatchesIncrementalAdd<QuadTreePooledStorage>(1.f);
+	TestQuadTreeBulkLoadMatchesIncrementalAdd<QuadTreePooledStorage>(2.f);
+}
+
+UNIQUE_TEST(QuadTreeBulkLoadFloat3)
+{
+	QuadTree<float3> tree;
+	tree.BulkLoad(0, 0);
+	assert(tree.NumObjects() == 0);
+
+	// Points on a single vertical line give degenerate bounds, which must still produce a valid tree.
+	std::vector<float3> points;
+	for(int i = 0; i < 100; ++i)
+		points.push_back(float3(2.f, (float)i, 0.f));
+	tree.BulkLoad(&points[0], (int)points.size());
+	assert(tree.NumObjects() == 100);
+	assert(!tree.BoundingAABB().IsDegenerate());
+	assert(!tree.Root()->IsLeaf());
+}
+
+const int numQuadTreeBulkLoadObjects = 100000;
+
+/// Returns pointers to a fixed set of objects for the QuadTree construction benchmarks.
+template<template<typename> class S>
+const std::vector<QuadTreeTestObject<S>*> &QuadTreeBulkLoadBenchmarkObjects()
+{
+	static std::vector<QuadTreeTestObject<S> > objects = QuadTreeTestObjects<S>(numQuadTreeBulkLoadObjects);
+	static std::vector<QuadTreeTestObject<S>*> pointers;
+	if (pointers.empty())
+		for(size_t i = 0; i < objects.size(); ++i)
+			pointers.push_back(&objects[i]);
+	return pointers;
+}
+
+BENCHMARK_ITERS(QuadTreeAddLoop_100000, 3, 3, "Constructing a QuadTree of 100000 objects with Add() into an initially small tree")
+{
+	static QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	const std::vector<QuadTreeTestObject<QuadTreePooledStorage>*> &objects = QuadTreeBulkLoadBenchmarkObjects<QuadTreePooledStorage>();
+	tree.Clear(float2(0, 0), float2(1, 1));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(objects[i]);
+	globalPokedData += tree.NumNodes();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeBulkLoad_100000, 3, 3, "Constructing a QuadTree of 100000 objects with BulkLoad()")
+{
+	static QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	const std::vector<QuadTreeTestObject<QuadTreePooledStorage>*> &objects = QuadTreeBulkLoadBenchmarkObjects<QuadTreePooledStorage>();
+	tree.BulkLoad(&objects[0], (int)objects.size());
+	globalPokedData += tree.NumNodes();
+}
+BENCHMARK_ITERS_END;
+
+/// Collects the pairs reported by QuadTree::CollidingPairsQuery().
+template<template<typename> class S>
+struct CollectQuadTreeTestPairs
+{
+	std::vector<std::pair<QuadTreeTestObject<S>*, QuadTreeTestObject<S>*> > pairs;
+
+	void operator()(QuadTreeTestObject<S> *a, QuadTreeTestObject<S> *b) { pairs.push_back(std::make_pair(a, b)); }
+};
+
+/// Returns the given pairs as sorted pairs of object indices, so that pair lists can be compared regardless of order.
+template<template<typename> class S>
+std::vector<std::pair<int, int> > SortedPairIndices(const std::vector<std::pair<QuadTreeTestObject<S>*, QuadTreeTestObject<S>*> > &pairs, const QuadTreeTestObject<S> *first)
+{
+	std::vector<std::pair<int, int> > indices;
+	for(size_t i = 0; i < pairs.size(); ++i)
+		indices.push_back(std::make_pair((int)(pairs[i].first - first), (int)(pairs[i].second - first)));
+	std::sort(indices.begin(), indices.end());
+	return indices;
+}
+
+UNIQUE_TEST(QuadTreeCollidingPairsQueryParallelMatchesSerial)
+{
+	typedef QuadTreeTestObject<QuadTreePooledStorage> Object;
+	std::vector<Object> objects = QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects);
+	// Make the objects larger, so that there are plenty of pairs, also between the inner nodes and their descendants.
+	for(size_t i = 0; i < objects.size(); ++i)
+		objects[i].halfSize *= 3.f;
+	Object::Tree tree;
+	tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+
+	AABB2D queries[2] = { tree.BoundingAABB(), AABB2D(float2(100.f, 200.f), float2(600.f, 450.f)) };
+	ParallelForPool pool(4);
+	for(int q = 0; q < 2; ++q)
+	{
+		CollectQuadTreeTestPairs<QuadTreePooledStorage> serial;
+		tree.CollidingPairsQuery(queries[q], serial);
+		std::vector<std::pair<int, int> > expected = SortedPairIndices<QuadTreePooledStorage>(serial.pairs, &objects[0]);
+		assert(expected.size() > 1000);
+
+		for(int numThreads = 0; numThreads <= 4; ++numThreads)
+		{
+			std::vector<std::pair<Object*, Object*> > pairs;
+			tree.CollidingPairsQueryParallel(queries[q], pairs, numThreads);
+			assert(SortedPairIndices<QuadTreePooledStorage>(pairs, &objects[0]) == expected);
+		}
+
+		// The same pool can be reused for any number of queries.
+		for(int i = 0; i < 3; ++i)
+		{
+			std::vector<std::pair<Object*, Object*> > pairs;
+			tree.CollidingPairsQueryParallel(queries[q], pairs, pool);
+			assert(SortedPairIndices<QuadTreePooledStorage>(pairs, &objects[0]) == expected);
+		}
+	}
+}
+
+/// Returns a tree of numQuadTreeTestObjects objects large enough to overlap each other, for the colliding pairs benchmarks.
+QuadTreeTestObject<QuadTreePooledStorage>::Tree &QuadTreeCollidingPairsBenchmarkTree()
+{
+	static std::vector<QuadTreeTestObject<QuadTreePooledStorage> > objects;
+	static QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	if (objects.empty())
+	{
+		objects = QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects);
+		for(size_t i = 0; i < objects.size(); ++i)
+			objects[i].halfSize *= 3.f;
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+	}
+	return tree;
+}
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQuery_10000, 5, 5, "QuadTree::CollidingPairsQuery over all of 10000 objects")
+{
+	static CollectQuadTreeTestPairs<QuadTreePooledStorage> collect;
+	collect.pairs.clear();
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree &tree = QuadTreeCollidingPairsBenchmarkTree();
+	tree.CollidingPairsQuery(tree.BoundingAABB(), collect);
+	globalPokedData += (int)collect.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQueryParallel_10000_1Thread, 5, 5, "QuadTree::CollidingPairsQueryParallel over all of 10000 objects on one thread")
+{
+	static std::vector<std::pair<QuadTreeTestObject<QuadTreePooledStorage>*, QuadTreeTestObject<QuadTreePooledStorage>*> > pairs;
+	pairs.clear();
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree &tree = QuadTreeCollidingPairsBenchmarkTree();
+	tree.CollidingPairsQueryParallel(tree.BoundingAABB(), pairs, 1);
+	globalPokedData += (int)pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQueryParallel_10000_AllThreads, 5, 5, "QuadTree::CollidingPairsQueryParallel over all of 10000 objects on all hardware threads")
+{
+	static std::vector<std::pair<QuadTreeTestObject<QuadTreePooledStorage>*, QuadTreeTestObject<QuadTreePooledStorage>*> > pairs;
+	pairs.clear();
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree &tree = QuadTreeCollidingPairsBenchmarkTree();
+	tree.CollidingPairsQueryParallel(tree.BoundingAABB(), pairs, NumHardwareThreads());
+	globalPokedData += (int)pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQueryParallel_10000_AllThreadsPool, 5, 5, "QuadTree::CollidingPairsQueryParallel over all of 10000 objects on a persistent pool of all hardware threads")
+{
+	static std::vector<std::pair<QuadTreeTestObject<QuadTreePooledStorage>*, QuadTreeTestObject<QuadTreePooledStorage>*> > pairs;
+	static ParallelForPool pool;
+	pairs.clear();
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree &tree = QuadTreeCollidingPairsBenchmarkTree();
+	tree.CollidingPairsQueryParallel(tree.BoundingAABB(), pairs, pool);
+	globalPokedData += (int)pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+/// Returns a deterministic mix of many small objects and a few large ones, which straddle the split lines of the
+/// nodes near the root of a regular quadtree.
+std::vector<QuadTreeTestObject<QuadTreePooledStorage> > QuadTreeMixedSizeTestObjects(int numObjects)
+{
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage> > objects = QuadTreeTestObjects<QuadTreePooledStorage>(numObjects);
+	LCG lcg(777);
+	for(size_t i = 0; i < objects.size(); i += 20)
+		objects[i].halfSize = lcg.Float(10.f, 60.f);
+	return objects;
+}
+
+/// Returns the given pairs with the smaller object index first in each pair, sorted.
+std::vector<std::pair<int, int> > NormalizedPairIndices(const std::vector<std::pair<QuadTreeTestObject<QuadTreePooledStorage>*, QuadTreeTestObject<QuadTreePooledStorage>*> > &pairs, const QuadTreeTestObject<QuadTreePooledStorage> *first)
+{
+	std::vector<std::pair<int, int> > indices = SortedPairIndices<QuadTreePooledStorage>(pairs, first);
+	for(size_t i = 0; i < indices.size(); ++i)
+		if (indices[i].first > indices[i].second)
+			std::swap(indices[i].first, indices[i].second);
+	std::sort(indices.begin(), indices.end());
+	return indices;
+}
+
+UNIQUE_TEST(QuadTreeLooseMatchesRegular)
+{
+	typedef QuadTreeTestObject<QuadTreePooledStorage> Object;
+	std::vector<Object> objects = QuadTreeMixedSizeTestObjects(numQuadTreeTestObjects);
+	std::vector<Object> looseObjects = objects;
+	Object::Tree tree, looseTree;
+	looseTree.SetLooseness(2.f);
+	assert(looseTree.Looseness() == 2.f);
+	tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	looseTree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		tree.Add(&objects[i]);
+		looseTree.Add(&looseObjects[i]);
+	}
+	// Move some objects, also to outside the initial bounds of the tree.
+	LCG lcg(3);
+	for(size_t i = 0; i < objects.size(); i += 7)
+	{
+		float2 newPos(lcg.Float(-100.f, quadTreeTestWorldSize + 100.f), lcg.Float(-100.f, quadTreeTestWorldSize + 100.f));
+		tree.Remove(&objects[i]);
+		looseTree.Remove(&looseObjects[i]);
+		objects[i].pos = looseObjects[i].pos = newPos;
+		tree.Add(&objects[i]);
+		looseTree.Add(&looseObjects[i]);
+	}
+	assert(looseTree.NumObjects() == (int)objects.size());
+	looseTree.DebugSanityCheckNode(looseTree.Root());
+	// The point of a loose tree: the large objects no longer pile up at the root.
+	assert(looseTree.Root()->objects.size() < tree.Root()->objects.size());
+
+	std::vector<AABB2D> queries = QuadTreeTestQueries(numQuadTreeTestQueries);
+	for(size_t i = 0; i < queries.size(); ++i)
+		assert(QuadTreeQueryIndices<QuadTreePooledStorage>(tree, objects, queries[i]) == QuadTreeQueryIndices<QuadTreePooledStorage>(looseTree, looseObjects, queries[i]));
+
+	// Over the whole tree, both report all colliding pairs.
+	CollectQuadTreeTestPairs<QuadTreePooledStorage> pairs, loosePairs;
+	tree.CollidingPairsQuery(AABB2D(float2(-1e6f, -1e6f), float2(1e6f, 1e6f)), pairs);
+	looseTree.CollidingPairsQuery(AABB2D(float2(-1e6f, -1e6f), float2(1e6f, 1e6f)), loosePairs);
+	assert(pairs.pairs.size() > 1000);
+	assert(NormalizedPairIndices(pairs.pairs, &objects[0]) == NormalizedPairIndices(loosePairs.pairs, &looseObjects[0]));
+
+	// Over a part of the tree, the loose tree reports each pair where at least one object intersects the query.
+	AABB2D query(float2(100.f, 200.f), float2(600.f, 450.f));
+	std::vector<std::pair<int, int> > expected;
+	for(size_t i = 0; i < looseObjects.size(); ++i)
+		for(size_t j = i+1; j < looseObjects.size(); ++j)
+		{
+			AABB2D aabbI = GetAABB2D(&looseObjects[i]);
+			AABB2D aabbJ = GetAABB2D(&looseObjects[j]);
+			if (aabbI.Intersects(aabbJ) && (query.Intersects(aabbI) || query.Intersects(aabbJ)))
+				expected.push_back(std::make_pair((int)i, (int)j));
+		}
+	loosePairs.pairs.clear();
+	looseTree.CollidingPairsQuery(query, loosePairs);
+	assert(NormalizedPairIndices(loosePairs.pairs, &looseObjects[0]) == expected);
+	std::vector<std::pair<Object*, Object*> > parallelPairs;
+	looseTree.CollidingPairsQueryParallel(query, parallelPairs, 3);
+	assert(NormalizedPairIndices(parallelPairs, &looseObjects[0]) == expected);
+}
+
+/// Holds a tree of mixed-size objects with the given looseness and queries into it, for the loose tree benchmarks.
+struct QuadTreeMixedSizeBenchmarkData
+{
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage> > objects;
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	std::vector<AABB2D> queries;
+
+	explicit QuadTreeMixedSizeBenchmarkData(float looseness)
+	:objects(QuadTreeMixedSizeTestObjects(numQuadTreeTestObjects)),
+	queries(QuadTreeTestQueries(numQuadTreeTestQueries))
+	{
+		tree.SetLooseness(looseness);
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+	}
+
+	int Query()
+	{
+		CollectObjectIndicesQuadTreeVisitor<QuadTreePooledStorage> visitor;
+		visitor.first = &objects[0];
+		visitor.indices.reserve(1024);
+		int numHits = 0;
+		for(size_t i = 0; i < queries.size(); ++i)
+		{
+			visitor.indices.clear();
+			tree.AABBQuery(queries[i], visitor);
+			numHits += (int)visitor.indices.size();
+		}
+		return numHits;
+	}
+
+	int CollidingPairs()
+	{
+		static CollectQuadTreeTestPairs<QuadTreePooledStorage> collect;
+		collect.pairs.clear();
+		tree.CollidingPairsQuery(tree.LooseAABB(tree.BoundingAABB()), collect);
+		return (int)collect.pairs.size();
+	}
+};
+
+QuadTreeMixedSizeBenchmarkData &QuadTreeMixedSizeBenchmark(float looseness)
+{
+	static QuadTreeMixedSizeBenchmarkData regular(1.f);
+	static QuadTreeMixedSizeBenchmarkData loose(2.f);
+	return looseness > 1.f ? loose : regular;
+}
+
+BENCHMARK_ITERS(QuadTreeAABBQuery_MixedSizes_Regular, 5, 5, "1000 AABBQuery calls on a regular QuadTree of 10000 objects of mixed sizes")
+{
+	globalPokedData += QuadTreeMixedSizeBenchmark(1.f).Query();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeAABBQuery_MixedSizes_Loose2, 5, 5, "1000 AABBQuery calls on a loose QuadTree (looseness 2) of 10000 objects of mixed sizes")
+{
+	globalPokedData += QuadTreeMixedSizeBenchmark(2.f).Query();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQuery_MixedSizes_Regular, 5, 5, "CollidingPairsQuery on a regular QuadTree of 10000 objects of mixed sizes")
+{
+	globalPokedData += QuadTreeMixedSizeBenchmark(1.f).CollidingPairs();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeCollidingPairsQuery_MixedSizes_Loose2, 5, 5, "CollidingPairsQuery on a loose QuadTree (looseness 2) of 10000 objects of mixed sizes")
+{
+	globalPokedData += QuadTreeMixedSizeBenchmark(2.f).CollidingPairs();
+}
+BENCHMARK_ITERS_END;
+
+/// Asserts that each object is associated with a node of the tree that holds it, and that the given queries return
+/// the same objects as a brute force search.
+template<template<typename> class S>
+void AssertQuadTreeMatchesBruteForce(typename QuadTreeTestObject<S>::Tree &tree, std::vector<QuadTreeTestObject<S> > &objects, const std::vector<AABB2D> &queries)
+{
+	assert(tree.NumObjects() == (int)objects.size());
+	assert(tree.NumLeaves() + tree.NumInnerNodes() == tree.NumNodes());
+	tree.DebugSanityCheckNode(tree.Root());
+	for(size_t i = 0; i < objects.size(); ++i)
+	{
+		typename QuadTreeTestObject<S>::Tree::Node *node = objects[i].node;
+		assert(node);
+		bool found = false;
+		for(size_t j = 0; j < node->objects.size(); ++j)
+			found = found || node->objects[j] == &objects[i];
+		assert(found);
+		MARK_UNUSED(found);
+	}
+	for(size_t i = 0; i < queries.size(); ++i)
+	{
+		std::vector<int> expected;
+		for(size_t j = 0; j < objects.size(); ++j)
+			if (GetAABB2D(&objects[j]).Intersects(queries[i]))
+				expected.push_back((int)j);
+		assert(QuadTreeQueryIndices<S>(tree, objects, queries[i]) == expected);
+	}
+}
+
+template<template<typename> class S>
+void TestQuadTreeUpdate(float looseness, bool batch)
+{
+	std::vector<QuadTreeTestObject<S> > objects = QuadTreeTestObjects<S>(numQuadTreeTestObjects);
+	std::vector<AABB2D> queries = QuadTreeTestQueries(100);
+
+	typename QuadTreeTestObject<S>::Tree tree;
+	tree.SetLooseness(looseness);
+	tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+
+	// Small moves that mostly stay in the same node, then large moves across the tree, then moves that also go
+	// outside the bounds of the tree.
+	LCG lcg(17);
+	const float moveSizes[] = { 1.f, 300.f, quadTreeTestWorldSize };
+	for(int pass = 0; pass < 3; ++pass)
+	{
+		std::vector<QuadTreeTestObject<S>*> moved;
+		for(size_t i = pass; i < objects.size(); i += 3)
+		{
+			objects[i].pos += float2(lcg.Float(-moveSizes[pass], moveSizes[pass]), lcg.Float(-moveSizes[pass], moveSizes[pass]));
+			moved.push_back(&objects[i]);
+		}
+		if (batch)
+			tree.UpdateBatch(&moved[0], (int)moved.size());
+		else
+			for(size_t i = 0; i < moved.size(); ++i)
+				tree.Update(moved[i]);
+		AssertQuadTreeMatchesBruteForce<S>(tree, objects, queries);
+	}
+	tree.UpdateBatch(0, 0);
+	AssertQuadTreeMatchesBruteForce<S>(tree, objects, queries);
+}
+
+UNIQUE_TEST(QuadTreeUpdateMatchesBruteForce)
+{
+	TestQuadTreeUpdate<QuadTreeVectorStorage>(1.f, false);
+	TestQuadTreeUpdate<QuadTreeVectorStorage>(1.f, true);
+	TestQuadTreeUpdate<QuadTreePooledStorage>(1.f, false);
+	TestQuadTreeUpdate<QuadTreePooledStorage>(1.f, true);
+	TestQuadTreeUpdate<QuadTreePooledStorage>(2.f, true);
+}
+
+UNIQUE_TEST(QuadTreeUpdateBatchCollapsesEmptyNodes)
+{
+	typedef QuadTreeTestObject<QuadTreePooledStorage> Object;
+	std::vector<Object> objects = QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects);
+	std::vector<Object*> pointers;
+	for(size_t i = 0; i < objects.size(); ++i)
+		pointers.push_back(&objects[i]);
+	std::vector<float2> homePositions;
+	for(size_t i = 0; i < objects.size(); ++i)
+		homePositions.push_back(objects[i].pos);
+	std::vector<AABB2D> queries = QuadTreeTestQueries(100);
+
+	Object::Tree tree;
+	tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+	for(size_t i = 0; i < objects.size(); ++i)
+		tree.Add(&objects[i]);
+	const int numNodesAtHome = tree.NumNodes();
+
+	int numNodesInCorner = -1;
+	for(int cycle = 0; cycle < 4; ++cycle)
+	{
+		// Gather all the objects to a corner of the tree, which leaves the rest of the tree empty.
+		for(size_t i = 0; i < objects.size(); ++i)
+			objects[i].pos = homePositions[i] * 0.05f + float2(2.f, 2.f);
+		tree.UpdateBatch(&pointers[0], (int)pointers.size());
+		AssertQuadTreeMatchesBruteForce<QuadTreePooledStorage>(tree, objects, queries);
+		assert(tree.NumNodes() < numNodesAtHome);
+		// The emptied subtrees are collapsed, and the corner splits reuse the collapsed nodes, so the tree does not
+		// keep growing when objects move back and forth.
+		if (numNodesInCorner < 0)
+			numNodesInCorner = tree.NumNodes();
+		assert(tree.NumNodes() == numNodesInCorner);
+
+		for(size_t i = 0; i < objects.size(); ++i)
+			objects[i].pos = homePositions[i];
+		tree.UpdateBatch(&pointers[0], (int)pointers.size());
+		AssertQuadTreeMatchesBruteForce<QuadTreePooledStorage>(tree, objects, queries);
+	}
+	MARK_UNUSED(numNodesAtHome);
+}
+
+/// Holds a tree of objects that move a small step each frame, for the update benchmarks.
+struct QuadTreeMovingObjectsBenchmarkData
+{
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage> > objects;
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage>*> pointers;
+	std::vector<float2> velocities;
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	float direction;
+
+	QuadTreeMovingObjectsBenchmarkData()
+	:objects(QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects)),
+	direction(1.f)
+	{
+		LCG lcg(55);
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+		{
+			tree.Add(&objects[i]);
+			pointers.push_back(&objects[i]);
+			velocities.push_back(float2(lcg.Float(-2.f, 2.f), lcg.Float(-2.f, 2.f)));
+		}
+	}
+
+	/// Moves all objects one frame forward, alternating the direction each frame so that the objects stay in place.
+	void Move()
+	{
+		for(size_t i = 0; i < objects.size(); ++i)
+			objects[i].pos += velocities[i] * direction;
+		direction = -direction;
+	}
+};
+
+QuadTreeMovingObjectsBenchmarkData &QuadTreeMovingObjectsBenchmark()
+{
+	static QuadTreeMovingObjectsBenchmarkData data;
+	return data;
+}
+
+BENCHMARK_ITERS(QuadTreeMoveRemoveAndAdd_10000, 5, 5, "Moving 10000 objects a small step in a QuadTree with Remove() and Add()")
+{
+	QuadTreeMovingObjectsBenchmarkData &data = QuadTreeMovingObjectsBenchmark();
+	for(size_t i = 0; i < data.objects.size(); ++i)
+		data.tree.Remove(&data.objects[i]);
+	data.Move();
+	for(size_t i = 0; i < data.objects.size(); ++i)
+		data.tree.Add(&data.objects[i]);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeMoveUpdate_10000, 5, 5, "Moving 10000 objects a small step in a QuadTree with Update()")
+{
+	QuadTreeMovingObjectsBenchmarkData &data = QuadTreeMovingObjectsBenchmark();
+	data.Move();
+	for(size_t i = 0; i < data.objects.size(); ++i)
+		data.tree.Update(&data.objects[i]);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeMoveUpdateBatch_10000, 5, 5, "Moving 10000 objects a small step in a QuadTree with UpdateBatch()")
+{
+	QuadTreeMovingObjectsBenchmarkData &data = QuadTreeMovingObjectsBenchmark();
+	data.Move();
+	data.tree.UpdateBatch(&data.pointers[0], (int)data.pointers.size());
+}
+BENCHMARK_ITERS_END;
+
+/// Collects the first maxCount objects of a nearest neighbor search.
+struct CollectQuadTreeNearestObjects
+{
+	typedef QuadTreeTestObject<QuadTreePooledStorage> Object;
+
+	int maxCount;
+	std::vector<Object*> objects;
+	std::vector<float> distancesSq;
+
+	bool operator()(Object::Tree & /*tree*/, const float2 & /*targetPoint*/, Object::Tree::Node * /*node*/, const AABB2D & /*aabb*/,
+		float distanceSquared, Object * const &object, int nearestNeighborIndex)
+	{
+		assert(nearestNeighborIndex == (int)objects.size());
+		MARK_UNUSED(nearestNeighborIndex);
+		objects.push_back(object);
+		distancesSq.push_back(distanceSquared);
+		return (int)objects.size() >= maxCount;
+	}
+};
+
+UNIQUE_TEST(QuadTreeKNearestObjectsMatchesBruteForce)
+{
+	typedef QuadTreeTestObject<QuadTreePooledStorage> Object;
+	std::vector<Object> objects = QuadTreeMixedSizeTestObjects(numQuadTreeTestObjects);
+	for(int l = 0; l < 2; ++l)
+	{
+		Object::Tree tree;
+		tree.SetLooseness(l == 0 ? 1.f : 2.f);
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+
+		Object::Tree::QueryScratch scratch;
+		LCG lcg(8);
+		const int k = 16;
+		Object *nearest[k];
+		float nearestDistancesSq[k];
+		for(int q = 0; q < 50; ++q)
+		{
+			// Also search from outside the tree.
+			float2 point(lcg.Float(-100.f, quadTreeTestWorldSize + 100.f), lcg.Float(-100.f, quadTreeTestWorldSize + 100.f));
+			int numFound = tree.KNearestObjects(point, k, nearest, nearestDistancesSq, scratch);
+			assert(numFound == k);
+			MARK_UNUSED(numFound);
+
+			std::vector<float> distancesSq;
+			for(size_t i = 0; i < objects.size(); ++i)
+				distancesSq.push_back(GetAABB2D(&objects[i]).DistanceSq(point));
+			std::sort(distancesSq.begin(), distancesSq.end());
+			for(int i = 0; i < k; ++i)
+			{
+				assert(nearestDistancesSq[i] == distancesSq[i]);
+				assert(GetAABB2D(nearest[i]).DistanceSq(point) == distancesSq[i]);
+			}
+
+			// The allocating overload finds the same objects.
+			CollectQuadTreeNearestObjects collect;
+			collect.maxCount = k;
+			tree.NearestNeighborObjects(point, collect);
+			assert(collect.distancesSq == std::vector<float>(nearestDistancesSq, nearestDistancesSq + k));
+		}
+
+		// Repeating a search with the same scratch memory does not allocate.
+		const float2 point(500.f, 500.f);
+		tree.KNearestObjects(point, k, nearest, 0, scratch);
+		const void *nodeQueueData = &scratch.nodeQueue[0];
+		const void *objectQueueData = &scratch.objectQueue[0];
+		size_t nodeQueueCapacity = scratch.nodeQueue.capacity();
+		size_t objectQueueCapacity = scratch.objectQueue.capacity();
+		tree.KNearestObjects(point, k, nearest, 0, scratch);
+		assert(&scratch.nodeQueue[0] == nodeQueueData);
+		assert(&scratch.objectQueue[0] == objectQueueData);
+		assert(scratch.nodeQueue.capacity() == nodeQueueCapacity);
+		assert(scratch.objectQueue.capacity() == objectQueueCapacity);
+		MARK_UNUSED(nodeQueueData);
+		MARK_UNUSED(objectQueueData);
+		MARK_UNUSED(nodeQueueCapacity);
+		MARK_UNUSED(objectQueueCapacity);
+
+		// Without an early out, the search outputs each object once, closest first.
+		CollectQuadTreeNearestObjects collect;
+		collect.maxCount = (int)objects.size() + 1;
+		tree.NearestNeighborObjects(point, collect, scratch);
+		assert(collect.objects.size() == objects.size());
+		for(size_t i = 1; i < collect.distancesSq.size(); ++i)
+			assert(collect.distancesSq[i-1] <= collect.distancesSq[i]);
+		std::sort(collect.objects.begin(), collect.objects.end());
+		for(size_t i = 0; i < objects.size(); ++i)
+			assert(collect.objects[i] == &objects[i]);
+
+		// The AABB queries with scratch memory return the same objects as without.
+		std::vector<AABB2D> queries = QuadTreeTestQueries(100);
+		for(size_t i = 0; i < queries.size(); ++i)
+		{
+			CollectObjectIndicesQuadTreeVisitor<QuadTreePooledStorage> visitor;
+			visitor.first = &objects[0];
+			tree.AABBQuery(queries[i], visitor, scratch);
+			std::sort(visitor.indices.begin(), visitor.indices.end());
+			assert(visitor.indices == QuadTreeQueryIndices<QuadTreePooledStorage>(tree, objects, queries[i]));
+		}
+	}
+
+	// Points need no distance function of their own.
+	QuadTree<float3> pointTree;
+	pointTree.Clear(float2(0, 0), float2(10.f, 10.f));
+	for(int i = 0; i < 100; ++i)
+		pointTree.Add(float3((float)(i % 10), (float)(i / 10), 0.f));
+	QuadTree<float3>::QueryScratch pointScratch;
+	float3 nearestPoints[2];
+	int numFound = pointTree.KNearestObjects(float2(3.2f, 4.1f), 2, nearestPoints, 0, pointScratch);
+	assert(numFound == 2);
+	assert(nearestPoints[0].Equals(float3(3.f, 4.f, 0.f)));
+	assert(nearestPoints[1].Equals(float3(4.f, 4.f, 0.f)));
+	MARK_UNUSED(numFound);
+	std::vector<float3> allPoints(1000);
+	assert(pointTree.KNearestObjects(float2(0, 0), 1000, &allPoints[0], 0, pointScratch) == 100);
+}
+
+/// Holds a tree of objects and search points for the nearest neighbor benchmarks.
+struct QuadTreeNearestNeighborBenchmarkData
+{
+	std::vector<QuadTreeTestObject<QuadTreePooledStorage> > objects;
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree tree;
+	QuadTreeTestObject<QuadTreePooledStorage>::Tree::QueryScratch scratch;
+	std::vector<float2> points;
+
+	QuadTreeNearestNeighborBenchmarkData()
+	:objects(QuadTreeTestObjects<QuadTreePooledStorage>(numQuadTreeTestObjects))
+	{
+		tree.Clear(float2(0, 0), float2(quadTreeTestWorldSize, quadTreeTestWorldSize));
+		for(size_t i = 0; i < objects.size(); ++i)
+			tree.Add(&objects[i]);
+		LCG lcg(31);
+		for(int i = 0; i < 10000; ++i)
+			points.push_back(float2(lcg.Float(0.f, quadTreeTestWorldSize), lcg.Float(0.f, quadTreeTestWorldSize)));
+	}
+
+	/// Finds the 8 nearest objects to the given search point, allocating the search queues anew.
+	float NearestAllocating(int i)
+	{
+		CollectQuadTreeNearestObjects collect;
+		collect.maxCount = 8;
+		tree.NearestNeighborObjects(points[i], collect);
+		return collect.distancesSq.back();
+	}
+
+	/// Finds the 8 nearest objects to the given search point, reusing the scratch memory.
+	float NearestWithScratch(int i)
+	{
+		QuadTreeTestObject<QuadTreePooledStorage> *nearest[8];
+		float distancesSq[8];
+		tree.KNearestObjects(points[i], 8, nearest, distancesSq, scratch);
+		return distancesSq[7];
+	}
+};
+
+QuadTreeNearestNeighborBenchmarkData &QuadTreeNearestNeighborBenchmark()
+{
+	static QuadTreeNearestNeighborBenchmarkData data;
+	return data;
+}
+
+UNIQUE_TEST(QuadTreeKNearestLatency)
+{
+	QuadTreeNearestNeighborBenchmarkData &data = QuadTreeNearestNeighborBenchmark();
+	const char * const names[] = { "allocating NearestNeighborObjects", "KNearestObjects with scratch memory" };
+	for(int variant = 0; variant < 2; ++variant)
+	{
+		std::vector<tick_t> latencies;
+		float sum = 0.f;
+		for(size_t i = 0; i < data.points.size(); ++i)
+		{
+			tick_t start = Clock::Tick();
+			sum += (variant == 0) ? data.NearestAllocating((int)i) : data.NearestWithScratch((int)i);
+			latencies.push_back(Clock::Tick() - start);
+		}
+		globalPokedData += (int)sum;
+		std::sort(latencies.begin(), latencies.end());
+		LOGI("8 nearest of %d objects, %s: p50 %s, p99 %s, max %s.", numQuadTreeTestObjects, names[variant],
+			FormatTime((double)latencies[latencies.size() / 2]).c_str(), FormatTime((double)latencies[latencies.size() * 99 / 100]).c_str(),
+			FormatTime((double)latencies.back()).c_str());
+	}
+}
+
+BENCHMARK_ITERS(QuadTreeNearestNeighborObjects_1000x8_Allocating, 5, 5, "1000 searches of the 8 nearest objects in a QuadTree of 10000 objects, allocating each search")
+{
+	QuadTreeNearestNeighborBenchmarkData &data = QuadTreeNearestNeighborBenchmark();
+	float sum = 0.f;
+	for(int i = 0; i < 1000; ++i)
+		sum += data.NearestAllocating(i);
+	globalPokedData += (int)sum;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(QuadTreeKNearestObjects_1000x8_Scratch, 5, 5, "1000 searches of the 8 nearest objects in a QuadTree of 10000 objects, reusing scratch memory")
+{
+	QuadTreeNearestNeighborBenchmarkData &data = QuadTreeNearestNeighborBenchmark();
+	float sum = 0.f;
+	for(int i = 0; i < 1000; ++i)
+		sum += data.NearestWithScratch(i);
+	globalPokedData += (int)sum;
+}
+BENCHMARK_ITERS_END;
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// Returns a deterministic set of boxes scattered over a cube of the given size. Every 100th box is large.
+std::vector<AABB> SweepAndPruneTestBoxes(int numBoxes, float worldSize, LCG &lcg)
+{
+	std::vector<AABB> boxes(numBoxes);
+	for(int i = 0; i < numBoxes; ++i)
+	{
+		float3 pos(lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize), lcg.Float(-worldSize, worldSize));
+		float3 halfSize(lcg.Float(0.f, 2.f), lcg.Float(0.f, 2.f), lcg.Float(0.f, 2.f));
+		if (i % 100 == 0)
+			halfSize *= 10.f;
+		boxes[i] = AABB(pos - halfSize, pos + halfSize);
+	}
+	return boxes;
+}
+
+std::vector<SweepAndPrune::Pair> SweepAndPruneBruteForcePairs(const std::vector<AABB> &boxes)
+{
+	std::vector<SweepAndPrune::Pair> pairs;
+	for(size_t i = 0; i < boxes.size(); ++i)
+		for(size_t j = i + 1; j < boxes.size(); ++j)
+			if (boxes[i].Intersects(boxes[j]))
+			{
+				SweepAndPrune::Pair p = { (u32)i, (u32)j };
+				pairs.push_back(p);
+			}
+	return pairs;
+}
+
+/// Applies the reported events to the given sorted pair list, checking that each event is a real change.
+void SweepAndPruneApplyEvents(std::vector<SweepAndPrune::Pair> &pairs, const std::vector<SweepAndPrune::Pair> &added, const std::vector<SweepAndPrune::Pair> &removed)
+{
+	for(size_t i = 0; i < removed.size(); ++i)
+	{
+		std::vector<SweepAndPrune::Pair>::iterator iter = std::lower_bound(pairs.begin(), pairs.end(), removed[i]);
+		assert(iter != pairs.end() && *iter == removed[i]);
+		pairs.erase(iter);
+	}
+	for(size_t i = 0; i < added.size(); ++i)
+	{
+		assert(added[i].a < added[i].b);
+		std::vector<SweepAndPrune::Pair>::iterator iter = std::lower_bound(pairs.begin(), pairs.end(), added[i]);
+		assert(iter == pairs.end() || *iter != added[i]);
+		pairs.insert(iter, added[i]);
+	}
+}
+
+UNIQUE_TEST(SweepAndPruneFindOverlappingPairsMatchesBruteForce)
+{
+	LCG lcg(1);
+	std::vector<AABB> boxes = SweepAndPruneTestBoxes(1000, 50.f, lcg);
+	// Add boxes that share faces and coordinates with each other, to test the handling of touching boxes.
+	for(int i = 0; i < 20; ++i)
+	{
+		boxes.push_back(AABB(float3((float)i, 0.f, 0.f), float3((float)i + 1.f, 1.f, 1.f)));
+		boxes.push_back(AABB(float3((float)i, 0.5f, 0.5f), float3((float)i, 2.f, 2.f)));
+	}
+
+	std::vector<SweepAndPrune::Pair> pairs;
+	SweepAndPrune::FindOverlappingPairs(&boxes[0], (int)boxes.size(), pairs);
+	std::sort(pairs.begin(), pairs.end());
+	std::vector<SweepAndPrune::Pair> expected = SweepAndPruneBruteForcePairs(boxes);
+	assert(expected.size() > 100);
+	assert(pairs == expected);
+}
+
+UNIQUE_TEST(SweepAndPruneUpdateMatchesBruteForce)
+{
+	LCG lcg(2);
+	std::vector<AABB> boxes = SweepAndPruneTestBoxes(500, 30.f, lcg);
+	SweepAndPrune sap;
+	std::vector<SweepAndPrune::Pair> pairs, added, removed;
+	int numEvents = 0;
+	for(int frame = 0; frame < 40; ++frame)
+	{
+		// Grow and shrink the array every few frames, and teleport a few boxes, in addition to the small moves.
+		if (frame % 10 == 5)
+		{
+			std::vector<AABB> newBoxes = SweepAndPruneTestBoxes(30, 30.f, lcg);
+			boxes.insert(boxes.end(), newBoxes.begin(), newBoxes.end());
+		}
+		else if (frame % 10 == 8)
+			boxes.resize(boxes.size() - 45);
+		for(size_t i = 0; i < boxes.size(); ++i)
+		{
+			float3 move = ((int)i % 50 == frame % 50) ? float3(lcg.Float(-30.f, 30.f), lcg.Float(-30.f, 30.f), lcg.Float(-30.f, 30.f))
+				: float3(lcg.Float(-0.5f, 0.5f), lcg.Float(-0.5f, 0.5f), lcg.Float(-0.5f, 0.5f));
+			boxes[i].Translate(move);
+		}
+
+		added.clear();
+		removed.clear();
+		sap.Update(&boxes[0], (int)boxes.size(), &added, &removed);
+		sap.DebugSanityCheck();
+		SweepAndPruneApplyEvents(pairs, added, removed);
+		numEvents += (int)(added.size() + removed.size());
+
+		std::vector<SweepAndPrune::Pair> expected = SweepAndPruneBruteForcePairs(boxes);
+		assert(pairs == expected);
+		assert(sap.NumOverlappingPairs() == (int)expected.size());
+		std::vector<SweepAndPrune::Pair> current;
+		sap.GetOverlappingPairs(current);
+		std::sort(current.begin(), current.end());
+		assert(current == expected);
+		for(size_t i = 0; i < expected.size(); ++i)
+			assert(sap.IsOverlapping(expected[i].b, expected[i].a));
+	}
+	assert(numEvents > 500);
+	assert(sap.NumBoxes() == (int)boxes.size());
+
+	// Removing all boxes reports all the remaining pairs as removed.
+	added.clear();
+	removed.clear();
+	sap.Update(0, 0, &added, &removed);
+	SweepAndPruneApplyEvents(pairs, added, removed);
+	assert(pairs.empty());
+	assert(sap.NumOverlappingPairs() == 0);
+	sap.DebugSanityCheck();
+}
+
+/// A set of boxes that move back and forth by a small step each frame.
+struct SweepAndPruneBenchmarkData
+{
+	std::vector<AABB> boxes;
+	SweepAndPrune sap;
+	std::vector<SweepAndPrune::Pair> added;
+	std::vector<SweepAndPrune::Pair> removed;
+	std::vector<SweepAndPrune::Pair> pairs;
+	int frame;
+
+	explicit SweepAndPruneBenchmarkData(int numBoxes):frame(0)
+	{
+		LCG lcg(3);
+		boxes = SweepAndPruneTestBoxes(numBoxes, 100.f, lcg);
+		sap.Update(&boxes[0], (int)boxes.size(), 0, 0);
+	}
+
+	void Step()
+	{
+		for(size_t i = 0; i < boxes.size(); ++i)
+		{
+			const float step = (((int)i + frame) % 4 < 2) ? 0.2f : -0.2f;
+			boxes[i].Translate(float3(step, 0.f, (i % 2 == 0) ? step : -step));
+		}
+		++frame;
+	}
+};
+
+BENCHMARK_ITERS(SweepAndPruneUpdate_10000, 5, 5, "SweepAndPrune::Update with 10000 boxes that move by a small step each frame")
+{
+	static SweepAndPruneBenchmarkData data(10000);
+	data.Step();
+	data.added.clear();
+	data.removed.clear();
+	data.sap.Update(&data.boxes[0], (int)data.boxes.size(), &data.added, &data.removed);
+	globalPokedData += data.sap.NumOverlappingPairs() + (int)data.added.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(SweepAndPruneFindOverlappingPairs_10000, 5, 5, "SweepAndPrune::FindOverlappingPairs from scratch over the same 10000 boxes, for comparison with Update")
+{
+	static SweepAndPruneBenchmarkData data(10000);
+	data.Step();
+	data.pairs.clear();
+	SweepAndPrune::FindOverlappingPairs(&data.boxes[0], (int)data.boxes.size(), data.pairs);
+	globalPokedData += (int)data.pairs.size();
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(SweepAndPrunePairwise_10000, 1, 1, "Testing all pairs of the same 10000 boxes with AABB::Intersects, for comparison with SweepAndPrune")
+{
+	static SweepAndPruneBenchmarkData data(10000);
+	data.Step();
+	int numPairs = 0;
+	for(size_t i = 0; i < data.boxes.size(); ++i)
+		for(size_t j = i + 1; j < data.boxes.size(); ++j)
+			if (data.boxes[i].Intersects(data.boxes[j]))
+				++numPairs;
+	globalPokedData += numPairs;
+}
+BENCHMARK_ITERS_END;
@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/MathGeoLib.h"
+#include "../src/Math/myassert.h"
+#include "TestRunner.h"
+
+/// Returns the vertex data of a height field of gridSize x gridSize quads, each split into two triangles, over the
+/// square [0, gridSize] on the xz plane.
+std::vector<float> TriangleMeshTestTerrain(int gridSize, int seed)
+{
+	LCG lcg(seed);
+	std::vector<float> heights((gridSize+1) * (gridSize+1));
+	for(size_t i = 0; i < heights.size(); ++i)
+		heights[i] = lcg.Float(0.f, 2.f);
+
+	std::vector<float> vertexData;
+	for(int z = 0; z < gridSize; ++z)
+		for(int x = 0; x < gridSize; ++x)
+		{
+			float3 v00((float)x, heights[z*(gridSize+1) + x], (float)z);
+			float3 v10((float)x+1, heights[z*(gridSize+1) + x+1], (float)z);
+			float3 v01((float)x, heights[(z+1)*(gridSize+1) + x], (float)z+1);
+			float3 v11((float)x+1, heights[(z+1)*(gridSize+1) + x+1], (float)z+1);
+			const float3 tris[6] = { v00, v10, v11, v00, v11, v01 };
+			for(int i = 0; i < 6; ++i)
+			{
+				vertexData.push_back(tris[i].x);
+				vertexData.push_back(tris[i].y);
+				vertexData.push_back(tris[i].z);
+			}
+		}
+	return vertexData;
+}
+
+/// Returns the vertex data of randomly placed triangles of mixed sizes.
+std::vector<float> TriangleMeshTestSoup(int numTriangles, int seed)
+{
+	LCG lcg(seed);
+	std::vector<float> vertexData;
+	for(int i = 0; i < numTriangles; ++i)
+	{
+		float3 center = float3::RandomBox(lcg, float3(-50.f, -50.f, -50.f), float3(50.f, 50.f, 50.f));
+		float size = (i % 50 == 0) ? 30.f : 3.f;
+		for(int j = 0; j < 3; ++j)
+		{
+			float3 v = center + float3::RandomBox(lcg, float3(-size, -size, -size), float3(size, size, size));
+			vertexData.push_back(v.x);
+			vertexData.push_back(v.y);
+			vertexData.push_back(v.z);
+		}
+	}
+	return vertexData;
+}
+
+/// Returns rays that start above the terrain and point down at it, mixed with rays in random directions.
+std::vector<Ray> TriangleMeshTestRays(int numRays, float worldSize, int seed)
+{
+	LCG lcg(seed);
+	std::vector<Ray> rays;
+	for(int i = 0; i < numRays; ++i)
+	{
+		float3 pos(lcg.Float(0.f, worldSize), 20.f, lcg.Float(0.f, worldSize));
+		float3 dir = (i % 4 == 0) ? float3::RandomDir(lcg) : (float3(lcg.Float(0.f, worldSize), 0.f, lcg.Float(0.f, worldSize)) - pos).Normalized();
+		rays.push_back(Ray(pos, dir));
+	}
+	return rays;
+}
+
+/// Finds the nearest hit by testing all the triangles of the given vertex data, as IntersectRay_TriangleIndex_UV_CPP does.
+float TriangleMeshBruteForceIntersect(const std::vector<float> &vertexData, const Ray &ray, int &outTriangleIndex)
+{
+	const Triangle *tris = reinterpret_cast<const Triangle*>(&vertexData[0]);
+	const int numTriangles = (int)vertexData.size() / 9;
+	float nearestD = FLOAT_INF;
+	for(int i = 0; i < numTriangles; ++i)
+	{
+		float u, v;
+		float d = Triangle::IntersectLineTri(ray.pos, ray.dir, tris[i].a, tris[i].b, tris[i].c, u, v);
+		if (d >= 0.f && d < nearestD)
+		{
+			nearestD = d;
+			outTriangleIndex = i;
+		}
+	}
+	return nearestD;
+}
+
+UNIQUE_TEST(TriangleMeshBVHMatchesBruteForce)
+{
+	for(int mesh = 0; mesh < 2; ++mesh)
+	{
+		std::vector<float> vertexData = (mesh == 0) ? TriangleMeshTestTerrain(40, 1) : TriangleMeshTestSoup(2000, 2);
+		const float worldSize = (mesh == 0) ? 40.f : 100.f;
+		std::vector<Ray> rays = TriangleMeshTestRays(500, worldSize, 3);
+		if (mesh == 1)
+			for(size_t i = 0; i < rays.size(); ++i)
+				rays[i].pos -= float3(50.f, 20.f, 50.f);
+
+		TriangleMesh tm;
+		tm.SetAoS(&vertexData[0], (int)vertexData.size() / 9, true);
+		assert(tm.HasBVH());
+		int numHits = 0;
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int expectedIndex = -1;
+			float expectedD = TriangleMeshBruteForceIntersect(vertexData, rays[i], expectedIndex);
+			int index = -1;
+			float u = -1.f, v = -1.f;
+			float d = tm.IntersectRay_TriangleIndex_UV_CPP(rays[i], index, u, v);
+			assert(d == expectedD);
+			if (d < FLOAT_INF)
+			{
+				++numHits;
+				// Triangles that share an edge can be hit at the same distance.
+				float indexU, indexV;
+				const Triangle *tris = reinterpret_cast<const Triangle*>(&vertexData[0]);
+				assert(index == expectedIndex || Triangle::IntersectLineTri(rays[i].pos, rays[i].dir, tris[index].a, tris[index].b, tris[index].c, indexU, indexV) == d);
+				assert(u >= -1e-3f && v >= -1e-3f && u + v <= 1.f + 1e-3f);
+				MARK_UNUSED(indexU);
+				MARK_UNUSED(indexV);
+				MARK_UNUSED(tris);
+			}
+			else
+			{
+				assert(index == -1);
+			}
+			MARK_UNUSED(expectedD);
+		}
+		assert(numHits > 100);
+	}
+}
+
+#ifdef MATH_TRIANGLEMESH_SSE2
+/// Checks that a SIMD routine gives the same hits with and without a BVH. The SIMD routines compute the hit distance
+/// with an approximate reciprocal, so nearly equally distant hits may resolve differently.
+static void CompareTriangleMeshHits(float flatD, int flatIndex, float bvhD, int bvhIndex, int numTriangles)
+{
+	assert((flatD < FLOAT_INF) == (bvhD < FLOAT_INF));
+	if (flatD < FLOAT_INF)
+	{
+		assert(bvhIndex == flatIndex || EqualRel(flatD, bvhD, 2e-3f));
+		assert(bvhIndex >= 0 && bvhIndex < numTriangles);
+	}
+	MARK_UNUSED(flatIndex);
+	MARK_UNUSED(bvhD);
+	MARK_UNUSED(bvhIndex);
+	MARK_UNUSED(numTriangles);
+}
+#endif
+
+UNIQUE_TEST(TriangleMeshBVHSIMDMatchesFlat)
+{
+	std::vector<float> vertexData = TriangleMeshTestTerrain(40, 4);
+	const int numTriangles = (int)vertexData.size() / 9;
+	std::vector<Ray> rays = TriangleMeshTestRays(300, 40.f, 5);
+	TriangleMesh flat, bvh;
+	int numHits = 0;
+	MARK_UNUSED(numTriangles);
+
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE2))
+	{
+		flat.SetSoA4(&vertexData[0], numTriangles);
+		bvh.SetSoA4(&vertexData[0], numTriangles, true);
+		assert(!flat.HasBVH());
+		assert(bvh.HasBVH());
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int flatIndex = -1, bvhIndex = -1;
+			float flatU, flatV, bvhU = -1.f, bvhV = -1.f;
+			float flatD = flat.IntersectRay_TriangleIndex_UV_SSE2(rays[i], flatIndex, flatU, flatV);
+			float bvhD = bvh.IntersectRay_TriangleIndex_UV_SSE2(rays[i], bvhIndex, bvhU, bvhV);
+			CompareTriangleMeshHits(flatD, flatIndex, bvhD, bvhIndex, numTriangles);
+			if (bvhD < FLOAT_INF)
+			{
+				++numHits;
+				assert(bvhU >= -1e-3f && bvhV >= -1e-3f && bvhU + bvhV <= 1.f + 1e-3f);
+			}
+			assert(bvh.IntersectRay_SSE2(rays[i]) == bvhD);
+			float d2 = bvh.IntersectRay_TriangleIndex_SSE2(rays[i], bvhIndex);
+			assert(d2 == bvhD);
+			MARK_UNUSED(d2);
+		}
+	}
+#endif
+
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE41))
+	{
+		flat.SetSoA4(&vertexData[0], numTriangles);
+		bvh.SetSoA4(&vertexData[0], numTriangles, true);
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int flatIndex = -1, bvhIndex = -1;
+			float flatU, flatV, bvhU, bvhV;
+			float flatD = flat.IntersectRay_TriangleIndex_UV_SSE41(rays[i], flatIndex, flatU, flatV);
+			float bvhD = bvh.IntersectRay_TriangleIndex_UV_SSE41(rays[i], bvhIndex, bvhU, bvhV);
+			CompareTriangleMeshHits(flatD, flatIndex, bvhD, bvhIndex, numTriangles);
+			numHits += (bvhD < FLOAT_INF) ? 1 : 0;
+			assert(bvh.IntersectRay_SSE41(rays[i]) == bvhD);
+		}
+	}
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX))
+	{
+		flat.SetSoA8(&vertexData[0], numTriangles);
+		bvh.SetSoA8(&vertexData[0], numTriangles, true);
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int flatIndex = -1, bvhIndex = -1;
+			float flatU, flatV, bvhU, bvhV;
+			float flatD = flat.IntersectRay_TriangleIndex_UV_AVX(rays[i], flatIndex, flatU, flatV);
+			float bvhD = bvh.IntersectRay_TriangleIndex_UV_AVX(rays[i], bvhIndex, bvhU, bvhV);
+			CompareTriangleMeshHits(flatD, flatIndex, bvhD, bvhIndex, numTriangles);
+			numHits += (bvhD < FLOAT_INF) ? 1 : 0;
+			assert(bvh.IntersectRay_AVX(rays[i]) == bvhD);
+		}
+	}
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+	{
+		flat.SetSoA16(&vertexData[0], numTriangles);
+		bvh.SetSoA16(&vertexData[0], numTriangles, true);
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int flatIndex = -1, bvhIndex = -1;
+			float flatU, flatV, bvhU, bvhV;
+			float flatD = flat.IntersectRay_TriangleIndex_UV_AVX512(rays[i], flatIndex, flatU, flatV);
+			float bvhD = bvh.IntersectRay_TriangleIndex_UV_AVX512(rays[i], bvhIndex, bvhU, bvhV);
+			CompareTriangleMeshHits(flatD, flatIndex, bvhD, bvhIndex, numTriangles);
+			numHits += (bvhD < FLOAT_INF) ? 1 : 0;
+			assert(bvh.IntersectRay_AVX512(rays[i]) == bvhD);
+		}
+	}
+#endif
+
+	LOGI("%d SIMD BVH hits checked.", numHits);
+}
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+/// Checks a hit of a SIMD routine against the hit of IntersectRay_TriangleIndex_UV_CPP. The C++ routine also accepts
+/// hits slightly outside the triangles, and the SIMD routines compute the hit distance with an approximate reciprocal,
+/// so the rays that pass near an edge may hit a different triangle, or miss. Returns true if the hits match.
+static bool CompareTriangleMeshHitToCPP(float cppD, int cppIndex, float cppU, float cppV, float d, int index, float u, float v)
+{
+	if (cppD == FLOAT_INF && d == FLOAT_INF)
+		return true;
+	if (index == cppIndex)
+	{
+		assert2(EqualRel(d, cppD, 1e-3f), d, cppD);
+		assert4(EqualAbs(u, cppU, 1e-3f) && EqualAbs(v, cppV, 1e-3f), u, cppU, v, cppV);
+		return true;
+	}
+	if (d < FLOAT_INF && EqualRel(d, cppD, 1e-3f))
+		return true; // Triangles that share an edge can be hit at the same distance.
+	// The C++ routine must have found a nearer hit, just at the edge of a triangle.
+	assert2(cppD < FLOAT_INF && (d == FLOAT_INF || cppD < d), cppD, d);
+	assert2(cppU < 1e-3f || cppV < 1e-3f || cppU + cppV > 1.f - 1e-3f, cppU, cppV);
+	return false;
+}
+
+UNIQUE_TEST(TriangleMeshAVX512MatchesCPP)
+{
+	if (!TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+	{
+		LOGI("AVX-512 is not supported by this CPU, skipping.");
+		return;
+	}
+
+	for(int mesh = 0; mesh < 2; ++mesh)
+	{
+		std::vector<float> vertexData = (mesh == 0) ? TriangleMeshTestTerrain(40, 15) : TriangleMeshTestSoup(2000, 16);
+		const int numTriangles = (int)vertexData.size() / 9;
+		std::vector<Ray> rays = TriangleMeshTestRays(500, (mesh == 0) ? 40.f : 100.f, 17);
+		if (mesh == 1)
+			for(size_t i = 0; i < rays.size(); ++i)
+				rays[i].pos -= float3(50.f, 20.f, 50.f);
+
+		TriangleMesh cpp;
+		cpp.SetAoS(&vertexData[0], numTriangles);
+		for(int useBVH = 0; useBVH < 2; ++useBVH)
+		{
+			TriangleMesh tm;
+			tm.SetSoA16(&vertexData[0], numTriangles, useBVH != 0);
+			int numHits = 0;
+			int numMismatches = 0;
+			for(size_t i = 0; i < rays.size(); ++i)
+			{
+				int cppIndex = -1, index = -1;
+				float cppU = 0.f, cppV = 0.f, u = 0.f, v = 0.f;
+				float cppD = cpp.IntersectRay_TriangleIndex_UV_CPP(rays[i], cppIndex, cppU, cppV);
+				float d = tm.IntersectRay_TriangleIndex_UV_AVX512(rays[i], index, u, v);
+				if (!CompareTriangleMeshHitToCPP(cppD, cppIndex, cppU, cppV, d, index, u, v))
+					++numMismatches;
+				if (d < FLOAT_INF)
+				{
+					++numHits;
+					assert(index >= 0 && index < numTriangles);
+				}
+				assert(tm.IntersectRay_AVX512(rays[i]) == d);
+				int index2 = -1;
+				assert(tm.IntersectRay_TriangleIndex_AVX512(rays[i], index2) == d);
+				assert(index2 == index);
+				MARK_UNUSED(index2);
+			}
+			assert(numHits > 100);
+			assert1(numMismatches <= 2, numMismatches);
+		}
+	}
+}
+#endif
+
+UNIQUE_TEST(TriangleMeshSetWithBVH)
+{
+	std::vector<float> vertexData = TriangleMeshTestSoup(100, 6);
+	TriangleMesh tm;
+	tm.Set(&vertexData[0], 100, true);
+	assert(tm.HasBVH());
+	tm.Set(&vertexData[0], 96);
+	assert(!tm.HasBVH());
+
+	// A ray from the inside of a closed polyhedron must hit it.
+	Polyhedron cube = AABB(float3(-1.f, -1.f, -1.f), float3(1.f, 1.f, 1.f)).ToPolyhedron();
+	tm.Set(cube, true);
+	assert(tm.HasBVH());
+	int index = -1;
+	float u, v;
+	float d = tm.IntersectRay_TriangleIndex_UV(Ray(float3(0.f, 0.f, 0.f), float3(0.f, 1.f, 0.f)), index, u, v);
+	assert(EqualAbs(d, 1.f, 1e-3f));
+	assert(index >= 0 && index < 12);
+	MARK_UNUSED(d);
+}
+
+/// Checks that each triangle of a row of 17 triangles on the xz plane, set with the given layout, is hit by a ray
+/// pointing down at it. The triangle count is not divisible by any of the SoA cluster sizes.
+static void CheckTriangleMeshPaddedRow(void (TriangleMesh::*set)(const float *, int, bool), float (TriangleMesh::*intersectRay)(const Ray &, int &, float &, float &) const)
+{
+	const int numTriangles = 17;
+	std::vector<float> vertexData;
+	for(int i = 0; i < numTriangles; ++i)
+	{
+		const float3 tri[3] = { float3(3.f*i, 0.f, 0.f), float3(3.f*i + 2.f, 0.f, 0.f), float3(3.f*i, 0.f, 2.f) };
+		for(int j = 0; j < 3; ++j)
+		{
+			vertexData.push_back(tri[j].x);
+			vertexData.push_back(tri[j].y);
+			vertexData.push_back(tri[j].z);
+		}
+	}
+	for(int useBVH = 0; useBVH < 2; ++useBVH)
+	{
+		TriangleMesh tm;
+		(tm.*set)(&vertexData[0], numTriangles, useBVH != 0);
+		for(int i = 0; i < numTriangles; ++i)
+		{
+			int index = -1;
+			float u, v;
+			float d = (tm.*intersectRay)(Ray(float3(3.f*i + 0.5f, 10.f, 0.5f), float3(0.f, -1.f, 0.f)), index, u, v);
+			assert2(EqualRel(d, 10.f, 1e-3f), i, d); // The SIMD routines use an approximate reciprocal.
+			assert2(index == i, index, i);
+			MARK_UNUSED(d);
+		}
+		// A ray that passes beside the row must miss it.
+		int index = -1;
+		float u, v;
+		float d = (tm.*intersectRay)(Ray(float3(-1.f, 10.f, -1.f), float3(0.f, -1.f, 0.f)), index, u, v);
+		assert1(d == FLOAT_INF, d);
+		assert1(index == -1, index);
+		MARK_UNUSED(d);
+	}
+}
+
+UNIQUE_TEST(TriangleMeshTriangleCountNotDivisibleByClusterSize)
+{
+	CheckTriangleMeshPaddedRow(&TriangleMesh::Set, &TriangleMesh::IntersectRay_TriangleIndex_UV);
+	CheckTriangleMeshPaddedRow(&TriangleMesh::SetAoS, &TriangleMesh::IntersectRay_TriangleIndex_UV_CPP);
+#ifdef MATH_TRIANGLEMESH_SSE2
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE2))
+		CheckTriangleMeshPaddedRow(&TriangleMesh::SetSoA4, &TriangleMesh::IntersectRay_TriangleIndex_UV_SSE2);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE41
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE41))
+		CheckTriangleMeshPaddedRow(&TriangleMesh::SetSoA4, &TriangleMesh::IntersectRay_TriangleIndex_UV_SSE41);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX))
+		CheckTriangleMeshPaddedRow(&TriangleMesh::SetSoA8, &TriangleMesh::IntersectRay_TriangleIndex_UV_AVX);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX512
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+		CheckTriangleMeshPaddedRow(&TriangleMesh::SetSoA16, &TriangleMesh::IntersectRay_TriangleIndex_UV_AVX512);
+#endif
+}
+
+/// Checks an any-hit routine against the nearest hit distances found by the same kind of routine.
+static void CheckIntersectRayAny(const TriangleMesh &tm, bool (TriangleMesh::*intersectRayAny)(const Ray &, float) const, const std::vector<Ray> &rays, const std::vector<float> &nearestD)
+{
+	for(size_t i = 0; i < rays.size(); ++i)
+	{
+		const float d = nearestD[i];
+		assert((tm.*intersectRayAny)(rays[i], FLOAT_INF) == (d < FLOAT_INF));
+		if (d < FLOAT_INF)
+		{
+			assert((tm.*intersectRayAny)(rays[i], d * 1.5f + 1e-3f));
+			assert(!(tm.*intersectRayAny)(rays[i], d * 0.5f));
+		}
+	}
+	MARK_UNUSED(tm);
+	MARK_UNUSED(intersectRayAny);
+}
+
+UNIQUE_TEST(TriangleMeshIntersectRayAnyMatchesNearest)
+{
+	std::vector<float> vertexData = TriangleMeshTestSoup(2000, 9);
+	const int numTriangles = (int)vertexData.size() / 9;
+	std::vector<Ray> rays = TriangleMeshTestRays(300, 100.f, 10);
+	for(size_t i = 0; i < rays.size(); ++i)
+		rays[i].pos -= float3(50.f, 20.f, 50.f);
+	std::vector<float> nearestD(rays.size());
+
+	for(int useBVH = 0; useBVH < 2; ++useBVH)
+	{
+		TriangleMesh tm;
+		int numHits = 0;
+		tm.SetAoS(&vertexData[0], numTriangles, useBVH != 0);
+		for(size_t i = 0; i < rays.size(); ++i)
+		{
+			int index;
+			float u, v;
+			nearestD[i] = tm.IntersectRay_TriangleIndex_UV_CPP(rays[i], index, u, v);
+			numHits += (nearestD[i] < FLOAT_INF) ? 1 : 0;
+		}
+		assert(numHits > 50 && numHits < (int)rays.size());
+		CheckIntersectRayAny(tm, &TriangleMesh::IntersectRayAny_CPP, rays, nearestD);
+
+#ifdef MATH_TRIANGLEMESH_SSE2
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE2))
+		{
+			tm.SetSoA4(&vertexData[0], numTriangles, useBVH != 0);
+			for(size_t i = 0; i < rays.size(); ++i)
+				nearestD[i] = tm.IntersectRay_SSE2(rays[i]);
+			CheckIntersectRayAny(tm, &TriangleMesh::IntersectRayAny_SSE2, rays, nearestD);
+		}
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE41
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_SSE41))
+		{
+			for(size_t i = 0; i < rays.size(); ++i)
+				nearestD[i] = tm.IntersectRay_SSE41(rays[i]);
+			CheckIntersectRayAny(tm, &TriangleMesh::IntersectRayAny_SSE41, rays, nearestD);
+		}
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX))
+		{
+			tm.SetSoA8(&vertexData[0], numTriangles, useBVH != 0);
+			for(size_t i = 0; i < rays.size(); ++i)
+				nearestD[i] = tm.IntersectRay_AVX(rays[i]);
+			CheckIntersectRayAny(tm, &TriangleMesh::IntersectRayAny_AVX, rays, nearestD);
+		}
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX512
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+		{
+			tm.SetSoA16(&vertexData[0], numTriangles, useBVH != 0);
+			for(size_t i = 0; i < rays.size(); ++i)
+				nearestD[i] = tm.IntersectRay_AVX512(rays[i]);
+			CheckIntersectRayAny(tm, &TriangleMesh::IntersectRayAny_AVX512, rays, nearestD);
+		}
+#endif
+	}
+}
+
+UNIQUE_TEST(TriangleMeshIntersectRaysMatchesSingleRays)
+{
+	// Not a multiple of the triangle chunk size or of the ray tile size.
+	std::vector<float> vertexData = TriangleMeshTestSoup(2000, 11);
+	const int numTriangles = (int)vertexData.size() / 9;
+	std::vector<Ray> rays = TriangleMeshTestRays(300, 100.f, 12);
+	for(size_t i = 0; i < rays.size(); ++i)
+		rays[i].pos -= float3(50.f, 20.f, 50.f);
+	const int numRays = (int)rays.size();
+
+	for(int useBVH = 0; useBVH < 2; ++useBVH)
+	{
+		TriangleMesh tm;
+		tm.Set(&vertexData[0], numTriangles, useBVH != 0);
+
+		std::vector<float> t(numRays), expectedT(numRays), tNoOutputs(numRays);
+		std::vector<int> index(numRays), expectedIndex(numRays, -1);
+		std::vector<float2> uv(numRays), expectedUV(numRays, float2::zero);
+		for(int i = 0; i < numRays; ++i)
+			expectedT[i] = tm.IntersectRay_TriangleIndex_UV(rays[i], expectedIndex[i], expectedUV[i].x, expectedUV[i].y);
+
+		for(int numThreads = 1; numThreads <= 4; numThreads += 3)
+		{
+			tm.IntersectRays(&rays[0], numRays, &t[0], &index[0], &uv[0], numThreads);
+			tm.IntersectRays(&rays[0], numRays, &tNoOutputs[0], 0, 0, numThreads);
+			for(int i = 0; i < numRays; ++i)
+			{
+				assert4(t[i] == expectedT[i], i, numThreads, t[i], expectedT[i]);
+				assert2(tNoOutputs[i] == expectedT[i], tNoOutputs[i], expectedT[i]);
+				assert2(index[i] == expectedIndex[i], index[i], expectedIndex[i]);
+				assert2(uv[i].Equals(expectedUV[i]), uv[i], expectedUV[i]);
+			}
+		}
+	}
+}
+
+UNIQUE_TEST(TriangleMeshActiveSIMDCapability)
+{
+	const TriangleMesh::SIMDCapability active = TriangleMesh::ActiveSIMDCapability();
+	LOGI("TriangleMesh uses the %s ray intersection routines.", TriangleMesh::SIMDCapabilityToString(active));
+	assert(TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_NONE));
+	assert(TriangleMesh::IsSIMDCapabilitySupported(active));
+	assert(active == TriangleMesh::SIMD_AVX512 || !TriangleMesh::IsSIMDCapabilitySupported((TriangleMesh::SIMDCapability)(active + 1)));
+#ifdef MATH_TRIANGLEMESH_RUNTIME_DISPATCH
+	// Every x86 CPU that runs 64-bit code supports SSE2.
+	assert(sizeof(void*) == 4 || active >= TriangleMesh::SIMD_SSE2);
+#endif
+
+	// Set() must pick the vertex layout of the routines that the dispatching functions call.
+	std::vector<float> vertexData = TriangleMeshTestSoup(1000, 13);
+	TriangleMesh tm;
+	tm.Set(&vertexData[0], (int)vertexData.size() / 9);
+	std::vector<Ray> rays = TriangleMeshTestRays(100, 100.f, 14);
+	for(size_t i = 0; i < rays.size(); ++i)
+	{
+		rays[i].pos -= float3(50.f, 20.f, 50.f);
+		int index = -1;
+		float u, v;
+		float d = tm.IntersectRay_TriangleIndex_UV(rays[i], index, u, v);
+		float expectedD = d;
+#ifdef MATH_TRIANGLEMESH_AVX512
+		if (active == TriangleMesh::SIMD_AVX512)
+			expectedD = tm.IntersectRay_AVX512(rays[i]);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX
+		if (active == TriangleMesh::SIMD_AVX)
+			expectedD = tm.IntersectRay_AVX(rays[i]);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE41
+		if (active == TriangleMesh::SIMD_SSE41)
+			expectedD = tm.IntersectRay_SSE41(rays[i]);
+#endif
+#ifdef MATH_TRIANGLEMESH_SSE2
+		if (active == TriangleMesh::SIMD_SSE2)
+			expectedD = tm.IntersectRay_SSE2(rays[i]);
+#endif
+		if (active == TriangleMesh::SIMD_NONE)
+			expectedD = tm.IntersectRay_TriangleIndex_UV_CPP(rays[i], index, u, v);
+		assert2(d == expectedD, d, expectedD);
+		assert(tm.IntersectRay(rays[i]) == d);
+		assert(tm.IntersectRayAny(rays[i], FLOAT_INF) == (d < FLOAT_INF));
+		MARK_UNUSED(expectedD);
+	}
+}
+
+/// A terrain of about 100000 triangles, and rays cast at it, shared by the benchmarks.
+struct TriangleMeshBenchmarkData
+{
+	std::vector<float> vertexData;
+	std::vector<Ray> rays;
+	/// Rays that start above the terrain and hit it.
+	std::vector<Ray> occludedRays;
+	/// The same rays pointing up, away from the terrain.
+	std::vector<Ray> unoccludedRays;
+	/// Rays for the throughput benchmarks, and the outputs for them.
+	std::vector<Ray> batchRays;
+	std::vector<float> batchT;
+	std::vector<int> batchTriangleIndex;
+	std::vector<float2> batchUV;
+	TriangleMesh flat;
+	TriangleMesh bvh;
+	/// The same mesh in the SoA8 and SoA16 layouts, if the CPU supports AVX and AVX-512.
+	TriangleMesh soa8;
+	TriangleMesh soa16;
+
+	TriangleMeshBenchmarkData()
+	{
+		vertexData = TriangleMeshTestTerrain(224, 7);
+		rays = TriangleMeshTestRays(100, 224.f, 8);
+		LCG lcg(9);
+		for(int i = 0; i < 20; ++i)
+		{
+			float3 pos(lcg.Float(0.f, 224.f), 20.f, lcg.Float(0.f, 224.f));
+			float3 dir = (float3(lcg.Float(0.f, 224.f), 0.f, lcg.Float(0.f, 224.f)) - pos).Normalized();
+			occludedRays.push_back(Ray(pos, dir));
+			unoccludedRays.push_back(Ray(pos, -dir));
+		}
+		batchRays = TriangleMeshTestRays(10000, 224.f, 10);
+		batchT.resize(batchRays.size());
+		batchTriangleIndex.resize(batchRays.size());
+		batchUV.resize(batchRays.size());
+		flat.Set(&vertexData[0], (int)vertexData.size() / 9);
+		bvh.Set(&vertexData[0], (int)vertexData.size() / 9, true);
+#ifdef MATH_TRIANGLEMESH_AVX
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX))
+			soa8.SetSoA8(&vertexData[0], (int)vertexData.size() / 9);
+#endif
+#ifdef MATH_TRIANGLEMESH_AVX512
+		if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+			soa16.SetSoA16(&vertexData[0], (int)vertexData.size() / 9);
+#endif
+	}
+};
+
+static TriangleMeshBenchmarkData &TriangleMeshBenchmark()
+{
+	static TriangleMeshBenchmarkData data;
+	return data;
+}
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_100k_Flat, 1, 1, "100 rays against a mesh of 100352 triangles, testing every triangle")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.rays.size(); ++i)
+	{
+		int index;
+		float u, v;
+		globalPokedData += (int)data.flat.IntersectRay_TriangleIndex_UV(data.rays[i], index, u, v);
+	}
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_100k_BVH, 5, 5, "The same 100 rays against the same mesh with a BVH")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.rays.size(); ++i)
+	{
+		int index;
+		float u, v;
+		globalPokedData += (int)data.bvh.IntersectRay_TriangleIndex_UV(data.rays[i], index, u, v);
+	}
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshBuildBVH_100k, 1, 1, "Building a BVH for a mesh of 100352 triangles")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	TriangleMesh tm;
+	tm.Set(&data.vertexData[0], (int)data.vertexData.size() / 9, true);
+	globalPokedData += tm.HasBVH() ? 1 : 0;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_Occluded_Flat, 1, 1, "20 rays that hit a mesh of 100352 triangles, finding the nearest hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.occludedRays.size(); ++i)
+		globalPokedData += (int)data.flat.IntersectRay(data.occludedRays[i]);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRayAny_Occluded_Flat, 1, 1, "The same 20 rays, stopping at the first hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.occludedRays.size(); ++i)
+		globalPokedData += data.flat.IntersectRayAny(data.occludedRays[i], FLOAT_INF) ? 1 : 0;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_Unoccluded_Flat, 1, 1, "20 rays that miss a mesh of 100352 triangles, finding the nearest hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.unoccludedRays.size(); ++i)
+		globalPokedData += (int)data.flat.IntersectRay(data.unoccludedRays[i]);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRayAny_Unoccluded_Flat, 1, 1, "The same 20 rays, stopping at the first hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.unoccludedRays.size(); ++i)
+		globalPokedData += data.flat.IntersectRayAny(data.unoccludedRays[i], FLOAT_INF) ? 1 : 0;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_Occluded_BVH, 5, 5, "20 rays that hit a mesh of 100352 triangles with a BVH, finding the nearest hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.occludedRays.size(); ++i)
+		globalPokedData += (int)data.bvh.IntersectRay(data.occludedRays[i]);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRayAny_Occluded_BVH, 5, 5, "The same 20 rays with a BVH, stopping at the first hit")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.occludedRays.size(); ++i)
+		globalPokedData += data.bvh.IntersectRayAny(data.occludedRays[i], FLOAT_INF) ? 1 : 0;
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRays_100k_Flat, 1, 1, "The 100 rays of TriangleMeshIntersectRay_100k_Flat as one batch, tested against the triangles in tiles")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	data.flat.IntersectRays(&data.rays[0], (int)data.rays.size(), &data.batchT[0], &data.batchTriangleIndex[0], &data.batchUV[0]);
+	globalPokedData += data.batchTriangleIndex[0];
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRay_10000Rays_BVH, 3, 3, "10000 IntersectRay_TriangleIndex_UV calls against a mesh of 100352 triangles with a BVH")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	for(size_t i = 0; i < data.batchRays.size(); ++i)
+		data.batchT[i] = data.bvh.IntersectRay_TriangleIndex_UV(data.batchRays[i], data.batchTriangleIndex[i], data.batchUV[i].x, data.batchUV[i].y);
+	globalPokedData += data.batchTriangleIndex[0];
+}
+BENCHMARK_ITERS_END;
+
+void BenchmarkTriangleMeshIntersectRays(int numThreads)
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	data.bvh.IntersectRays(&data.batchRays[0], (int)data.batchRays.size(), &data.batchT[0], &data.batchTriangleIndex[0], &data.batchUV[0], numThreads);
+	globalPokedData += data.batchTriangleIndex[0];
+}
+
+BENCHMARK_ITERS(TriangleMeshIntersectRays_10000Rays_BVH_1Thread, 3, 3, "The same 10000 rays as one IntersectRays batch on one thread")
+{
+	BenchmarkTriangleMeshIntersectRays(1);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRays_10000Rays_BVH_2Threads, 3, 3, "The same 10000 rays as one IntersectRays batch on two threads")
+{
+	BenchmarkTriangleMeshIntersectRays(2);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRays_10000Rays_BVH_4Threads, 3, 3, "The same 10000 rays as one IntersectRays batch on four threads")
+{
+	BenchmarkTriangleMeshIntersectRays(4);
+}
+BENCHMARK_ITERS_END;
+
+BENCHMARK_ITERS(TriangleMeshIntersectRays_10000Rays_BVH_AllThreads, 3, 3, "The same 10000 rays as one IntersectRays batch on all hardware threads")
+{
+	BenchmarkTriangleMeshIntersectRays(NumHardwareThreads());
+}
+BENCHMARK_ITERS_END;
+
+#ifdef MATH_TRIANGLEMESH_AVX
+BENCHMARK_ITERS(TriangleMeshIntersectRay_100k_Flat_AVX, 1, 1, "The 100 rays of TriangleMeshIntersectRay_100k_Flat with the AVX routines and the SoA8 layout")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX))
+		for(size_t i = 0; i < data.rays.size(); ++i)
+			globalPokedData += (int)data.soa8.IntersectRay_AVX(data.rays[i]);
+}
+BENCHMARK_ITERS_END;
+#endif
+
+#ifdef MATH_TRIANGLEMESH_AVX512
+BENCHMARK_ITERS(TriangleMeshIntersectRay_100k_Flat_AVX512, 1, 1, "The 100 rays of TriangleMeshIntersectRay_100k_Flat with the AVX-512 routines and the SoA16 layout")
+{
+	TriangleMeshBenchmarkData &data = TriangleMeshBenchmark();
+	if (TriangleMesh::IsSIMDCapabilitySupported(TriangleMesh::SIMD_AVX512))
+		for(size_t i = 0; i < data.rays.size(); ++i)
+			globalPokedData += (int)data.soa16.IntersectRay_AVX512(data.rays[i]);
+}
+BENCHMARK_ITERS_END;
+#endif